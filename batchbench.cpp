@@ -0,0 +1,461 @@
+
+//
+// batchbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Messages per second of a client that pipelines small messages, received three ways from the same reads.
+//     One call to the protocol core per fragment, the way WebSocketServer::Receive hands them to the application,
+//     one co_await ReceiveMessage per message, and one co_await ReceiveBatch per read.
+//     The transport reads from memory and never waits, so only the cost of handing messages over is measured.
+//     With --mixed a ping follows every 64th message and every 1000th message is sent in two fragments.
+//
+//     Usage: batchbench [--messages <count>] [--read <bytes>] [--batch <count>] [--rounds <count>] [--mixed] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketcoroutine.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The message sizes measured
+static const unsigned long long MessageSizes[] = { 16, 128 };
+
+// The ways of receiving
+#define BATCHBENCH_MODE_COUNT 3
+static const char* ModeNames[BATCHBENCH_MODE_COUNT] = { "receive", "message", "batch" };
+
+// The frames a client sent, read back in reads of at most dwReadSize bytes
+struct MEMORY_TRANSPORT
+{
+	const unsigned char* pData;
+	size_t length;
+	size_t offset;
+	unsigned long dwReadSize;
+};
+
+// What the application saw
+struct BATCHBENCH_COUNTS
+{
+	unsigned long long Messages;
+	unsigned long long Pings;
+	unsigned long long OutOfOrder;
+	unsigned long long Calls;
+	bool bFailed;
+};
+
+// The result of one way of receiving one message size
+struct BATCHBENCH_RESULT
+{
+	BATCHBENCH_COUNTS Counts;
+	double Seconds;
+};
+
+// Copy the next read from memory, 0 bytes once everything was read
+static unsigned long MemoryRead(MEMORY_TRANSPORT* pTransport, void* pBuffer, unsigned long dwLength)
+{
+	size_t length = pTransport->length - pTransport->offset;
+
+	if (length > dwLength) {
+		length = dwLength;
+	}
+	if (length > pTransport->dwReadSize) {
+		length = pTransport->dwReadSize;
+	}
+	memcpy(pBuffer, pTransport->pData + pTransport->offset, length);
+	pTransport->offset += length;
+
+	return (unsigned long)length;
+}
+
+// Check a data message carries the next sequence number
+static void CountMessage(BATCHBENCH_COUNTS* pCounts, const char* pData, unsigned long long qwLength)
+{
+	unsigned int sequence;
+
+	if (qwLength < sizeof(sequence)) {
+		pCounts->OutOfOrder++;
+	}
+	else
+	{
+		memcpy(&sequence, pData, sizeof(sequence));
+		if (sequence != (unsigned int)pCounts->Messages) {
+			pCounts->OutOfOrder++;
+		}
+	}
+	pCounts->Messages++;
+}
+
+// Encode the messages of a client, masked, with a sequence number at the start of each
+static void BuildFrames(std::vector<unsigned char>* pFrames, unsigned int messages, unsigned long long qwSize, bool bMixed)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned char payload[256];
+	unsigned int headerLength;
+	unsigned long long qwFirst;
+	char maskingKey[4];
+
+	pFrames->clear();
+	for (unsigned int i = 0; i < messages; i++)
+	{
+		for (unsigned long long j = 0; j < qwSize; j++) {
+			payload[j] = (unsigned char)(j * 7);
+		}
+		memcpy(payload, &i, sizeof(i));
+
+		if ((bMixed) && ((i % 1000) == 999))
+		{
+			// A binary fragment and a continuation
+			qwFirst = qwSize / 2;
+			WebSocketGenerateMaskingKey(maskingKey);
+			headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x02, qwFirst, maskingKey);
+			pFrames->insert(pFrames->end(), header, header + headerLength);
+			UnmaskWebSocketPayload(payload, qwFirst, maskingKey, 0);
+			pFrames->insert(pFrames->end(), payload, payload + qwFirst);
+			WebSocketGenerateMaskingKey(maskingKey);
+			headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x80, qwSize - qwFirst, maskingKey);
+			pFrames->insert(pFrames->end(), header, header + headerLength);
+			UnmaskWebSocketPayload(payload + qwFirst, qwSize - qwFirst, maskingKey, 0);
+			pFrames->insert(pFrames->end(), payload + qwFirst, payload + qwSize);
+		}
+		else
+		{
+			WebSocketGenerateMaskingKey(maskingKey);
+			headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwSize, maskingKey);
+			pFrames->insert(pFrames->end(), header, header + headerLength);
+			UnmaskWebSocketPayload(payload, qwSize, maskingKey, 0);
+			pFrames->insert(pFrames->end(), payload, payload + qwSize);
+		}
+
+		if ((bMixed) && ((i % 64) == 63))
+		{
+			memcpy(payload, "ping", 4);
+			WebSocketGenerateMaskingKey(maskingKey);
+			headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x89, 4, maskingKey);
+			pFrames->insert(pFrames->end(), header, header + headerLength);
+			UnmaskWebSocketPayload(payload, 4, maskingKey, 0);
+			pFrames->insert(pFrames->end(), payload, payload + 4);
+		}
+	}
+}
+
+//
+// One call to the protocol core per fragment
+//
+
+// The bytes of the last transport read, handed to the protocol core as it asks for them
+struct RECEIVE_CONTEXT
+{
+	MEMORY_TRANSPORT* pTransport;
+	unsigned char* pInput;
+	unsigned long dwStart;
+	unsigned long dwEnd;
+	bool bClosed;
+};
+
+static unsigned long ReceiveRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	RECEIVE_CONTEXT* pReceive = (RECEIVE_CONTEXT*)pContext;
+
+	if (pReceive->dwStart == pReceive->dwEnd)
+	{
+		pReceive->dwStart = 0;
+		pReceive->dwEnd = MemoryRead(pReceive->pTransport, pReceive->pInput, pReceive->pTransport->dwReadSize);
+		if (pReceive->dwEnd == 0) {
+			pReceive->bClosed = true;
+			return 1;
+		}
+	}
+	if (dwLength > pReceive->dwEnd - pReceive->dwStart) {
+		dwLength = pReceive->dwEnd - pReceive->dwStart;
+	}
+	memcpy(pBuffer, pReceive->pInput + pReceive->dwStart, dwLength);
+	pReceive->dwStart += dwLength;
+	*pdwBytesRead = dwLength;
+
+	return 0;
+}
+
+static void RunReceive(MEMORY_TRANSPORT* pTransport, BATCHBENCH_COUNTS* pCounts)
+{
+	std::vector<unsigned char> input(pTransport->dwReadSize);
+	char buffer[0x1000];
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	RECEIVE_CONTEXT receive;
+	IIS_WEB_SOCKET_RECEIVE_RESULT result;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	unsigned long dwReceived;
+	unsigned long dwLength;
+
+	memset(&stream, 0, sizeof(stream));
+	memset(&frame, 0, sizeof(frame));
+	stream.bQueuing = true;
+	stream.pFrameBuffer = frameBuffer;
+	receive.pTransport = pTransport;
+	receive.pInput = input.data();
+	receive.dwStart = 0;
+	receive.dwEnd = 0;
+	receive.bClosed = false;
+	bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+
+	// Fragments are put back together by the application, like it does with Receive
+	dwLength = 0;
+	for (;;)
+	{
+		result = ReceiveWebSocketData(&stream, &frame, 0xFFFFFFFFFFFFFFFFULL, ReceiveRead, &receive,
+			buffer + dwLength, sizeof(buffer) - dwLength, &dwReceived, &bufferType, NULL);
+		if (result != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			pCounts->bFailed = (!receive.bClosed);
+			return;
+		}
+		pCounts->Calls++;
+		dwLength += dwReceived;
+
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) {
+			pCounts->Pings++;
+			dwLength -= dwReceived;
+		}
+		else if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) ||
+			(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)) {
+			CountMessage(pCounts, buffer, dwLength);
+			dwLength = 0;
+		}
+	}
+}
+
+//
+// WebSocketAsyncConnection
+//
+
+static unsigned long ConnectionRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending)
+{
+	*pdwBytesRead = MemoryRead((MEMORY_TRANSPORT*)pContext, pBuffer, dwLength);
+	*pbPending = false;
+	return 0;
+}
+
+static unsigned long ConnectionWrite(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending)
+{
+	(void)pContext;
+	(void)bufferType;
+	(void)pData;
+	(void)qwLength;
+	*pbPending = false;
+	return 0;
+}
+
+static void CountAsyncMessage(BATCHBENCH_COUNTS* pCounts, const WEB_SOCKET_ASYNC_MESSAGE* pMessage)
+{
+	if (pMessage->BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) {
+		pCounts->Pings++;
+	}
+	else {
+		CountMessage(pCounts, pMessage->pData, pMessage->qwLength);
+	}
+}
+
+static WebSocketTask MessageHandler(WebSocketAsyncConnection* pConnection, BATCHBENCH_COUNTS* pCounts)
+{
+	WEB_SOCKET_ASYNC_MESSAGE message;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+
+	for (;;)
+	{
+		result = co_await pConnection->ReceiveMessage(&message);
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			pCounts->bFailed = (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_CLOSED_ASYNC_RESULT);
+			co_return;
+		}
+		pCounts->Calls++;
+		CountAsyncMessage(pCounts, &message);
+	}
+}
+
+static WebSocketTask BatchHandler(WebSocketAsyncConnection* pConnection, BATCHBENCH_COUNTS* pCounts, unsigned long dwBatch)
+{
+	std::vector<WEB_SOCKET_ASYNC_MESSAGE> messages(dwBatch);
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+	unsigned long dwCount;
+
+	for (;;)
+	{
+		result = co_await pConnection->ReceiveBatch(messages.data(), dwBatch, &dwCount);
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			pCounts->bFailed = (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_CLOSED_ASYNC_RESULT);
+			co_return;
+		}
+		pCounts->Calls++;
+		for (unsigned long i = 0; i < dwCount; i++) {
+			CountAsyncMessage(pCounts, &messages[i]);
+		}
+	}
+}
+
+// Receive every frame one way, the handler runs to the end inside Start because no read is ever pending
+static double RunMode(unsigned int mode, const std::vector<unsigned char>* pFrames, unsigned long dwReadSize, unsigned long dwBatch, BATCHBENCH_COUNTS* pCounts)
+{
+	WebSocketAsyncConnection connection;
+	MEMORY_TRANSPORT transport;
+	Clock::time_point start;
+	double seconds;
+
+	transport.pData = pFrames->data();
+	transport.length = pFrames->size();
+	transport.offset = 0;
+	transport.dwReadSize = dwReadSize;
+	memset(pCounts, 0, sizeof(*pCounts));
+
+	if (mode == 0)
+	{
+		start = Clock::now();
+		RunReceive(&transport, pCounts);
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	if (!connection.Initialize(NULL, ConnectionRead, ConnectionWrite, &transport, dwReadSize)) {
+		pCounts->bFailed = true;
+		return 0;
+	}
+	start = Clock::now();
+	if (mode == 1) {
+		MessageHandler(&connection, pCounts).Start(NULL);
+	}
+	else {
+		BatchHandler(&connection, pCounts, dwBatch).Start(NULL);
+	}
+	seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	connection.Free();
+
+	return seconds;
+}
+
+static void WriteJsonResult(FILE* pFile, const char* pName, const BATCHBENCH_RESULT* pResult, const char* pEnd)
+{
+	fprintf(pFile, "    \"%s\": { \"messages\": %llu, \"calls\": %llu, \"seconds\": %.6f, \"messages_per_second\": %.0f, \"out_of_order\": %llu, \"failed\": %s }%s\n",
+		pName, pResult->Counts.Messages, pResult->Counts.Calls, pResult->Seconds,
+		(pResult->Seconds != 0) ? (double)pResult->Counts.Messages / pResult->Seconds : 0.0,
+		pResult->Counts.OutOfOrder, pResult->Counts.bFailed ? "true" : "false", pEnd);
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t sizeCount = sizeof(MessageSizes) / sizeof(MessageSizes[0]);
+	unsigned int messages = 200000;
+	unsigned long dwReadSize = 0x4000;
+	unsigned long dwBatch = 256;
+	unsigned int rounds = 5;
+	bool bMixed = false;
+	const char* pJsonPath = NULL;
+	BATCHBENCH_RESULT results[sizeCount][BATCHBENCH_MODE_COUNT];
+	BATCHBENCH_COUNTS counts;
+	std::vector<unsigned char> frames;
+	unsigned long long qwExpectedPings;
+	double seconds;
+	bool bCorrect = true;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			messages = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--read") == 0) && (i + 1 < argc)) {
+			dwReadSize = strtoul(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+			dwBatch = strtoul(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--rounds") == 0) && (i + 1 < argc)) {
+			rounds = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--mixed") == 0) {
+			bMixed = true;
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: batchbench [--messages <count>] [--read <bytes>] [--batch <count>] [--rounds <count>] [--mixed] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((messages == 0) || (dwReadSize < 0x200) || (dwBatch == 0) || (rounds == 0)) {
+		fprintf(stderr, "--messages, --batch and --rounds must be at least 1, --read at least 512\n");
+		return 1;
+	}
+
+	printf("%u messages per run, reads of %lu bytes, batches of up to %lu, best of %u rounds%s\n",
+		messages, dwReadSize, dwBatch, rounds, bMixed ? ", with pings and fragments" : "");
+	qwExpectedPings = bMixed ? messages / 64 : 0;
+
+	for (size_t size = 0; size < sizeCount; size++)
+	{
+		BuildFrames(&frames, messages, MessageSizes[size], bMixed);
+
+		// The best round of each way, the ways take turns so they see the same machine
+		for (unsigned int mode = 0; mode < BATCHBENCH_MODE_COUNT; mode++) {
+			results[size][mode].Seconds = 0;
+		}
+		for (unsigned int round = 0; round < rounds; round++)
+		{
+			for (unsigned int mode = 0; mode < BATCHBENCH_MODE_COUNT; mode++)
+			{
+				seconds = RunMode(mode, &frames, dwReadSize, dwBatch, &counts);
+				if ((round == 0) || (seconds < results[size][mode].Seconds)) {
+					results[size][mode].Seconds = seconds;
+					results[size][mode].Counts = counts;
+				}
+				if ((counts.bFailed) || (counts.Messages != messages) || (counts.OutOfOrder != 0) || (counts.Pings != qwExpectedPings)) {
+					bCorrect = false;
+				}
+			}
+		}
+
+		for (unsigned int mode = 0; mode < BATCHBENCH_MODE_COUNT; mode++)
+		{
+			const BATCHBENCH_RESULT* pResult = &results[size][mode];
+			printf("%4llu bytes %-8s %12.0f messages/s %7.1f ns/message %10llu calls, %llu out of order%s\n",
+				MessageSizes[size], ModeNames[mode], (pResult->Seconds != 0) ? (double)pResult->Counts.Messages / pResult->Seconds : 0.0,
+				pResult->Seconds * 1e9 / (double)messages, pResult->Counts.Calls, pResult->Counts.OutOfOrder, pResult->Counts.bFailed ? " (failed)" : "");
+		}
+		printf("%4llu bytes batch is %.2fx receive and %.2fx message\n", MessageSizes[size],
+			(results[size][2].Seconds != 0) ? results[size][0].Seconds / results[size][2].Seconds : 0.0,
+			(results[size][2].Seconds != 0) ? results[size][1].Seconds / results[size][2].Seconds : 0.0);
+	}
+	printf("correct  %s\n", bCorrect ? "yes" : "no");
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"messages\": %u,\n  \"read_bytes\": %lu,\n  \"batch\": %lu,\n  \"rounds\": %u,\n  \"mixed\": %s,\n",
+			messages, dwReadSize, dwBatch, rounds, bMixed ? "true" : "false");
+		for (size_t size = 0; size < sizeCount; size++)
+		{
+			fprintf(pFile, "  \"%llu\": {\n", MessageSizes[size]);
+			for (unsigned int mode = 0; mode < BATCHBENCH_MODE_COUNT; mode++) {
+				WriteJsonResult(pFile, ModeNames[mode], &results[size][mode], (mode + 1 < BATCHBENCH_MODE_COUNT) ? "," : "");
+			}
+			fprintf(pFile, "  },\n");
+		}
+		fprintf(pFile, "  \"correct\": %s\n}\n", bCorrect ? "true" : "false");
+		fclose(pFile);
+	}
+
+	return bCorrect ? 0 : 1;
+}
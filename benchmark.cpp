@@ -0,0 +1,1709 @@
+
+//
+// benchmark.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Microbenchmarks for the platform-neutral WebSocket protocol core.
+//     Frames are read from and written to memory instead of IIS, so this builds and runs on any platform.
+//
+//     Usage: benchmark [--json <output file>] [--filter <name>] [--min-time <milliseconds>]
+//
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketpubsub.h"
+using namespace IISWebSocketServer;
+
+// Results are added to this so the compiler can't remove the work being measured
+static volatile unsigned long long BenchmarkSink;
+
+// A benchmark runs its work qwIterations times
+typedef void (*PFN_BENCHMARK)(void* pContext, unsigned long long qwIterations);
+
+// A single benchmark case
+struct BENCHMARK_CASE
+{
+	std::string Name;
+	PFN_BENCHMARK pfnBenchmark;
+	void* pContext;
+	// Bytes processed by one iteration, 0 if throughput isn't reported
+	unsigned long long qwBytesPerIteration;
+};
+
+// Another number a case can report about its run, like the growth of the resident set
+struct BENCHMARK_METRIC
+{
+	const char* pName;
+	double Value;
+};
+
+// Added to by the case with AddBenchmarkMetric, cleared before each run
+static std::vector<BENCHMARK_METRIC> BenchmarkMetrics;
+
+static void AddBenchmarkMetric(const char* pName, double value)
+{
+	BenchmarkMetrics.push_back({ pName, value });
+}
+
+// The measured result of a case
+struct BENCHMARK_RESULT
+{
+	std::string Name;
+	unsigned long long qwIterations;
+	double NanosecondsPerIteration;
+	double BytesPerSecond;
+	std::vector<BENCHMARK_METRIC> Metrics;
+};
+
+//
+// Frame parsing
+//
+
+struct PARSE_CONTEXT
+{
+	unsigned char Frame[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned long dwLength;
+};
+
+// The parser as it was before it validated headers, kept to show validation costs nothing on valid traffic
+static bool BaselineParseWebSocketFrame(unsigned char* pBuffer, unsigned long dwLength, WEB_SOCKET_FRAME* pOutFrame)
+{
+	pOutFrame->FrameSize = 2;
+	if (dwLength < 2) {
+		return false;
+	}
+
+	pOutFrame->Opcode = pBuffer[0] & 0x0F;
+	pOutFrame->FIN = pBuffer[0] & 0x80;
+	unsigned long long payloadLength = pBuffer[1] & 0x7F;
+	pOutFrame->bMask = pBuffer[1] & 0x80;
+
+	if (pOutFrame->bMask) {
+		pOutFrame->FrameSize += 4;
+	}
+	if (payloadLength == 126) {
+		pOutFrame->FrameSize += 2;
+	}
+	else if (payloadLength == 127) {
+		pOutFrame->FrameSize += 8;
+	}
+	if (dwLength < pOutFrame->FrameSize) {
+		return false;
+	}
+
+	int maskingKeyIndex = 2;
+	if (payloadLength == 126)
+	{
+		payloadLength = ((unsigned long long)pBuffer[2] << 8) + pBuffer[3];
+		maskingKeyIndex = 4;
+	}
+	else if (payloadLength == 127)
+	{
+		payloadLength =
+			((unsigned long long)pBuffer[2] << 56) +
+			((unsigned long long)pBuffer[3] << 48) +
+			((unsigned long long)pBuffer[4] << 40) +
+			((unsigned long long)pBuffer[5] << 32) +
+			((unsigned long long)pBuffer[6] << 24) +
+			((unsigned long long)pBuffer[7] << 16) +
+			((unsigned long long)pBuffer[8] << 8) +
+			(unsigned long long)pBuffer[9];
+		maskingKeyIndex = 10;
+	}
+	pOutFrame->PayloadLength = payloadLength;
+
+	if (pOutFrame->bMask)
+	{
+		for (int i = 0; i < 4; i++) {
+			pOutFrame->MaskingKey[i] = pBuffer[maskingKeyIndex + i];
+		}
+	}
+
+	return true;
+}
+
+static void BenchmarkParse(void* pContext, unsigned long long qwIterations)
+{
+	PARSE_CONTEXT* pParse = (PARSE_CONTEXT*)pContext;
+	WEB_SOCKET_FRAME frame;
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		if (ParseWebSocketFrame(pParse->Frame, pParse->dwLength, &frame, true)) {
+			qwSum += frame.PayloadLength + frame.FrameSize + (unsigned long long)frame.Violation;
+		}
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// Called through a pointer the compiler can't see through, so the baseline isn't inlined when the parser in the library can't be
+typedef bool (*PFN_BASELINE_PARSE)(unsigned char* pBuffer, unsigned long dwLength, WEB_SOCKET_FRAME* pOutFrame);
+static PFN_BASELINE_PARSE volatile pfnBaselineParse = BaselineParseWebSocketFrame;
+
+static void BenchmarkBaselineParse(void* pContext, unsigned long long qwIterations)
+{
+	PARSE_CONTEXT* pParse = (PARSE_CONTEXT*)pContext;
+	WEB_SOCKET_FRAME frame;
+	unsigned long long qwSum = 0;
+
+	PFN_BASELINE_PARSE pfnParse = pfnBaselineParse;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		if (pfnParse(pParse->Frame, pParse->dwLength, &frame)) {
+			qwSum += frame.PayloadLength + frame.FrameSize;
+		}
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// Build a masked client frame header with the given payload length
+static void InitializeParseContext(PARSE_CONTEXT* pParse, unsigned long long qwPayloadLength)
+{
+	const char maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	pParse->dwLength = EncodeMaskedWebSocketFrameHeader(pParse->Frame, 0x82, qwPayloadLength, maskingKey);
+}
+
+// A run of different headers, so neither parser is measured on a header the branch predictor has learned
+#define BENCHMARK_MIXED_HEADERS 1024
+
+struct MIXED_PARSE_CONTEXT
+{
+	unsigned char Headers[BENCHMARK_MIXED_HEADERS][IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned long Lengths[BENCHMARK_MIXED_HEADERS];
+};
+
+static void BenchmarkMixedParse(void* pContext, unsigned long long qwIterations)
+{
+	MIXED_PARSE_CONTEXT* pParse = (MIXED_PARSE_CONTEXT*)pContext;
+	WEB_SOCKET_FRAME frame;
+	unsigned long long qwSum = 0;
+	size_t next;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		next = (size_t)(i % BENCHMARK_MIXED_HEADERS);
+		if (ParseWebSocketFrame(pParse->Headers[next], pParse->Lengths[next], &frame, true)) {
+			qwSum += frame.PayloadLength + frame.FrameSize + (unsigned long long)frame.Violation;
+		}
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+static void BenchmarkBaselineMixedParse(void* pContext, unsigned long long qwIterations)
+{
+	MIXED_PARSE_CONTEXT* pParse = (MIXED_PARSE_CONTEXT*)pContext;
+	WEB_SOCKET_FRAME frame;
+	unsigned long long qwSum = 0;
+	PFN_BASELINE_PARSE pfnParse = pfnBaselineParse;
+	size_t next;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		next = (size_t)(i % BENCHMARK_MIXED_HEADERS);
+		if (pfnParse(pParse->Headers[next], pParse->Lengths[next], &frame)) {
+			qwSum += frame.PayloadLength + frame.FrameSize;
+		}
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// Valid client headers of every type and length encoding, or headers that each break one rule
+static void InitializeMixedParseContext(MIXED_PARSE_CONTEXT* pParse, bool bInvalid)
+{
+	static const unsigned char frameBytes[] = { 0x81, 0x82, 0x01, 0x00, 0x80, 0x89, 0x8A, 0x88 };
+	static const unsigned long long payloadLengths[] = { 0, 5, 125, 126, 1000, 65535, 65536, 100000 };
+	const char maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	unsigned int random = 12345;
+	unsigned char frameByte;
+	unsigned long long qwPayloadLength;
+
+	for (size_t i = 0; i < BENCHMARK_MIXED_HEADERS; i++)
+	{
+		random = random * 1103515245 + 12345;
+		frameByte = frameBytes[(random >> 16) % 8];
+		qwPayloadLength = ((frameByte & 0x08) != 0) ? ((random >> 8) % 126) : payloadLengths[(random >> 20) % 8];
+		pParse->Lengths[i] = EncodeMaskedWebSocketFrameHeader(pParse->Headers[i], frameByte, qwPayloadLength, maskingKey);
+		if (!bInvalid) {
+			continue;
+		}
+
+		// Break one rule per header, in turn
+		switch (i % 5)
+		{
+		case 0:
+			pParse->Headers[i][0] |= 0x40;
+			break;
+		case 1:
+			pParse->Headers[i][0] = (pParse->Headers[i][0] & 0xF0) | 0x03;
+			break;
+		case 2:
+			pParse->Headers[i][0] = 0x09;
+			break;
+		case 3:
+			pParse->Headers[i][1] &= 0x7F;
+			break;
+		default:
+			pParse->Lengths[i] = EncodeMaskedWebSocketFrameHeader(pParse->Headers[i], 0x82, 10, maskingKey);
+			pParse->Headers[i][1] = 0x80 | 126;
+			pParse->Headers[i][2] = 0;
+			pParse->Headers[i][3] = 10;
+			pParse->Lengths[i] = 8;
+			break;
+		}
+	}
+}
+
+//
+// Frame encoding
+//
+
+struct ENCODE_CONTEXT
+{
+	unsigned long long qwPayloadLength;
+};
+
+static void BenchmarkEncode(void* pContext, unsigned long long qwIterations)
+{
+	ENCODE_CONTEXT* pEncode = (ENCODE_CONTEXT*)pContext;
+	unsigned char header[10];
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwSum += EncodeWebSocketFrameHeader(header, 0x82, pEncode->qwPayloadLength + (i & 1));
+		qwSum += header[1];
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+//
+// Unmasking
+//
+
+struct UNMASK_CONTEXT
+{
+	std::vector<unsigned char> Payload;
+	// Index of the first byte in the payload, the position in the masking key the unmask starts at
+	unsigned long long mkI;
+};
+
+static void BenchmarkUnmask(void* pContext, unsigned long long qwIterations)
+{
+	UNMASK_CONTEXT* pUnmask = (UNMASK_CONTEXT*)pContext;
+	const char maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++) {
+		qwSum += UnmaskWebSocketPayload(pUnmask->Payload.data(), pUnmask->Payload.size(), maskingKey, pUnmask->mkI);
+	}
+
+	BenchmarkSink += qwSum + pUnmask->Payload[0];
+}
+
+//
+// Masking key generation
+//
+
+static void BenchmarkMaskingKey(void* pContext, unsigned long long qwIterations)
+{
+	char maskingKey[4];
+	unsigned long long qwSum = 0;
+
+	(void)pContext;
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		WebSocketGenerateMaskingKey(maskingKey);
+		qwSum += (unsigned char)maskingKey[0];
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+//
+// Message reassembly
+//
+// A fragmented masked message is read from a memory stream, the frames are parsed,
+// unmasked and appended to a reassembly buffer that grows like ReceiveMessage's.
+//
+
+struct REASSEMBLY_CONTEXT
+{
+	std::vector<unsigned char> Stream;
+	std::vector<unsigned char> Scratch;
+};
+
+static void BenchmarkReassembly(void* pContext, unsigned long long qwIterations)
+{
+	REASSEMBLY_CONTEXT* pReassembly = (REASSEMBLY_CONTEXT*)pContext;
+	WEB_SOCKET_FRAME frame;
+	unsigned char* pBuffer;
+	unsigned char* pNewBuffer;
+	unsigned long long qwBufferSize;
+	unsigned long long qwLength;
+	size_t offset;
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		// The stream is unmasked in place, so start from a fresh copy each time
+		memcpy(pReassembly->Scratch.data(), pReassembly->Stream.data(), pReassembly->Stream.size());
+
+		qwBufferSize = 0x1000;
+		pBuffer = (unsigned char*)malloc((size_t)qwBufferSize);
+		if (pBuffer == NULL) {
+			return;
+		}
+		qwLength = 0;
+		offset = 0;
+
+		do
+		{
+			if (!ParseWebSocketFrame(&pReassembly->Scratch[offset], (unsigned long)(pReassembly->Scratch.size() - offset), &frame, true)) {
+				break;
+			}
+			offset += frame.FrameSize;
+
+			// Double the reassembly buffer until the payload fits
+			while (qwLength + frame.PayloadLength > qwBufferSize)
+			{
+				qwBufferSize *= 2;
+				pNewBuffer = (unsigned char*)realloc(pBuffer, (size_t)qwBufferSize);
+				if (pNewBuffer == NULL) {
+					free(pBuffer);
+					return;
+				}
+				pBuffer = pNewBuffer;
+			}
+
+			UnmaskWebSocketPayload(&pReassembly->Scratch[offset], frame.PayloadLength, frame.MaskingKey, 0);
+			memcpy(pBuffer + qwLength, &pReassembly->Scratch[offset], (size_t)frame.PayloadLength);
+			qwLength += frame.PayloadLength;
+			offset += (size_t)frame.PayloadLength;
+		} while (!frame.FIN);
+
+		qwSum += qwLength + pBuffer[qwLength - 1];
+		free(pBuffer);
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// Build a message of qwFrameCount masked frames with qwFrameLength bytes of payload each
+static void InitializeReassemblyContext(REASSEMBLY_CONTEXT* pReassembly, unsigned long long qwFrameCount, unsigned long long qwFrameLength)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	const char maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	unsigned int headerLength;
+	size_t offset;
+
+	for (unsigned long long frame = 0; frame < qwFrameCount; frame++)
+	{
+		// Text frame, continuation frames, and FIN on the last
+		headerLength = EncodeMaskedWebSocketFrameHeader(header, (unsigned char)(((frame == qwFrameCount - 1) ? 0x80 : 0x00) | ((frame == 0) ? 0x01 : 0x00)), qwFrameLength, maskingKey);
+		pReassembly->Stream.insert(pReassembly->Stream.end(), header, header + headerLength);
+
+		offset = pReassembly->Stream.size();
+		pReassembly->Stream.resize(offset + (size_t)qwFrameLength);
+		for (unsigned long long i = 0; i < qwFrameLength; i++) {
+			pReassembly->Stream[offset + (size_t)i] = (unsigned char)('a' + (i % 26));
+		}
+		UnmaskWebSocketPayload(&pReassembly->Stream[offset], qwFrameLength, maskingKey, 0);
+	}
+
+	pReassembly->Scratch.resize(pReassembly->Stream.size());
+}
+
+//
+// Handshake header processing
+//
+
+struct HANDSHAKE_CONTEXT
+{
+	const char* pConnection;
+	const char* pUpgrade;
+};
+
+static void BenchmarkHandshake(void* pContext, unsigned long long qwIterations)
+{
+	HANDSHAKE_CONTEXT* pHandshake = (HANDSHAKE_CONTEXT*)pContext;
+	size_t connectionLength = strlen(pHandshake->pConnection);
+	size_t upgradeLength = strlen(pHandshake->pUpgrade);
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwSum += WebSocketConnectionHasUpgrade(pHandshake->pConnection, connectionLength);
+		qwSum += WebSocketHeaderValueEquals(pHandshake->pUpgrade, upgradeLength, "websocket");
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+//
+// Rate limiting
+//
+
+struct RATE_LIMIT_CONTEXT
+{
+	WEB_SOCKET_RATE_LIMITER Limiter;
+	// Nanoseconds between frames, so the limits are hit or not depending on the case
+	unsigned long long qwInterval;
+};
+
+// Charge a small frame to the frame, byte and message limits, time advances like a steady stream of frames
+static void BenchmarkRateLimit(void* pContext, unsigned long long qwIterations)
+{
+	RATE_LIMIT_CONTEXT* pRateLimit = (RATE_LIMIT_CONTEXT*)pContext;
+	unsigned long long qwNow = 1;
+	unsigned long long qwSum = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwSum += ChargeRateLimiter(&pRateLimit->Limiter, qwNow, 1, 70, 1);
+		qwNow += pRateLimit->qwInterval;
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+//
+// Memory accounting
+//
+
+struct MEMORY_CONTEXT
+{
+	// NULL to charge the global account only
+	WEB_SOCKET_MEMORY_ACCOUNT* pAccount;
+	// Charge the allocations, or only allocate them
+	bool bCharge;
+	// Allocate and free, or only charge
+	bool bAllocate;
+	size_t Size;
+	// Threads doing the same at once, each with its own connection account, 0 for the calling thread alone
+	unsigned int Threads;
+};
+
+// Allocate and free a buffer the size of a small message, charging the accounts as the library does
+static void BenchmarkMemoryLoop(MEMORY_CONTEXT* pMemory, unsigned long long qwIterations, unsigned long long* pqwSum)
+{
+	unsigned long long qwSum = 0;
+	void* pBuffer;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		if (pMemory->bCharge) {
+			qwSum += ChargeMemory(pMemory->pAccount, pMemory->Size);
+		}
+		if (pMemory->bAllocate)
+		{
+			pBuffer = malloc(pMemory->Size);
+			qwSum += (unsigned long long)(size_t)pBuffer;
+			free(pBuffer);
+		}
+		if (pMemory->bCharge) {
+			ReleaseMemory(pMemory->pAccount, pMemory->Size);
+		}
+	}
+
+	*pqwSum = qwSum;
+}
+
+// The time per iteration is of the slowest thread, the threads only share the global account
+static void BenchmarkMemory(void* pContext, unsigned long long qwIterations)
+{
+	MEMORY_CONTEXT* pMemory = (MEMORY_CONTEXT*)pContext;
+	std::vector<WEB_SOCKET_MEMORY_ACCOUNT> accounts(pMemory->Threads);
+	std::vector<MEMORY_CONTEXT> contexts(pMemory->Threads);
+	std::vector<unsigned long long> sums(pMemory->Threads);
+	std::vector<std::thread> threads;
+	unsigned long long qwSum;
+
+	if (pMemory->Threads == 0) {
+		BenchmarkMemoryLoop(pMemory, qwIterations, &qwSum);
+		BenchmarkSink += qwSum;
+		return;
+	}
+	for (unsigned int i = 0; i < pMemory->Threads; i++)
+	{
+		InitializeMemoryAccount(&accounts[i], NULL);
+		contexts[i] = *pMemory;
+		contexts[i].pAccount = &accounts[i];
+		threads.emplace_back(BenchmarkMemoryLoop, &contexts[i], qwIterations, &sums[i]);
+	}
+	for (unsigned int i = 0; i < pMemory->Threads; i++) {
+		threads[i].join();
+		BenchmarkSink += sums[i];
+	}
+	AddBenchmarkMetric("threads", (double)pMemory->Threads);
+}
+
+//
+// Publish and subscribe
+//
+// 100000 connections each subscribe to 4 of 10000 topics and to one topic all of them share.
+// A connection is an outbound queue, delivering queues the shared frame and the writer takes it straight off.
+//
+
+#define PUBSUB_CONNECTIONS 100000
+#define PUBSUB_TOPICS 10000
+#define PUBSUB_TOPICS_PER_CONNECTION 4
+
+struct PUBSUB_STATE
+{
+	bool bInitialized;
+	WebSocketRouter Router;
+	std::vector<WEB_SOCKET_OUTBOUND_QUEUE> Connections;
+	std::vector<std::string> Topics;
+};
+
+struct PUBSUB_CONTEXT
+{
+	PUBSUB_STATE* pState;
+	// The topic published to, NULL for a different one of the 10000 topics each time
+	const char* pTopic;
+	unsigned long long qwPayloadLength;
+};
+
+// The topics of a connection are spread so every topic has about 40 subscribers
+static const char* GetPubSubTopic(PUBSUB_STATE* pState, size_t connection, size_t slot)
+{
+	return pState->Topics[(connection * PUBSUB_TOPICS_PER_CONNECTION + slot * 2503) % PUBSUB_TOPICS].c_str();
+}
+
+// Building the index takes a moment, so it's only done when a pubsub case runs
+static void InitializePubSubState(PUBSUB_STATE* pState)
+{
+	char topic[0x20];
+
+	if (pState->bInitialized) {
+		return;
+	}
+	pState->bInitialized = true;
+
+	pState->Router.Initialize(0);
+	pState->Connections.resize(PUBSUB_CONNECTIONS);
+	for (size_t i = 0; i < PUBSUB_TOPICS; i++) {
+		snprintf(topic, sizeof(topic), "topic-%zu", i);
+		pState->Topics.push_back(topic);
+	}
+	for (size_t connection = 0; connection < PUBSUB_CONNECTIONS; connection++)
+	{
+		memset(&pState->Connections[connection], 0, sizeof(WEB_SOCKET_OUTBOUND_QUEUE));
+		pState->Connections[connection].Policy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_OLDEST_OUTBOUND_POLICY;
+		for (size_t slot = 0; slot < PUBSUB_TOPICS_PER_CONNECTION; slot++) {
+			pState->Router.Subscribe(&pState->Connections[connection], GetPubSubTopic(pState, connection, slot));
+		}
+		pState->Router.Subscribe(&pState->Connections[connection], "all");
+	}
+}
+
+// Queue the frame on the connection, then write it
+static void DeliverPubSub(void* pSubscriber, WEB_SOCKET_SHARED_FRAME* pFrame, const char* pTopic, void* pContext)
+{
+	WEB_SOCKET_OUTBOUND_QUEUE* pQueue = (WEB_SOCKET_OUTBOUND_QUEUE*)pSubscriber;
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+
+	(void)pTopic;
+	(void)pContext;
+	PushOutboundFrame(pQueue, pFrame, NULL, 0);
+	pMessage = PopOutboundMessage(pQueue, 0);
+	if (pMessage != NULL) {
+		BenchmarkSink += (unsigned char)pMessage->pData[0];
+		FreeOutboundMessage(pMessage);
+	}
+}
+
+static void BenchmarkPublish(void* pContext, unsigned long long qwIterations)
+{
+	PUBSUB_CONTEXT* pPubSub = (PUBSUB_CONTEXT*)pContext;
+	PUBSUB_STATE* pState = pPubSub->pState;
+	std::vector<unsigned char> payload((size_t)pPubSub->qwPayloadLength, 0x5A);
+	size_t subscribers;
+	unsigned long long qwSum = 0;
+
+	InitializePubSubState(pState);
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		pState->Router.Publish((pPubSub->pTopic != NULL) ? pPubSub->pTopic : pState->Topics[(size_t)(i % PUBSUB_TOPICS)].c_str(),
+			IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size(),
+			DeliverPubSub, NULL, &subscribers);
+		qwSum += subscribers;
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// A connection leaves one of its topics and joins it again
+static void BenchmarkSubscribeChurn(void* pContext, unsigned long long qwIterations)
+{
+	PUBSUB_CONTEXT* pPubSub = (PUBSUB_CONTEXT*)pContext;
+	PUBSUB_STATE* pState = pPubSub->pState;
+	size_t connection;
+	const char* pTopic;
+
+	InitializePubSubState(pState);
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		connection = (size_t)((i * 7919) % PUBSUB_CONNECTIONS);
+		pTopic = GetPubSubTopic(pState, connection, (size_t)(i % PUBSUB_TOPICS_PER_CONNECTION));
+		pState->Router.Unsubscribe(&pState->Connections[connection], pTopic);
+		pState->Router.Subscribe(&pState->Connections[connection], pTopic);
+	}
+}
+
+//
+// Flush policies
+//
+// 64 byte messages are sent back to back and coalesced in a 64 KB buffer like WebSocketServer coalesces them, with
+// GetWebSocketFlushAction deciding when to flush. A flush is a write to an unbuffered temporary file, a system call like the
+// flush of the response. The flush timer is checked before each message, as if it fired on time. The added latency is
+// how long a message waited in the buffer before it was flushed.
+//
+
+#define FLUSH_MESSAGE_LENGTH 64
+#define FLUSH_BUFFER_SIZE 0x10000
+#define FLUSH_LATENCY_SAMPLES 0x100000
+#define FLUSH_FILE_LIMIT 0x1000000
+
+struct FLUSH_CONTEXT
+{
+	IIS_WEB_SOCKET_FLUSH_POLICY Policy;
+	unsigned long dwFlushThreshold;
+	// Microseconds
+	unsigned long long qwFlushDelay;
+	FILE* pFile;
+	std::vector<unsigned char> Buffer;
+	unsigned long dwCoalescedLength;
+	// When each pending message was written, in nanoseconds
+	std::vector<unsigned long long> Pending;
+	std::vector<double> Latencies;
+	unsigned long long qwFlushes;
+};
+
+static unsigned long long GetNanoseconds()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Write the coalesced messages and note how long each waited
+static void FlushCoalesced(FLUSH_CONTEXT* pFlush, unsigned long long qwNow)
+{
+	if (pFlush->dwCoalescedLength == 0) {
+		return;
+	}
+
+	// Start over before the file gets large, the write is what's measured
+	if (ftell(pFlush->pFile) > FLUSH_FILE_LIMIT) {
+		fseek(pFlush->pFile, 0, SEEK_SET);
+	}
+	fwrite(pFlush->Buffer.data(), 1, pFlush->dwCoalescedLength, pFlush->pFile);
+	pFlush->dwCoalescedLength = 0;
+	pFlush->qwFlushes++;
+
+	for (size_t i = 0; (i < pFlush->Pending.size()) && (pFlush->Latencies.size() < FLUSH_LATENCY_SAMPLES); i++) {
+		pFlush->Latencies.push_back((double)(qwNow - pFlush->Pending[i]) / 1000.0);
+	}
+	pFlush->Pending.clear();
+}
+
+static double GetLatencyPercentile(std::vector<double>& latencies, double percentile)
+{
+	if (latencies.empty()) {
+		return 0;
+	}
+	return latencies[(size_t)((double)(latencies.size() - 1) * percentile)];
+}
+
+static void BenchmarkFlush(void* pContext, unsigned long long qwIterations)
+{
+	FLUSH_CONTEXT* pFlush = (FLUSH_CONTEXT*)pContext;
+	unsigned char payload[FLUSH_MESSAGE_LENGTH];
+	unsigned long long qwNow;
+	unsigned long long qwTimerDue;
+	unsigned int headerLength;
+	IIS_WEB_SOCKET_FLUSH_ACTION action;
+	bool bTimerSet;
+
+	if (pFlush->pFile == NULL)
+	{
+		pFlush->pFile = tmpfile();
+		if (pFlush->pFile == NULL) {
+			fprintf(stderr, "failed to create a temporary file to flush to\n");
+			return;
+		}
+		setvbuf(pFlush->pFile, NULL, _IONBF, 0);
+		pFlush->Buffer.resize(FLUSH_BUFFER_SIZE);
+	}
+	memset(payload, 0x5A, sizeof(payload));
+	pFlush->dwCoalescedLength = 0;
+	pFlush->Pending.clear();
+	pFlush->Latencies.clear();
+	pFlush->qwFlushes = 0;
+	bTimerSet = false;
+	qwTimerDue = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwNow = GetNanoseconds();
+
+		// The timer fires once its time has come
+		if ((bTimerSet) && (qwNow >= qwTimerDue)) {
+			bTimerSet = false;
+			FlushCoalesced(pFlush, qwNow);
+		}
+
+		// Coalesce the frame, the buffer is written out first when it's full
+		if (pFlush->dwCoalescedLength + 2 + FLUSH_MESSAGE_LENGTH > FLUSH_BUFFER_SIZE) {
+			FlushCoalesced(pFlush, qwNow);
+		}
+		headerLength = EncodeWebSocketFrameHeader(pFlush->Buffer.data() + pFlush->dwCoalescedLength, 0x82, FLUSH_MESSAGE_LENGTH);
+		memcpy(pFlush->Buffer.data() + pFlush->dwCoalescedLength + headerLength, payload, FLUSH_MESSAGE_LENGTH);
+		pFlush->dwCoalescedLength += headerLength + FLUSH_MESSAGE_LENGTH;
+		pFlush->Pending.push_back(qwNow);
+
+		action = GetWebSocketFlushAction(pFlush->Policy, false, pFlush->dwCoalescedLength, pFlush->dwFlushThreshold, bTimerSet);
+		if (action == IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_FLUSH_NOW_FLUSH_ACTION) {
+			FlushCoalesced(pFlush, GetNanoseconds());
+		}
+		else if (action == IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_SET_TIMER_FLUSH_ACTION) {
+			qwTimerDue = qwNow + pFlush->qwFlushDelay * 1000;
+			bTimerSet = true;
+		}
+	}
+
+	// The last messages wait for the timer
+	if (pFlush->dwCoalescedLength != 0) {
+		qwNow = GetNanoseconds();
+		FlushCoalesced(pFlush, (bTimerSet) && (qwTimerDue > qwNow) ? qwTimerDue : qwNow);
+	}
+
+	std::sort(pFlush->Latencies.begin(), pFlush->Latencies.end());
+	AddBenchmarkMetric("latency_p50_us", GetLatencyPercentile(pFlush->Latencies, 0.5));
+	AddBenchmarkMetric("latency_p99_us", GetLatencyPercentile(pFlush->Latencies, 0.99));
+	AddBenchmarkMetric("messages_per_flush", (double)qwIterations / (double)pFlush->qwFlushes);
+}
+
+//
+// Sending a file
+//
+// A 500 MB file is sent in frames of 64 KB the three ways SendFile can send it. Read into memory and written from there,
+// mapped and written from the mapping, or as a file handle chunk the kernel sends, where the worker only writes the headers.
+// Writing from memory is a copy into a 64 KB buffer, the copy the kernel makes into the socket.
+//
+
+#define SEND_FILE_LENGTH (500ULL << 20)
+#define SEND_FILE_FRAME_LENGTH 0x10000
+
+#define SEND_FILE_READ 0
+#define SEND_FILE_MAP 1
+#define SEND_FILE_HANDLE 2
+
+struct SEND_FILE_STATE
+{
+	// Created by the first case that runs
+	FILE* pFile;
+	std::vector<unsigned char> Socket;
+};
+
+struct SEND_FILE_CONTEXT
+{
+	SEND_FILE_STATE* pState;
+	int Mode;
+};
+
+// The resident set of the process in bytes, 0 where it can't be read
+static unsigned long long GetResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.WorkingSetSize;
+#else
+	unsigned long long qwSize;
+	unsigned long long qwResident;
+	FILE* pStatm;
+
+	pStatm = fopen("/proc/self/statm", "r");
+	if (pStatm == NULL) {
+		return 0;
+	}
+	if (fscanf(pStatm, "%llu %llu", &qwSize, &qwResident) != 2) {
+		qwResident = 0;
+	}
+	fclose(pStatm);
+
+	return qwResident * (unsigned long long)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static bool InitializeSendFileState(SEND_FILE_STATE* pState)
+{
+	std::vector<unsigned char> block(0x100000);
+
+	if (pState->pFile != NULL) {
+		return true;
+	}
+
+	pState->pFile = tmpfile();
+	if (pState->pFile == NULL) {
+		fprintf(stderr, "failed to create a temporary file to send\n");
+		return false;
+	}
+	for (unsigned long long qwOffset = 0; qwOffset < SEND_FILE_LENGTH; qwOffset += block.size())
+	{
+		for (size_t i = 0; i < block.size(); i++) {
+			block[i] = (unsigned char)((qwOffset + i) * 13);
+		}
+		fwrite(block.data(), 1, block.size(), pState->pFile);
+	}
+	fflush(pState->pFile);
+	pState->Socket.resize(SEND_FILE_FRAME_LENGTH + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH);
+
+	return true;
+}
+
+// Map a file for reading, NULL on failure
+static unsigned char* MapFile(FILE* pFile, unsigned long long qwLength)
+{
+#ifdef _WIN32
+	HANDLE hMapping;
+	void* pView;
+
+	hMapping = CreateFileMappingW((HANDLE)_get_osfhandle(_fileno(pFile)), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hMapping == NULL) {
+		return NULL;
+	}
+	// The view keeps the mapping open
+	pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, (SIZE_T)qwLength);
+	CloseHandle(hMapping);
+
+	return (unsigned char*)pView;
+#else
+	void* pView;
+
+	pView = mmap(NULL, (size_t)qwLength, PROT_READ, MAP_SHARED, fileno(pFile), 0);
+	if (pView == MAP_FAILED) {
+		return NULL;
+	}
+
+	return (unsigned char*)pView;
+#endif
+}
+
+static void UnmapFile(unsigned char* pView, unsigned long long qwLength)
+{
+#ifdef _WIN32
+	(void)qwLength;
+	UnmapViewOfFile(pView);
+#else
+	munmap(pView, (size_t)qwLength);
+#endif
+}
+
+// Send the file once per iteration, the metric is the most the resident set grew during a send
+static void BenchmarkSendFile(void* pContext, unsigned long long qwIterations)
+{
+	SEND_FILE_CONTEXT* pSendFile = (SEND_FILE_CONTEXT*)pContext;
+	SEND_FILE_STATE* pState = pSendFile->pState;
+	unsigned char* pSocket;
+	unsigned char* pView;
+	unsigned long long qwResident;
+	unsigned long long qwGrowth;
+	unsigned long long qwSum = 0;
+	unsigned int headerLength;
+	unsigned char frameByte;
+
+	if (!InitializeSendFileState(pState)) {
+		return;
+	}
+	pSocket = pState->Socket.data();
+
+	qwGrowth = 0;
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwResident = GetResidentBytes();
+		pView = NULL;
+		if (pSendFile->Mode == SEND_FILE_READ) {
+			fseek(pState->pFile, 0, SEEK_SET);
+		}
+		else if (pSendFile->Mode == SEND_FILE_MAP)
+		{
+			pView = MapFile(pState->pFile, SEND_FILE_LENGTH);
+			if (pView == NULL) {
+				fprintf(stderr, "failed to map the file to send\n");
+				return;
+			}
+		}
+
+		for (unsigned long long qwOffset = 0; qwOffset < SEND_FILE_LENGTH; qwOffset += SEND_FILE_FRAME_LENGTH)
+		{
+			frameByte = (qwOffset == 0) ? 0x02 : 0x00;
+			if (qwOffset + SEND_FILE_FRAME_LENGTH == SEND_FILE_LENGTH) {
+				frameByte |= 0x80;
+			}
+			headerLength = EncodeWebSocketFrameHeader(pSocket, frameByte, SEND_FILE_FRAME_LENGTH);
+
+			if (pSendFile->Mode == SEND_FILE_READ)
+			{
+				// Read into the buffer the frame is written from, and copy it into the socket
+				if (fread(pSocket + headerLength, 1, SEND_FILE_FRAME_LENGTH, pState->pFile) != SEND_FILE_FRAME_LENGTH) {
+					fprintf(stderr, "failed to read the file to send\n");
+					return;
+				}
+			}
+			else if (pSendFile->Mode == SEND_FILE_MAP) {
+				// Copy from the mapping into the socket
+				memcpy(pSocket + headerLength, pView + qwOffset, SEND_FILE_FRAME_LENGTH);
+			}
+			qwSum += pSocket[headerLength + (qwOffset & 0xFF)] + headerLength;
+		}
+
+		if (GetResidentBytes() > qwResident + qwGrowth) {
+			qwGrowth = GetResidentBytes() - qwResident;
+		}
+		if (pView != NULL) {
+			UnmapFile(pView, SEND_FILE_LENGTH);
+		}
+	}
+
+	AddBenchmarkMetric("resident_growth_mb", (double)qwGrowth / 1048576.0);
+	BenchmarkSink += qwSum;
+}
+
+//
+// Reassembling a large upload
+//
+// A 1 GB message in fragments of 1 MB from a client is reassembled the two ways ReceiveMessage can. In a buffer that doubles
+// as it fills, as with SpillThreshold at 0, or in memory up to the default SpillThreshold of 1 MB and then written to a
+// temporary file, which is mapped once the message is complete.
+//
+
+#define SPILL_MESSAGE_LENGTH (1ULL << 30)
+#define SPILL_FRAME_LENGTH 0x100000
+#define SPILL_THRESHOLD 0x100000
+
+struct SPILL_CONTEXT
+{
+	// 0 to reassemble in memory
+	unsigned long long qwSpillThreshold;
+	// The masked payload every fragment carries
+	std::vector<unsigned char> Payload;
+	char MaskingKey[4];
+};
+
+// Reads the frames of the message, the header and then the masked payload of each fragment
+struct SPILL_READER
+{
+	SPILL_CONTEXT* pSpill;
+	unsigned char Header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int HeaderLength;
+	unsigned int HeaderOffset;
+	// Payload bytes of the current frame already read
+	unsigned long long qwFrameOffset;
+	unsigned long long qwFrames;
+};
+
+static unsigned long SpillRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	SPILL_READER* pReader = (SPILL_READER*)pContext;
+	unsigned long dwRead;
+	unsigned char frameByte;
+
+	*pdwBytesRead = 0;
+	if (dwLength == 0) {
+		return 0;
+	}
+
+	// Start the next fragment once the last one was read
+	if ((pReader->HeaderOffset == pReader->HeaderLength) && (pReader->qwFrameOffset == SPILL_FRAME_LENGTH))
+	{
+		frameByte = (pReader->qwFrames == 0) ? 0x02 : 0x00;
+		if (pReader->qwFrames + 1 == SPILL_MESSAGE_LENGTH / SPILL_FRAME_LENGTH) {
+			frameByte |= 0x80;
+		}
+		pReader->HeaderLength = EncodeMaskedWebSocketFrameHeader(pReader->Header, frameByte, SPILL_FRAME_LENGTH, pReader->pSpill->MaskingKey);
+		pReader->HeaderOffset = 0;
+		pReader->qwFrameOffset = 0;
+		pReader->qwFrames++;
+	}
+
+	if (pReader->HeaderOffset < pReader->HeaderLength)
+	{
+		dwRead = pReader->HeaderLength - pReader->HeaderOffset;
+		if (dwRead > dwLength) {
+			dwRead = dwLength;
+		}
+		memcpy(pBuffer, pReader->Header + pReader->HeaderOffset, dwRead);
+		pReader->HeaderOffset += dwRead;
+	}
+	else
+	{
+		dwRead = (unsigned long)(SPILL_FRAME_LENGTH - pReader->qwFrameOffset);
+		if (dwRead > dwLength) {
+			dwRead = dwLength;
+		}
+		memcpy(pBuffer, pReader->pSpill->Payload.data() + pReader->qwFrameOffset, dwRead);
+		pReader->qwFrameOffset += dwRead;
+	}
+	*pdwBytesRead = dwRead;
+
+	return 0;
+}
+
+static void InitializeSpillContext(SPILL_CONTEXT* pSpill, unsigned long long qwSpillThreshold)
+{
+	pSpill->qwSpillThreshold = qwSpillThreshold;
+	pSpill->Payload.resize(SPILL_FRAME_LENGTH);
+	for (size_t i = 0; i < pSpill->Payload.size(); i++) {
+		pSpill->Payload[i] = (unsigned char)(i * 7);
+	}
+	WebSocketGenerateMaskingKey(pSpill->MaskingKey);
+	UnmaskWebSocketPayload(pSpill->Payload.data(), pSpill->Payload.size(), pSpill->MaskingKey, 0);
+}
+
+// Receive and reassemble the message once per iteration, the metric is the most the resident set grew holding it
+static void BenchmarkSpill(void* pContext, unsigned long long qwIterations)
+{
+	SPILL_CONTEXT* pSpill = (SPILL_CONTEXT*)pContext;
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	SPILL_READER reader;
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	unsigned long long qwLength;
+	unsigned long long qwBufferSize;
+	unsigned long long qwNewSize;
+	unsigned long long qwResident;
+	unsigned long long qwGrowth;
+	unsigned long long qwSum = 0;
+	unsigned long dwReceived;
+	unsigned char* pBuffer;
+	unsigned char* pNewBuffer;
+	unsigned char* pReceive;
+	unsigned char* pView;
+	FILE* pFile;
+
+	qwGrowth = 0;
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		qwResident = GetResidentBytes();
+		memset(&reader, 0, sizeof(reader));
+		reader.pSpill = pSpill;
+		reader.qwFrameOffset = SPILL_FRAME_LENGTH;
+		memset(&stream, 0, sizeof(stream));
+		memset(&frame, 0, sizeof(frame));
+		stream.bQueuing = true;
+		stream.pFrameBuffer = frameBuffer;
+		bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+		pBuffer = NULL;
+		pFile = NULL;
+		qwBufferSize = 0;
+		qwLength = 0;
+
+		for (;;)
+		{
+			// Grow the buffer like GrowAssembly, or move the message to a file once it's past the threshold
+			if ((pFile == NULL) && (qwBufferSize - qwLength < 0x400))
+			{
+				qwNewSize = (qwBufferSize == 0) ? 0x1000 : qwBufferSize * 2;
+				if ((pSpill->qwSpillThreshold == 0) || (qwNewSize <= pSpill->qwSpillThreshold) || (qwBufferSize == 0))
+				{
+					pNewBuffer = (unsigned char*)realloc(pBuffer, (size_t)qwNewSize);
+					if (pNewBuffer == NULL) {
+						fprintf(stderr, "failed to grow the reassembly buffer to %llu bytes\n", qwNewSize);
+						break;
+					}
+					pBuffer = pNewBuffer;
+					qwBufferSize = qwNewSize;
+				}
+				else
+				{
+					pFile = tmpfile();
+					if (pFile == NULL) {
+						fprintf(stderr, "failed to create a temporary file to spill to\n");
+						break;
+					}
+					fwrite(pBuffer, 1, (size_t)qwLength, pFile);
+				}
+			}
+
+			// Receive after the data in memory, or into the whole buffer once it's written to the file
+			pReceive = (pFile == NULL) ? pBuffer + qwLength : pBuffer;
+			if (ReceiveWebSocketData(&stream, &frame, 0xFFFFFFFFFFFFFFFFULL, SpillRead, &reader, pReceive,
+				(unsigned long)((pFile == NULL) ? qwBufferSize - qwLength : qwBufferSize), &dwReceived, &bufferType, NULL) !=
+				IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+				fprintf(stderr, "failed to receive the message at byte %llu\n", qwLength);
+				break;
+			}
+			if (pFile != NULL) {
+				fwrite(pReceive, 1, dwReceived, pFile);
+			}
+			qwLength += dwReceived;
+
+			if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) {
+				break;
+			}
+		}
+
+		// The application gets the message in memory or as a mapped view of the file
+		if (pFile != NULL)
+		{
+			fflush(pFile);
+			pView = MapFile(pFile, qwLength);
+			if (pView != NULL) {
+				qwSum += pView[qwLength - 1];
+			}
+			if (GetResidentBytes() > qwResident + qwGrowth) {
+				qwGrowth = GetResidentBytes() - qwResident;
+			}
+			if (pView != NULL) {
+				UnmapFile(pView, qwLength);
+			}
+			fclose(pFile);
+		}
+		else
+		{
+			if ((pBuffer != NULL) && (qwLength != 0)) {
+				qwSum += pBuffer[qwLength - 1];
+			}
+			if (GetResidentBytes() > qwResident + qwGrowth) {
+				qwGrowth = GetResidentBytes() - qwResident;
+			}
+		}
+		if (qwLength != SPILL_MESSAGE_LENGTH) {
+			fprintf(stderr, "reassembled %llu bytes of %llu\n", qwLength, SPILL_MESSAGE_LENGTH);
+		}
+		free(pBuffer);
+	}
+
+	AddBenchmarkMetric("resident_growth_mb", (double)qwGrowth / 1048576.0);
+	BenchmarkSink += qwSum;
+}
+
+//
+// Frame tracing
+//
+// A frame is traced the way WebSocketServer traces it. With tracing off that's the load of the enabled flag, with it on
+// it's a TSC timestamp and WriteTraceRecord into this thread's ring. The ring is drained every 512 records, as if the
+// trace thread kept up with it. The target is under 20 ns per traced frame. Reading the TSC is timed on its own too, in
+// a virtual machine that traps it the read alone can cost more than the target.
+//
+
+#define TRACE_DRAIN_INTERVAL 512
+#define TRACE_TARGET_NANOSECONDS 20.0
+
+struct TRACE_CONTEXT
+{
+	bool bEnabled;
+	unsigned char Payload[IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES];
+};
+
+// Set by WebSocketServer when tracing is started, never set here
+static std::atomic<bool> BenchmarkTraceEnabled;
+
+// The ring of the benchmark thread, allocated the first time a frame is traced
+static thread_local WEB_SOCKET_TRACE_RING* pBenchmarkTraceRing;
+
+// The TSC where we have one, like TraceTimestamp
+static inline unsigned long long GetTraceTimestamp()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+static void BenchmarkTrace(void* pContext, unsigned long long qwIterations)
+{
+	TRACE_CONTEXT* pTrace = (TRACE_CONTEXT*)pContext;
+	WEB_SOCKET_TRACE_RING* pRing;
+	unsigned long long qwTraced = 0;
+	unsigned long long qwStart;
+
+	if (pBenchmarkTraceRing == NULL) {
+		pBenchmarkTraceRing = new WEB_SOCKET_TRACE_RING();
+	}
+	pRing = pBenchmarkTraceRing;
+	pRing->Dropped.store(0, std::memory_order_relaxed);
+
+	qwStart = GetNanoseconds();
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		if ((pTrace->bEnabled) || (BenchmarkTraceEnabled.load(std::memory_order_relaxed)))
+		{
+			WriteTraceRecord(pRing, i, GetTraceTimestamp(), 1, IIS_WEB_SOCKET_TRACE_OUTBOUND, 0x02, true,
+				sizeof(pTrace->Payload), 2, pTrace->Payload, sizeof(pTrace->Payload));
+			qwTraced++;
+		}
+		if ((i % TRACE_DRAIN_INTERVAL) == TRACE_DRAIN_INTERVAL - 1) {
+			pRing->Tail.store(pRing->Head.load(std::memory_order_acquire), std::memory_order_release);
+		}
+	}
+
+	if (qwIterations != 0) {
+		AddBenchmarkMetric("ns_per_frame", (double)(GetNanoseconds() - qwStart) / (double)qwIterations);
+	}
+	AddBenchmarkMetric("target_ns", TRACE_TARGET_NANOSECONDS);
+	AddBenchmarkMetric("dropped", (double)pRing->Dropped.load(std::memory_order_relaxed));
+	BenchmarkSink += qwTraced;
+}
+
+// Read the timestamp alone
+static void BenchmarkTraceTimestamp(void* pContext, unsigned long long qwIterations)
+{
+	unsigned long long qwSum = 0;
+
+	(void)pContext;
+	for (unsigned long long i = 0; i < qwIterations; i++) {
+		qwSum += GetTraceTimestamp();
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+//
+// Latency histograms
+//
+// 64 byte masked frames are received from memory with ReceiveWebSocketData the way WebSocketServer::Receive receives
+// them. With the histograms off that's the load of the enabled flag and no timing, with them on the core times the read,
+// parse and unmask phases and each is recorded into this thread's histograms, like RecordLatency does. The difference is
+// the overhead per frame. latency/record is a single RecordWebSocketLatency on its own.
+//
+
+#define LATENCY_FRAME_LENGTH 64
+#define LATENCY_FRAME_COUNT 1024
+
+struct LATENCY_CONTEXT
+{
+	bool bEnabled;
+	std::vector<unsigned char> Stream;
+	size_t Offset;
+};
+
+// Set by EnableLatencyHistograms, never set here
+static std::atomic<bool> BenchmarkLatencyEnabled;
+
+// The histograms of the benchmark thread, read wait, parse and unmask
+static thread_local WEB_SOCKET_LATENCY_HISTOGRAM* pBenchmarkHistograms;
+
+// Converts ticks to nanoseconds, a typical TSC frequency, the multiply is part of what RecordLatency costs
+static volatile double BenchmarkNanosecondsPerTick = 0.3;
+
+// Allocated the first time a latency case runs on the thread
+static WEB_SOCKET_LATENCY_HISTOGRAM* GetBenchmarkHistograms()
+{
+	if (pBenchmarkHistograms == NULL)
+	{
+		pBenchmarkHistograms = new WEB_SOCKET_LATENCY_HISTOGRAM[3]();
+		for (int phase = 0; phase < 3; phase++) {
+			ClearWebSocketLatencyHistogram(&pBenchmarkHistograms[phase]);
+		}
+	}
+
+	return pBenchmarkHistograms;
+}
+
+// Reads the frames from memory, starting over at the end
+static unsigned long LatencyRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	LATENCY_CONTEXT* pLatency = (LATENCY_CONTEXT*)pContext;
+
+	if (pLatency->Offset == pLatency->Stream.size()) {
+		pLatency->Offset = 0;
+	}
+	if (dwLength > pLatency->Stream.size() - pLatency->Offset) {
+		dwLength = (unsigned long)(pLatency->Stream.size() - pLatency->Offset);
+	}
+	memcpy(pBuffer, &pLatency->Stream[pLatency->Offset], dwLength);
+	pLatency->Offset += dwLength;
+	*pdwBytesRead = dwLength;
+
+	return 0;
+}
+
+static void BenchmarkLatency(void* pContext, unsigned long long qwIterations)
+{
+	LATENCY_CONTEXT* pLatency = (LATENCY_CONTEXT*)pContext;
+	unsigned char buffer[LATENCY_FRAME_LENGTH];
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	WEB_SOCKET_RECEIVE_TIMING timing;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	unsigned long dwReceived;
+	WEB_SOCKET_LATENCY_HISTOGRAM* pHistograms;
+	unsigned long long qwSum = 0;
+	bool bLatency;
+
+	pHistograms = GetBenchmarkHistograms();
+	memset(&stream, 0, sizeof(stream));
+	memset(&frame, 0, sizeof(frame));
+	stream.bQueuing = true;
+	stream.pFrameBuffer = frameBuffer;
+	pLatency->Offset = 0;
+
+	for (unsigned long long i = 0; i < qwIterations; i++)
+	{
+		bLatency = (pLatency->bEnabled) || (BenchmarkLatencyEnabled.load(std::memory_order_relaxed));
+		timing.pfnTimestamp = bLatency ? GetTraceTimestamp : NULL;
+		bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+		if (ReceiveWebSocketData(&stream, &frame, 0xFFFFFFFFFFFFFFFFULL, LatencyRead, pLatency, buffer, sizeof(buffer),
+			&dwReceived, &bufferType, &timing) != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			fprintf(stderr, "failed to receive frame %llu\n", i);
+			return;
+		}
+		if (bLatency)
+		{
+			RecordWebSocketLatency(&pHistograms[0], (unsigned long long)((double)timing.qwReadWait * BenchmarkNanosecondsPerTick));
+			if (timing.bNewFrame) {
+				RecordWebSocketLatency(&pHistograms[1], (unsigned long long)((double)timing.qwParse * BenchmarkNanosecondsPerTick));
+			}
+			if (frame.bMask) {
+				RecordWebSocketLatency(&pHistograms[2], (unsigned long long)((double)timing.qwUnmask * BenchmarkNanosecondsPerTick));
+			}
+		}
+		qwSum += dwReceived + buffer[dwReceived - 1];
+	}
+
+	BenchmarkSink += qwSum;
+}
+
+// Record a spread of latencies into one histogram
+static void BenchmarkLatencyRecord(void* pContext, unsigned long long qwIterations)
+{
+	WEB_SOCKET_LATENCY_HISTOGRAM* pHistograms;
+
+	(void)pContext;
+	pHistograms = GetBenchmarkHistograms();
+
+	for (unsigned long long i = 0; i < qwIterations; i++) {
+		RecordWebSocketLatency(&pHistograms[0], (i * 0x9E3779B97F4A7C15ULL) >> 44);
+	}
+
+	// Spread evenly up to 1048 us, so p99 is about 1038 us give or take the 3% of a bucket
+	AddBenchmarkMetric("p99_us", (double)GetWebSocketLatencyPercentile(&pHistograms[0], qwIterations, 0.99) / 1000.0);
+	ClearWebSocketLatencyHistogram(&pHistograms[0]);
+}
+
+// The masked frames, each a binary message
+static void InitializeLatencyContext(LATENCY_CONTEXT* pLatency, bool bEnabled)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	const char maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+	unsigned int headerLength;
+	size_t offset;
+
+	pLatency->bEnabled = bEnabled;
+	pLatency->Offset = 0;
+	for (int frame = 0; frame < LATENCY_FRAME_COUNT; frame++)
+	{
+		headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, LATENCY_FRAME_LENGTH, maskingKey);
+		pLatency->Stream.insert(pLatency->Stream.end(), header, header + headerLength);
+
+		offset = pLatency->Stream.size();
+		pLatency->Stream.resize(offset + LATENCY_FRAME_LENGTH);
+		for (int i = 0; i < LATENCY_FRAME_LENGTH; i++) {
+			pLatency->Stream[offset + i] = (unsigned char)(frame + i);
+		}
+		UnmaskWebSocketPayload(&pLatency->Stream[offset], LATENCY_FRAME_LENGTH, maskingKey, 0);
+	}
+}
+
+//
+// Runner
+//
+
+// Run a case, doubling the iterations until it takes at least the minimum time
+static BENCHMARK_RESULT RunBenchmark(BENCHMARK_CASE* pCase, double minNanoseconds)
+{
+	BENCHMARK_RESULT result;
+	unsigned long long qwIterations;
+	double elapsed;
+
+	// Warm up caches and the branch predictor
+	pCase->pfnBenchmark(pCase->pContext, 1);
+
+	qwIterations = 1;
+	for (;;)
+	{
+		BenchmarkMetrics.clear();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		pCase->pfnBenchmark(pCase->pContext, qwIterations);
+		elapsed = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+		if ((elapsed >= minNanoseconds) || (qwIterations >= (1ULL << 40))) {
+			break;
+		}
+
+		// Aim straight for the minimum time once the measurement is long enough to trust
+		if (elapsed > minNanoseconds / 100) {
+			qwIterations = (unsigned long long)((double)qwIterations * minNanoseconds * 1.2 / elapsed) + 1;
+		}
+		else {
+			qwIterations *= 10;
+		}
+	}
+
+	result.Name = pCase->Name;
+	result.qwIterations = qwIterations;
+	result.NanosecondsPerIteration = elapsed / (double)qwIterations;
+	result.BytesPerSecond = 0;
+	if (pCase->qwBytesPerIteration != 0) {
+		result.BytesPerSecond = (double)pCase->qwBytesPerIteration * (double)qwIterations * 1000000000.0 / elapsed;
+	}
+	result.Metrics = BenchmarkMetrics;
+
+	return result;
+}
+
+// Write the results as JSON
+static void WriteResults(FILE* pFile, std::vector<BENCHMARK_RESULT>& results)
+{
+	fprintf(pFile, "{\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		fprintf(pFile, "    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"bytes_per_second\": %.0f",
+			results[i].Name.c_str(), results[i].qwIterations, results[i].NanosecondsPerIteration, results[i].BytesPerSecond);
+		for (size_t j = 0; j < results[i].Metrics.size(); j++) {
+			fprintf(pFile, ", \"%s\": %.3f", results[i].Metrics[j].pName, results[i].Metrics[j].Value);
+		}
+		fprintf(pFile, " }%s\n", (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(pFile, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* pJsonPath = NULL;
+	const char* pFilter = NULL;
+	double minNanoseconds = 200000000.0;
+	std::vector<BENCHMARK_CASE> cases;
+	std::vector<BENCHMARK_RESULT> results;
+	FILE* pFile;
+	char name[0x100];
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--filter") == 0) && (i + 1 < argc)) {
+			pFilter = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--min-time") == 0) && (i + 1 < argc)) {
+			minNanoseconds = atof(argv[++i]) * 1000000.0;
+		}
+		else {
+			fprintf(stderr, "usage: benchmark [--json <output file>] [--filter <name>] [--min-time <milliseconds>]\n");
+			return 1;
+		}
+	}
+
+	// Frame parsing for each of the three payload length encodings
+	static PARSE_CONTEXT parse7, parse16, parse64;
+	InitializeParseContext(&parse7, 100);
+	InitializeParseContext(&parse16, 1000);
+	InitializeParseContext(&parse64, 100000);
+	cases.push_back({ "parse/7-bit", BenchmarkParse, &parse7, 0 });
+	cases.push_back({ "parse/16-bit", BenchmarkParse, &parse16, 0 });
+	cases.push_back({ "parse/64-bit", BenchmarkParse, &parse64, 0 });
+
+	// The same headers with the parser as it was before validation, and a mix of valid and of invalid headers
+	static MIXED_PARSE_CONTEXT parseMixed, parseInvalid;
+	InitializeMixedParseContext(&parseMixed, false);
+	InitializeMixedParseContext(&parseInvalid, true);
+	cases.push_back({ "parse-baseline/7-bit", BenchmarkBaselineParse, &parse7, 0 });
+	cases.push_back({ "parse-baseline/16-bit", BenchmarkBaselineParse, &parse16, 0 });
+	cases.push_back({ "parse-baseline/64-bit", BenchmarkBaselineParse, &parse64, 0 });
+	cases.push_back({ "parse/mixed", BenchmarkMixedParse, &parseMixed, 0 });
+	cases.push_back({ "parse-baseline/mixed", BenchmarkBaselineMixedParse, &parseMixed, 0 });
+	cases.push_back({ "parse/invalid", BenchmarkMixedParse, &parseInvalid, 0 });
+
+	// Frame header encoding
+	static ENCODE_CONTEXT encode7 = { 100 }, encode16 = { 1000 }, encode64 = { 100000 };
+	cases.push_back({ "encode/7-bit", BenchmarkEncode, &encode7, 0 });
+	cases.push_back({ "encode/16-bit", BenchmarkEncode, &encode16, 0 });
+	cases.push_back({ "encode/64-bit", BenchmarkEncode, &encode64, 0 });
+
+	// Unmasking at varied sizes, starting at each position in the masking key
+	static const unsigned long long unmaskSizes[] = { 16, 125, 1024, 16384, 1048576 };
+	static UNMASK_CONTEXT unmask[sizeof(unmaskSizes) / sizeof(unmaskSizes[0])][4];
+	for (size_t size = 0; size < sizeof(unmaskSizes) / sizeof(unmaskSizes[0]); size++)
+	{
+		for (unsigned long long phase = 0; phase < 4; phase++)
+		{
+			unmask[size][phase].Payload.assign((size_t)unmaskSizes[size], 0x5A);
+			unmask[size][phase].mkI = phase;
+			snprintf(name, sizeof(name), "unmask/%llu/phase-%llu", unmaskSizes[size], phase);
+			cases.push_back({ name, BenchmarkUnmask, &unmask[size][phase], unmaskSizes[size] });
+		}
+	}
+
+	// Masking keys for client frames
+	cases.push_back({ "masking-key", BenchmarkMaskingKey, NULL, 0 });
+
+	// Reassembly of fragmented messages
+	static REASSEMBLY_CONTEXT reassemblySmall, reassemblyLarge;
+	InitializeReassemblyContext(&reassemblySmall, 4, 256);
+	InitializeReassemblyContext(&reassemblyLarge, 16, 65536);
+	cases.push_back({ "reassembly/4x256", BenchmarkReassembly, &reassemblySmall, 4 * 256 });
+	cases.push_back({ "reassembly/16x65536", BenchmarkReassembly, &reassemblyLarge, 16 * 65536 });
+
+	// Handshake header checks
+	static HANDSHAKE_CONTEXT handshakeSingle = { "Upgrade", "websocket" };
+	static HANDSHAKE_CONTEXT handshakeList = { "keep-alive, Upgrade", "WebSocket" };
+	cases.push_back({ "handshake/connection-single", BenchmarkHandshake, &handshakeSingle, 0 });
+	cases.push_back({ "handshake/connection-list", BenchmarkHandshake, &handshakeList, 0 });
+
+	// Rate limiting of 64 byte messages, within and over the limits, with nanosecond timestamps
+	static const IIS_WEB_SOCKET_RATE_LIMITS rateLimits = { 100000, 10000000, 100000, 0, 0, 0 };
+	static RATE_LIMIT_CONTEXT rateLimitWithin = { {}, 20000 }, rateLimitOver = { {}, 1000 };
+	InitializeRateLimiter(&rateLimitWithin.Limiter, &rateLimits, 1000000000);
+	InitializeRateLimiter(&rateLimitOver.Limiter, &rateLimits, 1000000000);
+	cases.push_back({ "rate-limit/within", BenchmarkRateLimit, &rateLimitWithin, 0 });
+	cases.push_back({ "rate-limit/over", BenchmarkRateLimit, &rateLimitOver, 0 });
+
+	// Memory accounting of 128 byte allocations, against malloc and free alone, with budgets that are never hit
+	static const IIS_WEB_SOCKET_MEMORY_BUDGET memoryBudget = { 1ULL << 40, 1ULL << 41 };
+	static WEB_SOCKET_MEMORY_ACCOUNT memoryAccount;
+	InitializeMemoryAccount(&memoryAccount, NULL);
+	SetMemoryAccountBudget(&memoryAccount, &memoryBudget);
+	static MEMORY_CONTEXT memoryMalloc = { NULL, false, true, 128, 0 }, memoryCharged = { &memoryAccount, true, true, 128, 0 };
+	static MEMORY_CONTEXT memoryGlobal = { NULL, true, false, 128, 0 }, memoryConnection = { &memoryAccount, true, false, 128, 0 };
+	cases.push_back({ "memory/malloc", BenchmarkMemory, &memoryMalloc, 0 });
+	cases.push_back({ "memory/malloc-charged", BenchmarkMemory, &memoryCharged, 0 });
+	cases.push_back({ "memory/charge-global", BenchmarkMemory, &memoryGlobal, 0 });
+	cases.push_back({ "memory/charge-connection", BenchmarkMemory, &memoryConnection, 0 });
+	static MEMORY_CONTEXT memoryThreads = { NULL, true, false, 128, 4 };
+	cases.push_back({ "memory/charge-4-threads", BenchmarkMemory, &memoryThreads, 0 });
+
+	// Publish and subscribe with 100000 connections and 10000 topics
+	static PUBSUB_STATE pubSubState;
+	static PUBSUB_CONTEXT publishTopic = { &pubSubState, NULL, 64 }, publishAll = { &pubSubState, "all", 64 }, churn = { &pubSubState, NULL, 0 };
+	cases.push_back({ "pubsub/publish-topic", BenchmarkPublish, &publishTopic, 0 });
+	cases.push_back({ "pubsub/publish-all", BenchmarkPublish, &publishAll, 0 });
+	cases.push_back({ "pubsub/subscribe-churn", BenchmarkSubscribeChurn, &churn, 0 });
+
+	// Flushing 64 byte messages after each one, at the default FlushThreshold of 16 KB, and at the default FlushDelay of 200 us
+	static FLUSH_CONTEXT flushImmediate, flushSizeThreshold, flushMaxDelay;
+	flushImmediate.Policy = IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_IMMEDIATE_FLUSH_POLICY;
+	flushSizeThreshold.Policy = IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_SIZE_THRESHOLD_FLUSH_POLICY;
+	flushMaxDelay.Policy = IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_MAX_DELAY_FLUSH_POLICY;
+	flushImmediate.dwFlushThreshold = flushSizeThreshold.dwFlushThreshold = flushMaxDelay.dwFlushThreshold = 0x4000;
+	flushImmediate.qwFlushDelay = flushSizeThreshold.qwFlushDelay = flushMaxDelay.qwFlushDelay = 200;
+	cases.push_back({ "flush/immediate", BenchmarkFlush, &flushImmediate, FLUSH_MESSAGE_LENGTH });
+	cases.push_back({ "flush/size-threshold", BenchmarkFlush, &flushSizeThreshold, FLUSH_MESSAGE_LENGTH });
+	cases.push_back({ "flush/max-delay", BenchmarkFlush, &flushMaxDelay, FLUSH_MESSAGE_LENGTH });
+
+	// Sending a 500 MB file read into memory, mapped, and as a file handle chunk, which only costs the worker the headers
+	static SEND_FILE_STATE sendFileState;
+	static SEND_FILE_CONTEXT sendFileRead = { &sendFileState, SEND_FILE_READ }, sendFileMap = { &sendFileState, SEND_FILE_MAP };
+	static SEND_FILE_CONTEXT sendFileHandle = { &sendFileState, SEND_FILE_HANDLE };
+	cases.push_back({ "send-file/read", BenchmarkSendFile, &sendFileRead, SEND_FILE_LENGTH });
+	cases.push_back({ "send-file/map", BenchmarkSendFile, &sendFileMap, SEND_FILE_LENGTH });
+	cases.push_back({ "send-file/handle", BenchmarkSendFile, &sendFileHandle, 0 });
+
+	// Reassembling a 1 GB upload in memory, and spilled to a file past 1 MB
+	static SPILL_CONTEXT spillMemory, spillFile;
+	InitializeSpillContext(&spillMemory, 0);
+	InitializeSpillContext(&spillFile, SPILL_THRESHOLD);
+	cases.push_back({ "spill/1gb-memory", BenchmarkSpill, &spillMemory, SPILL_MESSAGE_LENGTH });
+	cases.push_back({ "spill/1gb-file", BenchmarkSpill, &spillFile, SPILL_MESSAGE_LENGTH });
+
+	// Tracing a frame with tracing off and on, against the target of 20 ns per frame
+	static TRACE_CONTEXT traceDisabled = { false, {} }, traceEnabled = { true, {} };
+	cases.push_back({ "trace/disabled", BenchmarkTrace, &traceDisabled, 0 });
+	cases.push_back({ "trace/enabled", BenchmarkTrace, &traceEnabled, 0 });
+	cases.push_back({ "trace/timestamp", BenchmarkTraceTimestamp, NULL, 0 });
+
+	// Receiving a 64 byte frame with the latency histograms off and on, and recording a single latency
+	static LATENCY_CONTEXT latencyDisabled, latencyEnabled;
+	InitializeLatencyContext(&latencyDisabled, false);
+	InitializeLatencyContext(&latencyEnabled, true);
+	cases.push_back({ "latency/disabled", BenchmarkLatency, &latencyDisabled, LATENCY_FRAME_LENGTH });
+	cases.push_back({ "latency/enabled", BenchmarkLatency, &latencyEnabled, LATENCY_FRAME_LENGTH });
+	cases.push_back({ "latency/record", BenchmarkLatencyRecord, NULL, 0 });
+
+	// Run the cases
+	for (size_t i = 0; i < cases.size(); i++)
+	{
+		if ((pFilter != NULL) && (strstr(cases[i].Name.c_str(), pFilter) == NULL)) {
+			continue;
+		}
+
+		results.push_back(RunBenchmark(&cases[i], minNanoseconds));
+
+		BENCHMARK_RESULT* pResult = &results.back();
+		if (pResult->BytesPerSecond != 0) {
+			fprintf(stderr, "%-32s %14.2f ns/op %12.2f MB/s", pResult->Name.c_str(), pResult->NanosecondsPerIteration, pResult->BytesPerSecond / 1000000.0);
+		}
+		else {
+			fprintf(stderr, "%-32s %14.2f ns/op", pResult->Name.c_str(), pResult->NanosecondsPerIteration);
+		}
+		for (size_t j = 0; j < pResult->Metrics.size(); j++) {
+			fprintf(stderr, " %12.2f %s", pResult->Metrics[j].Value, pResult->Metrics[j].pName);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	// Write the JSON results
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		WriteResults(pFile, results);
+		fclose(pFile);
+	}
+	else {
+		WriteResults(stdout, results);
+	}
+
+	return 0;
+}
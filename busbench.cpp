@@ -0,0 +1,319 @@
+
+//
+// busbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Measures the shared memory bus between processes, like the worker processes of a web garden.
+//     Subscriber processes are forked, each adds connections to the shared count and reads every message
+//     the parent publishes. Messages carry the time they were published, the subscribers measure the latency.
+//
+//     Usage: busbench [--processes <count>] [--messages <count>] [--size <bytes>] [--rate <messages per second>]
+//                     [--capacity <bytes>] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketbus.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The bus used by the benchmark, removed before and after each run
+#define BUSBENCH_NAME "iiswebsocket-busbench"
+
+// Each subscriber process adds this many connections
+#define BUSBENCH_CONNECTIONS_PER_PROCESS 1000
+
+// What a subscriber process reports back through its pipe, followed by its latencies
+struct BUSBENCH_RESULT
+{
+	unsigned long long qwMessages;
+	unsigned long long qwOverruns;
+	unsigned long long qwLatencies;
+};
+
+// Nanoseconds on the monotonic clock, which is the same in every process
+static unsigned long long Timestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Write all bytes to a pipe
+static bool WriteAll(int fd, const void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = write(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (const char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read all bytes from a pipe
+static bool ReadAll(int fd, void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = read(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// A subscriber process, reads messages until the "stop" topic and reports its latencies
+static int Subscriber(int readyFd, int resultFd)
+{
+	WebSocketBus bus;
+	WEB_SOCKET_BUS_MESSAGE message;
+	BUSBENCH_RESULT result;
+	std::vector<unsigned long long> latencies;
+	unsigned long long qwPublished;
+	char ready = 1;
+
+	if (!bus.Open(BUSBENCH_NAME, 0)) {
+		fprintf(stderr, "subscriber %d failed to open the bus\n", (int)getpid());
+		return 1;
+	}
+	bus.AddConnections(BUSBENCH_CONNECTIONS_PER_PROCESS);
+	WriteAll(readyFd, &ready, 1);
+	close(readyFd);
+
+	memset(&result, 0, sizeof(result));
+	for (;;)
+	{
+		if (!bus.Receive(&message, 10000)) {
+			fprintf(stderr, "subscriber %d timed out\n", (int)getpid());
+			break;
+		}
+		if (strcmp(message.pTopic, "stop") == 0) {
+			break;
+		}
+		if (message.qwLength >= sizeof(qwPublished)) {
+			memcpy(&qwPublished, message.pData, sizeof(qwPublished));
+			latencies.push_back(Timestamp() - qwPublished);
+		}
+		result.qwMessages++;
+	}
+
+	result.qwOverruns = bus.GetOverruns();
+	result.qwLatencies = latencies.size();
+	WriteAll(resultFd, &result, sizeof(result));
+	WriteAll(resultFd, latencies.data(), latencies.size() * sizeof(unsigned long long));
+	close(resultFd);
+
+	bus.Close();
+	return 0;
+}
+
+// Get a percentile of sorted latencies
+static unsigned long long Percentile(const std::vector<unsigned long long>& latencies, double percentile)
+{
+	if (latencies.empty()) {
+		return 0;
+	}
+	return latencies[std::min(latencies.size() - 1, (size_t)(percentile * (double)latencies.size()))];
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int processes = 4;
+	unsigned long long qwMessages = 100000;
+	unsigned long long qwSize = 64;
+	unsigned long long qwCapacity = IIS_WEB_SOCKET_BUS_DEFAULT_CAPACITY;
+	double rate = 0;
+	const char* pJsonPath = NULL;
+	WebSocketBus bus;
+	std::vector<pid_t> children;
+	std::vector<int> resultFds;
+	std::vector<unsigned long long> latencies;
+	std::vector<unsigned char> payload;
+	BUSBENCH_RESULT result;
+	unsigned long long qwDelivered = 0;
+	unsigned long long qwOverruns = 0;
+	unsigned long long qwTimestamp;
+	long long connections;
+	long long connectionsAfter;
+	int readyPipe[2];
+	int resultPipe[2];
+	char ready;
+	double elapsed;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--processes") == 0) && (i + 1 < argc)) {
+			processes = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			qwMessages = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)) {
+			rate = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--capacity") == 0) && (i + 1 < argc)) {
+			qwCapacity = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: busbench [--processes <count>] [--messages <count>] [--size <bytes>] [--rate <messages per second>]\n"
+				"                [--capacity <bytes>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+
+	if ((processes == 0) || (processes >= IIS_WEB_SOCKET_BUS_MAX_PROCESSES)) {
+		fprintf(stderr, "--processes must be between 1 and %d\n", IIS_WEB_SOCKET_BUS_MAX_PROCESSES - 1);
+		return 1;
+	}
+	if (qwSize < sizeof(unsigned long long)) {
+		qwSize = sizeof(unsigned long long);
+	}
+
+	// Start from a new bus
+	RemoveSharedMemory(BUSBENCH_NAME);
+	if (!bus.Open(BUSBENCH_NAME, qwCapacity)) {
+		fprintf(stderr, "failed to create the bus\n");
+		return 1;
+	}
+
+	// Fork the subscribers, each says when it's reading
+	if (pipe(readyPipe) != 0) {
+		return 1;
+	}
+	for (unsigned int i = 0; i < processes; i++)
+	{
+		if (pipe(resultPipe) != 0) {
+			return 1;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(readyPipe[0]);
+			close(resultPipe[0]);
+			_exit(Subscriber(readyPipe[1], resultPipe[1]));
+		}
+		close(resultPipe[1]);
+		children.push_back(pid);
+		resultFds.push_back(resultPipe[0]);
+	}
+	close(readyPipe[1]);
+	for (unsigned int i = 0; i < processes; i++) {
+		if (!ReadAll(readyPipe[0], &ready, 1)) {
+			fprintf(stderr, "a subscriber failed to start\n");
+			return 1;
+		}
+	}
+	close(readyPipe[0]);
+
+	// Every process sees the connections of all of them
+	connections = bus.GetConnectionCount();
+
+	// Publish, the first bytes of each message are the time it was published
+	payload.assign((size_t)qwSize, 0x5A);
+	Clock::time_point start = Clock::now();
+	Clock::time_point next = start;
+	Clock::duration interval = Clock::duration::zero();
+	if (rate > 0) {
+		interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rate));
+	}
+	for (unsigned long long i = 0; i < qwMessages; i++)
+	{
+		if (rate > 0) {
+			std::this_thread::sleep_until(next);
+			next += interval;
+		}
+		qwTimestamp = Timestamp();
+		memcpy(payload.data(), &qwTimestamp, sizeof(qwTimestamp));
+		if (!bus.Publish("bench", IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size())) {
+			fprintf(stderr, "a %llu byte message doesn't fit in the bus\n", qwSize);
+			break;
+		}
+	}
+	elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// Wait for the subscribers to catch up, then stop them
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	bus.Publish("stop", IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, NULL, 0);
+
+	// Collect the results
+	for (unsigned int i = 0; i < processes; i++)
+	{
+		if (ReadAll(resultFds[i], &result, sizeof(result)))
+		{
+			size_t offset = latencies.size();
+			latencies.resize(offset + (size_t)result.qwLatencies);
+			if (!ReadAll(resultFds[i], latencies.data() + offset, (size_t)result.qwLatencies * sizeof(unsigned long long))) {
+				latencies.resize(offset);
+			}
+			qwDelivered += result.qwMessages;
+			qwOverruns += result.qwOverruns;
+		}
+		close(resultFds[i]);
+		waitpid(children[i], NULL, 0);
+	}
+	connectionsAfter = bus.GetConnectionCount();
+	bus.Close();
+	RemoveSharedMemory(BUSBENCH_NAME);
+
+	std::sort(latencies.begin(), latencies.end());
+
+	printf("processes        %u subscribers\n", processes);
+	printf("connections      %lld counted by the bus, %lld after the subscribers exited\n", connections, connectionsAfter);
+	printf("published        %llu messages of %llu bytes, %.0f messages/s, %.2f MB/s\n",
+		qwMessages, qwSize, (double)qwMessages / elapsed, (double)(qwMessages * qwSize) / elapsed / 1000000.0);
+	printf("delivered        %llu of %llu, %llu overruns\n", qwDelivered, qwMessages * processes, qwOverruns);
+	printf("latency p50      %.1f us\n", (double)Percentile(latencies, 0.5) / 1000.0);
+	printf("latency p99      %.1f us\n", (double)Percentile(latencies, 0.99) / 1000.0);
+	printf("latency p999     %.1f us\n", (double)Percentile(latencies, 0.999) / 1000.0);
+	printf("latency max      %.1f us\n", latencies.empty() ? 0.0 : (double)latencies.back() / 1000.0);
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"processes\": %u,\n  \"connections\": %lld,\n  \"connections_after_exit\": %lld,\n"
+			"  \"messages\": %llu,\n  \"message_bytes\": %llu,\n  \"seconds\": %.3f,\n  \"messages_per_second\": %.0f,\n"
+			"  \"delivered\": %llu,\n  \"overruns\": %llu,\n"
+			"  \"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu }\n}\n",
+			processes, connections, connectionsAfter, qwMessages, qwSize, elapsed, (double)qwMessages / elapsed,
+			qwDelivered, qwOverruns,
+			Percentile(latencies, 0.5), Percentile(latencies, 0.99), Percentile(latencies, 0.999),
+			latencies.empty() ? 0ULL : latencies.back());
+		fclose(pFile);
+	}
+
+	return (connections == (long long)processes * BUSBENCH_CONNECTIONS_PER_PROCESS) && (connectionsAfter == 0) ? 0 : 1;
+}
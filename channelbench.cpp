@@ -0,0 +1,635 @@
+
+//
+// channelbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Compares N logical channels over one WebSocket connection with N WebSocket connections.
+//     An echo server runs in the same process over loopback. Like the IIS module, every connection it
+//     accepts gets a thread and a receive buffer. The setup time covers the handshakes or channel opens and the
+//     first echo of every stream, the memory is the growth of the resident set while the streams are open.
+//
+//     Usage: channelbench [--streams <count>] [--messages <count per stream>] [--size <bytes>] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketchannel.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The receive buffer of each server connection, the size of a WebSocketServer's reassembly buffer
+#define CHANNELBENCH_RECEIVE_BUFFER_LENGTH 0x10000
+
+// The results of one way of opening the streams
+struct CHANNELBENCH_RESULT
+{
+	double SetupSeconds;
+	double RoundTripSeconds;
+	long long MemoryBytes;
+	bool bFailed;
+};
+
+// A server connection using the channel protocol
+struct CHANNELBENCH_SERVER_CONNECTION
+{
+	int Socket;
+	WebSocketChannels Channels;
+};
+
+// The client side of the channel connection
+struct CHANNELBENCH_CLIENT
+{
+	int Socket;
+	std::mutex WriteLock;
+	WebSocketChannels Channels;
+	// Counts the echoes received, the driver waits for each
+	std::mutex EchoLock;
+	std::condition_variable EchoReady;
+	unsigned long long qwEchoes;
+};
+
+// Stops the in-process echo server
+static std::atomic<bool> ServerStopping;
+
+// Write all bytes to a socket
+static bool SendAll(int socket, const void* pBuffer, size_t length)
+{
+	const char* pBytes = (const char*)pBuffer;
+	ssize_t sent;
+
+	while (length != 0)
+	{
+		sent = send(socket, pBytes, length, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		pBytes += sent;
+		length -= (size_t)sent;
+	}
+
+	return true;
+}
+
+// Read exactly length bytes from a socket
+static bool ReceiveAll(int socket, void* pBuffer, size_t length)
+{
+	char* pBytes = (char*)pBuffer;
+	ssize_t received;
+
+	while (length != 0)
+	{
+		received = recv(socket, pBytes, length, 0);
+		if (received <= 0) {
+			if ((received < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		pBytes += received;
+		length -= (size_t)received;
+	}
+
+	return true;
+}
+
+// Read an HTTP request or response up to the blank line that ends the headers
+static bool ReceiveHttpHeaders(int socket, std::string* pHeaders)
+{
+	char c;
+
+	pHeaders->clear();
+	while ((pHeaders->size() < 4) || (pHeaders->compare(pHeaders->size() - 4, 4, "\r\n\r\n") != 0))
+	{
+		if (!ReceiveAll(socket, &c, 1) || (pHeaders->size() > 0x2000)) {
+			return false;
+		}
+		pHeaders->push_back(c);
+	}
+
+	return true;
+}
+
+// Find a header value in HTTP headers, the header name is compared ignoring case
+static bool FindHttpHeader(const std::string& headers, const char* pName, std::string* pValue)
+{
+	size_t nameLength = strlen(pName);
+	size_t line = headers.find("\r\n");
+	size_t end;
+
+	while ((line != std::string::npos) && (line + 2 < headers.size()))
+	{
+		line += 2;
+		end = headers.find("\r\n", line);
+		if (end == std::string::npos) {
+			break;
+		}
+		if ((end - line > nameLength) && (headers[line + nameLength] == ':') && (strncasecmp(&headers[line], pName, nameLength) == 0))
+		{
+			size_t start = line + nameLength + 1;
+			while ((start < end) && (headers[start] == ' ')) {
+				start++;
+			}
+			pValue->assign(headers, start, end - start);
+			return true;
+		}
+		line = end;
+	}
+
+	return false;
+}
+
+// Read a frame header and its payload, the payload is unmasked
+// bMasked is true when reading a client's frames
+static bool ReceiveFrame(int socket, WEB_SOCKET_FRAME* pFrame, std::vector<unsigned char>* pPayload, bool bMasked)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned long dwReceived = 0;
+
+	while (!ParseWebSocketFrame(header, dwReceived, pFrame, bMasked))
+	{
+		if (!ReceiveAll(socket, header + dwReceived, pFrame->FrameSize - dwReceived)) {
+			return false;
+		}
+		dwReceived = pFrame->FrameSize;
+	}
+	if ((pFrame->Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) || (pFrame->PayloadLength > 0x1000000)) {
+		return false;
+	}
+
+	pPayload->resize((size_t)pFrame->PayloadLength);
+	if (!ReceiveAll(socket, pPayload->data(), pPayload->size())) {
+		return false;
+	}
+	if (pFrame->bMask) {
+		UnmaskWebSocketPayload(pPayload->data(), pPayload->size(), pFrame->MaskingKey, 0);
+	}
+
+	return true;
+}
+
+// Write a binary message, masked as a client sends it or unmasked as a server does
+static bool SendMessage(int socket, bool bMask, const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength)
+{
+	std::vector<unsigned char> frame(IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + prefixLength + (size_t)qwLength);
+	unsigned int headerLength;
+	char maskingKey[4];
+
+	if (bMask) {
+		WebSocketGenerateMaskingKey(maskingKey);
+		headerLength = EncodeMaskedWebSocketFrameHeader(frame.data(), 0x82, prefixLength + qwLength, maskingKey);
+	}
+	else {
+		headerLength = EncodeWebSocketFrameHeader(frame.data(), 0x82, prefixLength + qwLength);
+	}
+	memcpy(frame.data() + headerLength, pPrefix, prefixLength);
+	memcpy(frame.data() + headerLength + prefixLength, pData, (size_t)qwLength);
+	if (bMask) {
+		UnmaskWebSocketPayload(frame.data() + headerLength, prefixLength + qwLength, maskingKey, 0);
+	}
+
+	return SendAll(socket, frame.data(), headerLength + prefixLength + (size_t)qwLength);
+}
+
+// The resident set of the process in bytes
+static long long ResidentBytes()
+{
+	long long pages = 0;
+	long long resident = 0;
+	FILE* pFile;
+
+	pFile = fopen("/proc/self/statm", "r");
+	if (pFile != NULL) {
+		if (fscanf(pFile, "%lld %lld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(pFile);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+//
+// Echo server
+//
+
+// The server writes channel messages from its receive thread only
+static bool ServerWriteChannelMessage(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength)
+{
+	(void)bufferType;
+	return SendMessage(((CHANNELBENCH_SERVER_CONNECTION*)pContext)->Socket, false, pPrefix, prefixLength, pData, qwLength);
+}
+
+// Echo a message back on its channel
+static void ServerEchoChannel(void* pContext, unsigned long long channelId, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	if (bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+		((WebSocketChannels*)pContext)->Send(channelId, bufferType, pData, qwLength);
+	}
+}
+
+// A server connection, echoes messages or the messages of its channels
+static void EchoConnection(int socket)
+{
+	std::string request;
+	std::string key;
+	std::string protocol;
+	char accept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1];
+	char response[0x200];
+	WEB_SOCKET_FRAME frame;
+	std::vector<unsigned char> payload;
+	CHANNELBENCH_SERVER_CONNECTION connection;
+	bool bChannels;
+	int flag = 1;
+
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	// Each connection holds a receive buffer, like a WebSocketServer
+	payload.resize(CHANNELBENCH_RECEIVE_BUFFER_LENGTH);
+
+	if (!ReceiveHttpHeaders(socket, &request) || !FindHttpHeader(request, "Sec-WebSocket-Key", &key)) {
+		close(socket);
+		return;
+	}
+
+	// Accept the channel protocol when it's offered
+	bChannels = FindHttpHeader(request, "Sec-WebSocket-Protocol", &protocol) &&
+		WebSocketHeaderHasToken(protocol.data(), protocol.size(), IIS_WEB_SOCKET_CHANNEL_PROTOCOL);
+	WebSocketComputeHandshakeAccept(key.data(), key.size(), accept);
+	snprintf(response, sizeof(response),
+		"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s\r\n",
+		accept, bChannels ? "Sec-WebSocket-Protocol: " IIS_WEB_SOCKET_CHANNEL_PROTOCOL "\r\n" : "");
+	if (!SendAll(socket, response, strlen(response))) {
+		close(socket);
+		return;
+	}
+
+	connection.Socket = socket;
+	connection.Channels.Initialize(ServerWriteChannelMessage, &connection, ServerEchoChannel, &connection.Channels, 0);
+
+	while (ReceiveFrame(socket, &frame, &payload, true))
+	{
+		if (frame.Opcode == 0x08) {
+			break;
+		}
+		if (bChannels) {
+			if (connection.Channels.Dispatch(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size()) !=
+				IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT) {
+				break;
+			}
+		}
+		else if (!SendMessage(socket, false, NULL, 0, payload.data(), payload.size())) {
+			break;
+		}
+	}
+
+	connection.Channels.Free();
+	close(socket);
+}
+
+// Accept connections until the server is stopped, each gets its own thread
+static void EchoServer(int listenSocket)
+{
+	std::vector<std::thread> connections;
+	int socket;
+
+	while (!ServerStopping.load())
+	{
+		socket = accept(listenSocket, NULL, NULL);
+		if (socket < 0) {
+			continue;
+		}
+		connections.push_back(std::thread(EchoConnection, socket));
+	}
+
+	for (size_t i = 0; i < connections.size(); i++) {
+		connections[i].join();
+	}
+}
+
+//
+// Client
+//
+
+// Connect and perform the client side of the handshake, optionally asking for the channel protocol
+static int ClientConnect(const sockaddr_in* pAddress, bool bChannels)
+{
+	char key[IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH + 1];
+	char accept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1];
+	char request[0x200];
+	std::string response;
+	std::string value;
+	int flag = 1;
+	int socket;
+
+	socket = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (socket < 0) {
+		return -1;
+	}
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	if (connect(socket, (const sockaddr*)pAddress, sizeof(sockaddr_in)) != 0) {
+		close(socket);
+		return -1;
+	}
+
+	WebSocketGenerateHandshakeKey(key);
+	snprintf(request, sizeof(request),
+		"GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n%s\r\n",
+		key, bChannels ? "Sec-WebSocket-Protocol: " IIS_WEB_SOCKET_CHANNEL_PROTOCOL "\r\n" : "");
+
+	WebSocketComputeHandshakeAccept(key, IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH, accept);
+	if (!SendAll(socket, request, strlen(request)) || !ReceiveHttpHeaders(socket, &response) ||
+		(response.compare(0, 12, "HTTP/1.1 101") != 0) ||
+		!FindHttpHeader(response, "Sec-WebSocket-Accept", &value) || (value != accept) ||
+		(bChannels && (!FindHttpHeader(response, "Sec-WebSocket-Protocol", &value) || (value != IIS_WEB_SOCKET_CHANNEL_PROTOCOL)))) {
+		close(socket);
+		return -1;
+	}
+
+	return socket;
+}
+
+// The client writes from the driver and from the thread that grants credits
+static bool ClientWriteChannelMessage(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength)
+{
+	CHANNELBENCH_CLIENT* pClient = (CHANNELBENCH_CLIENT*)pContext;
+	(void)bufferType;
+
+	std::lock_guard<std::mutex> lock(pClient->WriteLock);
+	return SendMessage(pClient->Socket, true, pPrefix, prefixLength, pData, qwLength);
+}
+
+// Count an echo received on a channel
+static void ClientEchoReceived(void* pContext, unsigned long long channelId, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	CHANNELBENCH_CLIENT* pClient = (CHANNELBENCH_CLIENT*)pContext;
+	(void)channelId;
+	(void)pData;
+	(void)qwLength;
+
+	if (bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE)
+	{
+		std::lock_guard<std::mutex> lock(pClient->EchoLock);
+		pClient->qwEchoes++;
+		pClient->EchoReady.notify_one();
+	}
+}
+
+// Read the channel connection and dispatch the echoes and credits
+static void ClientReceiveThread(CHANNELBENCH_CLIENT* pClient)
+{
+	WEB_SOCKET_FRAME frame;
+	std::vector<unsigned char> payload;
+
+	while (ReceiveFrame(pClient->Socket, &frame, &payload, false) && (frame.Opcode != 0x08))
+	{
+		if (pClient->Channels.Dispatch(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size()) !=
+			IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT) {
+			break;
+		}
+	}
+
+	// Wake the driver if the connection ended
+	std::lock_guard<std::mutex> lock(pClient->EchoLock);
+	pClient->qwEchoes = ~0ULL;
+	pClient->EchoReady.notify_one();
+}
+
+// Send a message on a channel and wait for its echo
+static bool ChannelRoundTrip(CHANNELBENCH_CLIENT* pClient, unsigned long long channelId, const std::vector<unsigned char>& payload)
+{
+	unsigned long long qwExpected;
+
+	{
+		std::lock_guard<std::mutex> lock(pClient->EchoLock);
+		qwExpected = pClient->qwEchoes + 1;
+	}
+
+	while (pClient->Channels.Send(channelId, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size()) ==
+		IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_NO_CREDITS_CHANNEL_RESULT)
+	{
+		if (!pClient->Channels.WaitForCredits(channelId, 5000)) {
+			return false;
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(pClient->EchoLock);
+	return pClient->EchoReady.wait_for(lock, std::chrono::seconds(5), [pClient, qwExpected]() { return pClient->qwEchoes >= qwExpected; }) &&
+		(pClient->qwEchoes != ~0ULL);
+}
+
+// Open the streams as separate connections
+static void RunSockets(const sockaddr_in* pAddress, unsigned int streams, unsigned int messages, const std::vector<unsigned char>& payload, CHANNELBENCH_RESULT* pResult)
+{
+	std::vector<int> sockets;
+	WEB_SOCKET_FRAME frame;
+	std::vector<unsigned char> reply;
+	long long residentBefore;
+
+	memset(pResult, 0, sizeof(*pResult));
+	residentBefore = ResidentBytes();
+
+	// Handshake every connection and wait for its first echo
+	Clock::time_point start = Clock::now();
+	for (unsigned int i = 0; i < streams; i++)
+	{
+		int socket = ClientConnect(pAddress, false);
+		if ((socket < 0) || !SendMessage(socket, true, NULL, 0, payload.data(), payload.size()) || !ReceiveFrame(socket, &frame, &reply, false)) {
+			pResult->bFailed = true;
+			break;
+		}
+		sockets.push_back(socket);
+	}
+	pResult->SetupSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->MemoryBytes = ResidentBytes() - residentBefore;
+
+	// Round trips on every stream in turn
+	start = Clock::now();
+	for (unsigned int m = 0; (m < messages) && (!pResult->bFailed); m++)
+	{
+		for (size_t i = 0; i < sockets.size(); i++)
+		{
+			if (!SendMessage(sockets[i], true, NULL, 0, payload.data(), payload.size()) || !ReceiveFrame(sockets[i], &frame, &reply, false)) {
+				pResult->bFailed = true;
+				break;
+			}
+		}
+	}
+	pResult->RoundTripSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	for (size_t i = 0; i < sockets.size(); i++) {
+		close(sockets[i]);
+	}
+}
+
+// Open the streams as channels over one connection
+static void RunChannels(const sockaddr_in* pAddress, unsigned int streams, unsigned int messages, const std::vector<unsigned char>& payload, CHANNELBENCH_RESULT* pResult)
+{
+	CHANNELBENCH_CLIENT client;
+	std::thread receiver;
+	long long residentBefore;
+
+	memset(pResult, 0, sizeof(*pResult));
+	client.qwEchoes = 0;
+	residentBefore = ResidentBytes();
+
+	// One handshake, then open every channel and wait for its first echo
+	Clock::time_point start = Clock::now();
+	client.Socket = ClientConnect(pAddress, true);
+	if (client.Socket < 0) {
+		pResult->bFailed = true;
+		return;
+	}
+	client.Channels.Initialize(ClientWriteChannelMessage, &client, ClientEchoReceived, &client, 0);
+	receiver = std::thread(ClientReceiveThread, &client);
+	for (unsigned int i = 0; i < streams; i++)
+	{
+		if ((client.Channels.Open(i * 2 + 1, ClientEchoReceived, &client) != IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT) ||
+			!ChannelRoundTrip(&client, i * 2 + 1, payload)) {
+			pResult->bFailed = true;
+			break;
+		}
+	}
+	pResult->SetupSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->MemoryBytes = ResidentBytes() - residentBefore;
+
+	start = Clock::now();
+	for (unsigned int m = 0; (m < messages) && (!pResult->bFailed); m++)
+	{
+		for (unsigned int i = 0; i < streams; i++)
+		{
+			if (!ChannelRoundTrip(&client, i * 2 + 1, payload)) {
+				pResult->bFailed = true;
+				break;
+			}
+		}
+	}
+	pResult->RoundTripSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	shutdown(client.Socket, SHUT_RDWR);
+	receiver.join();
+	client.Channels.Free();
+	close(client.Socket);
+}
+
+static void PrintResult(const char* pName, const CHANNELBENCH_RESULT* pResult, unsigned int streams, unsigned int messages)
+{
+	printf("%-10s setup %.2f ms (%.1f us per stream), memory %.1f KB (%.1f KB per stream), round trip %.1f us%s\n",
+		pName, pResult->SetupSeconds * 1000.0, pResult->SetupSeconds * 1000000.0 / streams,
+		(double)pResult->MemoryBytes / 1024.0, (double)pResult->MemoryBytes / 1024.0 / streams,
+		(messages != 0) ? pResult->RoundTripSeconds * 1000000.0 / ((double)messages * streams) : 0.0,
+		pResult->bFailed ? " (failed)" : "");
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int streams = 100;
+	unsigned int messages = 100;
+	unsigned long long qwSize = 64;
+	const char* pJsonPath = NULL;
+	std::vector<unsigned char> payload;
+	CHANNELBENCH_RESULT sockets;
+	CHANNELBENCH_RESULT channels;
+	sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+	std::thread server;
+	int listenSocket;
+	int flag = 1;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--streams") == 0) && (i + 1 < argc)) {
+			streams = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			messages = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: channelbench [--streams <count>] [--messages <count per stream>] [--size <bytes>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((streams == 0) || (qwSize > 0x100000)) {
+		fprintf(stderr, "--streams must be at least 1 and --size at most 1048576\n");
+		return 1;
+	}
+	payload.assign((size_t)qwSize, 0x5A);
+
+	// Listen on an ephemeral loopback port
+	listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(listenSocket, (sockaddr*)&address, sizeof(address)) != 0) || (listen(listenSocket, 0x400) != 0) ||
+		(getsockname(listenSocket, (sockaddr*)&address, &addressLength) != 0)) {
+		fprintf(stderr, "failed to listen on loopback\n");
+		return 1;
+	}
+	server = std::thread(EchoServer, listenSocket);
+
+	// Channels first, so the sockets run doesn't leave threads behind in the resident set
+	RunChannels(&address, streams, messages, payload, &channels);
+	RunSockets(&address, streams, messages, payload, &sockets);
+
+	// Wake accept with one last connection
+	ServerStopping.store(true);
+	close(ClientConnect(&address, false));
+	server.join();
+	close(listenSocket);
+
+	printf("%u streams, %u round trips of %llu bytes each\n", streams, messages, qwSize);
+	PrintResult("channels", &channels, streams, messages);
+	PrintResult("sockets", &sockets, streams, messages);
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"streams\": %u,\n  \"messages\": %u,\n  \"message_bytes\": %llu,\n", streams, messages, qwSize);
+		fprintf(pFile, "  \"channels\": { \"setup_seconds\": %.6f, \"memory_bytes\": %lld, \"round_trip_seconds\": %.6f, \"failed\": %s },\n",
+			channels.SetupSeconds, channels.MemoryBytes, channels.RoundTripSeconds, channels.bFailed ? "true" : "false");
+		fprintf(pFile, "  \"sockets\": { \"setup_seconds\": %.6f, \"memory_bytes\": %lld, \"round_trip_seconds\": %.6f, \"failed\": %s }\n}\n",
+			sockets.SetupSeconds, sockets.MemoryBytes, sockets.RoundTripSeconds, sockets.bFailed ? "true" : "false");
+		fclose(pFile);
+	}
+
+	return (channels.bFailed || sockets.bFailed) ? 1 : 0;
+}
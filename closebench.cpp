@@ -0,0 +1,651 @@
+
+//
+// closebench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Measures how long the server holds a connection after it sends a close frame. Each connection is a socket pair with a
+//     server thread that closes it like WebSocketServer does, and one thread plays every client. Some clients answer the close
+//     after a random network delay, some never answer, and some send the first close and check the echo of their status code.
+//     Every fourth client that closes first sends a reserved or unassigned status code and checks it's answered with 1002.
+//     The close deadlines share a single timer thread that shuts down the sockets of clients that didn't answer in time, like
+//     the close timer resets the connection. With --no-deadline the server waits forever, as it did before CloseTimeout.
+//
+//     Usage: closebench [--connections <count>] [--timeout <ms>] [--latency <min ms> <max ms>] [--ignore <percent>]
+//                       [--client-first <percent>] [--observe <ms>] [--no-deadline] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// Status codes a client must not send
+static const unsigned int InvalidCloseStatus[] = { 999, 1004, 1005, 1006, 1015, 2000, 5000 };
+
+// What the client of a connection does
+enum class CLIENT_BEHAVIOR
+{
+	// Answers the server's close after the network delay
+	ANSWERS,
+	// Never answers and never closes its socket
+	IGNORES,
+	// Sends the first close, the server answers it
+	CLOSES_FIRST
+};
+
+// A connection, the server end is used by its thread and the client end by the client thread
+struct BENCH_CONNECTION
+{
+	int ServerSocket;
+	int ClientSocket;
+	CLIENT_BEHAVIOR Behavior;
+	// The status code a client that closes first sends, and the one the server must answer with
+	unsigned int Status;
+	unsigned int ExpectedStatus;
+	// The handshake and the socket are shared with the timer thread
+	std::mutex Lock;
+	WEB_SOCKET_CLOSE_HANDSHAKE Handshake;
+	// Nanoseconds from the start until the server released the connection, 0 while held
+	std::atomic<unsigned long long> qwReleased;
+	// Set when the server answered a client's close with ExpectedStatus
+	bool bEchoed;
+	// What the client thread has read
+	unsigned char ClientBuffer[256];
+	unsigned int ClientLength;
+	bool bClientDone;
+};
+
+// A deadline waiting on the timer thread
+struct BENCH_DEADLINE
+{
+	unsigned long long qwDeadline;
+	BENCH_CONNECTION* pConnection;
+	bool operator>(const BENCH_DEADLINE& other) const { return this->qwDeadline > other.qwDeadline; }
+};
+
+// Everything the threads share
+struct BENCH
+{
+	Clock::time_point Start;
+	unsigned long long qwTimeout;
+	unsigned int LatencyMin;
+	unsigned int LatencyMax;
+	// The deadlines of every connection, serviced by one thread
+	std::mutex TimerLock;
+	std::condition_variable TimerWake;
+	std::priority_queue<BENCH_DEADLINE, std::vector<BENCH_DEADLINE>, std::greater<BENCH_DEADLINE>> Deadlines;
+	bool bStop;
+	// Signalled when a connection is released
+	std::mutex ReleaseLock;
+	std::condition_variable Released;
+	std::atomic<unsigned long long> ReleasedCount;
+	std::atomic<unsigned long long> TimedOut;
+	std::atomic<unsigned long long> InvalidFrames;
+};
+
+// Nanoseconds since the start, the time the handshake is kept in
+static unsigned long long Now(BENCH* pBench)
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - pBench->Start).count();
+}
+
+// Encode a close frame with a status code, masked when a client sends it
+static unsigned int EncodeClose(unsigned char pFrame[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + 2], unsigned int status, bool bMask)
+{
+	unsigned char payload[2];
+	unsigned int headerLength;
+	char maskingKey[4];
+
+	payload[0] = (unsigned char)(status >> 8);
+	payload[1] = (unsigned char)(status & 0xFF);
+	if (!bMask)
+	{
+		headerLength = EncodeWebSocketFrameHeader(pFrame, 0x88, 2);
+		memcpy(pFrame + headerLength, payload, 2);
+		return headerLength + 2;
+	}
+
+	WebSocketGenerateMaskingKey(maskingKey);
+	headerLength = EncodeMaskedWebSocketFrameHeader(pFrame, 0x88, 2, maskingKey);
+	memcpy(pFrame + headerLength, payload, 2);
+	UnmaskWebSocketPayload(pFrame + headerLength, 2, maskingKey, 0);
+	return headerLength + 2;
+}
+
+// Write all of a buffer, returns false once the other end is gone
+static bool WriteAll(int socket, const unsigned char* pBuffer, size_t length)
+{
+	ssize_t written;
+
+	while (length != 0)
+	{
+		written = send(socket, pBuffer, length, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		pBuffer += written;
+		length -= (size_t)written;
+	}
+
+	return true;
+}
+
+// Get the first complete frame of a buffer, unmasking its payload in place, bMasked is true for a client's frames
+// An invalid header is returned at once with pFrame->Violation set
+static bool ReadFrame(unsigned char* pBuffer, unsigned int length, WEB_SOCKET_FRAME* pFrame, bool bMasked)
+{
+	if (!ParseWebSocketFrame(pBuffer, length, pFrame, bMasked)) {
+		return false;
+	}
+	if (pFrame->Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) {
+		return true;
+	}
+	if ((pFrame->PayloadLength > 125) || (length < pFrame->FrameSize + pFrame->PayloadLength)) {
+		return false;
+	}
+	if (pFrame->bMask) {
+		UnmaskWebSocketPayload(pBuffer + pFrame->FrameSize, pFrame->PayloadLength, pFrame->MaskingKey, 0);
+	}
+
+	return true;
+}
+
+// Release the server end of a connection, the point the bench measures
+static void ReleaseConnection(BENCH* pBench, BENCH_CONNECTION* pConnection)
+{
+	{
+		std::lock_guard<std::mutex> lock(pConnection->Lock);
+		if (pConnection->Handshake.bTimedOut) {
+			pBench->TimedOut.fetch_add(1);
+		}
+		close(pConnection->ServerSocket);
+		pConnection->ServerSocket = -1;
+	}
+	pConnection->qwReleased.store(std::max(Now(pBench), 1ULL));
+
+	std::lock_guard<std::mutex> lock(pBench->ReleaseLock);
+	pBench->ReleasedCount.fetch_add(1);
+	pBench->Released.notify_all();
+}
+
+// The server thread of a connection, closes it and reads until the handshake ends or the socket is shut down
+static void RunServer(BENCH* pBench, BENCH_CONNECTION* pConnection)
+{
+	unsigned char frame[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + 2];
+	unsigned char buffer[256];
+	unsigned char reply[2];
+	unsigned long dwReplyLength;
+	unsigned int length = 0;
+	unsigned int frameLength;
+	WEB_SOCKET_FRAME parsed;
+	ssize_t received;
+	bool bReply;
+	bool bClosed;
+
+	// The server closes first, unless its client does
+	if (pConnection->Behavior != CLIENT_BEHAVIOR::CLOSES_FIRST)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pConnection->Lock);
+			BeginWebSocketClose(&pConnection->Handshake, Now(pBench), pBench->qwTimeout);
+		}
+		if (pBench->qwTimeout != 0)
+		{
+			std::lock_guard<std::mutex> lock(pBench->TimerLock);
+			pBench->Deadlines.push({ pConnection->Handshake.qwDeadline, pConnection });
+			pBench->TimerWake.notify_one();
+		}
+		frameLength = EncodeClose(frame, 1000, false);
+		WriteAll(pConnection->ServerSocket, frame, frameLength);
+	}
+
+	for (;;)
+	{
+		received = recv(pConnection->ServerSocket, buffer + length, sizeof(buffer) - length, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			// Shut down by the deadline, or the client went away
+			break;
+		}
+		length += (unsigned int)received;
+		if (!ReadFrame(buffer, length, &parsed, true)) {
+			if (length == sizeof(buffer)) {
+				pBench->InvalidFrames.fetch_add(1);
+				break;
+			}
+			continue;
+		}
+		if ((parsed.Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) || (parsed.Opcode != 0x08)) {
+			pBench->InvalidFrames.fetch_add(1);
+			break;
+		}
+
+		// Answer the client's close, or end the handshake the server started
+		{
+			std::lock_guard<std::mutex> lock(pConnection->Lock);
+			bReply = ReceiveWebSocketClose(&pConnection->Handshake, buffer + parsed.FrameSize, parsed.PayloadLength, reply, &dwReplyLength);
+			if (bReply) {
+				BeginWebSocketClose(&pConnection->Handshake, Now(pBench), pBench->qwTimeout);
+			}
+			bClosed = (pConnection->Handshake.State == IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE);
+		}
+		if (bReply)
+		{
+			frameLength = EncodeWebSocketFrameHeader(frame, 0x88, dwReplyLength);
+			memcpy(frame + frameLength, reply, dwReplyLength);
+			WriteAll(pConnection->ServerSocket, frame, frameLength + dwReplyLength);
+		}
+		if (bClosed) {
+			break;
+		}
+		length = 0;
+	}
+
+	ReleaseConnection(pBench, pConnection);
+}
+
+// The timer thread, shuts down the sockets of connections whose close deadline passed
+static void RunTimer(BENCH* pBench)
+{
+	std::unique_lock<std::mutex> lock(pBench->TimerLock);
+
+	for (;;)
+	{
+		if (pBench->Deadlines.empty())
+		{
+			if (pBench->bStop) {
+				return;
+			}
+			pBench->TimerWake.wait(lock);
+			continue;
+		}
+		// A copy, the queue may grow while waiting
+		unsigned long long qwDeadline = pBench->Deadlines.top().qwDeadline;
+		unsigned long long qwNow = Now(pBench);
+		if (qwNow < qwDeadline) {
+			pBench->TimerWake.wait_for(lock, std::chrono::nanoseconds(qwDeadline - qwNow));
+			continue;
+		}
+
+		BENCH_CONNECTION* pConnection = pBench->Deadlines.top().pConnection;
+		pBench->Deadlines.pop();
+		lock.unlock();
+
+		// The server thread's read fails and it releases the connection
+		{
+			std::lock_guard<std::mutex> connectionLock(pConnection->Lock);
+			if ((ExpireWebSocketClose(&pConnection->Handshake, Now(pBench))) && (pConnection->ServerSocket != -1)) {
+				shutdown(pConnection->ServerSocket, SHUT_RDWR);
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+// A close the client sends after the network delay
+struct BENCH_REPLY
+{
+	Clock::time_point Due;
+	BENCH_CONNECTION* pConnection;
+	bool operator>(const BENCH_REPLY& other) const { return this->Due > other.Due; }
+};
+
+// The client thread, plays the client of every connection
+static void RunClients(BENCH* pBench, std::vector<BENCH_CONNECTION>* pConnections, std::atomic<bool>* pbStop)
+{
+	std::priority_queue<BENCH_REPLY, std::vector<BENCH_REPLY>, std::greater<BENCH_REPLY>> replies;
+	std::vector<struct pollfd> polls;
+	std::vector<BENCH_CONNECTION*> polled;
+	std::mt19937 random(54321);
+	unsigned char frame[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + 2];
+	unsigned int frameLength;
+	WEB_SOCKET_FRAME parsed;
+	ssize_t received;
+	int timeout;
+
+	// The clients that close first do it at once
+	for (BENCH_CONNECTION& connection : *pConnections)
+	{
+		if (connection.Behavior == CLIENT_BEHAVIOR::CLOSES_FIRST) {
+			frameLength = EncodeClose(frame, connection.Status, true);
+			WriteAll(connection.ClientSocket, frame, frameLength);
+		}
+	}
+
+	while (!pbStop->load())
+	{
+		// Send the answers that are due
+		while ((!replies.empty()) && (replies.top().Due <= Clock::now()))
+		{
+			frameLength = EncodeClose(frame, 1000, true);
+			WriteAll(replies.top().pConnection->ClientSocket, frame, frameLength);
+			replies.pop();
+		}
+
+		polls.clear();
+		polled.clear();
+		for (BENCH_CONNECTION& connection : *pConnections)
+		{
+			if (!connection.bClientDone) {
+				polls.push_back({ connection.ClientSocket, POLLIN, 0 });
+				polled.push_back(&connection);
+			}
+		}
+		if ((polls.empty()) && (replies.empty())) {
+			return;
+		}
+
+		timeout = 10;
+		if (!replies.empty()) {
+			timeout = (int)std::min<long long>(10, std::max<long long>(0,
+				std::chrono::duration_cast<std::chrono::milliseconds>(replies.top().Due - Clock::now()).count()));
+		}
+		if (poll(polls.data(), (nfds_t)polls.size(), timeout) <= 0) {
+			continue;
+		}
+
+		for (size_t i = 0; i < polls.size(); i++)
+		{
+			BENCH_CONNECTION* pConnection = polled[i];
+
+			if (polls[i].revents == 0) {
+				continue;
+			}
+			received = recv(pConnection->ClientSocket, pConnection->ClientBuffer + pConnection->ClientLength,
+				sizeof(pConnection->ClientBuffer) - pConnection->ClientLength, MSG_DONTWAIT);
+			if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+				continue;
+			}
+
+			// The server released the connection, a client that ignores the close keeps its end until the bench ends
+			if (received <= 0) {
+				pConnection->bClientDone = true;
+				continue;
+			}
+
+			pConnection->ClientLength += (unsigned int)received;
+			if (!ReadFrame(pConnection->ClientBuffer, pConnection->ClientLength, &parsed, false)) {
+				continue;
+			}
+			if ((parsed.Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) || (parsed.Opcode != 0x08) || (parsed.PayloadLength < 2)) {
+				pBench->InvalidFrames.fetch_add(1);
+			}
+			else if (pConnection->Behavior == CLIENT_BEHAVIOR::CLOSES_FIRST) {
+				pConnection->bEchoed = (((unsigned int)pConnection->ClientBuffer[parsed.FrameSize] << 8) |
+					pConnection->ClientBuffer[parsed.FrameSize + 1]) == pConnection->ExpectedStatus;
+			}
+			else if (pConnection->Behavior == CLIENT_BEHAVIOR::ANSWERS) {
+				replies.push({ Clock::now() + std::chrono::milliseconds(pBench->LatencyMin +
+					((pBench->LatencyMax > pBench->LatencyMin) ? (random() % (pBench->LatencyMax - pBench->LatencyMin + 1)) : 0)), pConnection });
+			}
+			pConnection->ClientLength = 0;
+		}
+	}
+}
+
+// Percentiles of release times in nanoseconds
+static void GetPercentiles(std::vector<unsigned long long>* pTimes, unsigned long long percentiles[3])
+{
+	memset(percentiles, 0, sizeof(unsigned long long) * 3);
+	if (pTimes->empty()) {
+		return;
+	}
+
+	std::sort(pTimes->begin(), pTimes->end());
+	percentiles[0] = (*pTimes)[pTimes->size() / 2];
+	percentiles[1] = (*pTimes)[std::min(pTimes->size() - 1, pTimes->size() * 99 / 100)];
+	percentiles[2] = pTimes->back();
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int connectionCount = 1000;
+	unsigned int timeout = 1000;
+	unsigned int ignorePercent = 10;
+	unsigned int clientFirstPercent = 10;
+	unsigned int observe = 0;
+	bool bDeadline = true;
+	const char* pJsonPath = NULL;
+	BENCH bench;
+	std::vector<BENCH_CONNECTION> connections;
+	std::vector<std::thread> servers;
+	std::thread timer;
+	std::thread clients;
+	std::atomic<bool> bClientsStop;
+	std::vector<unsigned long long> releasedAt;
+	std::vector<unsigned long long> answered;
+	std::vector<unsigned long long> ignored;
+	std::vector<unsigned long long> closedFirst;
+	unsigned long long answeredPercentiles[3];
+	unsigned long long ignoredPercentiles[3];
+	unsigned long long closedFirstPercentiles[3];
+	unsigned long long qwHeld;
+	unsigned long long qwEchoed;
+	unsigned long long qwClientsFirst;
+	unsigned long long qwIgnoring;
+	int sockets[2];
+	FILE* pFile;
+
+	bench.LatencyMin = 1;
+	bench.LatencyMax = 50;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			connectionCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--timeout") == 0) && (i + 1 < argc)) {
+			timeout = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--latency") == 0) && (i + 2 < argc)) {
+			bench.LatencyMin = (unsigned int)atoi(argv[++i]);
+			bench.LatencyMax = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--ignore") == 0) && (i + 1 < argc)) {
+			ignorePercent = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--client-first") == 0) && (i + 1 < argc)) {
+			clientFirstPercent = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--observe") == 0) && (i + 1 < argc)) {
+			observe = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-deadline") == 0) {
+			bDeadline = false;
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: closebench [--connections <count>] [--timeout <ms>] [--latency <min ms> <max ms>] [--ignore <percent>]\n"
+				"                  [--client-first <percent>] [--observe <ms>] [--no-deadline] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((connectionCount == 0) || (timeout == 0) || (ignorePercent + clientFirstPercent > 100)) {
+		fprintf(stderr, "--connections and --timeout must be at least 1 and --ignore and --client-first at most 100 together\n");
+		return 1;
+	}
+
+	// Watch long enough for every deadline and answer
+	if (observe == 0) {
+		observe = timeout + bench.LatencyMax + 1000;
+	}
+	bench.qwTimeout = bDeadline ? (unsigned long long)timeout * 1000000 : 0;
+	bench.bStop = false;
+	bench.ReleasedCount.store(0);
+	bench.TimedOut.store(0);
+	bench.InvalidFrames.store(0);
+
+	// Open the connections, the behaviors are spread at random
+	std::mt19937 random(12345);
+	connections = std::vector<BENCH_CONNECTION>(connectionCount);
+	qwIgnoring = 0;
+	qwClientsFirst = 0;
+	for (unsigned int i = 0; i < connectionCount; i++)
+	{
+		BENCH_CONNECTION* pConnection = &connections[i];
+		unsigned int roll = random() % 100;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+			fprintf(stderr, "socketpair failed for connection %u, raise the open file limit\n", i);
+			return 1;
+		}
+		pConnection->ServerSocket = sockets[0];
+		pConnection->ClientSocket = sockets[1];
+		pConnection->Behavior = (roll < ignorePercent) ? CLIENT_BEHAVIOR::IGNORES :
+			((roll < ignorePercent + clientFirstPercent) ? CLIENT_BEHAVIOR::CLOSES_FIRST : CLIENT_BEHAVIOR::ANSWERS);
+		pConnection->Status = 4000 + i % 1000;
+		pConnection->ExpectedStatus = pConnection->Status;
+		if ((i % 4) == 0) {
+			// Reserved for reporting, unassigned, or out of range, a protocol error
+			pConnection->Status = InvalidCloseStatus[(i / 4) % (sizeof(InvalidCloseStatus) / sizeof(InvalidCloseStatus[0]))];
+			pConnection->ExpectedStatus = 1002;
+		}
+		memset(&pConnection->Handshake, 0, sizeof(WEB_SOCKET_CLOSE_HANDSHAKE));
+		pConnection->qwReleased.store(0);
+		pConnection->bEchoed = false;
+		pConnection->ClientLength = 0;
+		pConnection->bClientDone = false;
+		qwIgnoring += (pConnection->Behavior == CLIENT_BEHAVIOR::IGNORES) ? 1 : 0;
+		qwClientsFirst += (pConnection->Behavior == CLIENT_BEHAVIOR::CLOSES_FIRST) ? 1 : 0;
+	}
+
+	bench.Start = Clock::now();
+	bClientsStop.store(false);
+	timer = std::thread(RunTimer, &bench);
+	clients = std::thread(RunClients, &bench, &connections, &bClientsStop);
+	for (unsigned int i = 0; i < connectionCount; i++) {
+		servers.emplace_back(RunServer, &bench, &connections[i]);
+	}
+
+	// Wait for every connection to be released, or until the observation ends
+	{
+		std::unique_lock<std::mutex> lock(bench.ReleaseLock);
+		bench.Released.wait_until(lock, bench.Start + std::chrono::milliseconds(observe), [&bench, connectionCount] {
+			return bench.ReleasedCount.load() == connectionCount;
+		});
+	}
+
+	// The connections still held, then end them so the threads can be joined
+	qwHeld = 0;
+	for (BENCH_CONNECTION& connection : connections)
+	{
+		std::lock_guard<std::mutex> lock(connection.Lock);
+		releasedAt.push_back(connection.qwReleased.load());
+		qwHeld += (releasedAt.back() == 0) ? 1 : 0;
+		if (connection.ServerSocket != -1) {
+			shutdown(connection.ServerSocket, SHUT_RDWR);
+		}
+	}
+	for (std::thread& server : servers) {
+		server.join();
+	}
+	{
+		std::lock_guard<std::mutex> lock(bench.TimerLock);
+		bench.bStop = true;
+		while (!bench.Deadlines.empty()) {
+			bench.Deadlines.pop();
+		}
+		bench.TimerWake.notify_one();
+	}
+	timer.join();
+	bClientsStop.store(true);
+	clients.join();
+
+	// When each kind of connection was released, a connection held past the observation isn't counted
+	qwEchoed = 0;
+	for (size_t i = 0; i < connections.size(); i++)
+	{
+		BENCH_CONNECTION& connection = connections[i];
+		unsigned long long qwReleased = releasedAt[i];
+
+		close(connection.ClientSocket);
+		if (qwReleased == 0) {
+			continue;
+		}
+		if (connection.Behavior == CLIENT_BEHAVIOR::ANSWERS) {
+			answered.push_back(qwReleased);
+		}
+		else if (connection.Behavior == CLIENT_BEHAVIOR::IGNORES) {
+			ignored.push_back(qwReleased);
+		}
+		else {
+			closedFirst.push_back(qwReleased);
+			qwEchoed += connection.bEchoed ? 1 : 0;
+		}
+	}
+	GetPercentiles(&answered, answeredPercentiles);
+	GetPercentiles(&ignored, ignoredPercentiles);
+	GetPercentiles(&closedFirst, closedFirstPercentiles);
+
+	printf("connections      %u, %llu never answer, %llu close first, %u..%u ms network delay\n",
+		connectionCount, qwIgnoring, qwClientsFirst, bench.LatencyMin, bench.LatencyMax);
+	printf("deadline         %s\n", bDeadline ? "on" : "off, the server waits for the client forever");
+	if (bDeadline) {
+		printf("close timeout    %u ms, %llu timed out\n", timeout, bench.TimedOut.load());
+	}
+	printf("answered         %zu released, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", answered.size(),
+		(double)answeredPercentiles[0] / 1000000.0, (double)answeredPercentiles[1] / 1000000.0, (double)answeredPercentiles[2] / 1000000.0);
+	printf("ignored          %zu released, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", ignored.size(),
+		(double)ignoredPercentiles[0] / 1000000.0, (double)ignoredPercentiles[1] / 1000000.0, (double)ignoredPercentiles[2] / 1000000.0);
+	printf("client first     %zu released, p50 %.2f ms, p99 %.2f ms, max %.2f ms, %llu answered with the right status code\n", closedFirst.size(),
+		(double)closedFirstPercentiles[0] / 1000000.0, (double)closedFirstPercentiles[1] / 1000000.0, (double)closedFirstPercentiles[2] / 1000000.0, qwEchoed);
+	printf("still held       %llu after %u ms\n", qwHeld, observe);
+	printf("invalid frames   %llu\n", bench.InvalidFrames.load());
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"connections\": %u,\n  \"ignoring\": %llu,\n  \"closing_first\": %llu,\n  \"latency_ms\": [%u, %u],\n"
+			"  \"deadline\": %s,\n  \"timeout_ms\": %u,\n  \"timed_out\": %llu,\n"
+			"  \"answered_released_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n"
+			"  \"ignored_released_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n"
+			"  \"client_first_released_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n"
+			"  \"echoed\": %llu,\n  \"held\": %llu,\n  \"observe_ms\": %u,\n  \"invalid_frames\": %llu\n}\n",
+			connectionCount, qwIgnoring, qwClientsFirst, bench.LatencyMin, bench.LatencyMax,
+			bDeadline ? "true" : "false", timeout, bench.TimedOut.load(),
+			(double)answeredPercentiles[0] / 1000000.0, (double)answeredPercentiles[1] / 1000000.0, (double)answeredPercentiles[2] / 1000000.0,
+			(double)ignoredPercentiles[0] / 1000000.0, (double)ignoredPercentiles[1] / 1000000.0, (double)ignoredPercentiles[2] / 1000000.0,
+			(double)closedFirstPercentiles[0] / 1000000.0, (double)closedFirstPercentiles[1] / 1000000.0, (double)closedFirstPercentiles[2] / 1000000.0,
+			qwEchoed, qwHeld, observe, bench.InvalidFrames.load());
+		fclose(pFile);
+	}
+
+	// With a deadline nothing is held, only the clients that ignore the close time out, and every client's close is answered right
+	if (bDeadline) {
+		return ((qwHeld == 0) && (bench.TimedOut.load() == qwIgnoring) && (qwEchoed == qwClientsFirst) && (bench.InvalidFrames.load() == 0)) ? 0 : 1;
+	}
+	return ((qwEchoed == qwClientsFirst) && (bench.InvalidFrames.load() == 0)) ? 0 : 1;
+}
@@ -0,0 +1,753 @@
+
+//
+// coroutinebench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Compares N echo connections served by coroutines on a small executor with N echo connections served by a thread each.
+//     The coroutine server reads and writes non-blocking sockets from one epoll thread, the thread server blocks in recv like
+//     the IIS module blocks in ReadEntityBody. Each way runs in its own forked process over socket pairs, so neither inherits
+//     the other's memory. The memory is the growth of the resident set once every connection has echoed a message,
+//     the context switches are counted by getrusage over the message rounds that follow.
+//
+//     Usage: coroutinebench [--connections <count>] [--messages <count per connection>] [--size <bytes>]
+//                           [--threads <executor threads>] [--read-buffer <bytes>] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketcoroutine.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// What each forked run reports back through its pipe
+struct COROUTINEBENCH_RESULT
+{
+	// The connections that got a server, the thread server stops at the process's thread limit
+	unsigned int Connections;
+	unsigned int Threads;
+	double SetupSeconds;
+	double RoundTripSeconds;
+	long long MemoryBytes;
+	long long ContextSwitches;
+	bool bFailed;
+};
+
+// A server connection of the coroutine server, the socket is the transport of its WebSocketAsyncConnection
+struct COROUTINEBENCH_CONNECTION
+{
+	int Socket;
+	std::mutex Lock;
+	// The read waiting for the socket to be readable
+	void* pReadBuffer;
+	unsigned long dwReadLength;
+	// The rest of a write waiting for the socket to be writable
+	std::vector<unsigned char> WriteBuffer;
+	size_t WriteOffset;
+	bool bWritePending;
+	WebSocketAsyncConnection Connection;
+};
+
+// The handlers that have returned
+static std::atomic<unsigned int> HandlersDone;
+
+// The resident set of the process in bytes
+static long long ResidentBytes()
+{
+	long long pages = 0;
+	long long resident = 0;
+	FILE* pFile;
+
+	pFile = fopen("/proc/self/statm", "r");
+	if (pFile != NULL) {
+		if (fscanf(pFile, "%lld %lld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(pFile);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Voluntary and involuntary context switches of every thread of the process
+static long long ContextSwitches()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+
+	return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Write all bytes to a socket or pipe
+static bool WriteAll(int fd, const void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = send(fd, pBuffer, length, MSG_NOSIGNAL);
+		if ((result < 0) && (errno == ENOTSOCK)) {
+			result = write(fd, pBuffer, length);
+		}
+		if (result <= 0) {
+			if ((result < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		pBuffer = (const char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read exactly length bytes from a pipe
+static bool ReadAll(int fd, void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = read(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// The first frame byte of a server frame
+static unsigned char FrameByte(IIS_WEB_SOCKET_BUFFER_TYPE bufferType)
+{
+	switch (bufferType)
+	{
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
+		return 0x81;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE:
+		return 0x88;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE:
+		return 0x89;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE:
+		return 0x8A;
+	default:
+		return 0x82;
+	}
+}
+
+//
+// Coroutine server
+//
+
+// Read for the WebSocketAsyncConnection, pending until epoll reports the socket readable
+static unsigned long SocketReadAsync(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending)
+{
+	COROUTINEBENCH_CONNECTION* pConnection = (COROUTINEBENCH_CONNECTION*)pContext;
+	std::lock_guard<std::mutex> lock(pConnection->Lock);
+	ssize_t received;
+
+	received = recv(pConnection->Socket, pBuffer, dwLength, MSG_DONTWAIT);
+	if (received >= 0) {
+		*pdwBytesRead = (unsigned long)received;
+		return 0;
+	}
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		return (unsigned long)errno;
+	}
+
+	// The socket is edge triggered, the lock holds back the epoll thread until the read is recorded
+	pConnection->pReadBuffer = pBuffer;
+	pConnection->dwReadLength = dwLength;
+	*pbPending = true;
+	return 0;
+}
+
+// Write for the WebSocketAsyncConnection, the rest of a partial write is sent when epoll reports the socket writable
+static unsigned long SocketWriteAsync(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending)
+{
+	COROUTINEBENCH_CONNECTION* pConnection = (COROUTINEBENCH_CONNECTION*)pContext;
+	std::lock_guard<std::mutex> lock(pConnection->Lock);
+	unsigned char header[10];
+	struct iovec chunks[2];
+	struct msghdr message;
+	size_t total;
+	ssize_t sent;
+
+	chunks[0].iov_base = header;
+	chunks[0].iov_len = EncodeWebSocketFrameHeader(header, FrameByte(bufferType), qwLength);
+	chunks[1].iov_base = (void*)pData;
+	chunks[1].iov_len = (size_t)qwLength;
+	total = chunks[0].iov_len + chunks[1].iov_len;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = chunks;
+	message.msg_iovlen = 2;
+	sent = sendmsg(pConnection->Socket, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if ((size_t)sent == total) {
+		return 0;
+	}
+	if ((sent < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		return (unsigned long)errno;
+	}
+	if (sent < 0) {
+		sent = 0;
+	}
+
+	// Keep the rest for the epoll thread
+	pConnection->WriteBuffer.assign(header, header + chunks[0].iov_len);
+	pConnection->WriteBuffer.insert(pConnection->WriteBuffer.end(), (const unsigned char*)pData, (const unsigned char*)pData + qwLength);
+	pConnection->WriteOffset = (size_t)sent;
+	pConnection->bWritePending = true;
+	*pbPending = true;
+	return 0;
+}
+
+// Complete the reads and writes of sockets that became ready
+static void Reactor(int epoll)
+{
+	struct epoll_event events[256];
+	COROUTINEBENCH_CONNECTION* pConnection;
+	ssize_t result;
+	unsigned long errorCode;
+	bool bReadDone;
+	bool bWriteDone;
+	int count;
+
+	for (;;)
+	{
+		count = epoll_wait(epoll, events, 256, -1);
+		for (int i = 0; i < count; i++)
+		{
+			// The event fd stops the reactor
+			pConnection = (COROUTINEBENCH_CONNECTION*)events[i].data.ptr;
+			if (pConnection == NULL) {
+				return;
+			}
+
+			bReadDone = false;
+			bWriteDone = false;
+			errorCode = 0;
+			result = 0;
+			{
+				std::lock_guard<std::mutex> lock(pConnection->Lock);
+				if ((pConnection->pReadBuffer != NULL) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				{
+					result = recv(pConnection->Socket, pConnection->pReadBuffer, pConnection->dwReadLength, MSG_DONTWAIT);
+					if ((result >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+						errorCode = (result < 0) ? (unsigned long)errno : 0;
+						pConnection->pReadBuffer = NULL;
+						bReadDone = true;
+					}
+				}
+				if ((pConnection->bWritePending) && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+				{
+					while (pConnection->WriteOffset < pConnection->WriteBuffer.size())
+					{
+						ssize_t sent = send(pConnection->Socket, pConnection->WriteBuffer.data() + pConnection->WriteOffset,
+							pConnection->WriteBuffer.size() - pConnection->WriteOffset, MSG_DONTWAIT | MSG_NOSIGNAL);
+						if (sent <= 0) {
+							break;
+						}
+						pConnection->WriteOffset += (size_t)sent;
+					}
+					if (pConnection->WriteOffset == pConnection->WriteBuffer.size()) {
+						pConnection->bWritePending = false;
+						bWriteDone = true;
+					}
+				}
+			}
+
+			// Completions start the next read or write, which takes the lock again
+			if (bReadDone) {
+				pConnection->Connection.CompleteRead((result > 0) ? (unsigned long)result : 0, errorCode);
+			}
+			if (bWriteDone) {
+				pConnection->Connection.CompleteWrite(0);
+			}
+		}
+	}
+}
+
+// Echo every message, straight-line code without a thread of its own
+static WebSocketTask EchoHandler(COROUTINEBENCH_CONNECTION* pConnection)
+{
+	WEB_SOCKET_ASYNC_MESSAGE message;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+
+	for (;;)
+	{
+		result = co_await pConnection->Connection.ReceiveMessage(&message);
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			break;
+		}
+
+		if (message.BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+			co_await pConnection->Connection.Send(message.BufferType, message.pData, message.qwLength);
+			break;
+		}
+		else if (message.BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) {
+			result = co_await pConnection->Connection.Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE, message.pData, message.qwLength);
+		}
+		else if (message.BufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE) {
+			result = co_await pConnection->Connection.Send(message.BufferType, message.pData, message.qwLength);
+		}
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			break;
+		}
+	}
+
+	HandlersDone.fetch_add(1);
+}
+
+//
+// Thread server
+//
+
+// Blocking read for the protocol core, a closed socket is an error so the core stops waiting
+static unsigned long SocketRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	ssize_t received;
+
+	do {
+		received = recv(*(int*)pContext, pBuffer, dwLength, 0);
+	} while ((received < 0) && (errno == EINTR));
+	if ((received <= 0) && (dwLength != 0)) {
+		return 1;
+	}
+	*pdwBytesRead = (received > 0) ? (unsigned long)received : 0;
+
+	return 0;
+}
+
+// Echo every message from a thread of its own, the way the IIS module runs a connection
+static void ThreadEcho(int socket)
+{
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	std::vector<char> message(0x100);
+	size_t length = 0;
+	unsigned long dwReceived;
+	unsigned char header[10];
+	unsigned int headerLength;
+
+	memset(&stream, 0, sizeof(stream));
+	memset(&frame, 0, sizeof(frame));
+	stream.bQueuing = true;
+	stream.pFrameBuffer = frameBuffer;
+	bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+
+	for (;;)
+	{
+		if (message.size() - length < 0x100) {
+			message.resize(message.size() * 2);
+		}
+		if (ReceiveWebSocketData(&stream, &frame, 0x1000000, SocketRead, &socket, message.data() + length,
+			(unsigned long)(message.size() - length), &dwReceived, &bufferType, NULL) != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			break;
+		}
+		length += dwReceived;
+		if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE) ||
+			(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE) || (!stream.bQueuing)) {
+			continue;
+		}
+
+		// Echo the message, a ping gets a pong
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) {
+			bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
+		}
+		if (bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE)
+		{
+			headerLength = EncodeWebSocketFrameHeader(header, FrameByte(bufferType), length);
+			if (!WriteAll(socket, header, headerLength) || !WriteAll(socket, message.data(), length)) {
+				break;
+			}
+		}
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+			break;
+		}
+		length = 0;
+	}
+
+	HandlersDone.fetch_add(1);
+}
+
+//
+// Client
+//
+
+// Send a message on every connection, then wait for every echo and check it
+static bool EchoRound(const std::vector<int>& clients, int epoll, const std::vector<unsigned char>& request,
+	const std::vector<unsigned char>& echo, std::vector<unsigned int>* pReceived)
+{
+	std::vector<unsigned char> buffer(echo.size());
+	struct epoll_event events[256];
+	size_t remaining = clients.size();
+	unsigned int index;
+	ssize_t received;
+	int count;
+
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		(*pReceived)[i] = 0;
+		if (!WriteAll(clients[i], request.data(), request.size())) {
+			return false;
+		}
+	}
+
+	while (remaining != 0)
+	{
+		count = epoll_wait(epoll, events, 256, 10000);
+		if (count <= 0) {
+			fprintf(stderr, "timed out waiting for %zu echoes\n", remaining);
+			return false;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			index = events[i].data.u32;
+			if ((*pReceived)[index] == echo.size()) {
+				return false;
+			}
+			received = recv(clients[index], buffer.data(), echo.size() - (*pReceived)[index], MSG_DONTWAIT);
+			if (received <= 0) {
+				if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+					continue;
+				}
+				return false;
+			}
+			if (memcmp(buffer.data(), echo.data() + (*pReceived)[index], (size_t)received) != 0) {
+				return false;
+			}
+			(*pReceived)[index] += (unsigned int)received;
+			if ((*pReceived)[index] == echo.size()) {
+				remaining--;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Serve the connections one of two ways, and echo messages on all of them
+static void Run(bool bCoroutines, unsigned int connections, unsigned int messages, unsigned long long qwSize,
+	unsigned int threadCount, unsigned long dwReadBuffer, COROUTINEBENCH_RESULT* pResult)
+{
+	std::vector<COROUTINEBENCH_CONNECTION*> servers;
+	std::vector<std::thread> threads;
+	std::vector<int> clients;
+	std::vector<unsigned int> received;
+	std::vector<unsigned char> request;
+	std::vector<unsigned char> echo;
+	WebSocketExecutor executor;
+	std::thread reactor;
+	struct epoll_event event;
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	char maskingKey[4];
+	long long residentBefore;
+	long long switches;
+	Clock::time_point start;
+	Clock::time_point deadline;
+	int serverEpoll;
+	int clientEpoll;
+	int stopEvent;
+	int pair[2];
+
+	memset(pResult, 0, sizeof(*pResult));
+	HandlersDone.store(0);
+
+	// Every client sends the same masked message and expects the same echo
+	WebSocketGenerateMaskingKey(maskingKey);
+	headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwSize, maskingKey);
+	request.assign(header, header + headerLength);
+	request.resize(headerLength + (size_t)qwSize, 0x5A);
+	UnmaskWebSocketPayload(request.data() + headerLength, qwSize, maskingKey, 0);
+	headerLength = EncodeWebSocketFrameHeader(header, 0x82, qwSize);
+	echo.assign(header, header + headerLength);
+	echo.resize(headerLength + (size_t)qwSize, 0x5A);
+
+	serverEpoll = epoll_create1(0);
+	clientEpoll = epoll_create1(0);
+	stopEvent = eventfd(0, 0);
+
+	residentBefore = ResidentBytes();
+	start = Clock::now();
+
+	if (bCoroutines)
+	{
+		if (!executor.Start(threadCount)) {
+			pResult->bFailed = true;
+			return;
+		}
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(serverEpoll, EPOLL_CTL_ADD, stopEvent, &event);
+		reactor = std::thread(Reactor, serverEpoll);
+		pResult->Threads = (unsigned int)executor.GetThreadCount() + 1;
+	}
+
+	for (unsigned int i = 0; i < connections; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+			fprintf(stderr, "socketpair failed after %u connections: %s\n", i, strerror(errno));
+			break;
+		}
+
+		if (bCoroutines)
+		{
+			COROUTINEBENCH_CONNECTION* pConnection = new COROUTINEBENCH_CONNECTION();
+			pConnection->Socket = pair[0];
+			pConnection->pReadBuffer = NULL;
+			pConnection->bWritePending = false;
+			if (!pConnection->Connection.Initialize(&executor, SocketReadAsync, SocketWriteAsync, pConnection, dwReadBuffer)) {
+				delete pConnection;
+				close(pair[0]);
+				close(pair[1]);
+				break;
+			}
+			event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			event.data.ptr = pConnection;
+			epoll_ctl(serverEpoll, EPOLL_CTL_ADD, pConnection->Socket, &event);
+			servers.push_back(pConnection);
+			EchoHandler(pConnection).Start(&executor);
+		}
+		else
+		{
+			try {
+				threads.emplace_back(ThreadEcho, pair[0]);
+			}
+			catch (const std::system_error&) {
+				fprintf(stderr, "no more threads after %u connections\n", i);
+				close(pair[0]);
+				close(pair[1]);
+				break;
+			}
+		}
+
+		event.events = EPOLLIN;
+		event.data.u32 = (unsigned int)clients.size();
+		epoll_ctl(clientEpoll, EPOLL_CTL_ADD, pair[1], &event);
+		clients.push_back(pair[1]);
+	}
+	pResult->Connections = (unsigned int)clients.size();
+	if (!bCoroutines) {
+		pResult->Threads = (unsigned int)threads.size();
+	}
+	received.resize(clients.size());
+
+	// The first echo is part of the setup, every connection has its buffers afterwards
+	if (!EchoRound(clients, clientEpoll, request, echo, &received)) {
+		pResult->bFailed = true;
+	}
+	pResult->SetupSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->MemoryBytes = ResidentBytes() - residentBefore;
+
+	switches = ContextSwitches();
+	start = Clock::now();
+	for (unsigned int m = 0; (m < messages) && (!pResult->bFailed); m++)
+	{
+		if (!EchoRound(clients, clientEpoll, request, echo, &received)) {
+			pResult->bFailed = true;
+		}
+	}
+	pResult->RoundTripSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->ContextSwitches = ContextSwitches() - switches;
+
+	// Closing the clients ends every handler
+	for (int client : clients) {
+		close(client);
+	}
+	deadline = Clock::now() + std::chrono::seconds(10);
+	while ((HandlersDone.load() < clients.size()) && (Clock::now() < deadline)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (HandlersDone.load() < clients.size()) {
+		fprintf(stderr, "%zu handlers didn't return\n", clients.size() - HandlersDone.load());
+		pResult->bFailed = true;
+	}
+
+	if (bCoroutines)
+	{
+		eventfd_write(stopEvent, 1);
+		reactor.join();
+		executor.Stop();
+		for (COROUTINEBENCH_CONNECTION* pConnection : servers) {
+			close(pConnection->Socket);
+			pConnection->Connection.Free();
+			delete pConnection;
+		}
+	}
+	else
+	{
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+
+	close(stopEvent);
+	close(clientEpoll);
+	close(serverEpoll);
+}
+
+// Run one way in a forked process and read back its result
+static bool RunForked(bool bCoroutines, unsigned int connections, unsigned int messages, unsigned long long qwSize,
+	unsigned int threadCount, unsigned long dwReadBuffer, COROUTINEBENCH_RESULT* pResult)
+{
+	int resultPipe[2];
+	pid_t pid;
+	bool bRead;
+
+	if (pipe(resultPipe) != 0) {
+		return false;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(resultPipe[0]);
+		Run(bCoroutines, connections, messages, qwSize, threadCount, dwReadBuffer, pResult);
+		_exit(WriteAll(resultPipe[1], pResult, sizeof(*pResult)) ? 0 : 1);
+	}
+	close(resultPipe[1]);
+	bRead = ReadAll(resultPipe[0], pResult, sizeof(*pResult));
+	close(resultPipe[0]);
+	waitpid(pid, NULL, 0);
+
+	if (!bRead) {
+		memset(pResult, 0, sizeof(*pResult));
+		pResult->bFailed = true;
+	}
+
+	return bRead;
+}
+
+static void PrintResult(const char* pName, const COROUTINEBENCH_RESULT* pResult, unsigned int messages)
+{
+	double qwMessages = (double)messages * pResult->Connections;
+
+	printf("%-10s %u connections on %u threads, setup %.1f ms, memory %.1f MB (%.2f KB per connection), "
+		"%lld context switches (%.3f per message), %.2f us per message%s\n",
+		pName, pResult->Connections, pResult->Threads, pResult->SetupSeconds * 1000.0,
+		(double)pResult->MemoryBytes / 1048576.0, (pResult->Connections != 0) ? (double)pResult->MemoryBytes / 1024.0 / pResult->Connections : 0.0,
+		pResult->ContextSwitches, (qwMessages != 0) ? (double)pResult->ContextSwitches / qwMessages : 0.0,
+		(qwMessages != 0) ? pResult->RoundTripSeconds * 1000000.0 / qwMessages : 0.0,
+		pResult->bFailed ? " (failed)" : "");
+}
+
+static void WriteJsonResult(FILE* pFile, const char* pName, const COROUTINEBENCH_RESULT* pResult, const char* pEnd)
+{
+	fprintf(pFile, "  \"%s\": { \"connections\": %u, \"threads\": %u, \"setup_seconds\": %.6f, \"memory_bytes\": %lld, "
+		"\"context_switches\": %lld, \"round_trip_seconds\": %.6f, \"failed\": %s }%s\n",
+		pName, pResult->Connections, pResult->Threads, pResult->SetupSeconds, pResult->MemoryBytes,
+		pResult->ContextSwitches, pResult->RoundTripSeconds, pResult->bFailed ? "true" : "false", pEnd);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int connections = 50000;
+	unsigned int messages = 10;
+	unsigned long long qwSize = 64;
+	unsigned int threadCount = 0;
+	unsigned long dwReadBuffer = 0;
+	const char* pJsonPath = NULL;
+	COROUTINEBENCH_RESULT coroutines;
+	COROUTINEBENCH_RESULT threads;
+	struct rlimit limit;
+	unsigned int maxConnections;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			connections = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			messages = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc)) {
+			threadCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--read-buffer") == 0) && (i + 1 < argc)) {
+			dwReadBuffer = strtoul(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: coroutinebench [--connections <count>] [--messages <count per connection>] [--size <bytes>]\n"
+				"                      [--threads <executor threads>] [--read-buffer <bytes>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((connections == 0) || (qwSize > 0x100000)) {
+		fprintf(stderr, "--connections must be at least 1 and --size at most 1048576\n");
+		return 1;
+	}
+
+	// Every connection is a socket pair, raise the open file limit as far as it goes
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		maxConnections = (limit.rlim_cur > 64) ? (unsigned int)((limit.rlim_cur - 64) / 2) : 1;
+		if (connections > maxConnections) {
+			printf("limited to %u connections by the open file limit of %llu, raise it with ulimit -n\n",
+				maxConnections, (unsigned long long)limit.rlim_cur);
+			connections = maxConnections;
+		}
+	}
+
+	// Coroutines first, each run is a fresh process either way
+	RunForked(true, connections, messages, qwSize, threadCount, dwReadBuffer, &coroutines);
+	RunForked(false, connections, messages, qwSize, threadCount, dwReadBuffer, &threads);
+
+	printf("%u connections, %u round trips of %llu bytes each after the first\n", connections, messages, qwSize);
+	PrintResult("coroutines", &coroutines, messages);
+	PrintResult("threads", &threads, messages);
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"connections\": %u,\n  \"messages\": %u,\n  \"message_bytes\": %llu,\n", connections, messages, qwSize);
+		WriteJsonResult(pFile, "coroutines", &coroutines, ",");
+		WriteJsonResult(pFile, "threads", &threads, "");
+		fprintf(pFile, "}\n");
+		fclose(pFile);
+	}
+
+	return (coroutines.bFailed || threads.bFailed) ? 1 : 0;
+}
@@ -0,0 +1,508 @@
+
+//
+// creditbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     A client sends messages as fast as the socket takes them to a WebSocketAsyncConnection whose handler queues them
+//     for an application that handles them slowly. Without receive credits the handler reads everything the client sends
+//     and the queue grows with it, with credits the connection stops reading once the application holds its budget and
+//     the socket's flow control holds the client back. Each way runs in its own forked process over a socket pair, and
+//     reports the most the queue held and the growth of the resident set.
+//
+//     Usage: creditbench [--messages <count>] [--size <bytes>] [--consume <us per message>] [--credits <bytes>]
+//                        [--message-credits <count>] [--json <output file>]
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketcoroutine.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// What each forked run reports back through its pipe
+struct CREDITBENCH_RESULT
+{
+	unsigned long long Messages;
+	unsigned long long OutOfOrder;
+	// The most the application's queue held
+	unsigned long long PeakQueuedBytes;
+	unsigned long long PeakQueuedMessages;
+	// The most the resident set grew while the messages were handled
+	long long PeakMemoryBytes;
+	double Seconds;
+	bool bFailed;
+};
+
+// The server side of the socket pair, the transport of the WebSocketAsyncConnection
+struct CREDITBENCH_CONNECTION
+{
+	int Socket;
+	std::mutex Lock;
+	// The read waiting for the socket to be readable
+	void* pReadBuffer;
+	unsigned long dwReadLength;
+	WebSocketAsyncConnection Connection;
+};
+
+// The messages the handler received and the application hasn't handled yet
+struct APPLICATION_QUEUE
+{
+	std::mutex Lock;
+	std::condition_variable Ready;
+	std::deque<std::vector<char>> Messages;
+	unsigned long long Bytes;
+	unsigned long long PeakBytes;
+	unsigned long long PeakMessages;
+	bool bClosed;
+};
+
+// The resident set of the process in bytes
+static long long ResidentBytes()
+{
+	long long pages = 0;
+	long long resident = 0;
+	FILE* pFile;
+
+	pFile = fopen("/proc/self/statm", "r");
+	if (pFile != NULL) {
+		if (fscanf(pFile, "%lld %lld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(pFile);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Write all bytes to a socket or pipe
+static bool WriteAll(int fd, const void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = send(fd, pBuffer, length, MSG_NOSIGNAL);
+		if ((result < 0) && (errno == ENOTSOCK)) {
+			result = write(fd, pBuffer, length);
+		}
+		if (result <= 0) {
+			if ((result < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		pBuffer = (const char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read exactly length bytes from a pipe
+static bool ReadAll(int fd, void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = read(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read for the WebSocketAsyncConnection, pending until epoll reports the socket readable
+static unsigned long SocketReadAsync(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending)
+{
+	CREDITBENCH_CONNECTION* pConnection = (CREDITBENCH_CONNECTION*)pContext;
+	std::lock_guard<std::mutex> lock(pConnection->Lock);
+	ssize_t received;
+
+	received = recv(pConnection->Socket, pBuffer, dwLength, MSG_DONTWAIT);
+	if (received >= 0) {
+		*pdwBytesRead = (unsigned long)received;
+		return 0;
+	}
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		return (unsigned long)errno;
+	}
+
+	// The socket is edge triggered, the lock holds back the epoll thread until the read is recorded
+	pConnection->pReadBuffer = pBuffer;
+	pConnection->dwReadLength = dwLength;
+	*pbPending = true;
+	return 0;
+}
+
+// Write for the WebSocketAsyncConnection, the handler never sends
+static unsigned long SocketWriteAsync(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending)
+{
+	(void)pContext;
+	(void)bufferType;
+	(void)pData;
+	(void)qwLength;
+	(void)pbPending;
+	return 1;
+}
+
+// Complete the reads of the socket when it becomes readable
+static void Reactor(int epoll)
+{
+	struct epoll_event events[4];
+	CREDITBENCH_CONNECTION* pConnection;
+	ssize_t result;
+	unsigned long errorCode;
+	bool bReadDone;
+	int count;
+
+	for (;;)
+	{
+		count = epoll_wait(epoll, events, 4, -1);
+		for (int i = 0; i < count; i++)
+		{
+			// The event fd stops the reactor
+			pConnection = (CREDITBENCH_CONNECTION*)events[i].data.ptr;
+			if (pConnection == NULL) {
+				return;
+			}
+
+			bReadDone = false;
+			errorCode = 0;
+			result = 0;
+			{
+				std::lock_guard<std::mutex> lock(pConnection->Lock);
+				if (pConnection->pReadBuffer != NULL)
+				{
+					result = recv(pConnection->Socket, pConnection->pReadBuffer, pConnection->dwReadLength, MSG_DONTWAIT);
+					if ((result >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+						errorCode = (result < 0) ? (unsigned long)errno : 0;
+						pConnection->pReadBuffer = NULL;
+						bReadDone = true;
+					}
+				}
+			}
+
+			if (bReadDone) {
+				pConnection->Connection.CompleteRead((result > 0) ? (unsigned long)result : 0, errorCode);
+			}
+		}
+	}
+}
+
+// Queue every data message for the application, like a handler that doesn't wait for the application to catch up
+static WebSocketTask QueueHandler(CREDITBENCH_CONNECTION* pConnection, APPLICATION_QUEUE* pQueue)
+{
+	WEB_SOCKET_ASYNC_MESSAGE message;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+
+	for (;;)
+	{
+		result = co_await pConnection->Connection.ReceiveMessage(&message);
+		if ((result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) ||
+			(message.BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE)) {
+			break;
+		}
+		if ((message.BufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) &&
+			(message.BufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)) {
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(pQueue->Lock);
+		pQueue->Messages.emplace_back(message.pData, message.pData + message.qwLength);
+		pQueue->Bytes += message.qwLength;
+		if (pQueue->Bytes > pQueue->PeakBytes) {
+			pQueue->PeakBytes = pQueue->Bytes;
+		}
+		if (pQueue->Messages.size() > pQueue->PeakMessages) {
+			pQueue->PeakMessages = pQueue->Messages.size();
+		}
+		pQueue->Ready.notify_one();
+	}
+
+	std::lock_guard<std::mutex> lock(pQueue->Lock);
+	pQueue->bClosed = true;
+	pQueue->Ready.notify_one();
+}
+
+// Send every message as fast as the socket takes them, the first 4 bytes are its sequence number
+static void RunClient(int socket, unsigned int messages, unsigned long long qwSize)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	std::vector<unsigned char> frame;
+	unsigned int headerLength;
+	char maskingKey[4];
+
+	for (unsigned int i = 0; i < messages; i++)
+	{
+		WebSocketGenerateMaskingKey(maskingKey);
+		headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwSize, maskingKey);
+		frame.assign(header, header + headerLength);
+		frame.resize(headerLength + (size_t)qwSize, 0x5A);
+		memcpy(frame.data() + headerLength, &i, sizeof(i));
+		UnmaskWebSocketPayload(frame.data() + headerLength, qwSize, maskingKey, 0);
+		if (!WriteAll(socket, frame.data(), frame.size())) {
+			break;
+		}
+	}
+
+	// The server reads 0 bytes once everything is received
+	shutdown(socket, SHUT_WR);
+}
+
+// Run one way in this process, the application handles the queue on the calling thread
+static void Run(bool bCredits, unsigned int messages, unsigned long long qwSize, unsigned int consumeMicroseconds,
+	unsigned long long qwCredits, unsigned long long qwMessageCredits, CREDITBENCH_RESULT* pResult)
+{
+	WebSocketExecutor executor;
+	CREDITBENCH_CONNECTION connection;
+	APPLICATION_QUEUE queue;
+	std::vector<char> message;
+	std::thread reactor;
+	std::thread client;
+	struct epoll_event event;
+	Clock::time_point start;
+	long long residentBefore;
+	long long resident;
+	unsigned int sequence;
+	unsigned int expected;
+	uint64_t stop;
+	int pair[2];
+	int epoll;
+	int stopEvent;
+
+	memset(pResult, 0, sizeof(*pResult));
+	queue.Bytes = 0;
+	queue.PeakBytes = 0;
+	queue.PeakMessages = 0;
+	queue.bClosed = false;
+
+	if ((socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) || (!executor.Start(1))) {
+		pResult->bFailed = true;
+		return;
+	}
+	epoll = epoll_create1(0);
+	stopEvent = eventfd(0, 0);
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, stopEvent, &event);
+
+	connection.Socket = pair[0];
+	connection.pReadBuffer = NULL;
+	if (!connection.Connection.Initialize(&executor, SocketReadAsync, SocketWriteAsync, &connection, 0)) {
+		pResult->bFailed = true;
+		return;
+	}
+	if (bCredits) {
+		connection.Connection.EnableReceiveCredits(qwCredits, qwMessageCredits);
+	}
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &connection;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, connection.Socket, &event);
+	reactor = std::thread(Reactor, epoll);
+
+	residentBefore = ResidentBytes();
+	start = Clock::now();
+	QueueHandler(&connection, &queue).Start(&executor);
+	client = std::thread(RunClient, pair[1], messages, qwSize);
+
+	// The application, slower than the client
+	expected = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(queue.Lock);
+			queue.Ready.wait(lock, [&queue] { return (!queue.Messages.empty()) || (queue.bClosed); });
+			if (queue.Messages.empty()) {
+				break;
+			}
+			message.swap(queue.Messages.front());
+			queue.Messages.pop_front();
+			queue.Bytes -= message.size();
+		}
+
+		std::this_thread::sleep_for(std::chrono::microseconds(consumeMicroseconds));
+		memcpy(&sequence, message.data(), sizeof(sequence));
+		if (sequence != expected) {
+			pResult->OutOfOrder++;
+		}
+		expected = sequence + 1;
+		pResult->Messages++;
+		if (bCredits) {
+			connection.Connection.GrantReceiveCredits(message.size(), 1);
+		}
+
+		if ((pResult->Messages % 64) == 0)
+		{
+			resident = ResidentBytes() - residentBefore;
+			if (resident > pResult->PeakMemoryBytes) {
+				pResult->PeakMemoryBytes = resident;
+			}
+		}
+	}
+	pResult->Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->PeakQueuedBytes = queue.PeakBytes;
+	pResult->PeakQueuedMessages = queue.PeakMessages;
+
+	client.join();
+	stop = 1;
+	if (write(stopEvent, &stop, sizeof(stop)) != sizeof(stop)) {
+		pResult->bFailed = true;
+	}
+	reactor.join();
+	executor.Stop();
+	connection.Connection.Free();
+	close(pair[0]);
+	close(pair[1]);
+	close(stopEvent);
+	close(epoll);
+
+	pResult->bFailed = pResult->bFailed || (pResult->Messages != messages) || (pResult->OutOfOrder != 0);
+}
+
+// Run one way in a forked process and read back its result
+static bool RunForked(bool bCredits, unsigned int messages, unsigned long long qwSize, unsigned int consumeMicroseconds,
+	unsigned long long qwCredits, unsigned long long qwMessageCredits, CREDITBENCH_RESULT* pResult)
+{
+	int resultPipe[2];
+	pid_t pid;
+	bool bRead;
+
+	if (pipe(resultPipe) != 0) {
+		return false;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(resultPipe[0]);
+		Run(bCredits, messages, qwSize, consumeMicroseconds, qwCredits, qwMessageCredits, pResult);
+		_exit(WriteAll(resultPipe[1], pResult, sizeof(*pResult)) ? 0 : 1);
+	}
+	close(resultPipe[1]);
+	bRead = ReadAll(resultPipe[0], pResult, sizeof(*pResult));
+	close(resultPipe[0]);
+	waitpid(pid, NULL, 0);
+
+	if (!bRead) {
+		memset(pResult, 0, sizeof(*pResult));
+		pResult->bFailed = true;
+	}
+
+	return bRead;
+}
+
+static void PrintResult(const char* pName, const CREDITBENCH_RESULT* pResult)
+{
+	printf("%-10s %llu messages in %.2f s (%.0f per second), queue peak %.1f KB in %llu messages, memory peak %.1f MB, %llu out of order%s\n",
+		pName, pResult->Messages, pResult->Seconds, (pResult->Seconds != 0) ? (double)pResult->Messages / pResult->Seconds : 0.0,
+		(double)pResult->PeakQueuedBytes / 1024.0, pResult->PeakQueuedMessages, (double)pResult->PeakMemoryBytes / 1048576.0,
+		pResult->OutOfOrder, pResult->bFailed ? " (failed)" : "");
+}
+
+static void WriteJsonResult(FILE* pFile, const char* pName, const CREDITBENCH_RESULT* pResult, const char* pEnd)
+{
+	fprintf(pFile, "  \"%s\": { \"messages\": %llu, \"seconds\": %.6f, \"peak_queued_bytes\": %llu, \"peak_queued_messages\": %llu, "
+		"\"peak_memory_bytes\": %lld, \"out_of_order\": %llu, \"failed\": %s }%s\n",
+		pName, pResult->Messages, pResult->Seconds, pResult->PeakQueuedBytes, pResult->PeakQueuedMessages,
+		pResult->PeakMemoryBytes, pResult->OutOfOrder, pResult->bFailed ? "true" : "false", pEnd);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int messages = 20000;
+	unsigned long long qwSize = 4096;
+	unsigned int consumeMicroseconds = 20;
+	unsigned long long qwCredits = 0x40000;
+	unsigned long long qwMessageCredits = 0;
+	const char* pJsonPath = NULL;
+	CREDITBENCH_RESULT unlimited;
+	CREDITBENCH_RESULT credits;
+	bool bBounded;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			messages = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--consume") == 0) && (i + 1 < argc)) {
+			consumeMicroseconds = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--credits") == 0) && (i + 1 < argc)) {
+			qwCredits = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--message-credits") == 0) && (i + 1 < argc)) {
+			qwMessageCredits = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: creditbench [--messages <count>] [--size <bytes>] [--consume <us per message>] [--credits <bytes>]\n"
+				"                   [--message-credits <count>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((messages == 0) || (qwSize < sizeof(unsigned int)) || (qwSize > 0x100000) || ((qwCredits == 0) && (qwMessageCredits == 0))) {
+		fprintf(stderr, "--messages must be at least 1, --size from 4 to 1048576, and --credits or --message-credits set\n");
+		return 1;
+	}
+
+	RunForked(false, messages, qwSize, consumeMicroseconds, qwCredits, qwMessageCredits, &unlimited);
+	RunForked(true, messages, qwSize, consumeMicroseconds, qwCredits, qwMessageCredits, &credits);
+
+	// The application never holds more than its budget and the message that went over it
+	bBounded = ((qwCredits == 0) || (credits.PeakQueuedBytes < qwCredits + qwSize)) &&
+		((qwMessageCredits == 0) || (credits.PeakQueuedMessages <= qwMessageCredits));
+
+	printf("%u messages of %llu bytes, %u us to handle each, %llu bytes and %llu messages of credits\n",
+		messages, qwSize, consumeMicroseconds, qwCredits, qwMessageCredits);
+	PrintResult("unlimited", &unlimited);
+	PrintResult("credits", &credits);
+	printf("bounded    %s\n", bBounded ? "yes" : "no");
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"messages\": %u,\n  \"message_bytes\": %llu,\n  \"consume_us\": %u,\n  \"credits\": %llu,\n  \"message_credits\": %llu,\n",
+			messages, qwSize, consumeMicroseconds, qwCredits, qwMessageCredits);
+		WriteJsonResult(pFile, "unlimited", &unlimited, ",");
+		WriteJsonResult(pFile, "credits", &credits, ",");
+		fprintf(pFile, "  \"bounded\": %s\n}\n", bBounded ? "true" : "false");
+		fclose(pFile);
+	}
+
+	return ((!unlimited.bFailed) && (!credits.bFailed) && (bBounded)) ? 0 : 1;
+}
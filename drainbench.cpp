@@ -0,0 +1,389 @@
+
+//
+// drainbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Measures a drain of many connections against a mock transport. Each connection's close frame is taken by a
+//     simulated client thread that answers it after a random network delay, and some clients never answer and are
+//     aborted at the deadline. Reports how long sending and waiting took, when the connections ended, and how
+//     the reconnect hints are spread.
+//
+//     Usage: drainbench [--connections <count>] [--batch <close frames per batch>] [--interval <ms between batches>]
+//                       [--timeout <ms>] [--latency <min ms> <max ms>] [--unresponsive <percent>]
+//                       [--reconnect <min ms> <max ms>] [--clients <threads>] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketdrain.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// A connection of the mock transport, the drain sees its address
+struct MOCK_CONNECTION
+{
+	unsigned int Index;
+	// Never answers the close frame
+	bool bUnresponsive;
+	// Set by the close and abort callbacks
+	std::atomic<bool> bCloseQueued;
+	std::atomic<bool> bAborted;
+	// The reconnect hint the client read, and when the connection ended in nanoseconds from the start of the drain
+	unsigned int Hint;
+	bool bHint;
+	unsigned long long qwEnded;
+};
+
+// A close frame on its way to a client
+struct MOCK_DELIVERY
+{
+	Clock::time_point Due;
+	MOCK_CONNECTION* pConnection;
+	WEB_SOCKET_SHARED_FRAME* pFrame;
+	bool operator>(const MOCK_DELIVERY& other) const { return this->Due > other.Due; }
+};
+
+// A client thread and the frames it hasn't received yet
+struct MOCK_CLIENT
+{
+	std::mutex Lock;
+	std::condition_variable Wake;
+	std::priority_queue<MOCK_DELIVERY, std::vector<MOCK_DELIVERY>, std::greater<MOCK_DELIVERY>> Wire;
+	std::mt19937 Random;
+	bool bStop;
+};
+
+// Everything the callbacks and client threads share
+struct MOCK_TRANSPORT
+{
+	WebSocketDrain* pDrain;
+	std::vector<MOCK_CLIENT*> Clients;
+	unsigned int LatencyMin;
+	unsigned int LatencyMax;
+	Clock::time_point Start;
+	std::atomic<unsigned long long> InvalidFrames;
+	std::atomic<unsigned long long> Aborted;
+};
+
+// The close callback, the frame is put on the wire to the connection's client
+static bool QueueMockClose(void* pConnection, WEB_SOCKET_SHARED_FRAME* pFrame, void* pContext)
+{
+	MOCK_TRANSPORT* pTransport = (MOCK_TRANSPORT*)pContext;
+	MOCK_CONNECTION* pMock = (MOCK_CONNECTION*)pConnection;
+	MOCK_CLIENT* pClient = pTransport->Clients[pMock->Index % pTransport->Clients.size()];
+	MOCK_DELIVERY delivery;
+
+	pMock->bCloseQueued.store(true);
+	AddSharedFrameReference(pFrame);
+	delivery.pConnection = pMock;
+	delivery.pFrame = pFrame;
+	{
+		std::lock_guard<std::mutex> lock(pClient->Lock);
+		delivery.Due = Clock::now() + std::chrono::milliseconds(pTransport->LatencyMin +
+			((pTransport->LatencyMax > pTransport->LatencyMin) ? (pClient->Random() % (pTransport->LatencyMax - pTransport->LatencyMin + 1)) : 0));
+		pClient->Wire.push(delivery);
+	}
+	pClient->Wake.notify_one();
+
+	return true;
+}
+
+// The abort callback, the connection is reset and removed after the drain like a connection's thread would
+static void AbortMock(void* pConnection, void* pContext)
+{
+	((MOCK_CONNECTION*)pConnection)->bAborted.store(true);
+	((MOCK_TRANSPORT*)pContext)->Aborted.fetch_add(1);
+}
+
+// Check a close frame the way a client would, and read its reconnect hint
+static bool ReadCloseFrame(WEB_SOCKET_SHARED_FRAME* pFrame, MOCK_CONNECTION* pMock)
+{
+	const unsigned char* pBytes = pFrame->pFrame;
+	unsigned int length;
+
+	// FIN, the close opcode, no mask and a payload that fits a control frame
+	if ((pBytes[0] != 0x88) || ((pBytes[1] & 0x80) != 0) || ((pBytes[1] & 0x7F) > 125) || ((pBytes[1] & 0x7F) < 2)) {
+		return false;
+	}
+	length = pBytes[1] & 0x7F;
+	if (((pBytes[2] << 8) | pBytes[3]) != 1001) {
+		return false;
+	}
+
+	pMock->bHint = ParseDrainReconnectHint((const char*)pBytes + 4, length - 2, &pMock->Hint);
+	return true;
+}
+
+// A client thread, answers each close frame when it arrives, which ends the connection
+static void RunClient(MOCK_TRANSPORT* pTransport, MOCK_CLIENT* pClient)
+{
+	std::unique_lock<std::mutex> lock(pClient->Lock);
+
+	for (;;)
+	{
+		if (pClient->Wire.empty())
+		{
+			if (pClient->bStop) {
+				return;
+			}
+			pClient->Wake.wait(lock);
+			continue;
+		}
+		// A copy, the queue may grow while waiting
+		Clock::time_point due = pClient->Wire.top().Due;
+		if (Clock::now() < due) {
+			pClient->Wake.wait_until(lock, due);
+			continue;
+		}
+
+		MOCK_DELIVERY delivery = pClient->Wire.top();
+		pClient->Wire.pop();
+		lock.unlock();
+
+		if (!ReadCloseFrame(delivery.pFrame, delivery.pConnection)) {
+			pTransport->InvalidFrames.fetch_add(1);
+		}
+		ReleaseSharedFrame(delivery.pFrame);
+
+		// The client's close reaches the server, which ends the connection
+		if (!delivery.pConnection->bUnresponsive)
+		{
+			delivery.pConnection->qwEnded = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - pTransport->Start).count();
+			pTransport->pDrain->Remove(delivery.pConnection);
+		}
+
+		lock.lock();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int connectionCount = 50000;
+	unsigned int clientCount = 4;
+	unsigned int unresponsivePercent = 1;
+	IIS_WEB_SOCKET_DRAIN_OPTIONS options;
+	IIS_WEB_SOCKET_DRAIN_STATS stats;
+	const char* pJsonPath = NULL;
+	WebSocketDrain drain;
+	MOCK_TRANSPORT transport;
+	std::vector<MOCK_CONNECTION> connections;
+	std::vector<std::thread> threads;
+	std::vector<unsigned long long> ended;
+	std::vector<unsigned int> hints;
+	unsigned long long qwLate;
+	unsigned long long qwHintless;
+	unsigned long long percentiles[3];
+	unsigned int distinctHints;
+	bool bRefused;
+	double drainSeconds;
+	FILE* pFile;
+
+	options.pReason = "Server restarting";
+	options.BatchSize = 1000;
+	options.BatchInterval = 5;
+	options.Timeout = 2000;
+	options.ReconnectMin = 1000;
+	options.ReconnectMax = 15000;
+	transport.LatencyMin = 1;
+	transport.LatencyMax = 50;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			connectionCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+			options.BatchSize = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--interval") == 0) && (i + 1 < argc)) {
+			options.BatchInterval = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--timeout") == 0) && (i + 1 < argc)) {
+			options.Timeout = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--latency") == 0) && (i + 2 < argc)) {
+			transport.LatencyMin = (unsigned int)atoi(argv[++i]);
+			transport.LatencyMax = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--unresponsive") == 0) && (i + 1 < argc)) {
+			unresponsivePercent = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--reconnect") == 0) && (i + 2 < argc)) {
+			options.ReconnectMin = (unsigned int)atoi(argv[++i]);
+			options.ReconnectMax = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--clients") == 0) && (i + 1 < argc)) {
+			clientCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: drainbench [--connections <count>] [--batch <close frames per batch>] [--interval <ms between batches>]\n"
+				"                  [--timeout <ms>] [--latency <min ms> <max ms>] [--unresponsive <percent>]\n"
+				"                  [--reconnect <min ms> <max ms>] [--clients <threads>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((connectionCount == 0) || (clientCount == 0) || (unresponsivePercent > 100)) {
+		fprintf(stderr, "--connections and --clients must be at least 1 and --unresponsive at most 100\n");
+		return 1;
+	}
+
+	if (!drain.Initialize(0)) {
+		fprintf(stderr, "failed to initialize the drain\n");
+		return 1;
+	}
+	transport.pDrain = &drain;
+	transport.InvalidFrames.store(0);
+	transport.Aborted.store(0);
+
+	// Open the connections, every hundredth one or so never answers
+	std::mt19937 random(12345);
+	connections = std::vector<MOCK_CONNECTION>(connectionCount);
+	for (unsigned int i = 0; i < connectionCount; i++)
+	{
+		connections[i].Index = i;
+		connections[i].bUnresponsive = (random() % 100) < unresponsivePercent;
+		connections[i].bCloseQueued.store(false);
+		connections[i].bAborted.store(false);
+		connections[i].bHint = false;
+		connections[i].Hint = 0;
+		connections[i].qwEnded = 0;
+		if (!drain.Add(&connections[i])) {
+			fprintf(stderr, "failed to add connection %u\n", i);
+			return 1;
+		}
+	}
+
+	for (unsigned int i = 0; i < clientCount; i++)
+	{
+		MOCK_CLIENT* pClient = new MOCK_CLIENT;
+		pClient->Random.seed(i + 1);
+		pClient->bStop = false;
+		transport.Clients.push_back(pClient);
+	}
+	for (unsigned int i = 0; i < clientCount; i++) {
+		threads.emplace_back(RunClient, &transport, transport.Clients[i]);
+	}
+
+	transport.Start = Clock::now();
+	drain.Drain(&options, QueueMockClose, AbortMock, &transport, &stats);
+	drainSeconds = std::chrono::duration<double>(Clock::now() - transport.Start).count();
+
+	// A connection that arrives during the drain is turned away
+	MOCK_CONNECTION late;
+	bRefused = !drain.Add(&late);
+
+	// The aborted connections end, like their threads would after the reset
+	for (unsigned int i = 0; i < connectionCount; i++)
+	{
+		if (connections[i].bAborted.load()) {
+			drain.Remove(&connections[i]);
+		}
+	}
+
+	for (MOCK_CLIENT* pClient : transport.Clients)
+	{
+		std::lock_guard<std::mutex> lock(pClient->Lock);
+		pClient->bStop = true;
+		pClient->Wake.notify_one();
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	// When the connections that answered ended, and the hints their clients read
+	qwLate = 0;
+	qwHintless = 0;
+	for (unsigned int i = 0; i < connectionCount; i++)
+	{
+		if ((!connections[i].bUnresponsive) && (!connections[i].bAborted.load())) {
+			ended.push_back(connections[i].qwEnded);
+		}
+		if ((!connections[i].bUnresponsive) && (connections[i].bAborted.load())) {
+			qwLate++;
+		}
+		if (connections[i].bCloseQueued.load())
+		{
+			if (connections[i].bHint) {
+				hints.push_back(connections[i].Hint);
+			}
+			else {
+				qwHintless++;
+			}
+		}
+	}
+	std::sort(ended.begin(), ended.end());
+	memset(percentiles, 0, sizeof(percentiles));
+	if (!ended.empty()) {
+		percentiles[0] = ended[ended.size() / 2];
+		percentiles[1] = ended[std::min(ended.size() - 1, ended.size() * 99 / 100)];
+		percentiles[2] = ended.back();
+	}
+	std::sort(hints.begin(), hints.end());
+	distinctHints = (unsigned int)(std::unique(hints.begin(), hints.end()) - hints.begin());
+	hints.resize(distinctHints);
+
+	drain.Free();
+	for (MOCK_CLIENT* pClient : transport.Clients) {
+		delete pClient;
+	}
+
+	printf("connections      %llu, %u clients, %u%% never answer, %u..%u ms network delay\n",
+		stats.Connections, clientCount, unresponsivePercent, transport.LatencyMin, transport.LatencyMax);
+	printf("drain            %.2f ms, batches of %u every %u ms, %u ms timeout\n",
+		drainSeconds * 1000.0, options.BatchSize, options.BatchInterval, options.Timeout);
+	printf("send             %.2f ms for %llu close frames, %llu failed\n",
+		(double)stats.SendTime / 1000.0, stats.ClosesSent, stats.CloseFailures);
+	printf("wait             %.2f ms\n", (double)stats.WaitTime / 1000.0);
+	printf("closed           %llu, %llu aborted (%llu answered too late)\n", stats.Closed, stats.Aborted, qwLate);
+	printf("ended p50        %.2f ms after the drain started\n", (double)percentiles[0] / 1000000.0);
+	printf("ended p99        %.2f ms\n", (double)percentiles[1] / 1000000.0);
+	printf("ended max        %.2f ms\n", (double)percentiles[2] / 1000000.0);
+	printf("reconnect hints  %u distinct from %u to %u ms, %llu frames without one, %llu invalid frames\n",
+		distinctHints, hints.empty() ? 0 : hints.front(), hints.empty() ? 0 : hints.back(), qwHintless, transport.InvalidFrames.load());
+	printf("late connection  %s\n", bRefused ? "refused" : "accepted");
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"connections\": %llu,\n  \"clients\": %u,\n  \"unresponsive_percent\": %u,\n  \"latency_ms\": [%u, %u],\n"
+			"  \"batch_size\": %u,\n  \"batch_interval_ms\": %u,\n  \"timeout_ms\": %u,\n  \"drain_ms\": %.3f,\n  \"send_ms\": %.3f,\n  \"wait_ms\": %.3f,\n"
+			"  \"closes_sent\": %llu,\n  \"close_failures\": %llu,\n  \"closed\": %llu,\n  \"aborted\": %llu,\n  \"late\": %llu,\n"
+			"  \"ended_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n  \"distinct_hints\": %u,\n  \"hint_ms\": [%u, %u],\n"
+			"  \"invalid_frames\": %llu,\n  \"late_connection_refused\": %s\n}\n",
+			stats.Connections, clientCount, unresponsivePercent, transport.LatencyMin, transport.LatencyMax,
+			options.BatchSize, options.BatchInterval, options.Timeout, drainSeconds * 1000.0,
+			(double)stats.SendTime / 1000.0, (double)stats.WaitTime / 1000.0,
+			stats.ClosesSent, stats.CloseFailures, stats.Closed, stats.Aborted, qwLate,
+			(double)percentiles[0] / 1000000.0, (double)percentiles[1] / 1000000.0, (double)percentiles[2] / 1000000.0,
+			distinctHints, hints.empty() ? 0 : hints.front(), hints.empty() ? 0 : hints.back(),
+			transport.InvalidFrames.load(), bRefused ? "true" : "false");
+		fclose(pFile);
+	}
+
+	// Every frame was a valid close, every connection got one, and only the ones that never answer were aborted
+	return ((transport.InvalidFrames.load() == 0) && (stats.ClosesSent == connectionCount) && (bRefused) &&
+		(stats.Closed + stats.Aborted == connectionCount)) ? 0 : 1;
+}
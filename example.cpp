@@ -17,6 +17,12 @@
 
 // The actual WebSocket server
 #include "iiswebsocket.h"
+
+// The bus between the worker processes of a web garden
+#include "iiswebsocketbus.h"
+
+// Closes every connection when the worker process shuts down
+#include "iiswebsocketdrain.h"
 using namespace IISWebSocketServer;
 
 // Set this to false to stop debugging
@@ -90,6 +96,18 @@ static HANDLE client_list_mutex;
 // The number of milliseconds to wait for the client list lock
 #define CLIENT_LIST_WAIT_TIME 3000
 
+// Counts the connections of every worker process, when the application pool is a web garden
+static WebSocketBus connection_bus;
+static bool connection_bus_open = false;
+
+// Keeps the echoes sent to each client, so a client that reconnects gets the ones it missed
+static WebSocketSessions echo_sessions;
+static bool echo_sessions_open = false;
+
+// Tells every client to reconnect when the application pool recycles, instead of letting the connections break
+static WebSocketDrain echo_drain;
+static bool echo_drain_open = false;
+
 // Add a client connection to the list
 bool add_client(CLIENT_CONNECTION* client)
 {
@@ -101,6 +119,9 @@ bool add_client(CLIENT_CONNECTION* client)
 	{
 		// Add client to list
 		client_list.push_back(client);
+		if (connection_bus_open) {
+			connection_bus.AddConnections(1);
+		}
 
 		// Release the client list lock
 		ReleaseMutex(client_list_mutex);
@@ -132,6 +153,9 @@ bool remove_client_by_id(GUID guid)
 			if ((*it)->guid == guid)
 			{
 				client_list.erase(it);
+				if (connection_bus_open) {
+					connection_bus.AddConnections(-1);
+				}
 				success = true;
 				break;
 			}
@@ -163,6 +187,9 @@ bool remove_client(CLIENT_CONNECTION* client)
 			if (*it == client)
 			{
 				client_list.erase(it);
+				if (connection_bus_open) {
+					connection_bus.AddConnections(-1);
+				}
 				success = true;
 				break;
 			}
@@ -182,6 +209,11 @@ size_t get_client_count()
 
 	count = 0;
 
+	// The connections of every worker process
+	if (connection_bus_open) {
+		return (size_t)connection_bus.GetConnectionCount();
+	}
+
 	// Get the client list lock
 	dwWaitResult = WaitForSingleObject(client_list_mutex, CLIENT_LIST_WAIT_TIME);
 	if (dwWaitResult == WAIT_OBJECT_0)
@@ -196,6 +228,20 @@ size_t get_client_count()
 	return count;
 }
 
+// Echo a message back on the channel it was received on, pContext is the connection's channels
+void echo_channel_message(void* pContext, unsigned long long channelId, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	WebSocketChannels* pChannels = (WebSocketChannels*)pContext;
+
+	// Nothing to do when the client closes a channel
+	if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+		return;
+	}
+
+	// A client that doesn't grant credits doesn't get its echoes
+	pChannels->Send(channelId, bufferType, pData, qwLength);
+}
+
 // WebSocket communication thread
 DWORD WINAPI RunWork(void* parameter)
 {
@@ -219,6 +265,10 @@ DWORD WINAPI RunWork(void* parameter)
 	// Get the WebSocket class
 	WebSocketServer* pWebSocketServer = pClientConnection->pWebSocketServer;
 
+	// Channels opened by the client echo their messages, used when the client asked for the channel protocol
+	WebSocketChannels channels;
+	channels.Initialize(WebSocketServer::WriteChannelMessage, pWebSocketServer, echo_channel_message, &channels, 0);
+
 	// Set a max payload length, if a frame payload is over this length the connection is closed
 	pWebSocketServer->MaxPayloadLength = 0x100;
 
@@ -230,23 +280,19 @@ DWORD WINAPI RunWork(void* parameter)
 	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
 	DWORD dwTotalBytesReceived;
 
-	// Debug buffer when debugging is enabled
-	CHAR* DebugBuffer = NULL;
-
-	// Allocate the debug buffer
 	if (DEBUG_WEB_SOCKET_SERVER) {
-		DebugBuffer = (CHAR*)malloc(0x1000);
-		if (DebugBuffer == NULL) {
-			goto exit;
-		}
+		pClientConnection->debugger.Out("Entering WebSocket loop...\n\n");
 	}
 
-	if (DEBUG_WEB_SOCKET_SERVER) {
-		pClientConnection->debugger.Out("Entering WebSocket loop...\n\n");
+	// A connection that got in as the worker process started shutting down is closed at once
+	bool bAdmitted = (!echo_drain_open) || (echo_drain.Add(pWebSocketServer));
+	if (!bAdmitted) {
+		IIS_WEB_SOCKET_CLOSE_DATA closeData(IIS_WEB_SOCKET_CLOSE_STATUS::IIS_WEB_SOCKET_ENDPOINT_TERMINATED_CLOSE_STATUS, "Server restarting");
+		pWebSocketServer->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, &closeData, (DWORD)closeData.length());
 	}
 
 	// Run loop while connected, get messages and process them
-	while (pWebSocketServer->IsConnected())
+	while ((bAdmitted) && (pWebSocketServer->IsConnected()))
 	{
 		// Reset dwBytesRead and dwTotalBytesReceived
 		dwBytesReceived = 0;
@@ -287,26 +333,6 @@ DWORD WINAPI RunWork(void* parameter)
 
 				// Copy the new data
 				memcpy(pInBuffer + (dwTotalBytesReceived - dwBytesReceived), localBuffer, dwBytesReceived);
-
-				if (DEBUG_WEB_SOCKET_SERVER)
-				{
-					sprintf_s(DebugBuffer, 0x1000, "Incoming: FIN:%d Opcode:0x%X Mask(BOOLEAN):%d Payload-Len:0x%llX Frame-Len:0x%X%s",
-						pWebSocketServer->WebSocketFrame.FIN,
-						pWebSocketServer->WebSocketFrame.Opcode,
-						pWebSocketServer->WebSocketFrame.bMask,
-						pWebSocketServer->WebSocketFrame.PayloadLength,
-						pWebSocketServer->WebSocketFrame.FrameSize,
-						"\n");
-					pClientConnection->debugger.Out(DebugBuffer);
-
-					pClientConnection->debugger.Out("RAW FRAME DATA: ");
-					for (unsigned int i = 0; i < pWebSocketServer->WebSocketFrame.FrameSize; i++)
-					{
-						sprintf_s(DebugBuffer, 0x1000, "0x%X ", (ULONG)(UCHAR)pWebSocketServer->Stream.pFrameBuffer[i]);
-						pClientConnection->debugger.Out(DebugBuffer);
-					}
-					pClientConnection->debugger.Out("\n");
-				}
 			}
 
 			// Loop while buffer type is a fragment
@@ -322,15 +348,7 @@ DWORD WINAPI RunWork(void* parameter)
 				pClientConnection->debugger.Out("Received (CLOSE BUFFER TYPE)\n");
 			}
 
-			// Finish the CLOSE 
-			errorCode = pWebSocketServer->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, pInBuffer, dwTotalBytesReceived);
-			if (errorCode != S_OK)
-			{
-				if (DEBUG_WEB_SOCKET_SERVER) {
-					pClientConnection->debugger.Out(pWebSocketServer->ErrorDescription);
-					pClientConnection->debugger.Out("WebSocketServer::Send() 'CLOSE FRAME' failed\n");
-				}
-			}
+			// Receive has answered the CLOSE, or it answers the close frame we sent
 			break;
 		}
 		else if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE)
@@ -348,6 +366,16 @@ DWORD WINAPI RunWork(void* parameter)
 				break;
 			}
 		}
+		else if ((pWebSocketServer->ChannelsNegotiated) && (dwTotalBytesReceived != 0))
+		{
+			// Every message belongs to a channel, a client that breaks the channel protocol is closed
+			if (channels.Dispatch(bufferType, pInBuffer, dwTotalBytesReceived) == IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT)
+			{
+				IIS_WEB_SOCKET_CLOSE_DATA closeData(IIS_WEB_SOCKET_CLOSE_STATUS::IIS_WEB_SOCKET_PROTOCOL_ERROR_CLOSE_STATUS, "Channel protocol error");
+				pWebSocketServer->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, &closeData, (DWORD)closeData.length());
+				break;
+			}
+		}
 		else if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) && (dwTotalBytesReceived != 0))
 		{
 			// Compiler thinks we are causing a buffer overrun, so we disbale the warning, then re-enable it
@@ -383,19 +411,8 @@ DWORD WINAPI RunWork(void* parameter)
 					break;
 				}
 
-				// Client will send a CLOSE frame back
-				errorCode = pWebSocketServer->Receive(&closeData, sizeof(IIS_WEB_SOCKET_CLOSE_DATA), &dwBytesReceived, &bufferType);
-				if (errorCode != S_OK)
-				{
-					if (DEBUG_WEB_SOCKET_SERVER) {
-						pClientConnection->debugger.Out(pWebSocketServer->ErrorDescription);
-						pClientConnection->debugger.Out("WebSocketServer::Receive(CLOSE) failed\n");
-					}
-					break;
-				}
-
-				// Exit the the loop
-				break;
+				// Keep receiving, the loop ends when the client's CLOSE arrives or the connection is aborted after `CloseTimeout`
+				continue;
 			}
 			else if (_stricmp(pInBuffer, "send-connection-count") == 0)
 			{
@@ -477,6 +494,9 @@ exit:
 
 	// Remove client from our connection list
 	remove_client(pClientConnection);
+	if (echo_drain_open) {
+		echo_drain.Remove(pWebSocketServer);
+	}
 
 	// Free resources
 
@@ -487,6 +507,7 @@ exit:
 		free(pOutBuffer);
 	}
 
+	channels.Free();
 	pWebSocketServer->Free();
 
 	pClientConnection->debugger.Close();
@@ -521,6 +542,13 @@ public:
 		pClientConnection = NULL;
 		pWebSocketServer = NULL;
 
+		// The worker process is shutting down, send the client to another one instead of accepting a connection that's closed at once
+		if ((echo_drain_open) && (echo_drain.IsDraining())) {
+			pHttpContext->GetResponse()->SetStatus(503, "Service Unavailable");
+			pHttpContext->GetResponse()->SetHeader("Retry-After", "5", 1, TRUE);
+			return RQ_NOTIFICATION_FINISH_REQUEST;
+		}
+
 		// Allocate our client connection struct
 		pClientConnection = (CLIENT_CONNECTION*)malloc(sizeof(CLIENT_CONNECTION));
 		if (pClientConnection == NULL) {
@@ -560,12 +588,23 @@ public:
 			pClientConnection->debugger.Out("WebSocket Server Initialized\n");
 		}
 
+		// Let clients multiplex channels over the connection
+		pWebSocketServer->AcceptChannels = TRUE;
+
+		// Let clients resume their session after a reconnect
+		if (echo_sessions_open) {
+			pWebSocketServer->pSessions = &echo_sessions;
+		}
+
 		// Attempt the WebSocket handshake
 		errorCode = pWebSocketServer->PerformHandshake(pHttpContext);
 		if (errorCode == S_OK)
 		{
 			if (DEBUG_WEB_SOCKET_SERVER) {
 				pClientConnection->debugger.Out("WebSocket Handshake was successful!\n");
+				if (pWebSocketServer->SessionResumed) {
+					pClientConnection->debugger.Out("WebSocket session resumed\n");
+				}
 			}
 
 			// Enable Full Duplex
@@ -605,6 +644,38 @@ public:
 	}
 };
 
+// Create the global module class, it closes the connections when the worker process stops listening.
+class WebSocketEchoGlobalModule : public CGlobalModule
+{
+public:
+	GLOBAL_NOTIFICATION_STATUS OnGlobalStopListening(IN IGlobalStopListeningProvider* pProvider)
+	{
+		UNREFERENCED_PARAMETER(pProvider);
+
+		IIS_WEB_SOCKET_DRAIN_OPTIONS options;
+
+		// 500 close frames every 10 milliseconds, clients reconnect within 1 to 15 seconds, and 10 seconds to answer
+		options.pReason = "Server restarting";
+		options.BatchSize = 500;
+		options.BatchInterval = 10;
+		options.ReconnectMin = 1000;
+		options.ReconnectMax = 15000;
+		options.Timeout = 10000;
+
+		if (echo_drain_open) {
+			echo_drain.Drain(&options, WebSocketServer::QueueDrainClose, WebSocketServer::AbortDrain, NULL, NULL);
+		}
+
+		return GL_NOTIFICATION_CONTINUE;
+	}
+
+	VOID Terminate()
+	{
+		// Remove the class from memory.
+		delete this;
+	}
+};
+
 // Create the module's class factory.
 class WebSocketEchoFactory : public IHttpModuleFactory
 {
@@ -633,6 +704,28 @@ public:
 
 	void Terminate()
 	{
+		// Stop the frame tracer
+		if (DEBUG_WEB_SOCKET_SERVER) {
+			StopTrace();
+		}
+
+		// Give up this process's share of the connection count
+		if (connection_bus_open) {
+			connection_bus.Close();
+			connection_bus_open = false;
+		}
+
+		// The sessions stay in shared memory while another worker process has them open
+		if (echo_sessions_open) {
+			echo_sessions.Close();
+			echo_sessions_open = false;
+		}
+
+		if (echo_drain_open) {
+			echo_drain.Free();
+			echo_drain_open = false;
+		}
+
 		// Remove the class from memory.
 		delete this;
 	}
@@ -650,6 +743,27 @@ HRESULT __stdcall RegisterModule(DWORD dwServerVersion, IHttpModuleRegistrationI
 	// Create the global client list mutex
 	client_list_mutex = CreateMutex(NULL, FALSE, NULL);
 
+	// Share the connection count with the other worker processes, each process counts its own without it
+	connection_bus_open = connection_bus.Open("IISWebSocketEcho", 0);
+
+	// Keep up to 1000 sessions with 64 KB of echoes each, for a minute after the client disconnects
+	echo_sessions_open = echo_sessions.Open("IISWebSocketEchoSessions", 1000, 0, 0);
+
+	// Trace the frames of every connection, decode the file with tracedump
+	if (DEBUG_WEB_SOCKET_SERVER) {
+		StartTrace(L"C:\\inetpub\\modules\\echo\\echo.trace", 0x100000);
+	}
+
+	// Track the connections, so they can be closed when the application pool recycles
+	echo_drain_open = echo_drain.Initialize(0);
+	if (echo_drain_open)
+	{
+		HRESULT errorCode = pModuleInfo->SetGlobalNotifications(new WebSocketEchoGlobalModule, GL_STOP_LISTENING);
+		if (errorCode != S_OK) {
+			return errorCode;
+		}
+	}
+
 	// Set the request notifications and exit.
 	return pModuleInfo->SetRequestNotifications(new WebSocketEchoFactory, RQ_BEGIN_REQUEST, 0);
 }
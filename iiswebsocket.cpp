@@ -11,6 +11,7 @@
 //
 
 #include "iiswebsocket.h"
+#include <intrin.h>
 using namespace IISWebSocketServer;
 
 // The headers a client must send to create a WebSocket connection
@@ -22,15 +23,14 @@ static CHAR* requiredHeadersValues[] = { "Upgrade", "websocket" };
 // Optional headers a client may send for the connection
 static CHAR* optionalHeaders[] = { "Sec-WebSocket-Version", "Sec-WebSocket-Key", "Sec-WebSocket-Protocol", "Host", "User-Agent" };
 
-// Generate WebSocket masking key
-void WebSocketGenerateMaskingKey(CHAR pMaskingKey[4])
-{
-	DWORD key = rand();
-	pMaskingKey[0] = key & 0xFF;
-	pMaskingKey[1] = (key >> 8) & 0xFF;
-	pMaskingKey[2] = (key >> 16) & 0xFF;
-	pMaskingKey[3] = (key >> 24) & 0xFF;
-}
+// The size of the request headers kept for the connection
+#define IIS_WEB_SOCKET_REQUEST_HEADERS_SIZE (sizeof(WEB_SOCKET_HTTP_HEADER) * (ARRAYSIZE(requiredHeaders) + ARRAYSIZE(optionalHeaders)))
+
+// The size of the frame header buffer
+#define IIS_WEB_SOCKET_FRAME_BUFFER_SIZE 0x100
+
+// The size of the buffer for printing an invalid header value
+#define IIS_WEB_SOCKET_HEADER_VALUE_BUFFER_SIZE 0x1000
 
 void IISWebSocketServer::PrintLastError(DWORD errorCode, CHAR* des, size_t desLen, CHAR* action, bool append)
 {
@@ -64,33 +64,641 @@ void IISWebSocketServer::PrintLastError(DWORD errorCode, CHAR* des, size_t desLe
 	}
 }
 
+//
+// Frame tracer
+//
+// Each thread writes fixed-size records into its own ring buffer without taking a lock.
+// A background thread drains the rings into a memory-mapped trace file, read with tracedump.
+//
+
+// How often the trace thread drains the ring buffers in milliseconds
+#define IIS_WEB_SOCKET_TRACE_DRAIN_INTERVAL 1
+
+// Marks the thread's ring buffer as orphaned when the thread exits, the trace thread frees it
+struct TRACE_RING_OWNER
+{
+	WEB_SOCKET_TRACE_RING* pRing;
+	~TRACE_RING_OWNER()
+	{
+		if (pRing) {
+			pRing->bOrphaned.store(true, std::memory_order_release);
+		}
+	}
+};
+
+// Checked before every trace record, a single relaxed load when tracing is off
+static std::atomic<bool> TraceEnabled;
+
+// Protects the trace file while tracing is started and stopped
+static SRWLOCK TraceStateLock = SRWLOCK_INIT;
+
+// Protects the list of ring buffers, only taken when a thread registers and while draining
+static SRWLOCK TraceRingLock = SRWLOCK_INIT;
+static WEB_SOCKET_TRACE_RING* pTraceRings;
+
+// This thread's ring buffer
+static thread_local TRACE_RING_OWNER TraceRingOwner;
+
+// The trace file and drain thread
+static HANDLE hTraceFile;
+static HANDLE hTraceMapping;
+static HANDLE hTraceThread;
+static HANDLE hTraceStopEvent;
+static IIS_WEB_SOCKET_TRACE_FILE_HEADER* pTraceHeader;
+static IIS_WEB_SOCKET_TRACE_RECORD* pTraceRecords;
+
+// Unique connection ids
+static std::atomic<unsigned long long> NextConnectionId;
+
+// Read the trace timestamp, the TSC where we have one
+static inline unsigned long long TraceTimestamp()
+{
+#if defined(_M_X64) || defined(_M_IX86)
+	return __rdtsc();
+#else
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long)counter.QuadPart;
+#endif
+}
+
+// Measure the frequency of TraceTimestamp against the performance counter
+static unsigned long long TraceTimestampFrequency()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+#if defined(_M_X64) || defined(_M_IX86)
+	LARGE_INTEGER counterStart;
+	LARGE_INTEGER counterEnd;
+	unsigned long long tscStart;
+	unsigned long long tscEnd;
+
+	QueryPerformanceCounter(&counterStart);
+	tscStart = __rdtsc();
+	Sleep(20);
+	QueryPerformanceCounter(&counterEnd);
+	tscEnd = __rdtsc();
+
+	return (unsigned long long)((double)(tscEnd - tscStart) * (double)frequency.QuadPart / (double)(counterEnd.QuadPart - counterStart.QuadPart));
+#else
+	return (unsigned long long)frequency.QuadPart;
+#endif
+}
+
+// Get this thread's ring buffer, the first call registers it with the trace thread
+static WEB_SOCKET_TRACE_RING* GetTraceRing()
+{
+	WEB_SOCKET_TRACE_RING* pRing = TraceRingOwner.pRing;
+	if (pRing != NULL) {
+		return pRing;
+	}
+
+	pRing = (WEB_SOCKET_TRACE_RING*)_aligned_malloc(sizeof(WEB_SOCKET_TRACE_RING), 64);
+	if (pRing == NULL) {
+		return NULL;
+	}
+	memset(pRing, 0, sizeof(WEB_SOCKET_TRACE_RING));
+
+	AcquireSRWLockExclusive(&TraceRingLock);
+	pRing->pNext = pTraceRings;
+	pTraceRings = pRing;
+	ReleaseSRWLockExclusive(&TraceRingLock);
+
+	TraceRingOwner.pRing = pRing;
+	return pRing;
+}
+
+// Add a frame to this thread's ring buffer, the record is dropped if the ring is full
+static void TraceFrame(unsigned long long ConnectionId, UCHAR Direction, UCHAR Opcode, bool FIN,
+	unsigned long long PayloadLength, DWORD FrameSize, const void* pPayload, unsigned long long qwPayloadBytes)
+{
+	WEB_SOCKET_TRACE_RING* pRing;
+
+	pRing = GetTraceRing();
+	if (pRing == NULL) {
+		return;
+	}
+
+	WriteTraceRecord(pRing, ConnectionId, TraceTimestamp(), GetCurrentThreadId(), Direction, Opcode, FIN,
+		PayloadLength, FrameSize, pPayload, qwPayloadBytes);
+}
+
+// Move all records from the ring buffers to the trace file, and free the rings of threads that have exited
+static void DrainTraceRings()
+{
+	WEB_SOCKET_TRACE_RING** ppRing;
+	WEB_SOCKET_TRACE_RING* pRing;
+	unsigned long long head;
+	unsigned long long tail;
+	bool bOrphaned;
+
+	AcquireSRWLockExclusive(&TraceRingLock);
+
+	ppRing = &pTraceRings;
+	while (*ppRing != NULL)
+	{
+		pRing = *ppRing;
+
+		// Check before reading Head, an orphaned ring gets no more records
+		bOrphaned = pRing->bOrphaned.load(std::memory_order_acquire);
+
+		head = pRing->Head.load(std::memory_order_acquire);
+		tail = pRing->Tail.load(std::memory_order_relaxed);
+
+		// Copy the records to the file, it wraps around when it's full
+		while (tail != head)
+		{
+			memcpy(&pTraceRecords[pTraceHeader->RecordCount % pTraceHeader->RecordCapacity],
+				&pRing->Records[tail & (IIS_WEB_SOCKET_TRACE_RING_SIZE - 1)], sizeof(IIS_WEB_SOCKET_TRACE_RECORD));
+			pTraceHeader->RecordCount++;
+			tail++;
+		}
+
+		// Give the slots back to the owning thread
+		pRing->Tail.store(tail, std::memory_order_release);
+		pTraceHeader->DroppedRecords += pRing->Dropped.exchange(0, std::memory_order_relaxed);
+
+		if (bOrphaned) {
+			*ppRing = pRing->pNext;
+			_aligned_free(pRing);
+		}
+		else {
+			ppRing = &pRing->pNext;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&TraceRingLock);
+}
+
+// The trace thread, drains the ring buffers until tracing is stopped
+static DWORD WINAPI TraceThread(void* parameter)
+{
+	UNREFERENCED_PARAMETER(parameter);
+
+	while (WaitForSingleObject(hTraceStopEvent, IIS_WEB_SOCKET_TRACE_DRAIN_INTERVAL) == WAIT_TIMEOUT) {
+		DrainTraceRings();
+	}
+
+	// Get the last records
+	DrainTraceRings();
+
+	return 0;
+}
+
+DWORD IISWebSocketServer::StartTrace(const WCHAR* pFilePath, unsigned long long qwRecordCapacity)
+{
+	DWORD errorCode;
+	ULARGE_INTEGER fileSize;
+
+	// Set success
+	errorCode = S_OK;
+
+	if ((pFilePath == NULL) || (qwRecordCapacity == 0)) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&TraceStateLock);
+
+	// Only one trace at a time
+	if (hTraceThread != NULL) {
+		errorCode = ERROR_INVALID_OPERATION;
+		goto exit;
+	}
+
+	// Create the trace file
+	hTraceFile = CreateFile(pFilePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTraceFile == INVALID_HANDLE_VALUE) {
+		hTraceFile = NULL;
+		errorCode = GetLastError();
+		goto exit;
+	}
+
+	// Map the whole file, the header followed by the records
+	fileSize.QuadPart = sizeof(IIS_WEB_SOCKET_TRACE_FILE_HEADER) + (qwRecordCapacity * sizeof(IIS_WEB_SOCKET_TRACE_RECORD));
+	hTraceMapping = CreateFileMapping(hTraceFile, NULL, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, NULL);
+	if (hTraceMapping == NULL) {
+		errorCode = GetLastError();
+		goto exit;
+	}
+
+	pTraceHeader = (IIS_WEB_SOCKET_TRACE_FILE_HEADER*)MapViewOfFile(hTraceMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (pTraceHeader == NULL) {
+		errorCode = GetLastError();
+		goto exit;
+	}
+	pTraceRecords = (IIS_WEB_SOCKET_TRACE_RECORD*)(pTraceHeader + 1);
+
+	// Write the header
+	memset(pTraceHeader, 0, sizeof(IIS_WEB_SOCKET_TRACE_FILE_HEADER));
+	pTraceHeader->Magic = IIS_WEB_SOCKET_TRACE_MAGIC;
+	pTraceHeader->Version = IIS_WEB_SOCKET_TRACE_VERSION;
+	pTraceHeader->TimestampFrequency = TraceTimestampFrequency();
+	pTraceHeader->RecordCapacity = qwRecordCapacity;
+
+	// Start the trace thread
+	hTraceStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (hTraceStopEvent == NULL) {
+		errorCode = GetLastError();
+		goto exit;
+	}
+
+	hTraceThread = CreateThread(NULL, 0, TraceThread, NULL, 0, NULL);
+	if (hTraceThread == NULL) {
+		errorCode = GetLastError();
+		goto exit;
+	}
+
+	// Start recording
+	TraceEnabled.store(true, std::memory_order_release);
+
+exit:
+
+	// Free resources on failure
+	if (errorCode != S_OK)
+	{
+		if (hTraceStopEvent) {
+			CloseHandle(hTraceStopEvent);
+			hTraceStopEvent = NULL;
+		}
+		if (pTraceHeader) {
+			UnmapViewOfFile(pTraceHeader);
+			pTraceHeader = NULL;
+		}
+		if (hTraceMapping) {
+			CloseHandle(hTraceMapping);
+			hTraceMapping = NULL;
+		}
+		if (hTraceFile) {
+			CloseHandle(hTraceFile);
+			hTraceFile = NULL;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&TraceStateLock);
+
+	// Return error code
+	return errorCode;
+}
+
+VOID IISWebSocketServer::StopTrace()
+{
+	AcquireSRWLockExclusive(&TraceStateLock);
+
+	if (hTraceThread != NULL)
+	{
+		// Stop recording, then let the trace thread write the last records
+		TraceEnabled.store(false, std::memory_order_release);
+		SetEvent(hTraceStopEvent);
+		WaitForSingleObject(hTraceThread, INFINITE);
+
+		CloseHandle(hTraceThread);
+		hTraceThread = NULL;
+		CloseHandle(hTraceStopEvent);
+		hTraceStopEvent = NULL;
+
+		// Write the trace file to disk
+		FlushViewOfFile(pTraceHeader, 0);
+		UnmapViewOfFile(pTraceHeader);
+		pTraceHeader = NULL;
+		pTraceRecords = NULL;
+		CloseHandle(hTraceMapping);
+		hTraceMapping = NULL;
+		CloseHandle(hTraceFile);
+		hTraceFile = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&TraceStateLock);
+}
+
+//
+// Latency histograms
+//
+// Each thread records phase latencies into its own log-linear histograms without taking a lock.
+// GetLatencySnapshot merges the histograms of all threads and reads the percentiles from the merged counts.
+//
+
+// A thread's histograms, Generation is compared with LatencyGeneration to pick up a reset
+struct LATENCY_HISTOGRAMS
+{
+	std::atomic<unsigned long> Generation;
+	LATENCY_HISTOGRAMS* pNext;
+	WEB_SOCKET_LATENCY_HISTOGRAM Phases[IIS_WEB_SOCKET_LATENCY_PHASE_COUNT];
+};
+
+// Checked before every phase is timed, a single relaxed load when the histograms are off
+static std::atomic<bool> LatencyEnabled;
+
+// Incremented by ResetLatencyHistograms, each thread clears its own histograms when it sees a new generation
+static std::atomic<unsigned long> LatencyGeneration;
+
+// Converts timestamps to nanoseconds, measured the first time the histograms are enabled
+static double LatencyNanosecondsPerTick;
+
+// Protects the list of histograms and the histograms of threads that have exited
+static SRWLOCK LatencyLock = SRWLOCK_INIT;
+static LATENCY_HISTOGRAMS* pLatencyHistograms;
+static LATENCY_HISTOGRAMS* pRetiredLatencyHistograms;
+
+// Clear a thread's histograms
+static void ClearLatencyHistograms(LATENCY_HISTOGRAMS* pHistograms)
+{
+	for (int phase = 0; phase < IIS_WEB_SOCKET_LATENCY_PHASE_COUNT; phase++) {
+		ClearWebSocketLatencyHistogram(&pHistograms->Phases[phase]);
+	}
+}
+
+// Add the counts of one thread's histograms to another
+static void MergeLatencyHistograms(LATENCY_HISTOGRAMS* pDestination, LATENCY_HISTOGRAMS* pSource)
+{
+	for (int phase = 0; phase < IIS_WEB_SOCKET_LATENCY_PHASE_COUNT; phase++) {
+		MergeWebSocketLatencyHistogram(&pDestination->Phases[phase], &pSource->Phases[phase]);
+	}
+}
+
+// Allocate a set of histograms for the current generation
+static LATENCY_HISTOGRAMS* AllocateLatencyHistograms()
+{
+	LATENCY_HISTOGRAMS* pHistograms = (LATENCY_HISTOGRAMS*)malloc(sizeof(LATENCY_HISTOGRAMS));
+	if (pHistograms == NULL) {
+		return NULL;
+	}
+	memset(pHistograms, 0, sizeof(LATENCY_HISTOGRAMS));
+	ClearLatencyHistograms(pHistograms);
+	pHistograms->Generation.store(LatencyGeneration.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	return pHistograms;
+}
+
+// Merges the thread's histograms into the retired histograms when the thread exits
+struct LATENCY_HISTOGRAMS_OWNER
+{
+	LATENCY_HISTOGRAMS* pHistograms;
+	~LATENCY_HISTOGRAMS_OWNER()
+	{
+		LATENCY_HISTOGRAMS** ppHistograms;
+
+		if (pHistograms == NULL) {
+			return;
+		}
+
+		AcquireSRWLockExclusive(&LatencyLock);
+
+		// Remove the histograms from the list
+		for (ppHistograms = &pLatencyHistograms; *ppHistograms != NULL; ppHistograms = &(*ppHistograms)->pNext)
+		{
+			if (*ppHistograms == pHistograms) {
+				*ppHistograms = pHistograms->pNext;
+				break;
+			}
+		}
+
+		// Keep the counts of the current generation
+		if (pHistograms->Generation.load(std::memory_order_relaxed) == LatencyGeneration.load(std::memory_order_relaxed))
+		{
+			if (pRetiredLatencyHistograms == NULL) {
+				pRetiredLatencyHistograms = AllocateLatencyHistograms();
+			}
+			else if (pRetiredLatencyHistograms->Generation.load(std::memory_order_relaxed) != LatencyGeneration.load(std::memory_order_relaxed)) {
+				ClearLatencyHistograms(pRetiredLatencyHistograms);
+				pRetiredLatencyHistograms->Generation.store(LatencyGeneration.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			}
+			if (pRetiredLatencyHistograms != NULL) {
+				MergeLatencyHistograms(pRetiredLatencyHistograms, pHistograms);
+			}
+		}
+
+		ReleaseSRWLockExclusive(&LatencyLock);
+
+		free(pHistograms);
+	}
+};
+
+// This thread's histograms
+static thread_local LATENCY_HISTOGRAMS_OWNER LatencyHistogramsOwner;
+
+// Record the latency of a phase in this thread's histograms, qwTicks is the difference of two TraceTimestamp values
+static void RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE phase, unsigned long long qwTicks)
+{
+	LATENCY_HISTOGRAMS* pHistograms;
+	unsigned long long qwNanoseconds;
+	unsigned long generation;
+
+	generation = LatencyGeneration.load(std::memory_order_relaxed);
+
+	// The first call registers the thread's histograms
+	pHistograms = LatencyHistogramsOwner.pHistograms;
+	if (pHistograms == NULL)
+	{
+		pHistograms = AllocateLatencyHistograms();
+		if (pHistograms == NULL) {
+			return;
+		}
+
+		AcquireSRWLockExclusive(&LatencyLock);
+		pHistograms->pNext = pLatencyHistograms;
+		pLatencyHistograms = pHistograms;
+		ReleaseSRWLockExclusive(&LatencyLock);
+
+		LatencyHistogramsOwner.pHistograms = pHistograms;
+	}
+	else if (pHistograms->Generation.load(std::memory_order_relaxed) != generation)
+	{
+		// The histograms were reset
+		ClearLatencyHistograms(pHistograms);
+		pHistograms->Generation.store(generation, std::memory_order_release);
+	}
+
+	qwNanoseconds = (unsigned long long)((double)qwTicks * LatencyNanosecondsPerTick);
+	RecordWebSocketLatency(&pHistograms->Phases[(int)phase], qwNanoseconds);
+}
+
+VOID IISWebSocketServer::EnableLatencyHistograms(BOOL bEnable)
+{
+	AcquireSRWLockExclusive(&LatencyLock);
+
+	// Measure the timestamp frequency once
+	if ((bEnable) && (LatencyNanosecondsPerTick == 0)) {
+		LatencyNanosecondsPerTick = 1000000000.0 / (double)TraceTimestampFrequency();
+	}
+
+	LatencyEnabled.store(bEnable ? true : false, std::memory_order_release);
+
+	ReleaseSRWLockExclusive(&LatencyLock);
+}
+
+VOID IISWebSocketServer::ResetLatencyHistograms()
+{
+	AcquireSRWLockExclusive(&LatencyLock);
+	LatencyGeneration.fetch_add(1, std::memory_order_release);
+	ReleaseSRWLockExclusive(&LatencyLock);
+}
+
+DWORD IISWebSocketServer::GetLatencySnapshot(IIS_WEB_SOCKET_LATENCY_SNAPSHOT* pSnapshot)
+{
+	LATENCY_HISTOGRAMS* pMerged;
+	LATENCY_HISTOGRAMS* pHistograms;
+	WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram;
+	IIS_WEB_SOCKET_LATENCY_PERCENTILES* pPercentiles;
+	unsigned long generation;
+	unsigned long long qwCount;
+
+	if (pSnapshot == NULL) {
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(pSnapshot, 0, sizeof(IIS_WEB_SOCKET_LATENCY_SNAPSHOT));
+
+	pMerged = AllocateLatencyHistograms();
+	if (pMerged == NULL) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	AcquireSRWLockShared(&LatencyLock);
+
+	// Merge the histograms of every thread, skipping any that haven't seen the last reset yet
+	generation = LatencyGeneration.load(std::memory_order_relaxed);
+	for (pHistograms = pLatencyHistograms; pHistograms != NULL; pHistograms = pHistograms->pNext)
+	{
+		if (pHistograms->Generation.load(std::memory_order_acquire) == generation) {
+			MergeLatencyHistograms(pMerged, pHistograms);
+		}
+	}
+	if ((pRetiredLatencyHistograms != NULL) && (pRetiredLatencyHistograms->Generation.load(std::memory_order_relaxed) == generation)) {
+		MergeLatencyHistograms(pMerged, pRetiredLatencyHistograms);
+	}
+
+	ReleaseSRWLockShared(&LatencyLock);
+
+	// Read the percentiles from the merged counts
+	for (int phase = 0; phase < IIS_WEB_SOCKET_LATENCY_PHASE_COUNT; phase++)
+	{
+		pHistogram = &pMerged->Phases[phase];
+		pPercentiles = &pSnapshot->Phases[phase];
+
+		qwCount = 0;
+		for (int i = 0; i < IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT; i++) {
+			qwCount += pHistogram->Counts[i].load(std::memory_order_relaxed);
+		}
+		if (qwCount == 0) {
+			continue;
+		}
+
+		pPercentiles->Count = qwCount;
+		pPercentiles->Min = pHistogram->Min.load(std::memory_order_relaxed);
+		pPercentiles->Max = pHistogram->Max.load(std::memory_order_relaxed);
+		pPercentiles->Mean = pHistogram->Sum.load(std::memory_order_relaxed) / qwCount;
+		pPercentiles->P50 = GetWebSocketLatencyPercentile(pHistogram, qwCount, 0.5);
+		pPercentiles->P99 = GetWebSocketLatencyPercentile(pHistogram, qwCount, 0.99);
+		pPercentiles->P999 = GetWebSocketLatencyPercentile(pHistogram, qwCount, 0.999);
+	}
+
+	free(pMerged);
+
+	return S_OK;
+}
+
+//
+// Inbound rate limiting
+//
+
+// Set while global rate limits are in place
+static std::atomic<bool> GlobalRateLimited;
+
+// The rate limiter shared by all connections
+static SRWLOCK GlobalRateLimitLock = SRWLOCK_INIT;
+static WEB_SOCKET_RATE_LIMITER GlobalRateLimiter;
+
+// Rate limiter and close deadline timestamps, the performance counter is consistent across processors
+static inline unsigned long long RateLimitTimestamp()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long)counter.QuadPart;
+}
+
+static unsigned long long RateLimitFrequency()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long long)frequency.QuadPart;
+}
+
+VOID IISWebSocketServer::SetGlobalRateLimits(const IIS_WEB_SOCKET_RATE_LIMITS* pLimits)
+{
+	AcquireSRWLockExclusive(&GlobalRateLimitLock);
+	InitializeRateLimiter(&GlobalRateLimiter, pLimits, RateLimitFrequency());
+	GlobalRateLimited.store(pLimits != NULL, std::memory_order_relaxed);
+	ReleaseSRWLockExclusive(&GlobalRateLimitLock);
+}
+
 DWORD WebSocketServer::Initialize()
 {
 	// Set class data to zero
 	memset(this, 0, sizeof(WebSocketServer));
 
+	// Everything the connection allocates is charged to its account, queued messages included
+	InitializeMemoryAccount(&this->MemoryAccount, this);
+	this->OutboundQueue.pAccount = &this->MemoryAccount;
+
+	// Create the send locks
+	InitializeCriticalSection(&this->MessageLock);
+	InitializeCriticalSection(&this->FrameLock);
+	InitializeCriticalSection(&this->QueueLock);
+	InitializeCriticalSection(&this->CloseLock);
+	InitializeConditionVariable(&this->StreamEnded);
+	InitializeConditionVariable(&this->FrameEnded);
+
 	// Set default error code
 	this->ErrorCode = S_OK;
 
+	// Give the connection a unique id
+	this->ConnectionId = NextConnectionId.fetch_add(1, std::memory_order_relaxed) + 1;
+
 	// We will be ready to start receiving frames
 	this->Stream.bQueuing = true;
 
 	// Set default max payload length of 4 GB (Gibibyte)
 	this->MaxPayloadLength = 0x400000;
 
+	// Flush after every Send by default, coalescing frames is opt-in
+	this->FlushPolicy = IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_IMMEDIATE_FLUSH_POLICY;
+	this->FlushThreshold = 0x4000;
+	this->FlushDelay = 200;
+
+	// Set default max reassembled message length of 4 MB, messages over 1 MB are reassembled in a temporary file
+	this->MaxMessageLength = 0x400000;
+	this->SpillThreshold = 0x100000;
+
+	// Set default max outgoing frame payload length of 64 KB, larger messages are fragmented
+	this->MaxFramePayloadLength = 0x10000;
+
+	// A client that stays over its rate limits for 10 seconds is closed
+	this->RateLimitCloseDelay = 10000;
+
+	// A client has 5 seconds to answer the server's close frame
+	this->CloseTimeout = 5000;
+
+	// No session until PerformHandshake starts or resumes one
+	this->Session.Slot = IIS_WEB_SOCKET_NO_SESSION;
+
+	// Queue up to 4 MB for a client that isn't keeping up, then disconnect it
+	this->MaxOutboundBytes = 0x400000;
+	this->OutboundPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY;
+
 	// Set the length of the description buffer
 	this->ErrorBufferLength = 0x1000;
 
-	this->Stream.pFrameBuffer = (CHAR*)malloc(0x100);
+	this->Stream.pFrameBuffer = (CHAR*)this->AllocateMemory(IIS_WEB_SOCKET_FRAME_BUFFER_SIZE);
 	if (this->Stream.pFrameBuffer == NULL) {
 		this->ErrorCode = ERROR_NOT_ENOUGH_MEMORY;
 		goto exit;
 	}
 
 	// Allocate memory for the description buffer
-	this->ErrorDescription = (CHAR*)malloc(this->ErrorBufferLength);
+	this->ErrorDescription = (CHAR*)this->AllocateMemory(this->ErrorBufferLength);
 	if (this->ErrorDescription == NULL) {
-		free(this->Stream.pFrameBuffer);
+		this->FreeMemory(this->Stream.pFrameBuffer, IIS_WEB_SOCKET_FRAME_BUFFER_SIZE);
+		this->Stream.pFrameBuffer = NULL;
 		this->ErrorCode = ERROR_NOT_ENOUGH_MEMORY;
 	}
 
@@ -109,6 +717,7 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	PCSTR pHeaderValuePointer;
 	USHORT headerValueLength;
 	CHAR* pHeaderValueBuffer;
+	bool bValidValue;
 
 	// Handle to generate the necessary headers for the handshake
 	WEB_SOCKET_HANDLE ServerHandle;
@@ -117,10 +726,17 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	WEB_SOCKET_HTTP_HEADER* pAdditionalHeaders;
 	ULONG AdditionalHeaderCount;
 
+	// The messages a resumed session missed
+	WEB_SOCKET_SESSION_REPLAY replay;
+	WEB_SOCKET_SESSION_MESSAGE replayMessage;
+	unsigned long long qwLastSequence;
+	CHAR sequence[24];
+
 	// Set default pointer values
 	pHeaderValueBuffer = NULL;
 	ServerHandle = NULL;
 	this->pRequestHeaders = NULL;
+	memset(&replay, 0, sizeof(replay));
 
 	// Default success code
 	errorCode = S_OK;
@@ -137,8 +753,8 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	}
 
 	// Create a buffer for the headers value
-	// NOTE: This is only for checking the value string
-	pHeaderValueBuffer = (CHAR*)malloc(0x1000);
+	// NOTE: This is only for printing an invalid value
+	pHeaderValueBuffer = (CHAR*)this->AllocateMemory(IIS_WEB_SOCKET_HEADER_VALUE_BUFFER_SIZE);
 	if (pHeaderValueBuffer == NULL) {
 		errorCode = ERROR_NOT_ENOUGH_MEMORY;
 		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::PerformHandshake()");
@@ -146,7 +762,7 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	}
 
 	// Create an array of WEB_SOCKET_HTTP_HEADER for our call to WebSocketBeginServerHandshake
-	this->pRequestHeaders = (WEB_SOCKET_HTTP_HEADER*)malloc(sizeof(WEB_SOCKET_HTTP_HEADER) * (ARRAYSIZE(requiredHeaders) + ARRAYSIZE(optionalHeaders)));
+	this->pRequestHeaders = (WEB_SOCKET_HTTP_HEADER*)this->AllocateMemory(IIS_WEB_SOCKET_REQUEST_HEADERS_SIZE);
 	if (this->pRequestHeaders == NULL) {
 		errorCode = ERROR_NOT_ENOUGH_MEMORY;
 		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::PerformHandshake()");
@@ -190,102 +806,43 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 			goto exit;
 		}
 
-		// Create a temporary NULL terminated version of the value
-		memcpy(pHeaderValueBuffer, pHeaderValuePointer, headerValueLength);
-		pHeaderValueBuffer[headerValueLength] = 0;
-
 		// Some clients may send a comma separated list for the 'Connection' header
 		// For example, Firefox sends the following "keep-alive, Upgrade"
-		if (_stricmp("Connection", requiredHeaders[i]) == 0)
-		{
-			// Set to true if 'Upgrade' is found
-			bool IsConnectionUpgrade = false;
-
-			// Allocate a buffer to create a NULL terminated string of each comma separated item
-			CHAR* pConnectionValueBuffer = (CHAR*)malloc(0x1000);
+		if (_stricmp("Connection", requiredHeaders[i]) == 0) {
+			bValidValue = WebSocketConnectionHasUpgrade(pHeaderValuePointer, headerValueLength);
+		}
+		else {
+			// Check the value is correct for the respective header
+			bValidValue = WebSocketHeaderValueEquals(pHeaderValuePointer, headerValueLength, requiredHeadersValues[i]);
+		}
 
-			// Set the initial parser pointer
-			CHAR* pValueSource = pHeaderValueBuffer;
+		if (bValidValue == false) {
+			errorCode = ERROR_INVALID_PARAMETER;
 
-			// Parse the string for each comma separated item
-		ParseConnectionValue:
+			// Create a temporary NULL terminated version of the value
+			memcpy(pHeaderValueBuffer, pHeaderValuePointer, headerValueLength);
+			pHeaderValueBuffer[headerValueLength] = 0;
 
-			// Skip spaces
-			while (*pValueSource == ' ') {
-				pValueSource++;
-			}
+			// Print header value on failure
+			sprintf_s(this->ErrorDescription, this->ErrorBufferLength, "%s%s%s%s%s",
+				"WebSocketServer::PerformHandshake() required header '",
+				requiredHeaders[i],
+				"' has an invalid value \"",
+				pHeaderValueBuffer,
+				"\".");
 
-			DWORD i = 0;
-			while ((*pValueSource != 0) && (*pValueSource != ','))
-			{
-				pConnectionValueBuffer[i] = *pValueSource;
-				pValueSource++;
-				i++;
-			}
+			goto exit;
+		}
 
-			// Set NULL character
-			pConnectionValueBuffer[i] = 0;
+		// Add the header to our array
+		this->pRequestHeaders[i].pcName = requiredHeaders[i];
+		this->pRequestHeaders[i].ulNameLength = (ULONG)strlen(requiredHeaders[i]);
+		this->pRequestHeaders[i].pcValue = (PCHAR)pHeaderValuePointer;
+		this->pRequestHeaders[i].ulValueLength = headerValueLength;
+	}
 
-			// Check for 'Upgrade' string
-			if (_stricmp("Upgrade", pConnectionValueBuffer) == 0) {
-				IsConnectionUpgrade = true;
-			}
-			else
-			{
-				// Are we done parsing?
-				if (*pValueSource != 0) {
-					if (*pValueSource == ',') {
-						pValueSource++;
-					}
-					goto ParseConnectionValue;
-				}
-			}
-
-			// Free the connection value buffer
-			free(pConnectionValueBuffer);
-
-			// We have finished parsing, check if the 'Upgrade' parameter was found
-			if (IsConnectionUpgrade == false) {
-				errorCode = ERROR_INVALID_PARAMETER;
-
-				// Print header value on failure
-				sprintf_s(this->ErrorDescription, this->ErrorBufferLength, "%s%s%s%s%s",
-					"WebSocketServer::PerformHandshake() required header '",
-					requiredHeaders[i],
-					"' has an invalid value \"",
-					pHeaderValueBuffer,
-					"\".");
-
-				goto exit;
-			}
-		}
-		else
-		{
-			// Check the value is correct for the respective header
-			if (_stricmp(pHeaderValueBuffer, requiredHeadersValues[i]) != 0) {
-				errorCode = ERROR_INVALID_PARAMETER;
-
-				// Print header value on failure
-				sprintf_s(this->ErrorDescription, this->ErrorBufferLength, "%s%s%s%s%s",
-					"WebSocketServer::PerformHandshake() required header '",
-					requiredHeaders[i],
-					"' has an invalid value \"",
-					pHeaderValueBuffer,
-					"\".");
-
-				goto exit;
-			}
-		}
-
-		// Add the header to our array
-		this->pRequestHeaders[i].pcName = requiredHeaders[i];
-		this->pRequestHeaders[i].ulNameLength = (ULONG)strlen(requiredHeaders[i]);
-		this->pRequestHeaders[i].pcValue = (PCHAR)pHeaderValuePointer;
-		this->pRequestHeaders[i].ulValueLength = headerValueLength;
-	}
-
-	// Set the count to (required headers)
-	this->RequestHeadersCount = ARRAYSIZE(requiredHeaders);
+	// Set the count to (required headers)
+	this->RequestHeadersCount = ARRAYSIZE(requiredHeaders);
 
 	// Get the optional headers and their values
 	for (int i = 0; i < ARRAYSIZE(optionalHeaders); i++)
@@ -337,6 +894,16 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	// Add the clients headers to our response
 	for (ULONG i = 0; i < this->RequestHeadersCount; i++)
 	{
+		// Answer a client that offers the channel protocol with just that protocol
+		if ((this->AcceptChannels) && (_stricmp(this->pRequestHeaders[i].pcName, "Sec-WebSocket-Protocol") == 0) &&
+			(WebSocketHeaderHasToken(this->pRequestHeaders[i].pcValue, this->pRequestHeaders[i].ulValueLength, IIS_WEB_SOCKET_CHANNEL_PROTOCOL)))
+		{
+			this->pHttpResponse->SetHeader(this->pRequestHeaders[i].pcName,
+				IIS_WEB_SOCKET_CHANNEL_PROTOCOL, (USHORT)strlen(IIS_WEB_SOCKET_CHANNEL_PROTOCOL), TRUE);
+			this->ChannelsNegotiated = TRUE;
+			continue;
+		}
+
 		this->pHttpResponse->SetHeader(this->pRequestHeaders[i].pcName,
 			this->pRequestHeaders[i].pcValue, (USHORT)this->pRequestHeaders[i].ulValueLength, TRUE);
 	}
@@ -348,6 +915,36 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 			pAdditionalHeaders[i].pcValue, (USHORT)pAdditionalHeaders[i].ulValueLength, TRUE);
 	}
 
+	// Resume the client's session from the last message it received, or start a new one
+	if (this->pSessions != NULL)
+	{
+		qwLastSequence = 0;
+		pHeaderValuePointer = this->pHttpRequest->GetHeader(IIS_WEB_SOCKET_SESSION_SEQUENCE_HEADER, &headerValueLength);
+		if ((pHeaderValuePointer != NULL) && (headerValueLength != 0) && (headerValueLength < 0x1000)) {
+			memcpy(pHeaderValueBuffer, pHeaderValuePointer, headerValueLength);
+			pHeaderValueBuffer[headerValueLength] = 0;
+			qwLastSequence = _strtoui64(pHeaderValueBuffer, NULL, 10);
+		}
+		pHeaderValuePointer = this->pHttpRequest->GetHeader(IIS_WEB_SOCKET_SESSION_HEADER, &headerValueLength);
+		if ((pHeaderValuePointer != NULL) && (headerValueLength != 0)) {
+			this->pSessions->Resume(pHeaderValuePointer, headerValueLength, qwLastSequence, &this->Session, &replay);
+		}
+
+		// A client whose session can't be resumed gets a new one and starts over
+		if (this->Session.Slot == IIS_WEB_SOCKET_NO_SESSION) {
+			this->pSessions->Create(&this->Session);
+		}
+
+		// The client counts the messages it receives from the sequence in the response
+		if (this->Session.Slot != IIS_WEB_SOCKET_NO_SESSION)
+		{
+			this->pHttpResponse->SetHeader(IIS_WEB_SOCKET_SESSION_HEADER, this->Session.Token, IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH, TRUE);
+			sprintf_s(sequence, sizeof(sequence), "%llu", this->Session.qwFirstSequence);
+			this->pHttpResponse->SetHeader(IIS_WEB_SOCKET_SESSION_SEQUENCE_HEADER, sequence, (USHORT)strlen(sequence), TRUE);
+			this->SessionResumed = this->Session.bResumed;
+		}
+	}
+
 	// Number of bytes sent to the client
 	DWORD cbSent = 0;
 
@@ -363,12 +960,28 @@ HRESULT WebSocketServer::PerformHandshake(IHttpContext* pHttpContext)
 	// Disbale buffering
 	this->pHttpResponse->DisableBuffering();
 
+	// Send the messages the client missed before anything new, they're already in the log
+	if (errorCode == S_OK)
+	{
+		this->bSessionReplay = TRUE;
+		while (NextSessionReplayMessage(&replay, &replayMessage))
+		{
+			errorCode = this->Send(replayMessage.BufferType, (void*)replayMessage.pData, replayMessage.qwLength);
+			if (errorCode != S_OK) {
+				break;
+			}
+		}
+		this->bSessionReplay = FALSE;
+	}
+
 exit:
 
+	FreeSessionReplay(&replay);
+
 	// Free resources and return the error code
 
 	if (pHeaderValueBuffer) {
-		free(pHeaderValueBuffer);
+		this->FreeMemory(pHeaderValueBuffer, IIS_WEB_SOCKET_HEADER_VALUE_BUFFER_SIZE);
 	}
 
 	if (ServerHandle) {
@@ -379,7 +992,7 @@ exit:
 	if (errorCode != S_OK)
 	{
 		if (this->pRequestHeaders) {
-			free(this->pRequestHeaders);
+			this->FreeMemory(this->pRequestHeaders, IIS_WEB_SOCKET_REQUEST_HEADERS_SIZE);
 			this->pRequestHeaders = NULL;
 		}
 	}
@@ -391,92 +1004,61 @@ exit:
 	return errorCode;
 }
 
-bool ParseWebSocketFrame(UCHAR* pBuffer, DWORD dwLength, WEB_SOCKET_FRAME* pOutFrame)
+unsigned long WebSocketServer::ReadCallback(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
 {
-	// Minimal size is 2 bytes for a WebSocket frame
-	pOutFrame->FrameSize = 2;
-	if (dwLength < 2) {
-		return false;
-	}
-
-	// Get the Opcode and FIN from the 1st byte
-	pOutFrame->Opcode = pBuffer[0] & 0x0F;
-	pOutFrame->FIN = pBuffer[0] & 0x80;
-
-	// Get the Payload length and Mask boolean from the 2nd byte
-	unsigned long long payloadLength = pBuffer[1] & 0x7F;
-	pOutFrame->bMask = pBuffer[1] & 0x80;
-
-	// Calculate the size of the full WebSocket frame
-	if (pOutFrame->bMask) {
-		pOutFrame->FrameSize += 4;
-	}
-	if (payloadLength == 126) {
-		pOutFrame->FrameSize += 2;
-	}
-	else if (payloadLength == 127) {
-		pOutFrame->FrameSize += 8;
-	}
+	WebSocketServer* pWebSocketServer;
+	HRESULT errorCode;
+	BOOL fCompletionPending;
 
-	// Return false if the buffer doesn't contain all of the frame
-	if (dwLength < pOutFrame->FrameSize) {
-		return false;
-	}
+	pWebSocketServer = (WebSocketServer*)pContext;
 
-	// This will be our index to get the masking key
-	int maskingKeyIndex = 2;
+	// Reset parameters
+	*pdwBytesRead = 0;
+	fCompletionPending = FALSE;
 
-	// Get the actual Payload length and Masking key index
-	if (payloadLength == 126)
-	{
-		// Payload length is stored in the next 2 bytes
-		payloadLength = ((unsigned long long)pBuffer[2] << 8) + pBuffer[3];
-		maskingKeyIndex = 4;
-	}
-	else if (payloadLength == 127)
-	{
-		// Payload length is stored in the next 8 bytes
-		payloadLength =
-			((unsigned long long)pBuffer[2] << 56) +
-			((unsigned long long)pBuffer[3] << 48) +
-			((unsigned long long)pBuffer[4] << 40) +
-			((unsigned long long)pBuffer[5] << 32) +
-			((unsigned long long)pBuffer[6] << 24) +
-			((unsigned long long)pBuffer[7] << 16) +
-			((unsigned long long)pBuffer[8] << 8) +
-			(unsigned long long)pBuffer[9];
-		maskingKeyIndex = 10;
+	// Receive data
+	errorCode = pWebSocketServer->pHttpRequest->ReadEntityBody(pBuffer, dwLength, FALSE, pdwBytesRead, &fCompletionPending);
+	if ((errorCode != S_OK) && (HRESULT_CODE(errorCode) != ERROR_MORE_DATA) && (HRESULT_CODE(errorCode) != ERROR_HANDLE_EOF)) {
+		PrintLastError(errorCode, pWebSocketServer->ErrorDescription, pWebSocketServer->ErrorBufferLength, "ReadEntityBody()");
+		pWebSocketServer->ErrorCode = errorCode;
+		return errorCode;
 	}
 
-	// Set the Payload length
-	pOutFrame->PayloadLength = payloadLength;
-
-	// Read the Masking key
-	if (pOutFrame->bMask)
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			pOutFrame->MaskingKey[i] = pBuffer[maskingKeyIndex + i];
-		}
+	// Record the chunk exactly as ReadEntityBody returned it
+	if (pWebSocketServer->hCaptureFile != NULL) {
+		pWebSocketServer->WriteCapture(pBuffer, *pdwBytesRead);
 	}
 
-	// We have parsed the full frame
-	return true;
+	// ERROR_MORE_DATA and ERROR_HANDLE_EOF aren't failures
+	return S_OK;
 }
 
 DWORD WebSocketServer::Receive(void* pBuffer, DWORD dwBufferLength, DWORD* pdwBytesReceived, IIS_WEB_SOCKET_BUFFER_TYPE* pBufferType)
 {
 	DWORD errorCode;
-	DWORD dwBytesReceived;
-	BOOL fCompletionPending;
-	DWORD dwMaxReceive;
+	bool bLatency;
+	bool bMessageComplete;
+	WEB_SOCKET_RECEIVE_TIMING timing;
+	IIS_WEB_SOCKET_RECEIVE_RESULT result;
+	unsigned long long qwNow;
+	unsigned long long qwFrequency;
+	BOOL bClosed;
+	BOOL bTimedOut;
+	bool bReply;
+	UCHAR closeReply[2];
+	unsigned long dwCloseReplyLength;
 
 	// Set success
 	errorCode = S_OK;
 
-	// Set defaults
-	dwBytesReceived = 0;
-	fCompletionPending = FALSE;
+	// Time the phases when the latency histograms are on, the application had the last message until now
+	bLatency = LatencyEnabled.load(std::memory_order_relaxed);
+	if (this->DispatchTimestamp != 0) {
+		if (bLatency) {
+			RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_DISPATCH_LATENCY_PHASE, TraceTimestamp() - this->DispatchTimestamp);
+		}
+		this->DispatchTimestamp = 0;
+	}
 
 	// pBuffer, pdwBytesReceived and pBufferType must be valid pointers
 	if ((pBuffer == NULL) || (pdwBytesReceived == NULL) || (pBufferType == NULL)) {
@@ -485,188 +1067,114 @@ DWORD WebSocketServer::Receive(void* pBuffer, DWORD dwBufferLength, DWORD* pdwBy
 		goto exit;
 	}
 
-	// Ensure *pdwBytesReceived = 0
-	*pdwBytesReceived = 0;
+	// Nothing more is read once the closing handshake is done
+	EnterCriticalSection(&this->CloseLock);
+	bClosed = (this->CloseHandshake.State == IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE);
+	bTimedOut = this->CloseHandshake.bTimedOut;
+	LeaveCriticalSection(&this->CloseLock);
+	if (bClosed) {
+		errorCode = bTimedOut ? ERROR_TIMEOUT : ERROR_GRACEFUL_DISCONNECT;
+		strcpy_s(this->ErrorDescription, this->ErrorBufferLength, bTimedOut ?
+			"The client didn't answer the close frame within `CloseTimeout`, the connection was aborted" : "The closing handshake is complete");
+		goto exit;
+	}
 
-	// Are we queuing a new frame?
-	if (this->Stream.bQueuing)
+	// Stop reading until the rate limits allow more, the client is held back by TCP flow control meanwhile
+	// A pause under a millisecond is carried by the token buckets until it adds up
+	if (this->qwRateLimitResume != 0)
 	{
-		// Reset dwReceivedSize
-		this->Stream.dwReceivedSize = 0;
-
-		// Parse the frame
-		while (!ParseWebSocketFrame((UCHAR*)this->Stream.pFrameBuffer, this->Stream.dwReceivedSize, &this->WebSocketFrame))
-		{
-			// Reset parameters
-			dwBytesReceived = 0;
-			fCompletionPending = FALSE;
-
-			// Receive data
-			errorCode = this->pHttpRequest->ReadEntityBody(this->Stream.pFrameBuffer + this->Stream.dwReceivedSize, this->WebSocketFrame.FrameSize - this->Stream.dwReceivedSize, FALSE, &dwBytesReceived, &fCompletionPending);
-			if ((errorCode != S_OK) && (HRESULT_CODE(errorCode) != ERROR_MORE_DATA) && (HRESULT_CODE(errorCode) != ERROR_HANDLE_EOF)) {
-				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "ReadEntityBody() 'WebSocket frame'");
-				goto exit;
-			}
-
-			// Reset error code because it could be ERROR_MORE_DATA or ERROR_HANDLE_EOF
-			errorCode = S_OK;
-
-			// Add bytes received to our total
-			this->Stream.dwReceivedSize += dwBytesReceived;
-		}
-
-		// Check if the payload will exceed the maximum length set by the server
-		if (this->WebSocketFrame.PayloadLength > this->MaxPayloadLength) {
-			errorCode = ERROR_INVALID_BLOCK_LENGTH;
-			strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "Received WebSocket `PayloadLength` exceeded `MaxPayloadLength`");
-			goto exit;
+		qwNow = RateLimitTimestamp();
+		qwFrequency = RateLimitFrequency();
+		if ((qwNow < this->qwRateLimitResume) && ((this->qwRateLimitResume - qwNow) * 1000 >= qwFrequency)) {
+			Sleep((DWORD)((this->qwRateLimitResume - qwNow) * 1000 / qwFrequency));
 		}
-
-		// Reset parameters
-		dwBytesReceived = 0;
-		fCompletionPending = FALSE;
-
-		// Setup our stream parameters
-		this->Stream.qwPayloadRemaining = this->WebSocketFrame.PayloadLength;
-
-		// Reset masking key index
-		this->Stream.mkI = 0;
-
-		// Set queuing to false until payload is received and transferred
-		this->Stream.bQueuing = false;
+		this->qwRateLimitResume = 0;
 	}
 
-receiveLoop: // Only used for "Connection close", "Ping" and "Pong" frames
-
-	// Determine the max amount to receive (so we dont receive any of the next frame)
-	if (this->Stream.qwPayloadRemaining < dwBufferLength) {
-		dwMaxReceive = (DWORD)this->Stream.qwPayloadRemaining;
+	// Parse, receive and unmask with the protocol core, reading from the request entity body
+	timing.pfnTimestamp = bLatency ? TraceTimestamp : NULL;
+	result = ReceiveWebSocketData(&this->Stream, &this->WebSocketFrame, this->MaxPayloadLength, ReadCallback, this,
+		pBuffer, dwBufferLength, pdwBytesReceived, pBufferType, &timing);
+	if (result == IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_READ_FAILED_RECEIVE_RESULT) {
+		// ReadCallback has set the error code and description, unless the close timer aborted the read
+		errorCode = this->ErrorCode;
+		EnterCriticalSection(&this->CloseLock);
+		bTimedOut = this->CloseHandshake.bTimedOut;
+		LeaveCriticalSection(&this->CloseLock);
+		if (bTimedOut) {
+			errorCode = ERROR_TIMEOUT;
+			strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "The client didn't answer the close frame within `CloseTimeout`, the connection was aborted");
+		}
+		goto exit;
 	}
-	else {
-		dwMaxReceive = dwBufferLength;
+	else if (result == IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_PAYLOAD_TOO_LARGE_RECEIVE_RESULT) {
+		errorCode = ERROR_INVALID_BLOCK_LENGTH;
+		strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "Received WebSocket `PayloadLength` exceeded `MaxPayloadLength`");
+		goto exit;
 	}
-
-	// Receive payload
-	errorCode = this->pHttpRequest->ReadEntityBody((CHAR*)pBuffer + *pdwBytesReceived, dwMaxReceive, FALSE, &dwBytesReceived, &fCompletionPending);
-	if ((errorCode != S_OK) && (HRESULT_CODE(errorCode) != ERROR_MORE_DATA) && (HRESULT_CODE(errorCode) != ERROR_HANDLE_EOF)) {
-		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "ReadEntityBody() 'WebSocket payload'");
+	else if (result == IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_BUFFER_TOO_SMALL_RECEIVE_RESULT) {
+		errorCode = ERROR_NOT_ENOUGH_MEMORY;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Receive() 'Connection close, Ping, Pong'");
 		goto exit;
 	}
+	else if (result == IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_RECEIVE_RESULT) {
+		// Fail the connection, nothing after the invalid header can be parsed
+		IIS_WEB_SOCKET_CLOSE_DATA closeData(IIS_WEB_SOCKET_CLOSE_STATUS::IIS_WEB_SOCKET_PROTOCOL_ERROR_CLOSE_STATUS, (CHAR*)GetWebSocketFrameViolationReason(this->WebSocketFrame.Violation));
+		this->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, &closeData, closeData.length());
 
-	// Reset error code because it could be ERROR_MORE_DATA or ERROR_HANDLE_EOF
-	errorCode = S_OK;
-
-	// Check if we should have received payload data
-	if ((dwBytesReceived == 0) && (this->Stream.qwPayloadRemaining != 0)) {
-		goto receiveLoop;
+		errorCode = ERROR_INVALID_DATA;
+		sprintf_s(this->ErrorDescription, this->ErrorBufferLength, "Received a WebSocket frame that violates the protocol: %s", closeData.reason);
+		goto exit;
 	}
 
-	// Adjust payload remaining
-	this->Stream.qwPayloadRemaining -= dwBytesReceived;
+	// A message is complete when the last frame of a data message or a control frame has been received
+	bMessageComplete = (this->Stream.bQueuing) &&
+		(*pBufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE) &&
+		(*pBufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE);
 
-	// Set bytes received for the transfer
-	*pdwBytesReceived += dwBytesReceived;
-
-	// Are we done with this payload?
-	if (this->Stream.qwPayloadRemaining != 0)
+	// Record the phases, and start the dispatch phase when a message is complete
+	if (bLatency)
 	{
-		// This is a fragment because we haven't finished receiving the payload
-		if (this->WebSocketFrame.Opcode == 0x01) {
-			*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+		RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_READ_WAIT_LATENCY_PHASE, timing.qwReadWait);
+		if (timing.bNewFrame) {
+			RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_PARSE_LATENCY_PHASE, timing.qwParse);
 		}
-		else if (this->WebSocketFrame.Opcode == 0x02) {
-			*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+		if (this->WebSocketFrame.bMask) {
+			RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_UNMASK_LATENCY_PHASE, timing.qwUnmask);
 		}
-		else if ((this->WebSocketFrame.Opcode == 0x08) || (this->WebSocketFrame.Opcode == 0x09) || (this->WebSocketFrame.Opcode == 0x0A)) {
-			// "Connection close", "Ping" and "Pong" must be received in a single buffer
-			if (*pdwBytesReceived != dwBufferLength) {
-				goto receiveLoop;
-			}
-			else {
-				errorCode = ERROR_NOT_ENOUGH_MEMORY;
-				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Receive() 'Connection close, Ping, Pong'");
-				goto exit;
-			}
+		if (bMessageComplete) {
+			this->DispatchTimestamp = TraceTimestamp();
 		}
+	}
 
-		// Could be a "Continuation frame", we assume `*pBufferType` has already been set
+	// Trace the frame
+	if ((timing.bNewFrame) && (TraceEnabled.load(std::memory_order_relaxed))) {
+		TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_INBOUND, (UCHAR)this->WebSocketFrame.Opcode, this->WebSocketFrame.FIN,
+			this->WebSocketFrame.PayloadLength, this->WebSocketFrame.FrameSize, pBuffer, *pdwBytesReceived);
 	}
-	else
+
+	// Answer a close frame with its status code, or end the handshake the server started
+	if (*pBufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE)
 	{
-		// This could be a fragment, or the end of the message
-		if (this->WebSocketFrame.FIN)
-		{
-			// This is the final fragment in a message
-			if (this->WebSocketFrame.Opcode == 0x00) {
-				// "Continuation frame"
-				if (*pBufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE) {
-					*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
-				}
-				else if (*pBufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE) {
-					*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
-				}
-			}
-			else if (this->WebSocketFrame.Opcode == 0x01) {
-				// "Text frame"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x02) {
-				// "Binary frame"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x08) {
-				// "Connection close"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x09) {
-				// "Ping"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x0A) {
-				// "Pong"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
-			}
-		}
-		else
-		{
-			// This is a fragment of a message
-			if (this->WebSocketFrame.Opcode == 0x00) {
-				// "Continuation frame"
-				// ... Do nothing!
-			}
-			else if (this->WebSocketFrame.Opcode == 0x01) {
-				// "Text frame"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x02) {
-				// "Binary frame"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x08) {
-				// "Connection close"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x09) {
-				// "Ping"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE;
-			}
-			else if (this->WebSocketFrame.Opcode == 0x0A) {
-				// "Pong"
-				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
-			}
+		EnterCriticalSection(&this->CloseLock);
+		bReply = ReceiveWebSocketClose(&this->CloseHandshake, pBuffer, *pdwBytesReceived, closeReply, &dwCloseReplyLength);
+		if ((!bReply) && (this->pCloseTimer != NULL)) {
+			// Not waited for, the callback takes the close lock and finds nothing to do
+			SetThreadpoolTimer(this->pCloseTimer, NULL, 0, 0);
 		}
+		LeaveCriticalSection(&this->CloseLock);
 
-		// We need to get a new frame on the next call
-		this->Stream.bQueuing = true;
+		// The close is returned either way, a client that's already gone can't be answered
+		// Inside a frame of declared length the reply is refused, the application sends it after EndMessage
+		if (bReply) {
+			this->SendControl(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, closeReply, dwCloseReplyLength);
+		}
 	}
 
-	// Unmask the payload data if necessary
-	if (this->WebSocketFrame.bMask)
-	{
-		for (unsigned long long i = 0; i < *pdwBytesReceived; i++)
-		{
-			((CHAR*)pBuffer)[i] ^= this->WebSocketFrame.MaskingKey[this->Stream.mkI++ % 4];
-		}
+	// Charge the frame header and payload to the rate limits
+	if ((this->bRateLimited) || (GlobalRateLimited.load(std::memory_order_relaxed))) {
+		errorCode = this->ChargeRateLimits(timing.bNewFrame ? 1 : 0,
+			*pdwBytesReceived + (timing.bNewFrame ? this->WebSocketFrame.FrameSize : 0), bMessageComplete ? 1 : 0);
 	}
 
 exit:
@@ -678,195 +1186,1990 @@ exit:
 	return errorCode;
 }
 
-DWORD WebSocketServer::Send(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, DWORD dwLength)
+VOID WebSocketServer::SetRateLimits(const IIS_WEB_SOCKET_RATE_LIMITS* pLimits)
+{
+	InitializeRateLimiter(&this->RateLimiter, pLimits, RateLimitFrequency());
+	this->bRateLimited = (pLimits != NULL);
+	this->qwRateLimitResume = 0;
+}
+
+void* WebSocketServer::AllocateMemory(size_t size)
+{
+	void* pMemory;
+
+	if (!ChargeMemory(&this->MemoryAccount, size)) {
+		return NULL;
+	}
+	pMemory = malloc(size);
+	if (pMemory == NULL) {
+		ReleaseMemory(&this->MemoryAccount, size);
+	}
+
+	return pMemory;
+}
+
+VOID WebSocketServer::FreeMemory(void* pMemory, size_t size)
+{
+	free(pMemory);
+	ReleaseMemory(&this->MemoryAccount, size);
+}
+
+VOID WebSocketServer::SetMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget)
+{
+	SetMemoryAccountBudget(&this->MemoryAccount, pBudget);
+}
+
+VOID WebSocketServer::GetMemoryStats(IIS_WEB_SOCKET_MEMORY_STATS* pStats)
+{
+	IISWebSocketServer::GetMemoryStats(&this->MemoryAccount, pStats);
+}
+
+DWORD WebSocketServer::ChargeRateLimits(unsigned long long qwFrames, unsigned long long qwBytes, unsigned long long qwMessages)
 {
 	DWORD errorCode;
-	DWORD dwFrameLength;
-	DWORD dwBufferSize;
-	UCHAR* pFrameBuffer;
-	DWORD dwBytesSent;
-	BOOL fCompletionExpected;
-	DWORD dwTotalBytesSent;
-	HTTP_DATA_CHUNK dataChunk;
+	unsigned long long qwNow;
+	unsigned long long qwPause;
+	unsigned long long qwGlobalPause;
 
 	// Set success
 	errorCode = S_OK;
 
-	// Clear the response
-	pHttpResponse->Clear();
+	qwNow = RateLimitTimestamp();
+	qwPause = 0;
 
-	// Determine the frame & buffer size in bytes
-	if (dwLength <= 125) {
-		dwFrameLength = 2;
-	}
-	else if (dwLength <= 65535) {
-		dwFrameLength = 4;
-	}
-	else {
-		dwFrameLength = 10;
-	}
-	dwBufferSize = dwFrameLength + dwLength;
+	if (this->bRateLimited)
+	{
+		qwPause = ChargeRateLimiter(&this->RateLimiter, qwNow, qwFrames, qwBytes, qwMessages);
 
-	// Allocate memory for the frame & payload
-	pFrameBuffer = (UCHAR*)malloc(dwBufferSize);
-	if (pFrameBuffer == NULL) {
-		errorCode = ERROR_NOT_ENOUGH_MEMORY;
-		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send()");
-		goto exit;
-	}
+		// Close a client that keeps sending over its own limits, being held back by the global limits doesn't count
+		if ((this->RateLimiter.qwOverLimitSince != 0) && (this->RateLimitCloseDelay != 0) &&
+			((qwNow - this->RateLimiter.qwOverLimitSince) * 1000 > (unsigned long long)this->RateLimitCloseDelay * RateLimitFrequency()))
+		{
+			IIS_WEB_SOCKET_CLOSE_DATA closeData(IIS_WEB_SOCKET_CLOSE_STATUS::IIS_WEB_SOCKET_POLICY_VIOLATION_CLOSE_STATUS, "Rate limit exceeded");
+			this->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, &closeData, closeData.length());
 
-	// Set FIN and Opcode in the frame
-	switch (bufferType)
-	{
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
-		if (this->IsFragment) {
-			pFrameBuffer[0] = 0x80; // End of multi frame message
-		}
-		else {
-			pFrameBuffer[0] = 0x81; // A single frame message
-		}
-		this->IsFragment = FALSE;
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE:
-		if (this->IsFragment) {
-			pFrameBuffer[0] = 0x00; // Continuation frame
-		}
-		else {
-			pFrameBuffer[0] = 0x01; // Start of multi frame message
-			this->IsFragment = TRUE;
-		}
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE:
-		if (this->IsFragment) {
-			pFrameBuffer[0] = 0x80; // End of multi frame data
-		}
-		else {
-			pFrameBuffer[0] = 0x82; // A single frame of data
-		}
-		this->IsFragment = FALSE;
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE:
-		if (this->IsFragment) {
-			pFrameBuffer[0] = 0x00; // Continuation frame
-		}
-		else {
-			pFrameBuffer[0] = 0x02; // Start of multi frame data
-			this->IsFragment = TRUE;
+			errorCode = ERROR_CONNECTION_ABORTED;
+			strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "The client exceeded its rate limits for longer than `RateLimitCloseDelay`, the connection was closed");
+			return errorCode;
 		}
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE:
-		pFrameBuffer[0] = 0x88;
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE:
-		pFrameBuffer[0] = 0x89;
-		break;
-	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE:
-		pFrameBuffer[0] = 0x8A;
-		break;
-	default:
-		errorCode = ERROR_INVALID_PARAMETER;
-		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send 'bufferType'");
-		goto exit;
 	}
 
-	// Set the payload length
-	if (dwLength <= 125)
+	if (GlobalRateLimited.load(std::memory_order_relaxed))
 	{
-		if (dwBufferSize >= 2) {
-			pFrameBuffer[1] = (UCHAR)dwLength;
+		AcquireSRWLockExclusive(&GlobalRateLimitLock);
+		qwGlobalPause = ChargeRateLimiter(&GlobalRateLimiter, qwNow, qwFrames, qwBytes, qwMessages);
+		ReleaseSRWLockExclusive(&GlobalRateLimitLock);
+		if (qwGlobalPause > qwPause) {
+			qwPause = qwGlobalPause;
 		}
 	}
-	else if (dwLength <= 65535)
-	{
-		if (dwBufferSize >= 4) {
-			pFrameBuffer[1] = 126;
-			pFrameBuffer[2] = (dwLength >> 8) & 0xFF;
-			pFrameBuffer[3] = dwLength & 0xFF;
-		}
+
+	// The next Receive waits before reading
+	if (qwPause != 0) {
+		this->qwRateLimitResume = qwNow + qwPause;
 	}
-	else
+
+	return errorCode;
+}
+
+// The size of the buffer capture records are collected in before they're written to the file
+#define IIS_WEB_SOCKET_CAPTURE_BUFFER_SIZE 0x10000
+
+DWORD WebSocketServer::FlushCapture()
+{
+	DWORD dwBytesWritten;
+
+	if ((this->dwCaptureLength != 0) &&
+		(!WriteFile(this->hCaptureFile, this->pCaptureBuffer, this->dwCaptureLength, &dwBytesWritten, NULL))) {
+		return GetLastError();
+	}
+	this->dwCaptureLength = 0;
+
+	return S_OK;
+}
+
+VOID WebSocketServer::WriteCapture(void* pChunk, DWORD dwLength)
+{
+	DWORD dwBytesWritten;
+
+	// Make room for the record, a chunk that doesn't fit in the buffer is written on its own
+	if (this->dwCaptureLength + sizeof(DWORD) + dwLength > IIS_WEB_SOCKET_CAPTURE_BUFFER_SIZE)
 	{
-		if (dwBufferSize >= 10) {
-			pFrameBuffer[1] = 127;
-			pFrameBuffer[2] = 0;
-			pFrameBuffer[3] = 0;
-			pFrameBuffer[4] = 0;
-			pFrameBuffer[5] = 0;
-			pFrameBuffer[6] = (dwLength >> 24) & 0xFF;
-			pFrameBuffer[7] = (dwLength >> 16) & 0xFF;
-			pFrameBuffer[8] = (dwLength >> 8) & 0xFF;
-			pFrameBuffer[9] = dwLength & 0xFF;
+		if (this->FlushCapture() != S_OK) {
+			this->StopCapture();
+			return;
+		}
+		if (sizeof(DWORD) + dwLength > IIS_WEB_SOCKET_CAPTURE_BUFFER_SIZE)
+		{
+			if ((!WriteFile(this->hCaptureFile, &dwLength, sizeof(DWORD), &dwBytesWritten, NULL)) ||
+				(!WriteFile(this->hCaptureFile, pChunk, dwLength, &dwBytesWritten, NULL))) {
+				this->StopCapture();
+			}
+			return;
 		}
 	}
 
-	// Append the payload to the frame
-	memcpy(pFrameBuffer + dwFrameLength, pBuffer, (size_t)dwLength);
+	// The chunk length, followed by the chunk
+	memcpy(this->pCaptureBuffer + this->dwCaptureLength, &dwLength, sizeof(DWORD));
+	memcpy(this->pCaptureBuffer + this->dwCaptureLength + sizeof(DWORD), pChunk, dwLength);
+	this->dwCaptureLength += sizeof(DWORD) + dwLength;
+}
 
-	// Set parameters
-	dwBytesSent = 0;
-	fCompletionExpected = FALSE;
-	dwTotalBytesSent = 0;
+DWORD WebSocketServer::StartCapture(const WCHAR* pFilePath)
+{
+	DWORD errorCode;
+	DWORD dwBytesWritten;
+	IIS_WEB_SOCKET_CAPTURE_FILE_HEADER header;
 
-	// Write chunks until all data has been written
-	while (dwTotalBytesSent < dwBufferSize)
-	{
-		// Setup chunk
-		dataChunk.DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory;
-		dataChunk.FromMemory.pBuffer = pFrameBuffer + dwTotalBytesSent;
-		dataChunk.FromMemory.BufferLength = dwBufferSize - dwTotalBytesSent;
+	// Set success
+	errorCode = S_OK;
 
-		// Write chunk
-		errorCode = pHttpResponse->WriteEntityChunks(&dataChunk, 1, FALSE, TRUE, &dwBytesSent, &fCompletionExpected);
-		if (errorCode != S_OK) {
-			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WriteEntityChunks()");
-			goto exit;
-		}
+	if (pFilePath == NULL) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::StartCapture() 'input paramter'");
+		goto exit;
+	}
 
-		// Increase total bytes sent
-		dwTotalBytesSent += dwBytesSent;
+	// A capture must start at a frame boundary to be replayed
+	if ((this->hCaptureFile != NULL) || (!this->Stream.bQueuing)) {
+		errorCode = ERROR_INVALID_OPERATION;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::StartCapture()");
+		goto exit;
+	}
 
-		// Reset parameters
-		dwBytesSent = 0;
-		fCompletionExpected = FALSE;
+	this->pCaptureBuffer = (UCHAR*)this->AllocateMemory(IIS_WEB_SOCKET_CAPTURE_BUFFER_SIZE);
+	if (this->pCaptureBuffer == NULL) {
+		errorCode = ERROR_NOT_ENOUGH_MEMORY;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::StartCapture()");
+		goto exit;
 	}
 
-	// Flush response
-	errorCode = pHttpResponse->Flush(FALSE, TRUE, &dwBytesSent, &fCompletionExpected);
-	if (errorCode != S_OK) {
-		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "Flush()");
+	this->hCaptureFile = CreateFile(pFilePath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (this->hCaptureFile == INVALID_HANDLE_VALUE) {
+		this->hCaptureFile = NULL;
+		errorCode = GetLastError();
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "CreateFile() 'capture file'");
 		goto exit;
 	}
 
+	// Write the file header
+	memset(&header, 0, sizeof(header));
+	header.Magic = IIS_WEB_SOCKET_CAPTURE_MAGIC;
+	header.Version = IIS_WEB_SOCKET_CAPTURE_VERSION;
+	header.ConnectionId = this->ConnectionId;
+	header.MaxPayloadLength = this->MaxPayloadLength;
+	if (!WriteFile(this->hCaptureFile, &header, sizeof(header), &dwBytesWritten, NULL)) {
+		errorCode = GetLastError();
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WriteFile() 'capture file'");
+		goto exit;
+	}
+
+	this->dwCaptureLength = 0;
+
 exit:
 
-	// Free resources
-	if (pFrameBuffer) {
-		free(pFrameBuffer);
+	if (errorCode != S_OK) {
+		this->StopCapture();
 	}
 
-	// Set class error code
-	this->ErrorCode = errorCode;
-
-	// Return error code
 	return errorCode;
 }
 
-BOOL WebSocketServer::IsConnected()
-{
-	return this->pHttpConnection->IsConnected();
-}
-
-VOID WebSocketServer::Free()
+VOID WebSocketServer::StopCapture()
 {
-	if (this->Stream.pFrameBuffer) {
-		free(this->Stream.pFrameBuffer);
+	if (this->hCaptureFile != NULL) {
+		this->FlushCapture();
+		CloseHandle(this->hCaptureFile);
+		this->hCaptureFile = NULL;
+	}
+
+	if (this->pCaptureBuffer != NULL) {
+		this->FreeMemory(this->pCaptureBuffer, IIS_WEB_SOCKET_CAPTURE_BUFFER_SIZE);
+		this->pCaptureBuffer = NULL;
+	}
+	this->dwCaptureLength = 0;
+}
+
+// Get the buffer type used for the leading fragments when a message is split
+// The smallest amount of free space a receive into the reassembly buffer is given
+// A control frame must fit in a single receive, so this can't be less than 125
+#define IIS_WEB_SOCKET_MIN_RECEIVE_SPACE 0x400
+
+// The initial size of the reassembly buffer
+#define IIS_WEB_SOCKET_ASSEMBLY_BUFFER_SIZE 0x1000
+
+DWORD WebSocketServer::GrowAssembly()
+{
+	DWORD errorCode;
+	unsigned long long qwNewSize;
+	CHAR* pNewBuffer;
+	WCHAR tempPath[MAX_PATH];
+	WCHAR tempFileName[MAX_PATH];
+	DWORD dwBytesWritten;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Double the buffer
+	if (this->Assembly.dwBufferSize == 0) {
+		qwNewSize = IIS_WEB_SOCKET_ASSEMBLY_BUFFER_SIZE;
+	}
+	else {
+		qwNewSize = (unsigned long long)this->Assembly.dwBufferSize * 2;
+	}
+
+	// Keep the message in memory while it's under the spill threshold
+	if ((this->SpillThreshold == 0) || (qwNewSize <= this->SpillThreshold) || (this->Assembly.dwBufferSize == 0))
+	{
+		if (qwNewSize > 0x80000000) {
+			errorCode = ERROR_NOT_ENOUGH_MEMORY;
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::ReceiveMessage() 'reassembly buffer'");
+			goto exit;
+		}
+
+		// The growth is charged, the message is too large for the connection's budget when it's refused
+		if (!ChargeMemory(&this->MemoryAccount, qwNewSize - this->Assembly.dwBufferSize)) {
+			errorCode = ERROR_NOT_ENOUGH_MEMORY;
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::ReceiveMessage() 'memory budget'");
+			goto exit;
+		}
+		pNewBuffer = (CHAR*)realloc(this->Assembly.pBuffer, (size_t)qwNewSize);
+		if (pNewBuffer == NULL) {
+			ReleaseMemory(&this->MemoryAccount, qwNewSize - this->Assembly.dwBufferSize);
+			errorCode = ERROR_NOT_ENOUGH_MEMORY;
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::ReceiveMessage() 'reassembly buffer'");
+			goto exit;
+		}
+
+		this->Assembly.pBuffer = pNewBuffer;
+		this->Assembly.dwBufferSize = (DWORD)qwNewSize;
+		goto exit;
+	}
+
+	// The message is too large to keep in memory, create a temporary file that is deleted when closed
+	if ((GetTempPath(MAX_PATH, tempPath) == 0) || (GetTempFileName(tempPath, L"iws", 0, tempFileName) == 0)) {
+		errorCode = GetLastError();
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "GetTempFileName()");
+		goto exit;
+	}
+
+	this->Assembly.hSpillFile = CreateFile(tempFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (this->Assembly.hSpillFile == INVALID_HANDLE_VALUE) {
+		this->Assembly.hSpillFile = NULL;
+		errorCode = GetLastError();
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "CreateFile() 'spill file'");
+		goto exit;
+	}
+
+	// Move what we have so far to the file, the buffer is then used to receive the rest of the message
+	if (!WriteFile(this->Assembly.hSpillFile, this->Assembly.pBuffer, (DWORD)this->Assembly.qwLength, &dwBytesWritten, NULL)) {
+		errorCode = GetLastError();
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WriteFile() 'spill file'");
+		goto exit;
+	}
+
+exit:
+
+	return errorCode;
+}
+
+VOID WebSocketServer::ResetAssembly()
+{
+	if (this->Assembly.pSpillView) {
+		UnmapViewOfFile(this->Assembly.pSpillView);
+		this->Assembly.pSpillView = NULL;
+	}
+
+	if (this->Assembly.hSpillMapping) {
+		CloseHandle(this->Assembly.hSpillMapping);
+		this->Assembly.hSpillMapping = NULL;
+	}
+
+	// The file is deleted when it's closed
+	if (this->Assembly.hSpillFile) {
+		CloseHandle(this->Assembly.hSpillFile);
+		this->Assembly.hSpillFile = NULL;
+	}
+
+	this->Assembly.qwLength = 0;
+	this->Assembly.bInProgress = FALSE;
+	this->Assembly.bComplete = FALSE;
+}
+
+VOID WebSocketServer::ReleaseMessage()
+{
+	// Don't discard a message that is still being reassembled
+	if (this->Assembly.bComplete) {
+		this->ResetAssembly();
+	}
+}
+
+DWORD WebSocketServer::ReceiveMessage(WEB_SOCKET_MESSAGE* pMessage)
+{
+	DWORD errorCode;
+	CHAR* pReceiveBuffer;
+	DWORD dwReceiveLength;
+	DWORD dwBytesReceived;
+	DWORD dwBytesWritten;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	const CHAR* pViolation;
+	BOOL bNewFrame;
+
+	// Set success
+	errorCode = S_OK;
+
+	// pMessage must be a valid pointer
+	if (pMessage == NULL) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::ReceiveMessage() 'pMessage'");
+		goto exit;
+	}
+
+	// Release the previous message
+	this->ReleaseMessage();
+
+	// Receive frames until we have a complete message or a control frame
+	for (;;)
+	{
+		if (this->Assembly.hSpillFile == NULL)
+		{
+			// Make room for the next receive
+			if (this->Assembly.dwBufferSize - this->Assembly.qwLength < IIS_WEB_SOCKET_MIN_RECEIVE_SPACE) {
+				errorCode = this->GrowAssembly();
+				if (errorCode != S_OK) {
+					this->ResetAssembly();
+					goto exit;
+				}
+			}
+		}
+
+		if (this->Assembly.hSpillFile == NULL) {
+			// Receive directly after the data we already have
+			pReceiveBuffer = this->Assembly.pBuffer + this->Assembly.qwLength;
+			dwReceiveLength = this->Assembly.dwBufferSize - (DWORD)this->Assembly.qwLength;
+		}
+		else {
+			// Receive into the whole buffer, it's written to the file after each receive
+			pReceiveBuffer = this->Assembly.pBuffer;
+			dwReceiveLength = this->Assembly.dwBufferSize;
+		}
+
+		// Continuation frames keep the type of the message being reassembled
+		bufferType = this->Assembly.FragmentType;
+
+		// A new frame header is parsed when the last frame was received to its end
+		bNewFrame = this->Stream.bQueuing;
+
+		// Receive the payload
+		errorCode = this->Receive(pReceiveBuffer, dwReceiveLength, &dwBytesReceived, &bufferType);
+		if (errorCode != S_OK) {
+			this->ResetAssembly();
+			goto exit;
+		}
+
+		// Control frames are returned straight away, the message being reassembled is kept
+		if (IsControlBufferType(bufferType))
+		{
+			// The parser rejects control frames over 125 bytes, but the control buffer can't rely on it
+			if (dwBytesReceived > sizeof(this->Assembly.ControlBuffer)) {
+				pViolation = "control frame too long";
+				goto protocolError;
+			}
+			memcpy(this->Assembly.ControlBuffer, pReceiveBuffer, dwBytesReceived);
+			pMessage->BufferType = bufferType;
+			pMessage->pData = this->Assembly.ControlBuffer;
+			pMessage->qwLength = dwBytesReceived;
+			pMessage->bMapped = FALSE;
+			goto exit;
+		}
+
+		// Start a new message
+		if (!this->Assembly.bInProgress)
+		{
+			// A continuation frame must follow the start of a message
+			if (this->WebSocketFrame.Opcode == 0x00) {
+				pViolation = "continuation frame without a message";
+				goto protocolError;
+			}
+			this->Assembly.bInProgress = TRUE;
+			this->Assembly.FragmentType = GetFragmentBufferType(bufferType);
+		}
+		else if ((bNewFrame) && (this->WebSocketFrame.Opcode != 0x00)) {
+			// Only continuation frames can follow the start of a message until its final fragment
+			pViolation = "new message inside a fragmented message";
+			goto protocolError;
+		}
+
+		// Check if the message will exceed the maximum length set by the server
+		if ((this->MaxMessageLength != 0) && (this->Assembly.qwLength + dwBytesReceived > this->MaxMessageLength)) {
+			errorCode = ERROR_INVALID_BLOCK_LENGTH;
+			strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "Received WebSocket message exceeded `MaxMessageLength`");
+			this->ResetAssembly();
+			goto exit;
+		}
+
+		// Add the payload to the spill file
+		if ((this->Assembly.hSpillFile != NULL) && (dwBytesReceived != 0)) {
+			if (!WriteFile(this->Assembly.hSpillFile, pReceiveBuffer, dwBytesReceived, &dwBytesWritten, NULL)) {
+				errorCode = GetLastError();
+				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WriteFile() 'spill file'");
+				this->ResetAssembly();
+				goto exit;
+			}
+		}
+
+		this->Assembly.qwLength += dwBytesReceived;
+
+		// Keep receiving until the final fragment
+		if ((bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) &&
+			(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)) {
+			continue;
+		}
+
+		// The message is complete
+		pMessage->BufferType = bufferType;
+		pMessage->qwLength = this->Assembly.qwLength;
+
+		if (this->Assembly.hSpillFile == NULL) {
+			pMessage->pData = this->Assembly.pBuffer;
+			pMessage->bMapped = FALSE;
+		}
+		else
+		{
+			// Map the spill file so the application can read the message in place
+			this->Assembly.hSpillMapping = CreateFileMapping(this->Assembly.hSpillFile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (this->Assembly.hSpillMapping == NULL) {
+				errorCode = GetLastError();
+				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "CreateFileMapping() 'spill file'");
+				this->ResetAssembly();
+				goto exit;
+			}
+
+			this->Assembly.pSpillView = MapViewOfFile(this->Assembly.hSpillMapping, FILE_MAP_READ, 0, 0, 0);
+			if (this->Assembly.pSpillView == NULL) {
+				errorCode = GetLastError();
+				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "MapViewOfFile() 'spill file'");
+				this->ResetAssembly();
+				goto exit;
+			}
+
+			pMessage->pData = (CHAR*)this->Assembly.pSpillView;
+			pMessage->bMapped = TRUE;
+		}
+
+		this->Assembly.bInProgress = FALSE;
+		this->Assembly.bComplete = TRUE;
+		break;
+	}
+
+	goto exit;
+
+protocolError:
+
+	// Fail the connection like Receive does for an invalid frame header
+	{
+		IIS_WEB_SOCKET_CLOSE_DATA closeData(IIS_WEB_SOCKET_CLOSE_STATUS::IIS_WEB_SOCKET_PROTOCOL_ERROR_CLOSE_STATUS, (CHAR*)pViolation);
+		this->Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, &closeData, closeData.length());
+	}
+	this->ResetAssembly();
+
+	errorCode = ERROR_INVALID_DATA;
+	sprintf_s(this->ErrorDescription, this->ErrorBufferLength, "Received a WebSocket message that violates the protocol: %s", pViolation);
+
+exit:
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+DWORD WebSocketServer::EncodeFrameOpcode(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, UCHAR* pFrameByte)
+{
+	// Set FIN and Opcode in the frame, continuing or ending a message sent as fragments
+	if (!EncodeWebSocketFrameOpcode(bufferType, &this->IsFragment, pFrameByte)) {
+		PrintLastError(ERROR_INVALID_PARAMETER, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send 'bufferType'");
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return S_OK;
+}
+
+DWORD WebSocketServer::PlanFragment(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwRemaining, UCHAR* pFrameByte, unsigned long long* pqwFrameLength)
+{
+	// Get the next frame no larger than MaxFramePayloadLength, with FIN and Opcode from the fragment state
+	if (!PlanWebSocketFragment(bufferType, qwRemaining, this->MaxFramePayloadLength, &this->IsFragment, pFrameByte, pqwFrameLength)) {
+		PrintLastError(ERROR_INVALID_PARAMETER, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send 'bufferType'");
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return S_OK;
+}
+
+DWORD WebSocketServer::WriteChunks(HTTP_DATA_CHUNK* pDataChunks, DWORD dwChunkCount)
+{
+	DWORD errorCode;
+	DWORD dwBytesSent;
+	BOOL fCompletionExpected;
+	bool bLatency;
+	unsigned long long qwTimestamp;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Write chunks until all data has been written
+	while (dwChunkCount != 0)
+	{
+		// Reset parameters
+		dwBytesSent = 0;
+		fCompletionExpected = FALSE;
+
+		// Write chunks
+		bLatency = LatencyEnabled.load(std::memory_order_relaxed);
+		if (bLatency) {
+			qwTimestamp = TraceTimestamp();
+		}
+		errorCode = pHttpResponse->WriteEntityChunks(pDataChunks, dwChunkCount, FALSE, TRUE, &dwBytesSent, &fCompletionExpected);
+		if (bLatency) {
+			RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_WRITE_LATENCY_PHASE, TraceTimestamp() - qwTimestamp);
+		}
+		if (errorCode != S_OK) {
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WriteEntityChunks()");
+			break;
+		}
+
+		// Skip the chunks that were written, a partial write moves the start of the chunk
+		while (dwChunkCount != 0)
+		{
+			if (pDataChunks->DataChunkType == HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory)
+			{
+				if (dwBytesSent < pDataChunks->FromMemory.BufferLength) {
+					pDataChunks->FromMemory.pBuffer = (UCHAR*)pDataChunks->FromMemory.pBuffer + dwBytesSent;
+					pDataChunks->FromMemory.BufferLength -= dwBytesSent;
+					break;
+				}
+				dwBytesSent -= pDataChunks->FromMemory.BufferLength;
+			}
+			else if (pDataChunks->DataChunkType == HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromFileHandle)
+			{
+				if (dwBytesSent < pDataChunks->FromFileHandle.ByteRange.Length.QuadPart) {
+					pDataChunks->FromFileHandle.ByteRange.StartingOffset.QuadPart += dwBytesSent;
+					pDataChunks->FromFileHandle.ByteRange.Length.QuadPart -= dwBytesSent;
+					break;
+				}
+				dwBytesSent -= (DWORD)pDataChunks->FromFileHandle.ByteRange.Length.QuadPart;
+			}
+
+			// This chunk has been fully written
+			pDataChunks++;
+			dwChunkCount--;
+		}
+	}
+
+	return errorCode;
+}
+
+// The largest payload slice written in a single memory data chunk
+#define IIS_WEB_SOCKET_MAX_CHUNK_LENGTH 0x40000000
+
+// The size of the buffer frames are coalesced in when the flush policy isn't immediate
+#define IIS_WEB_SOCKET_COALESCE_BUFFER_SIZE 0x10000
+
+DWORD WebSocketServer::WriteCoalesced()
+{
+	DWORD errorCode;
+	HTTP_DATA_CHUNK dataChunk;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Write all the coalesced frames in a single chunk
+	if (this->dwCoalescedLength != 0)
+	{
+		dataChunk.DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory;
+		dataChunk.FromMemory.pBuffer = this->pCoalesceBuffer;
+		dataChunk.FromMemory.BufferLength = this->dwCoalescedLength;
+		this->dwCoalescedLength = 0;
+
+		errorCode = this->WriteChunks(&dataChunk, 1);
+	}
+
+	return errorCode;
+}
+
+DWORD WebSocketServer::WriteMemory(UCHAR* pPrefix, DWORD dwPrefixLength, void* pPayload, unsigned long long qwPayloadLength)
+{
+	DWORD errorCode;
+	HTTP_DATA_CHUNK dataChunks[2];
+	DWORD dwChunkCount;
+	DWORD dwSliceLength;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Coalesce small frames when the flush policy allows it
+	if ((this->FlushPolicy != IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_IMMEDIATE_FLUSH_POLICY) &&
+		(dwPrefixLength + qwPayloadLength <= IIS_WEB_SOCKET_COALESCE_BUFFER_SIZE))
+	{
+		// Allocate the coalescing buffer the first time it's used
+		if (this->pCoalesceBuffer == NULL) {
+			this->pCoalesceBuffer = (UCHAR*)this->AllocateMemory(IIS_WEB_SOCKET_COALESCE_BUFFER_SIZE);
+			if (this->pCoalesceBuffer == NULL) {
+				errorCode = ERROR_NOT_ENOUGH_MEMORY;
+				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send() 'coalesce buffer'");
+				return errorCode;
+			}
+		}
+
+		// Make room by writing what has been coalesced so far
+		if (this->dwCoalescedLength + dwPrefixLength + qwPayloadLength > IIS_WEB_SOCKET_COALESCE_BUFFER_SIZE) {
+			errorCode = this->WriteCoalesced();
+			if (errorCode != S_OK) {
+				return errorCode;
+			}
+		}
+
+		// Copy the frame, it's written with the next flush
+		memcpy(this->pCoalesceBuffer + this->dwCoalescedLength, pPrefix, dwPrefixLength);
+		this->dwCoalescedLength += dwPrefixLength;
+		memcpy(this->pCoalesceBuffer + this->dwCoalescedLength, pPayload, (size_t)qwPayloadLength);
+		this->dwCoalescedLength += (DWORD)qwPayloadLength;
+		return errorCode;
+	}
+
+	// Anything coalesced must be written before this frame
+	errorCode = this->WriteCoalesced();
+	if (errorCode != S_OK) {
+		return errorCode;
+	}
+
+	// Write the prefix with the first slice of the payload, then the remaining slices
+	do
+	{
+		dwChunkCount = 0;
+
+		// Setup prefix chunk
+		if (dwPrefixLength != 0)
+		{
+			dataChunks[dwChunkCount].DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory;
+			dataChunks[dwChunkCount].FromMemory.pBuffer = pPrefix;
+			dataChunks[dwChunkCount].FromMemory.BufferLength = dwPrefixLength;
+			dwChunkCount++;
+			dwPrefixLength = 0;
+		}
+
+		// Setup payload chunk, the payload is written directly without being copied
+		if (qwPayloadLength != 0)
+		{
+			if (qwPayloadLength < IIS_WEB_SOCKET_MAX_CHUNK_LENGTH) {
+				dwSliceLength = (DWORD)qwPayloadLength;
+			}
+			else {
+				dwSliceLength = IIS_WEB_SOCKET_MAX_CHUNK_LENGTH;
+			}
+			dataChunks[dwChunkCount].DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory;
+			dataChunks[dwChunkCount].FromMemory.pBuffer = pPayload;
+			dataChunks[dwChunkCount].FromMemory.BufferLength = dwSliceLength;
+			dwChunkCount++;
+			pPayload = (UCHAR*)pPayload + dwSliceLength;
+			qwPayloadLength -= dwSliceLength;
+		}
+
+		// Write chunks
+		errorCode = this->WriteChunks(dataChunks, dwChunkCount);
+		if (errorCode != S_OK) {
+			break;
+		}
+
+	} while (qwPayloadLength != 0);
+
+	return errorCode;
+}
+
+DWORD WebSocketServer::WriteFrame(UCHAR frameByte, unsigned long long qwPayloadLength, void* pPayload, unsigned long long qwBytes)
+{
+	UCHAR frameHeader[10];
+	DWORD dwFrameLength;
+
+	// Encode the frame header
+	dwFrameLength = EncodeWebSocketFrameHeader(frameHeader, frameByte, qwPayloadLength);
+
+	// Trace the frame
+	if (TraceEnabled.load(std::memory_order_relaxed)) {
+		TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_OUTBOUND, frameByte & 0x0F, (frameByte & 0x80) != 0,
+			qwPayloadLength, dwFrameLength, pPayload, qwBytes);
+	}
+
+	// Write the header and payload
+	return this->WriteMemory(frameHeader, dwFrameLength, pPayload, qwBytes);
+}
+
+DWORD WebSocketServer::WriteSendFrame(const WEB_SOCKET_SEND_FRAME* pFrame, void* pBuffer, DWORD dwLength)
+{
+	// A new frame, or a fragment, with the chunk as its payload
+	if (pFrame->bHeader) {
+		return this->WriteFrame(pFrame->FrameByte, pFrame->qwPayloadLength, pBuffer, dwLength);
+	}
+
+	// More of the payload of the frame of declared length
+	if (dwLength != 0) {
+		return this->WriteMemory(NULL, 0, pBuffer, dwLength);
+	}
+
+	return S_OK;
+}
+
+DWORD WebSocketServer::FlushResponse()
+{
+	DWORD errorCode;
+	DWORD dwBytesSent;
+	BOOL fCompletionExpected;
+	bool bLatency;
+	unsigned long long qwTimestamp;
+
+	// Write any coalesced frames
+	errorCode = this->WriteCoalesced();
+	if (errorCode != S_OK) {
+		return errorCode;
+	}
+
+	// Set parameters
+	dwBytesSent = 0;
+	fCompletionExpected = FALSE;
+
+	// Flush response
+	bLatency = LatencyEnabled.load(std::memory_order_relaxed);
+	if (bLatency) {
+		qwTimestamp = TraceTimestamp();
+	}
+	errorCode = pHttpResponse->Flush(FALSE, TRUE, &dwBytesSent, &fCompletionExpected);
+	if (bLatency) {
+		RecordLatency(IIS_WEB_SOCKET_LATENCY_PHASE::IIS_WEB_SOCKET_FLUSH_LATENCY_PHASE, TraceTimestamp() - qwTimestamp);
+	}
+	if (errorCode != S_OK) {
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "Flush()");
+	}
+
+	return errorCode;
+}
+
+// Flushes frames that were coalesced under the max delay or size threshold flush policy
+static VOID CALLBACK FlushTimerCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_TIMER Timer)
+{
+	UNREFERENCED_PARAMETER(Instance);
+	UNREFERENCED_PARAMETER(Timer);
+
+	((WebSocketServer*)Context)->FlushNow();
+}
+
+DWORD WebSocketServer::EndWrite(BOOL bUrgent)
+{
+	DWORD errorCode;
+	FILETIME dueTime;
+	ULARGE_INTEGER relativeTime;
+	IIS_WEB_SOCKET_FLUSH_ACTION action;
+
+	// Set success
+	errorCode = S_OK;
+
+	// The frame is already coalesced, flush it or start the timer before a failed flush from the timer is reported
+	action = GetWebSocketFlushAction(this->FlushPolicy, bUrgent ? true : false, this->dwCoalescedLength, this->FlushThreshold, this->bFlushTimerSet ? true : false);
+	if (action == IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_FLUSH_NOW_FLUSH_ACTION) {
+		errorCode = this->FlushResponse();
+	}
+	else if (action == IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_SET_TIMER_FLUSH_ACTION)
+	{
+		// Create the timer the first time it's needed
+		if (this->pFlushTimer == NULL) {
+			this->pFlushTimer = CreateThreadpoolTimer(FlushTimerCallback, this, NULL);
+		}
+
+		if (this->pFlushTimer == NULL) {
+			// We can't wait, just flush
+			errorCode = this->FlushResponse();
+		}
+		else
+		{
+			// Flush after FlushDelay microseconds, a negative due time is relative in 100 nanosecond units
+			relativeTime.QuadPart = (ULONGLONG)(-((LONGLONG)this->FlushDelay * 10));
+			dueTime.dwLowDateTime = relativeTime.LowPart;
+			dueTime.dwHighDateTime = relativeTime.HighPart;
+			SetThreadpoolTimer(this->pFlushTimer, &dueTime, 0, 0);
+			this->bFlushTimerSet = TRUE;
+		}
+	}
+
+	// Report a failed flush from the timer
+	if (this->FlushErrorCode != S_OK)
+	{
+		if (errorCode == S_OK) {
+			errorCode = this->FlushErrorCode;
+		}
+		this->FlushErrorCode = S_OK;
+	}
+
+	return errorCode;
+}
+
+DWORD WebSocketServer::FlushNow()
+{
+	DWORD errorCode;
+
+	EnterCriticalSection(&this->FrameLock);
+
+	// The timer has fired or is no longer needed
+	this->bFlushTimerSet = FALSE;
+
+	// Write and flush everything that has been coalesced
+	errorCode = this->FlushResponse();
+
+	// Keep the error for the next Send if we were called from the timer
+	if (errorCode != S_OK) {
+		this->FlushErrorCode = errorCode;
+	}
+
+	LeaveCriticalSection(&this->FrameLock);
+
+	return errorCode;
+}
+
+VOID WebSocketServer::SetCloseTimer(unsigned long long qwMilliseconds)
+{
+	FILETIME dueTime;
+	ULARGE_INTEGER relativeTime;
+
+	// Create the timer the first time it's needed
+	if (this->pCloseTimer == NULL) {
+		this->pCloseTimer = CreateThreadpoolTimer(CloseTimerCallback, this, NULL);
+		if (this->pCloseTimer == NULL) {
+			// Without a deadline the connection ends when the client closes it
+			return;
+		}
+	}
+
+	// A negative due time is relative in 100 nanosecond units
+	relativeTime.QuadPart = (ULONGLONG)(-((LONGLONG)qwMilliseconds * 10000));
+	dueTime.dwLowDateTime = relativeTime.LowPart;
+	dueTime.dwHighDateTime = relativeTime.HighPart;
+	SetThreadpoolTimer(this->pCloseTimer, &dueTime, 0, 0);
+}
+
+BOOL WebSocketServer::BeginClose()
+{
+	unsigned long long qwFrequency = RateLimitFrequency();
+	BOOL bSend;
+
+	EnterCriticalSection(&this->CloseLock);
+
+	bSend = BeginWebSocketClose(&this->CloseHandshake, RateLimitTimestamp(), (unsigned long long)this->CloseTimeout * qwFrequency / 1000) ? TRUE : FALSE;
+
+	// The server closed first, give the client until the deadline to answer
+	if ((bSend) && (this->CloseHandshake.State == IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE) && (this->CloseTimeout != 0)) {
+		this->SetCloseTimer(this->CloseTimeout);
+	}
+
+	LeaveCriticalSection(&this->CloseLock);
+
+	return bSend;
+}
+
+// Aborts a connection whose client didn't answer the server's close frame in time
+// Only takes the close lock, a send blocked on the client holds the frame lock until the reset fails its write
+VOID CALLBACK WebSocketServer::CloseTimerCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_TIMER Timer)
+{
+	WebSocketServer* pWebSocketServer = (WebSocketServer*)Context;
+	unsigned long long qwNow;
+	BOOL bExpired;
+
+	UNREFERENCED_PARAMETER(Instance);
+	UNREFERENCED_PARAMETER(Timer);
+
+	EnterCriticalSection(&pWebSocketServer->CloseLock);
+
+	qwNow = RateLimitTimestamp();
+	bExpired = ExpireWebSocketClose(&pWebSocketServer->CloseHandshake, qwNow) ? TRUE : FALSE;
+	if ((!bExpired) && (pWebSocketServer->CloseHandshake.State == IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE)) {
+		// Fired before the deadline, wait out the rest
+		pWebSocketServer->SetCloseTimer((pWebSocketServer->CloseHandshake.qwDeadline - qwNow) * 1000 / RateLimitFrequency() + 1);
+	}
+
+	LeaveCriticalSection(&pWebSocketServer->CloseLock);
+
+	// The pending read and any blocked write fail, and Receive reports the timeout
+	if (bExpired) {
+		pWebSocketServer->pHttpResponse->ResetConnection();
+	}
+}
+
+DWORD WebSocketServer::EnterMessage(const char* pError)
+{
+	EnterCriticalSection(&this->MessageLock);
+
+	// Wait for a streamed message to end, the thread sending it would wait for itself
+	while (this->SendStream.bActive)
+	{
+		if (this->StreamThreadId == GetCurrentThreadId()) {
+			LeaveCriticalSection(&this->MessageLock);
+			PrintLastError(ERROR_INVALID_OPERATION, this->ErrorDescription, this->ErrorBufferLength, pError);
+			return ERROR_INVALID_OPERATION;
+		}
+		SleepConditionVariableCS(&this->StreamEnded, &this->MessageLock, INFINITE);
+	}
+
+	return S_OK;
+}
+
+DWORD WebSocketServer::EnterFrame(const char* pError)
+{
+	EnterCriticalSection(&this->FrameLock);
+
+	// Wait for a frame of declared length to end, the thread sending it would wait for itself
+	while (this->SendStream.bDeclaredLength)
+	{
+		if (this->StreamThreadId == GetCurrentThreadId()) {
+			LeaveCriticalSection(&this->FrameLock);
+			PrintLastError(ERROR_INVALID_OPERATION, this->ErrorDescription, this->ErrorBufferLength, pError);
+			return ERROR_INVALID_OPERATION;
+		}
+		SleepConditionVariableCS(&this->FrameEnded, &this->FrameLock, INFINITE);
+	}
+
+	return S_OK;
+}
+
+DWORD WebSocketServer::SendControl(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength)
+{
+	DWORD errorCode;
+	UCHAR frameByte;
+
+	// Control frames can't be fragmented and must have a payload of 125 bytes or less
+	if (qwLength > 125) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::Send() 'control frame length'");
+		return errorCode;
+	}
+
+	// Only the frame lock is taken, so a control frame goes out between the fragments of a data message
+	errorCode = this->EnterFrame("WebSocketServer::Send() 'frame of declared length in progress'");
+	if (errorCode != S_OK) {
+		return errorCode;
+	}
+
+	// A connection sends one close frame, the first one starts the close deadline or answers the client
+	if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) && (!this->BeginClose())) {
+		LeaveCriticalSection(&this->FrameLock);
+		return S_OK;
+	}
+
+	// Clear the response
+	pHttpResponse->Clear();
+
+	// Set FIN and Opcode in the frame
+	errorCode = this->EncodeFrameOpcode(bufferType, &frameByte);
+	if (errorCode == S_OK)
+	{
+		// Write the frame
+		errorCode = this->WriteFrame(frameByte, qwLength, pBuffer, qwLength);
+		if (errorCode == S_OK) {
+			errorCode = this->FlushResponse();
+		}
+	}
+
+	LeaveCriticalSection(&this->FrameLock);
+
+	return errorCode;
+}
+
+VOID WebSocketServer::LogMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pPrefix, DWORD dwPrefixLength, const void* pData, unsigned long long qwLength)
+{
+	if ((this->pSessions == NULL) || (this->Session.Slot == IIS_WEB_SOCKET_NO_SESSION) || (this->bSessionReplay)) {
+		return;
+	}
+
+	// A message sent as fragments is numbered when its last fragment is sent, but only a whole message can be logged
+	if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ||
+		(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE))
+	{
+		if (this->IsFragment) {
+			this->pSessions->Skip(&this->Session);
+		}
+		else {
+			this->pSessions->Append(&this->Session, bufferType, pPrefix, dwPrefixLength, pData, qwLength);
+		}
+	}
+}
+
+VOID WebSocketServer::SkipMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType)
+{
+	if ((this->pSessions == NULL) || (this->Session.Slot == IIS_WEB_SOCKET_NO_SESSION) || (this->bSessionReplay)) {
+		return;
+	}
+
+	if ((bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ||
+		(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)) {
+		this->pSessions->Skip(&this->Session);
+	}
+}
+
+DWORD WebSocketServer::Send(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, BOOL bUrgent)
+{
+	DWORD errorCode;
+	UCHAR frameByte;
+	unsigned long long qwFrameLength;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Control frames don't wait for data messages
+	if (IsControlBufferType(bufferType)) {
+		errorCode = this->SendControl(bufferType, pBuffer, qwLength);
+		goto exit;
+	}
+
+	// One data message at a time, a streamed message is finished first
+	errorCode = this->EnterMessage("WebSocketServer::Send() 'streamed message in progress'");
+	if (errorCode != S_OK) {
+		goto exit;
+	}
+
+	// Number the message before it's written, so the log is in the order the client receives
+	this->LogMessage(bufferType, NULL, 0, pBuffer, qwLength);
+
+	// Split the payload into frames no larger than MaxFramePayloadLength
+	do
+	{
+		// Each frame is written under the frame lock so pending control frames can go between them
+		EnterCriticalSection(&this->FrameLock);
+
+		// Clear the response
+		pHttpResponse->Clear();
+
+		// Get the length, FIN and Opcode of this frame, the last frame uses the callers buffer type
+		errorCode = this->PlanFragment(bufferType, qwLength, &frameByte, &qwFrameLength);
+
+		// Write the frame
+		if (errorCode == S_OK) {
+			errorCode = this->WriteFrame(frameByte, qwFrameLength, pBuffer, qwFrameLength);
+		}
+
+		// Flush response after the last frame, according to the flush policy
+		if ((errorCode == S_OK) && (qwFrameLength == qwLength)) {
+			errorCode = this->EndWrite(bUrgent);
+		}
+
+		LeaveCriticalSection(&this->FrameLock);
+
+		if (errorCode != S_OK) {
+			break;
+		}
+
+		// Move to the next frame
+		pBuffer = (UCHAR*)pBuffer + qwFrameLength;
+		qwLength -= qwFrameLength;
+
+	} while (qwLength != 0);
+
+	LeaveCriticalSection(&this->MessageLock);
+
+exit:
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+VOID WebSocketServer::AbortMessage()
+{
+	EnterCriticalSection(&this->MessageLock);
+
+	if (this->SendStream.bActive)
+	{
+		EnterCriticalSection(&this->FrameLock);
+		AbortWebSocketSendStream(&this->SendStream, &this->IsFragment);
+		WakeAllConditionVariable(&this->FrameEnded);
+		LeaveCriticalSection(&this->FrameLock);
+
+		WakeAllConditionVariable(&this->StreamEnded);
+	}
+
+	LeaveCriticalSection(&this->MessageLock);
+}
+
+DWORD WebSocketServer::BeginMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwMessageLength)
+{
+	DWORD errorCode;
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT result;
+	WEB_SOCKET_SEND_FRAME frame;
+	BOOL bLogged;
+
+	// Only one streamed message can be sent at a time, one from another thread is finished first
+	errorCode = this->EnterMessage("WebSocketServer::BeginMessage() 'message in progress'");
+	if (errorCode != S_OK) {
+		goto exit;
+	}
+
+	// A message already logged by SendPrefixed
+	bLogged = this->bStreamLogged;
+	this->bStreamLogged = FALSE;
+
+	// The frame lock guards the fragment state
+	EnterCriticalSection(&this->FrameLock);
+
+	// Not in the middle of a fragmented Send
+	result = BeginWebSocketSendStream(&this->SendStream, bufferType, qwMessageLength, &this->IsFragment, &frame);
+	if (result == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT) {
+		errorCode = ERROR_INVALID_OPERATION;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::BeginMessage() 'message in progress'");
+		goto unlock;
+	}
+	if (result != IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::BeginMessage() 'bufferType'");
+		goto unlock;
+	}
+	this->StreamThreadId = GetCurrentThreadId();
+
+	// A streamed message is numbered but not logged, it isn't held in memory
+	if (!bLogged) {
+		this->SkipMessage(bufferType);
+	}
+
+	// The length is known, send a single frame with the full 64-bit length now
+	// Until EndMessage other frames wait for bDeclaredLength to clear, nothing can be sent inside the frame
+	if (frame.bHeader)
+	{
+		// Clear the response
+		pHttpResponse->Clear();
+
+		errorCode = this->WriteSendFrame(&frame, NULL, 0);
+		if (errorCode != S_OK) {
+			AbortWebSocketSendStream(&this->SendStream, &this->IsFragment);
+		}
+	}
+
+unlock:
+
+	LeaveCriticalSection(&this->FrameLock);
+	LeaveCriticalSection(&this->MessageLock);
+
+exit:
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+DWORD WebSocketServer::WriteMessageChunk(void* pBuffer, DWORD dwLength)
+{
+	DWORD errorCode;
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT result;
+	WEB_SOCKET_SEND_FRAME frame;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Only for the call, data messages wait for the stream to end and not for the lock
+	EnterCriticalSection(&this->MessageLock);
+
+	// Send the chunk as more of the frame of declared length, or as the next fragment, control frames can go between fragments
+	EnterCriticalSection(&this->FrameLock);
+
+	result = WriteWebSocketSendStream(&this->SendStream, dwLength, &this->IsFragment, &frame);
+	if (result == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT) {
+		this->StreamThreadId = GetCurrentThreadId();
+		errorCode = this->WriteSendFrame(&frame, pBuffer, dwLength);
+	}
+	else if (result == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT) {
+		// We can't send more than the length declared in the frame header
+		errorCode = ERROR_INVALID_BLOCK_LENGTH;
+		strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::WriteMessageChunk() chunk exceeded the declared message length");
+	}
+	else {
+		// BeginMessage must be called first
+		errorCode = ERROR_INVALID_OPERATION;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::WriteMessageChunk() 'no message in progress'");
+	}
+
+	LeaveCriticalSection(&this->FrameLock);
+	LeaveCriticalSection(&this->MessageLock);
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+DWORD WebSocketServer::EndMessage()
+{
+	DWORD errorCode;
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT result;
+	WEB_SOCKET_SEND_FRAME frame;
+
+	// Set success
+	errorCode = S_OK;
+
+	EnterCriticalSection(&this->MessageLock);
+
+	// BeginMessage must be called first
+	if (!this->SendStream.bActive) {
+		errorCode = ERROR_INVALID_OPERATION;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::EndMessage() 'no message in progress'");
+		goto exit;
+	}
+
+	// Send the final (empty) fragment of an unknown length, a declared length must have been reached
+	EnterCriticalSection(&this->FrameLock);
+
+	result = EndWebSocketSendStream(&this->SendStream, &this->IsFragment, &frame);
+	if (result == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT)
+	{
+		errorCode = this->WriteSendFrame(&frame, NULL, 0);
+		if (errorCode == S_OK) {
+			errorCode = this->EndWrite(FALSE);
+		}
+	}
+	else
+	{
+		// The frame can't be finished, the client will see a truncated frame so the connection must be closed
+		errorCode = ERROR_INVALID_BLOCK_LENGTH;
+		strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::EndMessage() message is shorter than the declared length");
+	}
+
+	// The message is over even if we failed, wake the frames and messages waiting for it
+	WakeAllConditionVariable(&this->FrameEnded);
+	LeaveCriticalSection(&this->FrameLock);
+	WakeAllConditionVariable(&this->StreamEnded);
+
+exit:
+
+	LeaveCriticalSection(&this->MessageLock);
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+// The size of the buffer SendFromProducer passes to the producer
+#define IIS_WEB_SOCKET_PRODUCER_BUFFER_LENGTH 0x10000
+
+DWORD WebSocketServer::SendFromProducer(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwMessageLength, PFN_IIS_WEB_SOCKET_PRODUCER pfnProducer, void* pContext)
+{
+	DWORD errorCode;
+	CHAR* pChunkBuffer;
+	DWORD dwChunkLength;
+	DWORD dwBytesProduced;
+	unsigned long long qwRemaining;
+
+	// Set success
+	errorCode = S_OK;
+
+	// Set pointers
+	pChunkBuffer = NULL;
+
+	// pfnProducer must be a valid pointer
+	if (pfnProducer == NULL) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFromProducer() 'pfnProducer'");
+		goto exit;
+	}
+
+	// Allocate the chunk buffer, this is the only memory used no matter how large the message is
+	pChunkBuffer = (CHAR*)this->AllocateMemory(IIS_WEB_SOCKET_PRODUCER_BUFFER_LENGTH);
+	if (pChunkBuffer == NULL) {
+		errorCode = ERROR_NOT_ENOUGH_MEMORY;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFromProducer()");
+		goto exit;
+	}
+
+	// Start the message
+	errorCode = this->BeginMessage(bufferType, qwMessageLength);
+	if (errorCode != S_OK) {
+		goto exit;
+	}
+
+	qwRemaining = qwMessageLength;
+
+	// Get chunks from the producer until the message is complete
+	while (qwRemaining != 0)
+	{
+		// Don't ask for more than the declared length
+		if (qwRemaining < IIS_WEB_SOCKET_PRODUCER_BUFFER_LENGTH) {
+			dwChunkLength = (DWORD)qwRemaining;
+		}
+		else {
+			dwChunkLength = IIS_WEB_SOCKET_PRODUCER_BUFFER_LENGTH;
+		}
+
+		// Produce the next chunk
+		dwBytesProduced = 0;
+		errorCode = pfnProducer(pContext, pChunkBuffer, dwChunkLength, &dwBytesProduced);
+		if (errorCode != S_OK) {
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFromProducer() 'pfnProducer'");
+			break;
+		}
+		if (dwBytesProduced > dwChunkLength) {
+			errorCode = ERROR_INVALID_BLOCK_LENGTH;
+			strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFromProducer() producer returned more bytes than requested");
+			break;
+		}
+
+		// An empty chunk ends the message
+		if (dwBytesProduced == 0) {
+			break;
+		}
+
+		// Send the chunk
+		errorCode = this->WriteMessageChunk(pChunkBuffer, dwBytesProduced);
+		if (errorCode != S_OK) {
+			break;
+		}
+
+		if (qwMessageLength != IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH) {
+			qwRemaining -= dwBytesProduced;
+		}
+	}
+
+	// Finish the message, keep the first error
+	if (errorCode == S_OK) {
+		errorCode = this->EndMessage();
+	}
+	else {
+		this->AbortMessage();
+	}
+
+exit:
+
+	// Free resources
+	if (pChunkBuffer) {
+		this->FreeMemory(pChunkBuffer, IIS_WEB_SOCKET_PRODUCER_BUFFER_LENGTH);
+	}
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+DWORD WebSocketServer::SendFile(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, HANDLE hFile, unsigned long long qwOffset, unsigned long long qwLength)
+{
+	DWORD errorCode;
+	UCHAR frameByte;
+	UCHAR frameHeader[10];
+	LARGE_INTEGER fileSize;
+	HTTP_DATA_CHUNK dataChunks[2];
+	unsigned long long qwFrameLength;
+
+	// Set success
+	errorCode = S_OK;
+
+	// hFile must be a valid handle
+	if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE)) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFile() 'hFile'");
+		goto exit;
+	}
+
+	// A file can only be sent as a data frame
+	if (IsControlBufferType(bufferType)) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFile() 'bufferType'");
+		goto exit;
+	}
+
+	// Send the rest of the file if the length isn't given
+	if (qwLength == IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH)
+	{
+		if (!GetFileSizeEx(hFile, &fileSize)) {
+			errorCode = GetLastError();
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "GetFileSizeEx()");
+			goto exit;
+		}
+		if ((unsigned long long)fileSize.QuadPart < qwOffset) {
+			errorCode = ERROR_INVALID_PARAMETER;
+			PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendFile() 'qwOffset'");
+			goto exit;
+		}
+		qwLength = (unsigned long long)fileSize.QuadPart - qwOffset;
+	}
+
+	// One data message at a time, a streamed message is finished first
+	errorCode = this->EnterMessage("WebSocketServer::SendFile() 'streamed message in progress'");
+	if (errorCode != S_OK) {
+		goto exit;
+	}
+
+	// The file isn't copied into the log
+	this->SkipMessage(bufferType);
+
+	// Split the file into frames no larger than MaxFramePayloadLength
+	do
+	{
+		EnterCriticalSection(&this->FrameLock);
+
+		// Clear the response
+		pHttpResponse->Clear();
+
+		// Get the length, FIN and Opcode of this frame, the last frame uses the callers buffer type
+		errorCode = this->PlanFragment(bufferType, qwLength, &frameByte, &qwFrameLength);
+
+		if (errorCode == S_OK)
+		{
+			// Setup the frame header chunk from memory
+			dataChunks[0].DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromMemory;
+			dataChunks[0].FromMemory.pBuffer = frameHeader;
+			dataChunks[0].FromMemory.BufferLength = EncodeWebSocketFrameHeader(frameHeader, frameByte, qwFrameLength);
+
+			// Trace the frame, the payload isn't in memory
+			if (TraceEnabled.load(std::memory_order_relaxed)) {
+				TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_OUTBOUND, frameByte & 0x0F, (frameByte & 0x80) != 0,
+					qwFrameLength, dataChunks[0].FromMemory.BufferLength, NULL, 0);
+			}
+
+			// Setup the payload chunk from the file handle, the file is never read into our memory
+			dataChunks[1].DataChunkType = HTTP_DATA_CHUNK_TYPE::HttpDataChunkFromFileHandle;
+			dataChunks[1].FromFileHandle.ByteRange.StartingOffset.QuadPart = qwOffset;
+			dataChunks[1].FromFileHandle.ByteRange.Length.QuadPart = qwFrameLength;
+			dataChunks[1].FromFileHandle.FileHandle = hFile;
+
+			// Anything coalesced must be written before this frame
+			errorCode = this->WriteCoalesced();
+
+			// Write the frame, an empty file is just the header
+			if (errorCode == S_OK) {
+				errorCode = this->WriteChunks(dataChunks, (qwFrameLength != 0) ? 2 : 1);
+			}
+		}
+
+		// Flush response after the last frame
+		if ((errorCode == S_OK) && (qwFrameLength == qwLength)) {
+			errorCode = this->FlushResponse();
+		}
+
+		LeaveCriticalSection(&this->FrameLock);
+
+		if (errorCode != S_OK) {
+			break;
+		}
+
+		// Move to the next frame
+		qwOffset += qwFrameLength;
+		qwLength -= qwFrameLength;
+
+	} while (qwLength != 0);
+
+	LeaveCriticalSection(&this->MessageLock);
+
+exit:
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	// Return error code
+	return errorCode;
+}
+
+// Outbound queue timestamps in microseconds
+static unsigned long long QueueTimestamp()
+{
+	unsigned long long qwCounter = RateLimitTimestamp();
+	unsigned long long qwFrequency = RateLimitFrequency();
+
+	// Split so the multiplication can't overflow
+	return ((qwCounter / qwFrequency) * 1000000) + ((qwCounter % qwFrequency) * 1000000 / qwFrequency);
+}
+
+VOID CALLBACK WebSocketServer::QueueWorkCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work)
+{
+	UNREFERENCED_PARAMETER(Instance);
+	UNREFERENCED_PARAMETER(Work);
+
+	((WebSocketServer*)Context)->WriteQueue();
+}
+
+VOID WebSocketServer::WriteQueue()
+{
+	DWORD errorCode;
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+
+	for (;;)
+	{
+		EnterCriticalSection(&this->QueueLock);
+		pMessage = PopOutboundMessage(&this->OutboundQueue, QueueTimestamp());
+		if (pMessage == NULL)
+		{
+			this->bQueueWriting = FALSE;
+			LeaveCriticalSection(&this->QueueLock);
+			return;
+		}
+		LeaveCriticalSection(&this->QueueLock);
+
+		// This blocks while the client isn't reading, QueueMessage keeps the queue within its limit meanwhile
+		if (pMessage->pSharedFrame != NULL) {
+			errorCode = this->SendSharedFrame(pMessage->pSharedFrame);
+		}
+		else {
+			errorCode = this->Send(pMessage->BufferType, pMessage->pData, pMessage->qwLength);
+		}
+		FreeOutboundMessage(pMessage);
+
+		// The connection is broken, drop what's left and report the error to the next QueueMessage
+		if (errorCode != S_OK)
+		{
+			EnterCriticalSection(&this->QueueLock);
+			this->QueueErrorCode = errorCode;
+			this->OutboundQueue.Stats.DroppedMessages += this->OutboundQueue.Stats.QueuedMessages;
+			ClearOutboundQueue(&this->OutboundQueue);
+			this->bQueueWriting = FALSE;
+			LeaveCriticalSection(&this->QueueLock);
+			return;
+		}
+	}
+}
+
+DWORD WebSocketServer::SendSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame)
+{
+	DWORD errorCode;
+
+	// A control frame doesn't wait for data messages and is flushed at once, like SendControl
+	if (IsControlBufferType(pFrame->BufferType))
+	{
+		// Not inside the payload of a frame of declared length
+		errorCode = this->EnterFrame("WebSocketServer::SendSharedFrame() 'frame of declared length in progress'");
+		if (errorCode != S_OK) {
+			this->ErrorCode = errorCode;
+			return errorCode;
+		}
+
+		// A close frame is only sent once
+		if ((pFrame->BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) && (!this->BeginClose())) {
+			LeaveCriticalSection(&this->FrameLock);
+			return S_OK;
+		}
+
+		pHttpResponse->Clear();
+
+		if (TraceEnabled.load(std::memory_order_relaxed)) {
+			TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_OUTBOUND, pFrame->pFrame[0] & 0x0F, true,
+				pFrame->qwPayloadLength, pFrame->HeaderLength, pFrame->pFrame + pFrame->HeaderLength, pFrame->qwPayloadLength);
+		}
+
+		errorCode = this->WriteMemory(NULL, 0, pFrame->pFrame, pFrame->HeaderLength + pFrame->qwPayloadLength);
+		if (errorCode == S_OK) {
+			errorCode = this->FlushResponse();
+		}
+
+		LeaveCriticalSection(&this->FrameLock);
+
+		this->ErrorCode = errorCode;
+
+		return errorCode;
+	}
+
+	// A frame larger than MaxFramePayloadLength is sent in fragments
+	if ((this->MaxFramePayloadLength != 0) && (pFrame->qwPayloadLength > this->MaxFramePayloadLength)) {
+		return this->Send(pFrame->BufferType, pFrame->pFrame + pFrame->HeaderLength, pFrame->qwPayloadLength);
+	}
+
+	errorCode = this->EnterMessage("WebSocketServer::SendSharedFrame() 'streamed message in progress'");
+	if (errorCode != S_OK) {
+		this->ErrorCode = errorCode;
+		return errorCode;
+	}
+
+	this->LogMessage(pFrame->BufferType, NULL, 0, pFrame->pFrame + pFrame->HeaderLength, pFrame->qwPayloadLength);
+
+	EnterCriticalSection(&this->FrameLock);
+
+	// Clear the response
+	pHttpResponse->Clear();
+
+	// Trace the frame
+	if (TraceEnabled.load(std::memory_order_relaxed)) {
+		TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_OUTBOUND, pFrame->pFrame[0] & 0x0F, true,
+			pFrame->qwPayloadLength, pFrame->HeaderLength, pFrame->pFrame + pFrame->HeaderLength, pFrame->qwPayloadLength);
+	}
+
+	// The header and payload are already together, write them as one chunk
+	errorCode = this->WriteMemory(NULL, 0, pFrame->pFrame, pFrame->HeaderLength + pFrame->qwPayloadLength);
+	if (errorCode == S_OK) {
+		errorCode = this->EndWrite(FALSE);
+	}
+
+	LeaveCriticalSection(&this->FrameLock);
+
+	LeaveCriticalSection(&this->MessageLock);
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	return errorCode;
+}
+
+// The longest prefix SendPrefixed puts in front of a payload
+#define IIS_WEB_SOCKET_MAX_MESSAGE_PREFIX_LENGTH 0x20
+
+DWORD WebSocketServer::SendPrefixed(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const UCHAR* pPrefix, DWORD dwPrefixLength, void* pBuffer, unsigned long long qwLength)
+{
+	DWORD errorCode;
+	UCHAR frameByte;
+	UCHAR frameHeader[10 + IIS_WEB_SOCKET_MAX_MESSAGE_PREFIX_LENGTH];
+	DWORD dwHeaderLength;
+	unsigned long long qwSliceLength;
+
+	if (dwPrefixLength > IIS_WEB_SOCKET_MAX_MESSAGE_PREFIX_LENGTH) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::SendPrefixed() 'dwPrefixLength'");
+		this->ErrorCode = errorCode;
+		return errorCode;
+	}
+
+	// A message larger than MaxFramePayloadLength is streamed as fragments, the prefix is the first one
+	if ((this->MaxFramePayloadLength != 0) && (dwPrefixLength + qwLength > this->MaxFramePayloadLength))
+	{
+		// The whole message is logged here, so BeginMessage doesn't number it again
+		// No streamed message is in progress while the message lock is held, so BeginMessage doesn't wait with it held twice
+		errorCode = this->EnterMessage("WebSocketServer::SendPrefixed() 'streamed message in progress'");
+		if (errorCode != S_OK) {
+			this->ErrorCode = errorCode;
+			return errorCode;
+		}
+		if (!this->IsFragment) {
+			this->LogMessage(bufferType, pPrefix, dwPrefixLength, pBuffer, qwLength);
+			this->bStreamLogged = TRUE;
+		}
+		errorCode = this->BeginMessage(bufferType, IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH);
+		LeaveCriticalSection(&this->MessageLock);
+		if (errorCode != S_OK) {
+			return errorCode;
+		}
+		errorCode = this->WriteMessageChunk((void*)pPrefix, dwPrefixLength);
+		while ((errorCode == S_OK) && (qwLength != 0))
+		{
+			qwSliceLength = (qwLength < this->MaxFramePayloadLength) ? qwLength : this->MaxFramePayloadLength;
+			if (qwSliceLength > IIS_WEB_SOCKET_MAX_CHUNK_LENGTH) {
+				qwSliceLength = IIS_WEB_SOCKET_MAX_CHUNK_LENGTH;
+			}
+			errorCode = this->WriteMessageChunk(pBuffer, (DWORD)qwSliceLength);
+			pBuffer = (UCHAR*)pBuffer + qwSliceLength;
+			qwLength -= qwSliceLength;
+		}
+		if (errorCode != S_OK) {
+			this->AbortMessage();
+			return errorCode;
+		}
+		return this->EndMessage();
+	}
+
+	errorCode = this->EnterMessage("WebSocketServer::SendPrefixed() 'streamed message in progress'");
+	if (errorCode != S_OK) {
+		this->ErrorCode = errorCode;
+		return errorCode;
+	}
+
+	this->LogMessage(bufferType, pPrefix, dwPrefixLength, pBuffer, qwLength);
+
+	EnterCriticalSection(&this->FrameLock);
+
+	// Clear the response
+	pHttpResponse->Clear();
+
+	// The prefix is written with the frame header, the payload is written directly
+	errorCode = this->EncodeFrameOpcode(bufferType, &frameByte);
+	if (errorCode == S_OK)
+	{
+		dwHeaderLength = EncodeWebSocketFrameHeader(frameHeader, frameByte, dwPrefixLength + qwLength);
+		memcpy(frameHeader + dwHeaderLength, pPrefix, dwPrefixLength);
+
+		// Trace the frame
+		if (TraceEnabled.load(std::memory_order_relaxed)) {
+			TraceFrame(this->ConnectionId, IIS_WEB_SOCKET_TRACE_OUTBOUND, frameByte & 0x0F, true,
+				dwPrefixLength + qwLength, dwHeaderLength, frameHeader + dwHeaderLength, dwPrefixLength);
+		}
+
+		errorCode = this->WriteMemory(frameHeader, dwHeaderLength + dwPrefixLength, pBuffer, qwLength);
+	}
+	if (errorCode == S_OK) {
+		errorCode = this->EndWrite(FALSE);
+	}
+
+	LeaveCriticalSection(&this->FrameLock);
+
+	LeaveCriticalSection(&this->MessageLock);
+
+	// Set class error code
+	this->ErrorCode = errorCode;
+
+	return errorCode;
+}
+
+bool WebSocketServer::WriteChannelMessage(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength)
+{
+	WebSocketServer* pWebSocketServer = (WebSocketServer*)pContext;
+
+	return pWebSocketServer->SendPrefixed(bufferType, (const UCHAR*)pPrefix, prefixLength, (void*)pData, qwLength) == S_OK;
+}
+
+unsigned long WebSocketServer::ReadAsync(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending)
+{
+	WebSocketServer* pWebSocketServer;
+	HRESULT errorCode;
+	BOOL fCompletionPending;
+	DWORD cbRead;
+
+	pWebSocketServer = (WebSocketServer*)pContext;
+
+	// Reset parameters
+	*pdwBytesRead = 0;
+	cbRead = 0;
+	fCompletionPending = FALSE;
+
+	// Receive data, the completion is delivered to the module's OnAsyncCompletion
+	errorCode = pWebSocketServer->pHttpRequest->ReadEntityBody(pBuffer, dwLength, TRUE, &cbRead, &fCompletionPending);
+	if (HRESULT_CODE(errorCode) == ERROR_HANDLE_EOF) {
+		// Reading 0 bytes ends the connection
+		return S_OK;
+	}
+	if ((errorCode != S_OK) && (HRESULT_CODE(errorCode) != ERROR_MORE_DATA)) {
+		PrintLastError(errorCode, pWebSocketServer->ErrorDescription, pWebSocketServer->ErrorBufferLength, "ReadEntityBody()");
+		pWebSocketServer->ErrorCode = errorCode;
+		return errorCode;
+	}
+
+	*pdwBytesRead = cbRead;
+	*pbPending = (fCompletionPending != FALSE);
+
+	return S_OK;
+}
+
+unsigned long WebSocketServer::WriteAsync(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending)
+{
+	WebSocketServer* pWebSocketServer = (WebSocketServer*)pContext;
+
+	// Send writes synchronously, the flush policy, fragmentation and the session log all apply
+	*pbPending = false;
+	return pWebSocketServer->Send(bufferType, (void*)pData, qwLength);
+}
+
+bool WebSocketServer::QueueDrainClose(void* pConnection, WEB_SOCKET_SHARED_FRAME* pFrame, void* pContext)
+{
+	UNREFERENCED_PARAMETER(pContext);
+
+	// Queued behind the messages already waiting, so the client gets them before the close
+	return ((WebSocketServer*)pConnection)->QueueSharedFrame(pFrame) == S_OK;
+}
+
+void WebSocketServer::AbortDrain(void* pConnection, void* pContext)
+{
+	UNREFERENCED_PARAMETER(pContext);
+
+	// The pending read fails, and the connection's thread ends it
+	((WebSocketServer*)pConnection)->pHttpResponse->ResetConnection();
+}
+
+DWORD WebSocketServer::QueueMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, const CHAR* pKey)
+{
+	DWORD errorCode;
+
+	// Only data messages are queued, control frames are sent with Send
+	if (((pBuffer == NULL) && (qwLength != 0)) ||
+		((bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) &&
+		(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE))) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::QueueMessage() 'input paramter'");
+		return errorCode;
+	}
+
+	return this->PushQueue(bufferType, pBuffer, qwLength, NULL, pKey);
+}
+
+DWORD WebSocketServer::QueueSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame, const CHAR* pKey)
+{
+	DWORD errorCode;
+
+	// Shared frames are made by CreateSharedFrame, a control frame is written when its turn in the queue comes
+	if (pFrame == NULL) {
+		errorCode = ERROR_INVALID_PARAMETER;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::QueueSharedFrame() 'input paramter'");
+		return errorCode;
+	}
+
+	return this->PushQueue(pFrame->BufferType, NULL, pFrame->qwPayloadLength, pFrame, pKey);
+}
+
+DWORD WebSocketServer::PushQueue(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, WEB_SOCKET_SHARED_FRAME* pFrame, const CHAR* pKey)
+{
+	DWORD errorCode;
+	IIS_WEB_SOCKET_QUEUE_RESULT result;
+	BOOL bReset;
+
+	// Set success
+	errorCode = S_OK;
+	bReset = FALSE;
+
+	EnterCriticalSection(&this->QueueLock);
+
+	// Report a failed write from the queue writer
+	if (this->QueueErrorCode != S_OK) {
+		errorCode = this->QueueErrorCode;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::PushQueue() 'queued write'");
+		goto exit;
+	}
+
+	// The limit and policy can be changed at any time
+	this->OutboundQueue.qwLimit = this->MaxOutboundBytes;
+	this->OutboundQueue.Policy = this->OutboundPolicy;
+
+	if (pFrame != NULL) {
+		result = PushOutboundFrame(&this->OutboundQueue, pFrame, pKey, QueueTimestamp());
+	}
+	else {
+		result = PushOutboundMessage(&this->OutboundQueue, bufferType, pBuffer, qwLength, pKey, QueueTimestamp());
+	}
+	if (result == IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_QUEUE_RESULT) {
+		errorCode = ERROR_NOT_ENOUGH_MEMORY;
+		PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "WebSocketServer::PushQueue()");
+		goto exit;
+	}
+	if (result == IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT) {
+		// The writer is stuck in a write the client isn't reading, only a reset gets it out
+		bReset = !this->bQueueReset;
+		this->bQueueReset = TRUE;
+		errorCode = ERROR_CONNECTION_ABORTED;
+		strcpy_s(this->ErrorDescription, this->ErrorBufferLength, "The client wasn't keeping up with queued messages, the connection was reset");
+		goto exit;
+	}
+
+	// Start the writer, the work item is created the first time it's needed
+	if ((!this->bQueueWriting) && (this->OutboundQueue.pHead != NULL))
+	{
+		if (this->pQueueWork == NULL) {
+			this->pQueueWork = CreateThreadpoolWork(QueueWorkCallback, this, NULL);
+			if (this->pQueueWork == NULL) {
+				errorCode = GetLastError();
+				PrintLastError(errorCode, this->ErrorDescription, this->ErrorBufferLength, "CreateThreadpoolWork()");
+				goto exit;
+			}
+		}
+		this->bQueueWriting = TRUE;
+		SubmitThreadpoolWork(this->pQueueWork);
+	}
+
+exit:
+
+	LeaveCriticalSection(&this->QueueLock);
+
+	// Reset outside the lock, the writer takes it when its write fails
+	if (bReset) {
+		this->pHttpResponse->ResetConnection();
+	}
+
+	return errorCode;
+}
+
+VOID WebSocketServer::GetOutboundStats(IIS_WEB_SOCKET_OUTBOUND_STATS* pStats)
+{
+	unsigned long long qwNow;
+
+	EnterCriticalSection(&this->QueueLock);
+
+	*pStats = this->OutboundQueue.Stats;
+
+	// Include a stall that's still going
+	if (this->OutboundQueue.bStalled) {
+		qwNow = QueueTimestamp();
+		if (qwNow > this->OutboundQueue.qwStallStart) {
+			pStats->StallTime += qwNow - this->OutboundQueue.qwStallStart;
+		}
+	}
+
+	LeaveCriticalSection(&this->QueueLock);
+}
+
+BOOL WebSocketServer::IsConnected()
+{
+	BOOL bClosed;
+
+	EnterCriticalSection(&this->CloseLock);
+	bClosed = (this->CloseHandshake.State == IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE);
+	LeaveCriticalSection(&this->CloseLock);
+
+	return (!bClosed) && (this->pHttpConnection->IsConnected());
+}
+
+VOID WebSocketServer::Free()
+{
+	PTP_WORK pQueueWork;
+
+	// Write and close the capture file
+	this->StopCapture();
+
+	// Stop the queue writer, it finishes the message it's writing, nothing can be queued after this
+	EnterCriticalSection(&this->QueueLock);
+	ClearOutboundQueue(&this->OutboundQueue);
+	this->QueueErrorCode = ERROR_INVALID_HANDLE;
+	pQueueWork = this->pQueueWork;
+	this->pQueueWork = NULL;
+	LeaveCriticalSection(&this->QueueLock);
+	if (pQueueWork) {
+		WaitForThreadpoolWorkCallbacks(pQueueWork, FALSE);
+		CloseThreadpoolWork(pQueueWork);
+	}
+
+	if (this->Stream.pFrameBuffer) {
+		this->FreeMemory(this->Stream.pFrameBuffer, IIS_WEB_SOCKET_FRAME_BUFFER_SIZE);
 	}
 
 	if (this->ErrorDescription) {
-		free(this->ErrorDescription);
+		this->FreeMemory(this->ErrorDescription, this->ErrorBufferLength);
 	}
 
 	if (this->pRequestHeaders) {
-		free(this->pRequestHeaders);
+		this->FreeMemory(this->pRequestHeaders, IIS_WEB_SOCKET_REQUEST_HEADERS_SIZE);
+	}
+
+	// Keep the session for a client that reconnects
+	if (this->pSessions != NULL) {
+		this->pSessions->Detach(&this->Session);
+	}
+
+	// Stop the flush timer and wait for a running callback
+	if (this->pFlushTimer) {
+		SetThreadpoolTimer(this->pFlushTimer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(this->pFlushTimer, TRUE);
+		CloseThreadpoolTimer(this->pFlushTimer);
 	}
+
+	// Stop the close timer the same way
+	if (this->pCloseTimer) {
+		SetThreadpoolTimer(this->pCloseTimer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(this->pCloseTimer, TRUE);
+		CloseThreadpoolTimer(this->pCloseTimer);
+	}
+
+	if (this->pCoalesceBuffer) {
+		this->FreeMemory(this->pCoalesceBuffer, IIS_WEB_SOCKET_COALESCE_BUFFER_SIZE);
+	}
+
+	// Discard any reassembled message
+	this->ResetAssembly();
+
+	if (this->Assembly.pBuffer) {
+		this->FreeMemory(this->Assembly.pBuffer, this->Assembly.dwBufferSize);
+	}
+
+	DeleteCriticalSection(&this->MessageLock);
+	DeleteCriticalSection(&this->FrameLock);
+	DeleteCriticalSection(&this->QueueLock);
+	DeleteCriticalSection(&this->CloseLock);
 }
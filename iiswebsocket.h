@@ -20,6 +20,25 @@
 #include <windows.h>
 #include <httpserv.h>
 #include <sstream>
+#include <atomic>
+
+// Platform-neutral frame parsing and encoding
+#include "iiswebsocketframe.h"
+
+// Trace file format for the frame tracer
+#include "iiswebsockettrace.h"
+
+// Capture file format for StartCapture
+#include "iiswebsocketcapture.h"
+
+// Logical channels over one connection
+#include "iiswebsocketchannel.h"
+
+// Resumable sessions with a replay log in shared memory
+#include "iiswebsocketsession.h"
+
+// Coroutine connections, with C++20
+#include "iiswebsocketcoroutine.h"
 
 // Include header required for generating handshake HTTP headers
 #include <websocket.h>
@@ -32,33 +51,62 @@ namespace IISWebSocketServer
 	// Print a Windows Error Code
 	void PrintLastError(DWORD errorCode, CHAR* des, size_t desLen, CHAR* action, bool append = false);
 
-	// Parsed WebSocket frame
-	struct WEB_SOCKET_FRAME
+	// Start tracing frames of all connections to a memory-mapped trace file
+	DWORD StartTrace(const WCHAR* pFilePath, unsigned long long qwRecordCapacity);
+
+	// Stop tracing and close the trace file
+	VOID StopTrace();
+
+	// The phases of the receive and send pipeline timed by the latency histograms
+	typedef enum class _IIS_WEB_SOCKET_LATENCY_PHASE
+	{
+		// Waiting in ReadEntityBody for frame headers and payload
+		IIS_WEB_SOCKET_READ_WAIT_LATENCY_PHASE = 0,
+		// Parsing frame headers
+		IIS_WEB_SOCKET_PARSE_LATENCY_PHASE = 1,
+		// Unmasking the payload
+		IIS_WEB_SOCKET_UNMASK_LATENCY_PHASE = 2,
+		// Application handling, from Receive returning a message to the next call to Receive
+		IIS_WEB_SOCKET_DISPATCH_LATENCY_PHASE = 3,
+		// Writing frames with WriteEntityChunks
+		IIS_WEB_SOCKET_WRITE_LATENCY_PHASE = 4,
+		// Flushing the response
+		IIS_WEB_SOCKET_FLUSH_LATENCY_PHASE = 5
+	} IIS_WEB_SOCKET_LATENCY_PHASE;
+
+	// The number of latency phases
+#define IIS_WEB_SOCKET_LATENCY_PHASE_COUNT 6
+
+	// Latency of a single phase, all times are in nanoseconds
+	struct IIS_WEB_SOCKET_LATENCY_PERCENTILES
 	{
-		// 0x00 = Continuation frame
-		// 0x01 = Text frame
-		// 0x02 = Binary frame
-		// 0x08 = Connection close
-		// 0x09 = Ping
-		// 0x0A = Pong
-		int Opcode;
-		bool FIN;
-		unsigned long long PayloadLength;
-		bool bMask;
-		char MaskingKey[4];
-		unsigned int FrameSize;
+		unsigned long long Count;
+		unsigned long long Min;
+		unsigned long long Max;
+		unsigned long long Mean;
+		unsigned long long P50;
+		unsigned long long P99;
+		unsigned long long P999;
 	};
 
-	// WebSocket buffer type
-	typedef enum class _IIS_WEB_SOCKET_BUFFER_TYPE {
-		IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE = 0,
-		IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE = 1,
-		IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE = 2,
-		IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE = 3,
-		IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE = 4,
-		IIS_WEB_SOCKET_PING_BUFFER_TYPE = 5,
-		IIS_WEB_SOCKET_PONG_BUFFER_TYPE = 6
-	} IIS_WEB_SOCKET_BUFFER_TYPE;
+	// The latency histograms of all threads merged by GetLatencySnapshot
+	struct IIS_WEB_SOCKET_LATENCY_SNAPSHOT
+	{
+		// Indexed by IIS_WEB_SOCKET_LATENCY_PHASE
+		IIS_WEB_SOCKET_LATENCY_PERCENTILES Phases[IIS_WEB_SOCKET_LATENCY_PHASE_COUNT];
+	};
+
+	// Turn the per-phase latency histograms on or off
+	VOID EnableLatencyHistograms(BOOL bEnable);
+
+	// Discard everything recorded in the latency histograms
+	VOID ResetLatencyHistograms();
+
+	// Merge the latency histograms of all threads into a snapshot
+	DWORD GetLatencySnapshot(IIS_WEB_SOCKET_LATENCY_SNAPSHOT* pSnapshot);
+
+	// Set inbound rate limits shared by all connections, NULL removes them
+	VOID SetGlobalRateLimits(const IIS_WEB_SOCKET_RATE_LIMITS* pLimits);
 
 	// WebSocket close status
 	typedef enum class _IIS_WEB_SOCKET_CLOSE_STATUS
@@ -92,21 +140,47 @@ namespace IISWebSocketServer
 		}
 	};
 
-	// WebSocket receiving stream
-	struct WEB_SOCKET_STREAM
+	// A complete message returned by ReceiveMessage
+	struct WEB_SOCKET_MESSAGE
 	{
-		// Set to true when we are queuing a new frame
-		BOOL bQueuing;
-		// The frame buffer
-		CHAR* pFrameBuffer;
-		// The total bytes received in the frame buffer
-		DWORD dwReceivedSize;
-		// Remaining payload to receive
-		unsigned long long qwPayloadRemaining;
-		// Index of the current payload byte to unmask
-		unsigned long long mkI;
+		// The type of message, a complete data message or a control frame
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		// The message payload, valid until ReleaseMessage or the next call to ReceiveMessage
+		CHAR* pData;
+		// The length of the message payload in bytes
+		unsigned long long qwLength;
+		// Set to true when pData is a mapped view of a spill file
+		BOOL bMapped;
 	};
 
+	// WebSocket message reassembly, used by ReceiveMessage
+	struct WEB_SOCKET_MESSAGE_ASSEMBLY
+	{
+		// Set to true while a data message is being reassembled
+		BOOL bInProgress;
+		// Set to true when a completed message is held for the application
+		BOOL bComplete;
+		// The fragment buffer type of the message being reassembled
+		IIS_WEB_SOCKET_BUFFER_TYPE FragmentType;
+		// The in-memory reassembly buffer, used as a receive buffer once the message spills
+		CHAR* pBuffer;
+		// The size of the reassembly buffer in bytes
+		DWORD dwBufferSize;
+		// The number of payload bytes received for the message
+		unsigned long long qwLength;
+		// The temporary file the message spills to once it exceeds SpillThreshold
+		HANDLE hSpillFile;
+		// The file mapping and view of the spill file, created when the message is complete
+		HANDLE hSpillMapping;
+		void* pSpillView;
+		// The payload of the last control frame
+		CHAR ControlBuffer[125];
+	};
+
+	// Application callback that produces the payload for SendFromProducer
+	// Set *pdwBytesProduced to 0 to end a message of unknown length
+	typedef DWORD(*PFN_IIS_WEB_SOCKET_PRODUCER)(void* pContext, void* pBuffer, DWORD dwBufferLength, DWORD* pdwBytesProduced);
+
 	// WebSocket server class
 	class WebSocketServer
 	{
@@ -120,12 +194,158 @@ namespace IISWebSocketServer
 		WEB_SOCKET_HTTP_HEADER* pRequestHeaders;
 		ULONG RequestHeadersCount;
 		// This is set according to the Send function
-		BOOL IsFragment;
+		bool IsFragment;
+		// The streamed message being sent, changed under the message lock and the frame lock
+		// No lock is held between BeginMessage, WriteMessageChunk and EndMessage, any thread can make the next call
+		WEB_SOCKET_SEND_STREAM SendStream;
+		// The thread that made the last call of the streamed message, it gets an error instead of waiting for the message to end
+		DWORD StreamThreadId;
+		// Held while a data message is being sent
+		CRITICAL_SECTION MessageLock;
+		// Held while a single frame is being written
+		CRITICAL_SECTION FrameLock;
+		// Woken when a streamed message ends, data messages wait for it under the message lock
+		CONDITION_VARIABLE StreamEnded;
+		// Woken when a frame of declared length ends, control frames wait for it under the frame lock
+		CONDITION_VARIABLE FrameEnded;
+		// Take the message lock once no streamed message is in progress, pError describes the error returned to the thread sending it
+		DWORD EnterMessage(const char* pError);
+		// Take the frame lock once no frame of declared length is in progress, pError describes the error returned to the thread sending it
+		DWORD EnterFrame(const char* pError);
+		// Get the first frame byte (FIN and Opcode) for a buffer type
+		DWORD EncodeFrameOpcode(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, UCHAR* pFrameByte);
+		DWORD PlanFragment(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwRemaining, UCHAR* pFrameByte, unsigned long long* pqwFrameLength);
+		// Write data chunks to the response until all bytes are written
+		DWORD WriteChunks(HTTP_DATA_CHUNK* pDataChunks, DWORD dwChunkCount);
+		// Write a prefix and a payload from memory to the response
+		DWORD WriteMemory(UCHAR* pPrefix, DWORD dwPrefixLength, void* pPayload, unsigned long long qwPayloadLength);
+		// Write a frame header followed by the first qwBytes of the payload
+		DWORD WriteFrame(UCHAR frameByte, unsigned long long qwPayloadLength, void* pPayload, unsigned long long qwBytes);
+		// Write what a call of the sending stream returned, followed by the chunk
+		DWORD WriteSendFrame(const WEB_SOCKET_SEND_FRAME* pFrame, void* pBuffer, DWORD dwLength);
+		// Frames coalesced by the flush policy
+		UCHAR* pCoalesceBuffer;
+		DWORD dwCoalescedLength;
+		// Flushes coalesced frames after FlushDelay
+		PTP_TIMER pFlushTimer;
+		BOOL bFlushTimerSet;
+		// Error of a flush done by the timer, returned by the next Send
+		DWORD FlushErrorCode;
+		// Write the coalesced frames to the response
+		DWORD WriteCoalesced();
+		// Write the coalesced frames and flush the response
+		DWORD FlushResponse();
+		// Flush or schedule a flush according to the flush policy
+		DWORD EndWrite(BOOL bUrgent);
+		// Send a close, ping or pong frame
+		DWORD SendControl(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength);
+		// The closing handshake and its timer, changed under the close lock
+		// Never held while taking another lock, so the timer isn't held up by a send blocked under the frame lock
+		CRITICAL_SECTION CloseLock;
+		WEB_SOCKET_CLOSE_HANDSHAKE CloseHandshake;
+		// Aborts the connection when the client doesn't answer the server's close frame within CloseTimeout
+		PTP_TIMER pCloseTimer;
+		// Call before sending a close frame while holding the frame lock, returns FALSE if it must not be sent
+		BOOL BeginClose();
+		// Start or restart the close timer
+		VOID SetCloseTimer(unsigned long long qwMilliseconds);
+		static VOID CALLBACK CloseTimerCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_TIMER Timer);
+		// End a streamed message without sending anything, wakes the messages and frames waiting for it
+		VOID AbortMessage();
+		// The message being reassembled by ReceiveMessage
+		WEB_SOCKET_MESSAGE_ASSEMBLY Assembly;
+		// Make room in the reassembly buffer, or start spilling to a temporary file
+		DWORD GrowAssembly();
+		// Discard the reassembled message, its buffer is kept for the next message
+		VOID ResetAssembly();
+		// When Receive last returned a message, the start of the dispatch phase
+		unsigned long long DispatchTimestamp;
+		// Reads from the request entity body for the protocol core, pContext is the WebSocketServer
+		static unsigned long ReadCallback(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead);
+		// The capture file and the records waiting to be written to it
+		HANDLE hCaptureFile;
+		UCHAR* pCaptureBuffer;
+		DWORD dwCaptureLength;
+		// Add a chunk returned by ReadEntityBody to the capture file
+		VOID WriteCapture(void* pChunk, DWORD dwLength);
+		// Write the buffered capture records to the capture file
+		DWORD FlushCapture();
+		// The connection's own rate limits
+		WEB_SOCKET_RATE_LIMITER RateLimiter;
+		BOOL bRateLimited;
+		// When reading may start again after a rate limit was hit, 0 when reading isn't paused
+		unsigned long long qwRateLimitResume;
+		// Charge received frames, bytes and messages to the connection and global rate limits
+		DWORD ChargeRateLimits(unsigned long long qwFrames, unsigned long long qwBytes, unsigned long long qwMessages);
+		// Messages queued by QueueMessage, written by a thread pool work item
+		WEB_SOCKET_OUTBOUND_QUEUE OutboundQueue;
+		CRITICAL_SECTION QueueLock;
+		PTP_WORK pQueueWork;
+		BOOL bQueueWriting;
+		// Set once the disconnect policy has reset the connection
+		BOOL bQueueReset;
+		// Error of a write done by the queue writer, returned by the next QueueMessage
+		DWORD QueueErrorCode;
+		// Write queued messages until the queue is empty
+		VOID WriteQueue();
+		// Add a copied message or a shared frame to the outbound queue and start the writer
+		DWORD PushQueue(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, WEB_SOCKET_SHARED_FRAME* pFrame, const CHAR* pKey);
+		// Write a shared frame as it was encoded
+		DWORD SendSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame);
+		// Send a message whose payload is a short prefix followed by the buffer, without copying them together
+		DWORD SendPrefixed(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const UCHAR* pPrefix, DWORD dwPrefixLength, void* pBuffer, unsigned long long qwLength);
+		static VOID CALLBACK QueueWorkCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work);
+		// The connection's resumable session
+		WEB_SOCKET_SESSION Session;
+		// Set while the messages a resumed session missed are sent, they're already in the log
+		BOOL bSessionReplay;
+		// Set by SendPrefixed when the message it streams with BeginMessage is already in the log
+		BOOL bStreamLogged;
+		// Number a data message sent to the session, whole messages are added to its log
+		VOID LogMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pPrefix, DWORD dwPrefixLength, const void* pData, unsigned long long qwLength);
+		// Number a data message that can't be added to the log, the session can't be resumed from before it
+		VOID SkipMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType);
+		// The library-owned memory of the connection, everything charged to it is charged to the global account too
+		WEB_SOCKET_MEMORY_ACCOUNT MemoryAccount;
+		// Allocate memory charged to the connection, NULL if out of memory or over a hard budget
+		void* AllocateMemory(size_t size);
+		// Free memory allocated with AllocateMemory
+		VOID FreeMemory(void* pMemory, size_t size);
 	public:
+		// Unique id of the connection, used in trace records
+		unsigned long long ConnectionId;
 		// The parsed recieved WebSocket frame
 		WEB_SOCKET_FRAME WebSocketFrame;
 		// The maximum a payload can be in a frame
 		unsigned long long MaxPayloadLength;
+		// The maximum length of a message reassembled by ReceiveMessage (0 = no limit)
+		unsigned long long MaxMessageLength;
+		// Messages larger than this are reassembled in a temporary file instead of memory (0 = never)
+		DWORD SpillThreshold;
+		// When frames are flushed to the network
+		IIS_WEB_SOCKET_FLUSH_POLICY FlushPolicy;
+		// Pending bytes that trigger a flush with the size threshold policy
+		DWORD FlushThreshold;
+		// The longest a frame waits to be flushed in microseconds, when the policy isn't immediate
+		DWORD FlushDelay;
+		// The maximum payload of an outgoing frame, larger messages are sent as fragments (0 = no limit)
+		unsigned long long MaxFramePayloadLength;
+		// The most payload bytes QueueMessage holds for a client that isn't keeping up (0 = no limit)
+		unsigned long long MaxOutboundBytes;
+		// What QueueMessage does when MaxOutboundBytes is reached
+		IIS_WEB_SOCKET_OUTBOUND_POLICY OutboundPolicy;
+		// Milliseconds a client may stay over its rate limits before it's closed with a policy violation (0 = never)
+		DWORD RateLimitCloseDelay;
+		// Milliseconds the client has to answer the server's close frame before the connection is aborted (0 = wait forever)
+		DWORD CloseTimeout;
+		// Accept the channel protocol when the client offers it in 'Sec-WebSocket-Protocol', set before PerformHandshake
+		BOOL AcceptChannels;
+		// Set by PerformHandshake when the channel protocol was accepted
+		BOOL ChannelsNegotiated;
+		// Resumable sessions, set before PerformHandshake to number the messages sent and keep them for a reconnecting client
+		WebSocketSessions* pSessions;
+		// Set by PerformHandshake when the client resumed its session, the messages it missed have been sent
+		BOOL SessionResumed;
 		// The receiving WebSocket stream
 		WEB_SOCKET_STREAM Stream;
 		// Error of the called function
@@ -138,11 +358,55 @@ namespace IISWebSocketServer
 		DWORD Initialize();
 		// Perform a WebSocket handshake with a client
 		HRESULT PerformHandshake(IHttpContext* pHttpContext);
-		// Receive data from the WebSocket client
+		// Receive data from the WebSocket client, a close frame is answered before it's returned
 		DWORD Receive(void* pBuffer, DWORD dwBufferLength, DWORD* pdwBytesReceived, IIS_WEB_SOCKET_BUFFER_TYPE* pBufferType);
+		// Receive a complete message from the WebSocket client
+		DWORD ReceiveMessage(WEB_SOCKET_MESSAGE* pMessage);
+		// Release the memory or mapped view of the last message returned by ReceiveMessage
+		VOID ReleaseMessage();
 		// Send data to the WebSocket client
-		DWORD Send(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, DWORD dwLength);
-		// Determines whether a WebSocket client is still connected
+		DWORD Send(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, BOOL bUrgent = FALSE);
+		// Flush frames held back by the flush policy
+		DWORD FlushNow();
+		// Begin sending a message in chunks
+		DWORD BeginMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwMessageLength);
+		// Send the next chunk of a message started with BeginMessage
+		DWORD WriteMessageChunk(void* pBuffer, DWORD dwLength);
+		// Finish a message started with BeginMessage
+		DWORD EndMessage();
+		// Send a message whose payload is generated by a producer callback
+		DWORD SendFromProducer(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwMessageLength, PFN_IIS_WEB_SOCKET_PRODUCER pfnProducer, void* pContext);
+		// Send part of a file to the WebSocket client, the payload is transferred by the kernel from the file handle
+		DWORD SendFile(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, HANDLE hFile, unsigned long long qwOffset, unsigned long long qwLength);
+		// Queue a message to be sent from a thread pool thread, the caller never waits for a slow client
+		DWORD QueueMessage(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, void* pBuffer, unsigned long long qwLength, const CHAR* pKey = NULL);
+		// Queue a frame encoded once for many connections, like QueueMessage without copying the payload
+		DWORD QueueSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame, const CHAR* pKey = NULL);
+		// Get the counters of the messages queued by QueueMessage
+		VOID GetOutboundStats(IIS_WEB_SOCKET_OUTBOUND_STATS* pStats);
+		// Set the connection's inbound rate limits, NULL removes them
+		VOID SetRateLimits(const IIS_WEB_SOCKET_RATE_LIMITS* pLimits);
+		// Set the connection's memory budgets, NULL removes them
+		VOID SetMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget);
+		// Get the library-owned memory the connection holds
+		VOID GetMemoryStats(IIS_WEB_SOCKET_MEMORY_STATS* pStats);
+		// Start recording the bytes received from the client to a capture file, for replaying with the replay tool
+		DWORD StartCapture(const WCHAR* pFilePath);
+		// Write the remaining records and close the capture file
+		VOID StopCapture();
+		// Write a message for WebSocketChannels, pContext is the WebSocketServer
+		static bool WriteChannelMessage(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+			const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength);
+		// Read for WebSocketAsyncConnection with ReadEntityBody, pContext is the WebSocketServer
+		// A pending read completes in the module's OnAsyncCompletion, which passes it to WebSocketAsyncConnection::CompleteRead
+		static unsigned long ReadAsync(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending);
+		// Write for WebSocketAsyncConnection with Send, never pending, pContext is the WebSocketServer
+		static unsigned long WriteAsync(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending);
+		// Queue a drain's close frame for WebSocketDrain, pConnection is the WebSocketServer
+		static bool QueueDrainClose(void* pConnection, WEB_SOCKET_SHARED_FRAME* pFrame, void* pContext);
+		// Reset a connection that didn't answer a drain's close frame for WebSocketDrain, pConnection is the WebSocketServer
+		static void AbortDrain(void* pConnection, void* pContext);
+		// Determines whether a WebSocket client is still connected, FALSE once the closing handshake is done
 		BOOL IsConnected();
 		// Free resources
 		VOID Free();
@@ -0,0 +1,569 @@
+
+//
+// iiswebsocketbus.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     A message bus between the worker processes of a web garden, a ring buffer in shared memory.
+//
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "iiswebsocketbus.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+using namespace IISWebSocketServer;
+
+// The shared structures are used by several processes, their atomics can't be locks
+static_assert(std::atomic<unsigned int>::is_always_lock_free, "the bus needs lock-free 32-bit atomics");
+static_assert(std::atomic<unsigned long long>::is_always_lock_free, "the bus needs lock-free 64-bit atomics");
+
+// A record in the ring, the NULL terminated topic and the payload follow it
+// Records are 16 byte aligned so the space left at the end of the ring always fits a padding record
+struct WEB_SOCKET_BUS_RECORD
+{
+	// The record length, including this header
+	unsigned int Length;
+	// IIS_WEB_SOCKET_BUS_PADDING for the record that fills the end of the ring
+	unsigned short TopicLength;
+	unsigned char BufferType;
+	unsigned char Reserved;
+	unsigned long long qwPayloadLength;
+};
+
+#define IIS_WEB_SOCKET_BUS_PADDING 0xFFFF
+#define IIS_WEB_SOCKET_BUS_ALIGN(x) (((x) + 15) & ~15ULL)
+#define IIS_WEB_SOCKET_BUS_HEADER_SIZE IIS_WEB_SOCKET_BUS_ALIGN(sizeof(WEB_SOCKET_BUS_HEADER))
+
+//
+// Shared memory
+//
+
+#ifdef _WIN32
+
+bool IISWebSocketServer::OpenSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory, const char* pName, size_t size, bool* pbCreated)
+{
+	char name[0x100];
+	MEMORY_BASIC_INFORMATION info;
+
+	memset(pMemory, 0, sizeof(WEB_SOCKET_SHARED_MEMORY));
+	snprintf(name, sizeof(name), "Local\\%s", pName);
+
+	// The size is ignored when the mapping already exists
+	pMemory->hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, name);
+	if (pMemory->hMapping == NULL) {
+		return false;
+	}
+	*pbCreated = (GetLastError() != ERROR_ALREADY_EXISTS);
+
+	pMemory->pView = MapViewOfFile(pMemory->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if ((pMemory->pView == NULL) || (VirtualQuery(pMemory->pView, &info, sizeof(info)) == 0)) {
+		CloseSharedMemory(pMemory);
+		return false;
+	}
+	pMemory->Size = info.RegionSize;
+
+	return true;
+}
+
+void IISWebSocketServer::CloseSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory)
+{
+	if (pMemory->pView != NULL) {
+		UnmapViewOfFile(pMemory->pView);
+	}
+	if (pMemory->hMapping != NULL) {
+		CloseHandle(pMemory->hMapping);
+	}
+	memset(pMemory, 0, sizeof(WEB_SOCKET_SHARED_MEMORY));
+}
+
+void IISWebSocketServer::RemoveSharedMemory(const char* pName)
+{
+	(void)pName;
+}
+
+unsigned long IISWebSocketServer::GetBusProcessId()
+{
+	return GetCurrentProcessId();
+}
+
+bool IISWebSocketServer::IsBusProcessAlive(unsigned long processId)
+{
+	HANDLE hProcess;
+	bool bAlive;
+
+	hProcess = OpenProcess(SYNCHRONIZE, FALSE, processId);
+	if (hProcess == NULL) {
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+	bAlive = (WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT);
+	CloseHandle(hProcess);
+
+	return bAlive;
+}
+
+#else
+
+bool IISWebSocketServer::OpenSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory, const char* pName, size_t size, bool* pbCreated)
+{
+	char name[0x100];
+	struct stat status;
+
+	memset(pMemory, 0, sizeof(WEB_SOCKET_SHARED_MEMORY));
+	pMemory->fd = -1;
+	snprintf(name, sizeof(name), "/%s", pName);
+
+	// Only one process creates the region and sets its size
+	*pbCreated = false;
+	pMemory->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (pMemory->fd >= 0)
+	{
+		*pbCreated = true;
+		if (ftruncate(pMemory->fd, (off_t)size) != 0) {
+			CloseSharedMemory(pMemory);
+			shm_unlink(name);
+			return false;
+		}
+	}
+	else if (errno == EEXIST) {
+		pMemory->fd = shm_open(name, O_RDWR, 0600);
+	}
+	if (pMemory->fd < 0) {
+		return false;
+	}
+
+	// A region that was just created may not have its size yet
+	for (int i = 0; ; i++)
+	{
+		if (fstat(pMemory->fd, &status) != 0) {
+			CloseSharedMemory(pMemory);
+			return false;
+		}
+		if (status.st_size != 0) {
+			break;
+		}
+		if (i == 1000) {
+			CloseSharedMemory(pMemory);
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	pMemory->Size = (size_t)status.st_size;
+
+	pMemory->pView = mmap(NULL, pMemory->Size, PROT_READ | PROT_WRITE, MAP_SHARED, pMemory->fd, 0);
+	if (pMemory->pView == MAP_FAILED) {
+		pMemory->pView = NULL;
+		CloseSharedMemory(pMemory);
+		return false;
+	}
+
+	return true;
+}
+
+void IISWebSocketServer::CloseSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory)
+{
+	if (pMemory->pView != NULL) {
+		munmap(pMemory->pView, pMemory->Size);
+	}
+	if (pMemory->fd >= 0) {
+		close(pMemory->fd);
+	}
+	memset(pMemory, 0, sizeof(WEB_SOCKET_SHARED_MEMORY));
+	pMemory->fd = -1;
+}
+
+void IISWebSocketServer::RemoveSharedMemory(const char* pName)
+{
+	char name[0x100];
+
+	snprintf(name, sizeof(name), "/%s", pName);
+	shm_unlink(name);
+}
+
+unsigned long IISWebSocketServer::GetBusProcessId()
+{
+	return (unsigned long)getpid();
+}
+
+bool IISWebSocketServer::IsBusProcessAlive(unsigned long processId)
+{
+	return (kill((pid_t)processId, 0) == 0) || (errno == EPERM);
+}
+
+#endif
+
+//
+// Bus
+//
+
+bool WebSocketBus::Open(const char* pName, unsigned long long qwCapacity)
+{
+	bool bCreated;
+	unsigned long processId;
+	unsigned long slotProcessId;
+
+	this->pHeader = NULL;
+	this->pRing = NULL;
+	this->Slot = IIS_WEB_SOCKET_BUS_MAX_PROCESSES;
+	this->qwOverruns = 0;
+	this->hWakeEvent = NULL;
+	memset(this->WakeEvents, 0, sizeof(this->WakeEvents));
+	memset(this->WakeEventProcessIds, 0, sizeof(this->WakeEventProcessIds));
+	snprintf(this->Name, sizeof(this->Name), "%s", pName);
+
+	// The ring is a power of two so positions wrap with a mask
+	if (qwCapacity == 0) {
+		qwCapacity = IIS_WEB_SOCKET_BUS_DEFAULT_CAPACITY;
+	}
+	while ((qwCapacity & (qwCapacity - 1)) != 0) {
+		qwCapacity &= qwCapacity - 1;
+	}
+	if (qwCapacity < 0x1000) {
+		qwCapacity = 0x1000;
+	}
+
+	if (!OpenSharedMemory(&this->Memory, pName, (size_t)(IIS_WEB_SOCKET_BUS_HEADER_SIZE + qwCapacity), &bCreated)) {
+		return false;
+	}
+	this->pHeader = (WEB_SOCKET_BUS_HEADER*)this->Memory.pView;
+
+	// New shared memory is zeroed, the creator fills in the rest and sets the magic last
+	if (bCreated)
+	{
+		this->pHeader->Version = IIS_WEB_SOCKET_BUS_VERSION;
+		this->pHeader->qwCapacity = qwCapacity;
+		this->pHeader->Magic.store(IIS_WEB_SOCKET_BUS_MAGIC, std::memory_order_release);
+	}
+	else
+	{
+		for (int i = 0; this->pHeader->Magic.load(std::memory_order_acquire) != IIS_WEB_SOCKET_BUS_MAGIC; i++)
+		{
+			if (i == 1000) {
+				this->Close();
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if ((this->pHeader->Version != IIS_WEB_SOCKET_BUS_VERSION) ||
+			(IIS_WEB_SOCKET_BUS_HEADER_SIZE + this->pHeader->qwCapacity > this->Memory.Size)) {
+			this->Close();
+			return false;
+		}
+	}
+	this->pRing = (unsigned char*)this->Memory.pView + IIS_WEB_SOCKET_BUS_HEADER_SIZE;
+
+	// Take a free slot, or the slot of a process that exited without closing the bus
+	processId = GetBusProcessId();
+	for (this->Slot = 0; this->Slot < IIS_WEB_SOCKET_BUS_MAX_PROCESSES; this->Slot++)
+	{
+		slotProcessId = this->pHeader->Processes[this->Slot].ProcessId.load();
+		if (((slotProcessId == 0) || (!IsBusProcessAlive(slotProcessId))) &&
+			(this->pHeader->Processes[this->Slot].ProcessId.compare_exchange_strong(slotProcessId, processId))) {
+			break;
+		}
+	}
+	if (this->Slot == IIS_WEB_SOCKET_BUS_MAX_PROCESSES) {
+		this->Close();
+		return false;
+	}
+	this->pHeader->Processes[this->Slot].Waiting.store(0);
+	this->pHeader->Processes[this->Slot].Connections.store(0);
+
+#ifdef _WIN32
+	// Publishers open this event by name to wake this process
+	char eventName[0x100];
+	snprintf(eventName, sizeof(eventName), "Local\\%s-%u-%lu", pName, this->Slot, processId);
+	this->hWakeEvent = CreateEventA(NULL, FALSE, FALSE, eventName);
+	if (this->hWakeEvent == NULL) {
+		this->Close();
+		return false;
+	}
+#endif
+
+	// Start reading at the next message published
+	this->qwReadPosition = this->pHeader->qwWritePosition.load(std::memory_order_acquire);
+
+	return true;
+}
+
+void WebSocketBus::Wake()
+{
+#ifdef _WIN32
+	unsigned long processId;
+	char eventName[0x100];
+
+	for (unsigned int slot = 0; slot < IIS_WEB_SOCKET_BUS_MAX_PROCESSES; slot++)
+	{
+		if (this->pHeader->Processes[slot].Waiting.load() == 0) {
+			continue;
+		}
+
+		// Open the event of a process the first time it needs waking
+		processId = this->pHeader->Processes[slot].ProcessId.load();
+		if (this->WakeEventProcessIds[slot] != processId)
+		{
+			if (this->WakeEvents[slot] != NULL) {
+				CloseHandle(this->WakeEvents[slot]);
+			}
+			snprintf(eventName, sizeof(eventName), "Local\\%s-%u-%lu", this->Name, slot, processId);
+			this->WakeEvents[slot] = OpenEventA(EVENT_MODIFY_STATE, FALSE, eventName);
+			this->WakeEventProcessIds[slot] = processId;
+		}
+		if (this->WakeEvents[slot] != NULL) {
+			SetEvent(this->WakeEvents[slot]);
+		}
+	}
+#else
+	// Every process waits on the same futex word
+	if (this->pHeader->Waiters.load() != 0) {
+		syscall(SYS_futex, (unsigned int*)&this->pHeader->Sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+#endif
+}
+
+void WebSocketBus::Wait(unsigned int sequence, unsigned long dwTimeout)
+{
+#ifdef _WIN32
+	UNREFERENCED_PARAMETER(sequence);
+
+	// A publish after the flag is set always sees it
+	this->pHeader->Processes[this->Slot].Waiting.store(1);
+	if (this->pHeader->qwWritePosition.load() == this->qwReadPosition) {
+		WaitForSingleObject(this->hWakeEvent, dwTimeout);
+	}
+	this->pHeader->Processes[this->Slot].Waiting.store(0);
+#else
+	struct timespec timeout;
+
+	// The wait returns straight away if a publish changed the sequence since it was read
+	timeout.tv_sec = dwTimeout / 1000;
+	timeout.tv_nsec = (long)(dwTimeout % 1000) * 1000000;
+	this->pHeader->Waiters.fetch_add(1);
+	syscall(SYS_futex, (unsigned int*)&this->pHeader->Sequence, FUTEX_WAIT, sequence, &timeout, NULL, 0);
+	this->pHeader->Waiters.fetch_sub(1);
+#endif
+}
+
+bool WebSocketBus::Publish(const char* pTopic, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	WEB_SOCKET_BUS_RECORD record;
+	WEB_SOCKET_BUS_RECORD padding;
+	unsigned long long qwCapacity;
+	unsigned long long qwRecordLength;
+	unsigned long long qwPosition;
+	unsigned long long qwOffset;
+	unsigned long processId;
+	unsigned long owner;
+	size_t topicLength;
+
+	// A record is at most a quarter of the ring, so a publish in progress never reaches a record a reader has validated
+	qwCapacity = this->pHeader->qwCapacity;
+	topicLength = strlen(pTopic);
+	if ((topicLength >= IIS_WEB_SOCKET_BUS_PADDING) || (qwLength > qwCapacity)) {
+		return false;
+	}
+	qwRecordLength = IIS_WEB_SOCKET_BUS_ALIGN(sizeof(WEB_SOCKET_BUS_RECORD) + topicLength + 1 + qwLength);
+	if (qwRecordLength > qwCapacity / 4) {
+		return false;
+	}
+
+	// One publisher at a time, the lock of a process that died while holding it is taken over
+	processId = GetBusProcessId();
+	for (unsigned long long spin = 1; ; spin++)
+	{
+		owner = 0;
+		if (this->pHeader->PublishLock.compare_exchange_weak(owner, processId, std::memory_order_acquire)) {
+			break;
+		}
+		if ((spin % 0x10000) == 0) {
+			if ((owner != 0) && (!IsBusProcessAlive(owner)) &&
+				(this->pHeader->PublishLock.compare_exchange_strong(owner, processId, std::memory_order_acquire))) {
+				break;
+			}
+		}
+		if ((spin % 0x40) == 0) {
+			std::this_thread::yield();
+		}
+	}
+
+	// Fill the end of the ring with padding if the record doesn't fit
+	qwPosition = this->pHeader->qwWritePosition.load(std::memory_order_relaxed);
+	qwOffset = qwPosition & (qwCapacity - 1);
+	if (qwOffset + qwRecordLength > qwCapacity)
+	{
+		memset(&padding, 0, sizeof(padding));
+		padding.Length = (unsigned int)(qwCapacity - qwOffset);
+		padding.TopicLength = IIS_WEB_SOCKET_BUS_PADDING;
+		memcpy(this->pRing + qwOffset, &padding, sizeof(padding));
+		qwPosition += qwCapacity - qwOffset;
+		qwOffset = 0;
+	}
+
+	// The single copy of the message
+	record.Length = (unsigned int)qwRecordLength;
+	record.TopicLength = (unsigned short)topicLength;
+	record.BufferType = (unsigned char)bufferType;
+	record.Reserved = 0;
+	record.qwPayloadLength = qwLength;
+	memcpy(this->pRing + qwOffset, &record, sizeof(record));
+	memcpy(this->pRing + qwOffset + sizeof(record), pTopic, topicLength + 1);
+	if (qwLength != 0) {
+		memcpy(this->pRing + qwOffset + sizeof(record) + topicLength + 1, pData, (size_t)qwLength);
+	}
+
+	this->pHeader->qwWritePosition.store(qwPosition + qwRecordLength, std::memory_order_release);
+	this->pHeader->PublishLock.store(0, std::memory_order_release);
+
+	// Wake the readers
+	this->pHeader->Sequence.fetch_add(1);
+	this->Wake();
+
+	return true;
+}
+
+bool WebSocketBus::Receive(WEB_SOCKET_BUS_MESSAGE* pMessage, unsigned long dwTimeout)
+{
+	WEB_SOCKET_BUS_RECORD record;
+	unsigned long long qwCapacity;
+	unsigned long long qwWritePosition;
+	unsigned long long qwOffset;
+	unsigned int sequence;
+	bool bValid;
+	std::chrono::steady_clock::time_point deadline;
+	long long remaining;
+
+	qwCapacity = this->pHeader->qwCapacity;
+	deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwTimeout);
+
+	for (;;)
+	{
+		sequence = this->pHeader->Sequence.load();
+		qwWritePosition = this->pHeader->qwWritePosition.load(std::memory_order_acquire);
+
+		// Nothing new, wait for a publish, a wake meant for an earlier publish can end the wait early
+		if (qwWritePosition == this->qwReadPosition)
+		{
+			remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remaining <= 0) {
+				return false;
+			}
+			this->Wait(sequence, (unsigned long)remaining);
+			continue;
+		}
+
+		// Too far behind, publishers may be writing over the next record, skip to the newest
+		if (qwWritePosition - this->qwReadPosition > qwCapacity / 2) {
+			this->qwReadPosition = qwWritePosition;
+			this->qwOverruns++;
+			continue;
+		}
+
+		// Copy the record out, then check it wasn't written over while it was copied
+		qwOffset = this->qwReadPosition & (qwCapacity - 1);
+		memcpy(&record, this->pRing + qwOffset, sizeof(record));
+		bValid = (record.Length >= sizeof(record)) && (record.Length <= qwCapacity - qwOffset) && (record.Length % 16 == 0) &&
+			(this->qwReadPosition + record.Length <= qwWritePosition);
+		if ((bValid) && (record.TopicLength != IIS_WEB_SOCKET_BUS_PADDING))
+		{
+			bValid = (sizeof(record) + record.TopicLength + 1 + record.qwPayloadLength <= record.Length);
+			if (bValid) {
+				this->Record.resize(record.Length);
+				memcpy(this->Record.data(), this->pRing + qwOffset, record.Length);
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		qwWritePosition = this->pHeader->qwWritePosition.load(std::memory_order_relaxed);
+		if ((!bValid) || (qwWritePosition - this->qwReadPosition > qwCapacity / 2)) {
+			this->qwReadPosition = qwWritePosition;
+			this->qwOverruns++;
+			continue;
+		}
+
+		this->qwReadPosition += record.Length;
+		if (record.TopicLength == IIS_WEB_SOCKET_BUS_PADDING) {
+			continue;
+		}
+		pMessage->pTopic = (const char*)this->Record.data() + sizeof(record);
+		pMessage->BufferType = (IIS_WEB_SOCKET_BUFFER_TYPE)record.BufferType;
+		pMessage->pData = this->Record.data() + sizeof(record) + record.TopicLength + 1;
+		pMessage->qwLength = record.qwPayloadLength;
+		return true;
+	}
+}
+
+long long WebSocketBus::AddConnections(long long delta)
+{
+	this->pHeader->Processes[this->Slot].Connections.fetch_add(delta);
+	return this->GetConnectionCount();
+}
+
+long long WebSocketBus::GetConnectionCount()
+{
+	unsigned long processId;
+	unsigned long currentProcessId;
+	long long count = 0;
+
+	// The connections of a process that exited without closing the bus aren't counted
+	currentProcessId = GetBusProcessId();
+	for (unsigned int slot = 0; slot < IIS_WEB_SOCKET_BUS_MAX_PROCESSES; slot++)
+	{
+		processId = this->pHeader->Processes[slot].ProcessId.load();
+		if ((processId != 0) && ((processId == currentProcessId) || (IsBusProcessAlive(processId)))) {
+			count += this->pHeader->Processes[slot].Connections.load();
+		}
+	}
+
+	return count;
+}
+
+unsigned long long WebSocketBus::GetOverruns()
+{
+	return this->qwOverruns;
+}
+
+void WebSocketBus::Close()
+{
+	// Give up the slot, its connections stop counting
+	if ((this->pHeader != NULL) && (this->pRing != NULL) && (this->Slot < IIS_WEB_SOCKET_BUS_MAX_PROCESSES)) {
+		this->pHeader->Processes[this->Slot].Connections.store(0);
+		this->pHeader->Processes[this->Slot].ProcessId.store(0);
+	}
+
+#ifdef _WIN32
+	for (unsigned int slot = 0; slot < IIS_WEB_SOCKET_BUS_MAX_PROCESSES; slot++) {
+		if (this->WakeEvents[slot] != NULL) {
+			CloseHandle(this->WakeEvents[slot]);
+			this->WakeEvents[slot] = NULL;
+		}
+	}
+	if (this->hWakeEvent != NULL) {
+		CloseHandle(this->hWakeEvent);
+		this->hWakeEvent = NULL;
+	}
+#endif
+
+	CloseSharedMemory(&this->Memory);
+	this->pHeader = NULL;
+	this->pRing = NULL;
+}
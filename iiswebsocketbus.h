@@ -0,0 +1,145 @@
+
+//
+// iiswebsocketbus.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     A message bus between the worker processes of a web garden, a ring buffer in shared memory.
+//     Every process reads every message, and the processes share a count of their connections.
+//     The shared memory functions have a Windows and a POSIX implementation, so the bus builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_BUS_H
+#define IIS_WEB_SOCKET_BUS_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// A named region of memory shared between processes
+	struct WEB_SOCKET_SHARED_MEMORY
+	{
+		void* pView;
+		size_t Size;
+		// The file mapping handle on Windows
+		void* hMapping;
+		// The shared memory file descriptor on POSIX
+		int fd;
+	};
+
+	// Create or open a named region of shared memory, *pbCreated is set when this call created it
+	// The size is only used when the region is created, pMemory->Size is the size of the region
+	bool OpenSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory, const char* pName, size_t size, bool* pbCreated);
+
+	// Unmap a region of shared memory
+	void CloseSharedMemory(WEB_SOCKET_SHARED_MEMORY* pMemory);
+
+	// Remove the name of a region of shared memory, on Windows a region goes away with the last process using it
+	void RemoveSharedMemory(const char* pName);
+
+	// Get the id of the current process, and check if a process is still running
+	unsigned long GetBusProcessId();
+	bool IsBusProcessAlive(unsigned long processId);
+
+#define IIS_WEB_SOCKET_BUS_MAGIC 0x53554257
+#define IIS_WEB_SOCKET_BUS_VERSION 1
+
+	// The most processes that can have a bus open at once
+#define IIS_WEB_SOCKET_BUS_MAX_PROCESSES 64
+
+	// The ring capacity used when Open is given 0
+#define IIS_WEB_SOCKET_BUS_DEFAULT_CAPACITY 0x400000
+
+	// A process with the bus open
+	struct WEB_SOCKET_BUS_PROCESS
+	{
+		// 0 when the slot is free, a slot of a process that exited is taken over
+		std::atomic<unsigned long> ProcessId;
+		// Set while the process waits for a message, Windows wakes it with a named event
+		std::atomic<unsigned int> Waiting;
+		// The connections the process has added with AddConnections
+		std::atomic<long long> Connections;
+	};
+
+	// The start of the shared memory, the ring follows it
+	struct WEB_SOCKET_BUS_HEADER
+	{
+		// Set last by the process that created the bus
+		std::atomic<unsigned int> Magic;
+		unsigned int Version;
+		// Bytes in the ring, a power of two
+		unsigned long long qwCapacity;
+		// The id of the process publishing, 0 when no one is
+		std::atomic<unsigned long> PublishLock;
+		// Incremented after every publish, POSIX waits on it with a futex
+		std::atomic<unsigned int> Sequence;
+		std::atomic<unsigned int> Waiters;
+		// The total number of bytes ever written to the ring, the offset in the ring is this modulo the capacity
+		std::atomic<unsigned long long> qwWritePosition;
+		WEB_SOCKET_BUS_PROCESS Processes[IIS_WEB_SOCKET_BUS_MAX_PROCESSES];
+	};
+
+	// A message read from the bus, valid until the next Receive
+	struct WEB_SOCKET_BUS_MESSAGE
+	{
+		// NULL terminated
+		const char* pTopic;
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		const void* pData;
+		unsigned long long qwLength;
+	};
+
+	// Publishes messages to every process with the bus open
+	class WebSocketBus
+	{
+	private:
+		WEB_SOCKET_SHARED_MEMORY Memory;
+		WEB_SOCKET_BUS_HEADER* pHeader;
+		unsigned char* pRing;
+		// This process's slot in the header
+		unsigned int Slot;
+		// Where this process reads the next message
+		unsigned long long qwReadPosition;
+		// Times this process fell a full ring behind and skipped ahead
+		unsigned long long qwOverruns;
+		// The last message read
+		std::vector<unsigned char> Record;
+		// Windows wake events, this process's own and the ones opened for the other slots
+		void* hWakeEvent;
+		void* WakeEvents[IIS_WEB_SOCKET_BUS_MAX_PROCESSES];
+		unsigned long WakeEventProcessIds[IIS_WEB_SOCKET_BUS_MAX_PROCESSES];
+		char Name[0x80];
+		// Wake the processes waiting in Receive
+		void Wake();
+		// Wait for qwWritePosition to move past the read position
+		void Wait(unsigned int sequence, unsigned long dwTimeout);
+	public:
+		// Create or open a bus, qwCapacity is the size of the ring when it's created (0 = 4 MB)
+		// Returns false if the shared memory can't be opened or every process slot is taken
+		bool Open(const char* pName, unsigned long long qwCapacity);
+		// Publish a message to every process, including this one
+		// Returns false if the message is larger than a quarter of the ring
+		bool Publish(const char* pTopic, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength);
+		// Wait up to dwTimeout milliseconds for the next message, returns false on timeout
+		// Only one thread of a process may receive
+		bool Receive(WEB_SOCKET_BUS_MESSAGE* pMessage, unsigned long dwTimeout);
+		// Add to this process's share of the connection count, returns the new total
+		long long AddConnections(long long delta);
+		// Get the connections of every running process
+		long long GetConnectionCount();
+		// Get the number of times this process fell a full ring behind, the messages in between were lost
+		unsigned long long GetOverruns();
+		// Free this process's slot and unmap the bus
+		void Close();
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_BUS_H
@@ -0,0 +1,39 @@
+//
+// iiswebsocketcapture.h
+// 
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+// 
+// Description:
+//     The capture file format written by WebSocketServer::StartCapture and read by the replay tool.
+//     This header only uses standard types so captures can be replayed on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_CAPTURE_H
+#define IIS_WEB_SOCKET_CAPTURE_H
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// "IWSC" at the start of every capture file
+	#define IIS_WEB_SOCKET_CAPTURE_MAGIC 0x43535749
+
+	// Capture file format version
+	#define IIS_WEB_SOCKET_CAPTURE_VERSION 1
+
+	// The capture file header (32 bytes)
+	// It's followed by a record for every chunk ReadEntityBody returned, a 4 byte little-endian chunk length then the chunk bytes
+	struct IIS_WEB_SOCKET_CAPTURE_FILE_HEADER
+	{
+		unsigned int Magic;
+		unsigned int Version;
+		// The connection the capture was taken from
+		unsigned long long ConnectionId;
+		// MaxPayloadLength of the connection when the capture started
+		unsigned long long MaxPayloadLength;
+		unsigned long long Reserved;
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_CAPTURE_H
@@ -0,0 +1,367 @@
+
+//
+// iiswebsocketchannel.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Logical channels over one WebSocket connection.
+//
+
+#include "iiswebsocketchannel.h"
+#include <chrono>
+#include <new>
+
+using namespace IISWebSocketServer;
+
+unsigned int IISWebSocketServer::EncodeChannelVarint(unsigned char pBuffer[IIS_WEB_SOCKET_MAX_VARINT_LENGTH], unsigned long long qwValue)
+{
+	unsigned int length = 0;
+
+	// 6 bits per byte, 0x40 is set on every byte but the last
+	// Every byte is ASCII, so the prefix of a text message is valid UTF-8
+	while (qwValue >= 0x40)
+	{
+		pBuffer[length++] = (unsigned char)((qwValue & 0x3F) | 0x40);
+		qwValue >>= 6;
+	}
+	pBuffer[length++] = (unsigned char)qwValue;
+
+	return length;
+}
+
+unsigned int IISWebSocketServer::DecodeChannelVarint(const unsigned char* pBuffer, unsigned long long qwLength, unsigned long long* pqwValue)
+{
+	unsigned long long qwValue = 0;
+	unsigned int i;
+
+	for (i = 0; (i < qwLength) && (i < IIS_WEB_SOCKET_MAX_VARINT_LENGTH); i++)
+	{
+		if (pBuffer[i] >= 0x80) {
+			return 0;
+		}
+		qwValue |= (unsigned long long)(pBuffer[i] & 0x3F) << (6 * i);
+		if ((pBuffer[i] & 0x40) == 0)
+		{
+			// The last byte only has room for the top 4 bits of the value
+			if ((i == IIS_WEB_SOCKET_MAX_VARINT_LENGTH - 1) && (pBuffer[i] > 0x0F)) {
+				return 0;
+			}
+			*pqwValue = qwValue;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+void WebSocketChannels::Initialize(PFN_IIS_WEB_SOCKET_CHANNEL_WRITE pfnWrite, void* pWriteContext,
+	PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext, unsigned long long qwWindow)
+{
+	this->pfnWrite = pfnWrite;
+	this->pWriteContext = pWriteContext;
+	this->pfnDefaultHandler = pfnHandler;
+	this->pDefaultHandlerContext = pHandlerContext;
+
+	// Every channel starts with the initial credits, the window can only add to them
+	if (qwWindow < IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS) {
+		qwWindow = IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS;
+	}
+	this->qwWindow = qwWindow;
+}
+
+bool WebSocketChannels::WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL type, unsigned long long channelId, unsigned long long qwValue)
+{
+	unsigned char message[1 + IIS_WEB_SOCKET_MAX_VARINT_LENGTH * 3];
+	unsigned int length;
+
+	// The control channel id, then the type, channel and value
+	length = EncodeChannelVarint(message, IIS_WEB_SOCKET_CONTROL_CHANNEL);
+	length += EncodeChannelVarint(message + length, (unsigned long long)type);
+	length += EncodeChannelVarint(message + length, channelId);
+	length += EncodeChannelVarint(message + length, qwValue);
+
+	return this->pfnWrite(this->pWriteContext, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, message, length, NULL, 0);
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::Open(unsigned long long channelId, PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext)
+{
+	CHANNEL channel;
+
+	if (channelId == IIS_WEB_SOCKET_CONTROL_CHANNEL) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_IN_USE_CHANNEL_RESULT;
+	}
+
+	// The peer may send the whole window straight away, this side may send the initial credits
+	channel.pfnHandler = pfnHandler;
+	channel.pHandlerContext = pHandlerContext;
+	channel.SendCredits = IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS;
+	channel.PeerCredits = (long long)this->qwWindow;
+	channel.qwConsumed = 0;
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		if (!this->Channels.emplace(channelId, channel).second) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_IN_USE_CHANNEL_RESULT;
+		}
+	}
+	catch (const std::bad_alloc&) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_CHANNEL_RESULT;
+	}
+
+	if (!this->WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_OPEN_CHANNEL_CONTROL, channelId, this->qwWindow)) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT;
+	}
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::SetHandler(unsigned long long channelId, PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext)
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+	auto it = this->Channels.find(channelId);
+
+	if (it == this->Channels.end()) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_CLOSED_CHANNEL_RESULT;
+	}
+	it->second.pfnHandler = pfnHandler;
+	it->second.pHandlerContext = pHandlerContext;
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::Send(unsigned long long channelId, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	unsigned char prefix[IIS_WEB_SOCKET_MAX_VARINT_LENGTH];
+	unsigned int prefixLength;
+
+	// Take the credits before writing, a message may take a channel below 0
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		auto it = this->Channels.find(channelId);
+		if ((it == this->Channels.end()) || (channelId == IIS_WEB_SOCKET_CONTROL_CHANNEL)) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_CLOSED_CHANNEL_RESULT;
+		}
+		if (it->second.SendCredits <= 0) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_NO_CREDITS_CHANNEL_RESULT;
+		}
+		it->second.SendCredits -= (long long)qwLength;
+	}
+
+	// The channel id goes in front of the payload, the payload isn't copied
+	prefixLength = EncodeChannelVarint(prefix, channelId);
+	if (!this->pfnWrite(this->pWriteContext, bufferType, prefix, prefixLength, pData, qwLength)) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT;
+	}
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+bool WebSocketChannels::WaitForCredits(unsigned long long channelId, unsigned long dwTimeout)
+{
+	std::unique_lock<std::mutex> lock(this->Lock);
+
+	return this->CreditsChanged.wait_for(lock, std::chrono::milliseconds(dwTimeout), [this, channelId]() {
+		auto it = this->Channels.find(channelId);
+		return (it == this->Channels.end()) || (it->second.SendCredits > 0);
+	}) && (this->Channels.count(channelId) != 0);
+}
+
+long long WebSocketChannels::GetCredits(unsigned long long channelId)
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+	auto it = this->Channels.find(channelId);
+
+	return (it != this->Channels.end()) ? it->second.SendCredits : 0;
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::Close(unsigned long long channelId)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		if (this->Channels.erase(channelId) == 0) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_CLOSED_CHANNEL_RESULT;
+		}
+	}
+	this->CreditsChanged.notify_all();
+
+	if (!this->WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_CLOSE_CHANNEL_CONTROL, channelId, 0)) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT;
+	}
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::DispatchControl(const unsigned char* pData, unsigned long long qwLength)
+{
+	unsigned long long type;
+	unsigned long long channelId;
+	unsigned long long qwValue;
+	unsigned int length;
+	unsigned int offset;
+	CHANNEL channel;
+	PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler;
+	void* pHandlerContext;
+
+	// Exactly three varints
+	offset = 0;
+	length = DecodeChannelVarint(pData, qwLength, &type);
+	offset += length;
+	if (length != 0) {
+		length = DecodeChannelVarint(pData + offset, qwLength - offset, &channelId);
+		offset += length;
+	}
+	if (length != 0) {
+		length = DecodeChannelVarint(pData + offset, qwLength - offset, &qwValue);
+		offset += length;
+	}
+	if ((length == 0) || (offset != qwLength) || (channelId == IIS_WEB_SOCKET_CONTROL_CHANNEL)) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+	}
+
+	switch ((IIS_WEB_SOCKET_CHANNEL_CONTROL)type)
+	{
+	case IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_OPEN_CHANNEL_CONTROL:
+		// The value is what the opener lets this side send, this side grants its window beyond the initial credits
+		channel.pfnHandler = this->pfnDefaultHandler;
+		channel.pHandlerContext = this->pDefaultHandlerContext;
+		channel.SendCredits = (long long)qwValue;
+		channel.PeerCredits = (long long)this->qwWindow;
+		channel.qwConsumed = 0;
+		try
+		{
+			std::lock_guard<std::mutex> lock(this->Lock);
+			if (!this->Channels.emplace(channelId, channel).second) {
+				return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+			}
+		}
+		catch (const std::bad_alloc&) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_CHANNEL_RESULT;
+		}
+		if ((this->qwWindow > IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS) &&
+			(!this->WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_CREDIT_CHANNEL_CONTROL, channelId,
+				this->qwWindow - IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS))) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT;
+		}
+		break;
+
+	case IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_CLOSE_CHANNEL_CONTROL:
+		// Tell the handler, a channel this side already closed is ignored
+		{
+			std::lock_guard<std::mutex> lock(this->Lock);
+			auto it = this->Channels.find(channelId);
+			if (it == this->Channels.end()) {
+				break;
+			}
+			pfnHandler = it->second.pfnHandler;
+			pHandlerContext = it->second.pHandlerContext;
+			this->Channels.erase(it);
+		}
+		this->CreditsChanged.notify_all();
+		if (pfnHandler != NULL) {
+			pfnHandler(pHandlerContext, channelId, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, NULL, 0);
+		}
+		break;
+
+	case IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_CREDIT_CHANNEL_CONTROL:
+		{
+			std::lock_guard<std::mutex> lock(this->Lock);
+			auto it = this->Channels.find(channelId);
+			if (it == this->Channels.end()) {
+				break;
+			}
+			it->second.SendCredits += (long long)qwValue;
+		}
+		this->CreditsChanged.notify_all();
+		break;
+
+	default:
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+	}
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+IIS_WEB_SOCKET_CHANNEL_RESULT WebSocketChannels::Dispatch(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	unsigned long long channelId;
+	unsigned long long qwGrant;
+	unsigned int prefixLength;
+	PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler;
+	void* pHandlerContext;
+
+	prefixLength = DecodeChannelVarint((const unsigned char*)pData, qwLength, &channelId);
+	if (prefixLength == 0) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+	}
+	pData = (const unsigned char*)pData + prefixLength;
+	qwLength -= prefixLength;
+
+	if (channelId == IIS_WEB_SOCKET_CONTROL_CHANNEL)
+	{
+		if (bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+		}
+		return this->DispatchControl((const unsigned char*)pData, qwLength);
+	}
+
+	// Charge the message to the peer's credits, a channel this side already closed is ignored
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		auto it = this->Channels.find(channelId);
+		if (it == this->Channels.end()) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+		}
+		if (it->second.PeerCredits <= 0) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT;
+		}
+		it->second.PeerCredits -= (long long)qwLength;
+		pfnHandler = it->second.pfnHandler;
+		pHandlerContext = it->second.pHandlerContext;
+	}
+
+	// The handler may send or close channels
+	if (pfnHandler != NULL) {
+		pfnHandler(pHandlerContext, channelId, bufferType, pData, qwLength);
+	}
+
+	// Grant the credits back once half the window has been handled
+	qwGrant = 0;
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		auto it = this->Channels.find(channelId);
+		if (it == this->Channels.end()) {
+			return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+		}
+		it->second.qwConsumed += qwLength;
+		if (it->second.qwConsumed >= this->qwWindow / 2) {
+			qwGrant = it->second.qwConsumed;
+			it->second.qwConsumed = 0;
+			it->second.PeerCredits += (long long)qwGrant;
+		}
+	}
+	if ((qwGrant != 0) && (!this->WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL::IIS_WEB_SOCKET_CREDIT_CHANNEL_CONTROL, channelId, qwGrant))) {
+		return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT;
+	}
+
+	return IIS_WEB_SOCKET_CHANNEL_RESULT::IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT;
+}
+
+size_t WebSocketChannels::GetChannelCount()
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+
+	return this->Channels.size();
+}
+
+void WebSocketChannels::Free()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		this->Channels.clear();
+	}
+	this->CreditsChanged.notify_all();
+}
@@ -0,0 +1,143 @@
+
+//
+// iiswebsocketchannel.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Logical channels over one WebSocket connection, negotiated with the 'Sec-WebSocket-Protocol' header.
+//     Each message starts with its channel id as a varint of ASCII bytes, channel 0 carries the open, close and credit messages.
+//     A sender may only send on a channel while the receiver has granted it credits, so one slow channel
+//     can't fill the connection. Like the protocol core, this only uses standard types and builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_CHANNEL_H
+#define IIS_WEB_SOCKET_CHANNEL_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// The 'Sec-WebSocket-Protocol' token of the channel protocol
+#define IIS_WEB_SOCKET_CHANNEL_PROTOCOL "iis.channels.v1"
+
+	// The channel that carries the control messages
+#define IIS_WEB_SOCKET_CONTROL_CHANNEL 0
+
+	// The bytes each side may send on a new channel before the other side grants more
+#define IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS 0x10000
+
+	// The longest a varint can be, 6 bits per byte
+#define IIS_WEB_SOCKET_MAX_VARINT_LENGTH 11
+
+	// Encode a varint, 6 bits per byte with 0x40 set on every byte but the last
+	// Channels 1 to 63 take a single byte, returns the number of bytes written to pBuffer
+	unsigned int EncodeChannelVarint(unsigned char pBuffer[IIS_WEB_SOCKET_MAX_VARINT_LENGTH], unsigned long long qwValue);
+
+	// Decode a varint, returns the number of bytes read or 0 if it's truncated or too long
+	unsigned int DecodeChannelVarint(const unsigned char* pBuffer, unsigned long long qwLength, unsigned long long* pqwValue);
+
+	// The control messages on channel 0, each is the type, the channel id and a value as varints
+	typedef enum class _IIS_WEB_SOCKET_CHANNEL_CONTROL
+	{
+		// Open a channel, the value is the credits the opener grants
+		IIS_WEB_SOCKET_OPEN_CHANNEL_CONTROL = 1,
+		// Close a channel, nothing more is sent or received on it
+		IIS_WEB_SOCKET_CLOSE_CHANNEL_CONTROL = 2,
+		// Grant the value in bytes of credits on a channel
+		IIS_WEB_SOCKET_CREDIT_CHANNEL_CONTROL = 3
+	} IIS_WEB_SOCKET_CHANNEL_CONTROL;
+
+	// The result of the WebSocketChannels functions
+	typedef enum class _IIS_WEB_SOCKET_CHANNEL_RESULT
+	{
+		IIS_WEB_SOCKET_SUCCESS_CHANNEL_RESULT = 0,
+		// The channel has no credits left, wait for more with WaitForCredits
+		IIS_WEB_SOCKET_NO_CREDITS_CHANNEL_RESULT = 1,
+		// The channel isn't open
+		IIS_WEB_SOCKET_CLOSED_CHANNEL_RESULT = 2,
+		// Open was given a channel that is already open
+		IIS_WEB_SOCKET_IN_USE_CHANNEL_RESULT = 3,
+		// The write function failed
+		IIS_WEB_SOCKET_WRITE_FAILED_CHANNEL_RESULT = 4,
+		// The peer broke the channel protocol, close the connection with status code 1002
+		IIS_WEB_SOCKET_PROTOCOL_ERROR_CHANNEL_RESULT = 5,
+		IIS_WEB_SOCKET_OUT_OF_MEMORY_CHANNEL_RESULT = 6
+	} IIS_WEB_SOCKET_CHANNEL_RESULT;
+
+	// Writes one WebSocket message, the prefix followed by the payload, returns false if the write failed
+	// WebSocketServer::WriteChannelMessage writes to a WebSocketServer passed as pContext
+	typedef bool (*PFN_IIS_WEB_SOCKET_CHANNEL_WRITE)(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+		const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength);
+
+	// Called with each message received on a channel, and with IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE when the peer closes it
+	// The channel's credits are granted back once the handler returns
+	typedef void (*PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER)(void* pContext, unsigned long long channelId,
+		IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength);
+
+	// Multiplexes logical channels over one WebSocket connection
+	class WebSocketChannels
+	{
+	private:
+		// A channel open on the connection
+		struct CHANNEL
+		{
+			PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler;
+			void* pHandlerContext;
+			// The bytes this side may still send, a message is sent while it's above 0
+			long long SendCredits;
+			// The bytes the peer may still send, as the peer sees it
+			long long PeerCredits;
+			// Bytes handled since credits were last granted
+			unsigned long long qwConsumed;
+		};
+		std::mutex Lock;
+		// Signaled when credits are granted or a channel is closed
+		std::condition_variable CreditsChanged;
+		std::unordered_map<unsigned long long, CHANNEL> Channels;
+		PFN_IIS_WEB_SOCKET_CHANNEL_WRITE pfnWrite;
+		void* pWriteContext;
+		// The handler of channels the peer opens
+		PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnDefaultHandler;
+		void* pDefaultHandlerContext;
+		// The most credits this side grants a channel
+		unsigned long long qwWindow;
+		// Write a control message
+		bool WriteControl(IIS_WEB_SOCKET_CHANNEL_CONTROL type, unsigned long long channelId, unsigned long long qwValue);
+		// Handle a control message from the peer
+		IIS_WEB_SOCKET_CHANNEL_RESULT DispatchControl(const unsigned char* pData, unsigned long long qwLength);
+	public:
+		// Set up the channels of a connection, pfnHandler handles the channels the peer opens
+		// qwWindow is the most bytes the peer may send on a channel before it's granted more, at least IIS_WEB_SOCKET_CHANNEL_INITIAL_CREDITS
+		void Initialize(PFN_IIS_WEB_SOCKET_CHANNEL_WRITE pfnWrite, void* pWriteContext,
+			PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext, unsigned long long qwWindow);
+		// Open a channel with its own handler, by convention the server opens even ids and the client odd ids
+		IIS_WEB_SOCKET_CHANNEL_RESULT Open(unsigned long long channelId, PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext);
+		// Change the handler of a channel
+		IIS_WEB_SOCKET_CHANNEL_RESULT SetHandler(unsigned long long channelId, PFN_IIS_WEB_SOCKET_CHANNEL_HANDLER pfnHandler, void* pHandlerContext);
+		// Send a message on a channel, returns IIS_WEB_SOCKET_NO_CREDITS_CHANNEL_RESULT without sending when the channel is out of credits
+		IIS_WEB_SOCKET_CHANNEL_RESULT Send(unsigned long long channelId, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength);
+		// Wait up to dwTimeout milliseconds for a channel to have credits, returns false on timeout or if the channel is closed
+		bool WaitForCredits(unsigned long long channelId, unsigned long dwTimeout);
+		// Get the bytes that can still be sent on a channel before it runs out of credits, 0 if it's closed
+		long long GetCredits(unsigned long long channelId);
+		// Close a channel
+		IIS_WEB_SOCKET_CHANNEL_RESULT Close(unsigned long long channelId);
+		// Handle a message received on the connection, call this with every message ReceiveMessage returns
+		IIS_WEB_SOCKET_CHANNEL_RESULT Dispatch(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength);
+		// Get the number of open channels
+		size_t GetChannelCount();
+		// Forget every channel, WaitForCredits returns false
+		void Free();
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_CHANNEL_H
@@ -0,0 +1,1248 @@
+
+//
+// iiswebsocketcoroutine.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Coroutine connections and the executor that resumes them.
+//
+
+#include "iiswebsocketcoroutine.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <unordered_set>
+
+#include "iiswebsocketshard.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace IISWebSocketServer;
+
+// A thread per core and what it owns, only the rings and the remote queue are touched by other threads
+struct WebSocketExecutor::SHARD
+{
+	WebSocketExecutor* pExecutor;
+	unsigned int Index;
+	// Coroutines to resume, and delayed coroutines in a heap ordered by deadline
+	std::deque<std::coroutine_handle<>> Local;
+	std::vector<TIMER> Timers;
+	// A ring from every other shard, indexed by the shard that pushes
+	WEB_SOCKET_SPSC_RING* pInbound;
+	// Coroutines from threads that aren't shards, and from shards whose ring was full
+	std::mutex RemoteLock;
+	std::vector<TIMER> Remote;
+	std::atomic<bool> bRemotePending;
+	// Set while the shard waits, a thread that queues work wakes it
+	std::atomic<bool> bSleeping;
+#ifdef _WIN32
+	HANDLE hWake;
+#else
+	// The shard waits in epoll, for its event fd and watched file descriptors
+	int Epoll;
+	int WakeEvent;
+#endif
+	WEB_SOCKET_BUFFER_POOL Pool;
+	// The registry slice, only the count is read by other threads
+	std::unordered_set<void*> Connections;
+	alignas(IIS_WEB_SOCKET_CACHE_LINE) std::atomic<size_t> ConnectionCount;
+};
+
+// The shard of the calling thread
+static thread_local void* pCurrentShard = NULL;
+
+// Order delayed coroutines so the earliest deadline is at the front of the heap
+static bool LaterDeadline(const std::chrono::steady_clock::time_point& left, const std::chrono::steady_clock::time_point& right)
+{
+	return left > right;
+}
+
+bool WebSocketExecutor::Start(unsigned int threadCount)
+{
+	this->bStopping.store(false);
+
+	if (threadCount == 0) {
+		threadCount = std::thread::hardware_concurrency();
+		if (threadCount == 0) {
+			threadCount = 1;
+		}
+	}
+
+	try
+	{
+		for (unsigned int i = 0; i < threadCount; i++) {
+			this->Threads.emplace_back(&WebSocketExecutor::Run, this);
+		}
+	}
+	catch (const std::system_error&) {
+		this->Stop();
+		return false;
+	}
+
+	return true;
+}
+
+bool WebSocketExecutor::StartShards(unsigned int shardCount, const IIS_WEB_SOCKET_SHARD_OPTIONS* pOptions)
+{
+	SHARD* pShard;
+	bool bCreated;
+
+	this->bStopping.store(false);
+	this->NextShard.store(0);
+	if (pOptions != NULL) {
+		this->ShardOptions = *pOptions;
+	}
+	else {
+		memset(&this->ShardOptions, 0, sizeof(this->ShardOptions));
+	}
+	if (this->ShardOptions.RingCapacity == 0) {
+		this->ShardOptions.RingCapacity = IIS_WEB_SOCKET_SHARD_RING_CAPACITY;
+	}
+	if (shardCount == 0) {
+		shardCount = GetShardProcessorCount();
+	}
+
+	// Every shard is set up before any thread starts, a thread may pass coroutines to any shard once it runs
+	for (unsigned int i = 0; i < shardCount; i++)
+	{
+		pShard = new (std::nothrow) SHARD();
+		if (pShard == NULL) {
+			this->Stop();
+			return false;
+		}
+		pShard->pExecutor = this;
+		pShard->Index = i;
+		pShard->bRemotePending.store(false);
+		pShard->bSleeping.store(false);
+		pShard->ConnectionCount.store(0);
+		memset(&pShard->Pool, 0, sizeof(pShard->Pool));
+#ifdef _WIN32
+		pShard->hWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+		bCreated = (pShard->hWake != NULL);
+#else
+		struct epoll_event event;
+		pShard->Epoll = epoll_create1(EPOLL_CLOEXEC);
+		pShard->WakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		bCreated = (pShard->Epoll >= 0) && (pShard->WakeEvent >= 0) && (epoll_ctl(pShard->Epoll, EPOLL_CTL_ADD, pShard->WakeEvent, &event) == 0);
+#endif
+		pShard->pInbound = new (std::nothrow) WEB_SOCKET_SPSC_RING[shardCount];
+		try {
+			this->Shards.push_back(pShard);
+		}
+		catch (const std::bad_alloc&) {
+			bCreated = false;
+		}
+		if ((!bCreated) || (pShard->pInbound == NULL)) {
+			this->Stop();
+			return false;
+		}
+		for (unsigned int j = 0; j < shardCount; j++)
+		{
+			pShard->pInbound[j].qwHead.store(0);
+			pShard->pInbound[j].qwTail.store(0);
+			pShard->pInbound[j].qwCachedHead = 0;
+			pShard->pInbound[j].qwCachedTail = 0;
+			pShard->pInbound[j].pEntries = NULL;
+			pShard->pInbound[j].qwMask = 0;
+		}
+		for (unsigned int j = 0; j < shardCount; j++)
+		{
+			// A shard doesn't pass coroutines to itself, its ring stays empty
+			if ((j != i) && (!CreateSpscRing(&pShard->pInbound[j], this->ShardOptions.RingCapacity))) {
+				this->Stop();
+				return false;
+			}
+		}
+	}
+
+	try
+	{
+		for (SHARD* pShard : this->Shards) {
+			this->Threads.emplace_back(&WebSocketExecutor::RunShard, this, pShard);
+		}
+	}
+	catch (const std::system_error&) {
+		this->Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void WebSocketExecutor::Run()
+{
+	std::coroutine_handle<> handle;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(this->Lock);
+			for (;;)
+			{
+				if (this->bStopping.load()) {
+					return;
+				}
+
+				// Delayed coroutines whose deadline passed are queued
+				while ((!this->Timers.empty()) && (this->Timers.front().Deadline <= std::chrono::steady_clock::now()))
+				{
+					std::pop_heap(this->Timers.begin(), this->Timers.end(), [](const TIMER& left, const TIMER& right) { return LaterDeadline(left.Deadline, right.Deadline); });
+					this->Queue.push_back(this->Timers.back().Handle);
+					this->Timers.pop_back();
+				}
+				if (!this->Queue.empty()) {
+					break;
+				}
+				if (!this->Timers.empty()) {
+					this->Ready.wait_until(lock, this->Timers.front().Deadline);
+				}
+				else {
+					this->Ready.wait(lock);
+				}
+			}
+			handle = this->Queue.front();
+			this->Queue.pop_front();
+		}
+
+		// Runs until the coroutine awaits something that doesn't complete right away
+		handle.resume();
+	}
+}
+
+void WebSocketExecutor::RunShard(SHARD* pShard)
+{
+	std::chrono::steady_clock::time_point now;
+	std::vector<TIMER> remote;
+	std::coroutine_handle<> handle;
+	unsigned long long qwWait;
+	size_t count;
+	void* pEntry;
+	int timeout;
+	auto later = [](const TIMER& left, const TIMER& right) { return LaterDeadline(left.Deadline, right.Deadline); };
+
+	pCurrentShard = pShard;
+
+	// The pool is allocated and touched from the pinned thread, so its pages are on the thread's NUMA node
+	if (this->ShardOptions.bPinThreads) {
+		PinShardThread(pShard->Index % GetShardProcessorCount());
+	}
+	if (this->ShardOptions.BufferCount != 0) {
+		CreateBufferPool(&pShard->Pool, this->ShardOptions.BufferSize, this->ShardOptions.BufferCount, this->ShardOptions.bHugePages);
+	}
+
+	while (!this->bStopping.load(std::memory_order_relaxed))
+	{
+		// Coroutines passed by other shards
+		for (unsigned int i = 0; i < this->Shards.size(); i++)
+		{
+			while (PopSpscRing(&pShard->pInbound[i], &pEntry)) {
+				pShard->Local.push_back(std::coroutine_handle<>::from_address(pEntry));
+			}
+		}
+
+		// Coroutines from other threads, some of them delayed
+		if ((pShard->bRemotePending.load(std::memory_order_relaxed)) && (pShard->bRemotePending.exchange(false)))
+		{
+			{
+				std::lock_guard<std::mutex> lock(pShard->RemoteLock);
+				remote.swap(pShard->Remote);
+			}
+			for (TIMER& timer : remote)
+			{
+				if (timer.Deadline == std::chrono::steady_clock::time_point()) {
+					pShard->Local.push_back(timer.Handle);
+				}
+				else {
+					pShard->Timers.push_back(timer);
+					std::push_heap(pShard->Timers.begin(), pShard->Timers.end(), later);
+				}
+			}
+			remote.clear();
+		}
+
+		// Delayed coroutines whose deadline passed
+		if (!pShard->Timers.empty())
+		{
+			now = std::chrono::steady_clock::now();
+			while ((!pShard->Timers.empty()) && (pShard->Timers.front().Deadline <= now))
+			{
+				std::pop_heap(pShard->Timers.begin(), pShard->Timers.end(), later);
+				pShard->Local.push_back(pShard->Timers.back().Handle);
+				pShard->Timers.pop_back();
+			}
+		}
+
+		// Resume what's queued now, coroutines they queue wait for the next pass so the rings and file descriptors aren't starved
+		count = pShard->Local.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			handle = pShard->Local.front();
+			pShard->Local.pop_front();
+			handle.resume();
+		}
+
+		// Wait when there's nothing to do, until the next deadline or a wake
+		timeout = 0;
+		if (pShard->Local.empty())
+		{
+			timeout = -1;
+			if (!pShard->Timers.empty())
+			{
+				now = std::chrono::steady_clock::now();
+				qwWait = (pShard->Timers.front().Deadline <= now) ? 0 :
+					(unsigned long long)std::chrono::ceil<std::chrono::milliseconds>(pShard->Timers.front().Deadline - now).count();
+				timeout = (qwWait < 0x7FFFFFFF) ? (int)qwWait : 0x7FFFFFFF;
+			}
+
+			// The sleeping flag is set before the rings and the remote queue are checked, a thread that queues work
+			// checks the flag after, so one of them sees the other
+			pShard->bSleeping.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if ((pShard->bRemotePending.load(std::memory_order_relaxed)) || (this->bStopping.load(std::memory_order_relaxed))) {
+				timeout = 0;
+			}
+			for (unsigned int i = 0; (i < this->Shards.size()) && (timeout != 0); i++)
+			{
+				if (!IsSpscRingEmpty(&pShard->pInbound[i])) {
+					timeout = 0;
+				}
+			}
+		}
+
+#ifdef _WIN32
+		if (timeout != 0) {
+			WaitForSingleObject(pShard->hWake, (timeout < 0) ? INFINITE : (DWORD)timeout);
+		}
+#else
+		struct epoll_event events[64];
+		WEB_SOCKET_SHARD_WATCH* pWatch;
+		eventfd_t value;
+		int ready;
+
+		// File descriptors are checked on every pass, without waiting while coroutines are queued
+		ready = epoll_wait(pShard->Epoll, events, 64, timeout);
+		for (int i = 0; i < ready; i++)
+		{
+			pWatch = (WEB_SOCKET_SHARD_WATCH*)events[i].data.ptr;
+			if (pWatch == NULL) {
+				eventfd_read(pShard->WakeEvent, &value);
+			}
+			else {
+				pWatch->pfnReady(pWatch->pContext, events[i].events);
+			}
+		}
+#endif
+		pShard->bSleeping.store(false, std::memory_order_relaxed);
+	}
+
+	pCurrentShard = NULL;
+}
+
+// Wake a shard that waits, after queuing work for it
+static void WakeShard(std::atomic<bool>* pbSleeping, void* pWake)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if ((pbSleeping->load(std::memory_order_relaxed)) && (pbSleeping->exchange(false)))
+	{
+#ifdef _WIN32
+		SetEvent((HANDLE)pWake);
+#else
+		eventfd_write((int)(intptr_t)pWake, 1);
+#endif
+	}
+}
+
+WebSocketExecutor::SHARD* WebSocketExecutor::GetShard()
+{
+	SHARD* pShard = (SHARD*)pCurrentShard;
+
+	if ((pShard == NULL) || (pShard->pExecutor != this)) {
+		return NULL;
+	}
+
+	return pShard;
+}
+
+void WebSocketExecutor::QueueRemote(SHARD* pShard, std::coroutine_handle<> handle, std::chrono::steady_clock::time_point deadline)
+{
+	{
+		std::lock_guard<std::mutex> lock(pShard->RemoteLock);
+		pShard->Remote.push_back(TIMER{ deadline, handle });
+		pShard->bRemotePending.store(true, std::memory_order_relaxed);
+	}
+#ifdef _WIN32
+	WakeShard(&pShard->bSleeping, pShard->hWake);
+#else
+	WakeShard(&pShard->bSleeping, (void*)(intptr_t)pShard->WakeEvent);
+#endif
+}
+
+void WebSocketExecutor::Post(std::coroutine_handle<> handle)
+{
+	SHARD* pShard;
+
+	// A shard keeps the coroutines it posts, other threads spread them over the shards
+	if (!this->Shards.empty())
+	{
+		pShard = this->GetShard();
+		if (pShard != NULL) {
+			pShard->Local.push_back(handle);
+		}
+		else {
+			this->QueueRemote(this->Shards[this->AssignShard()], handle, std::chrono::steady_clock::time_point());
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		this->Queue.push_back(handle);
+	}
+	this->Ready.notify_one();
+}
+
+void WebSocketExecutor::PostToShard(unsigned int shard, std::coroutine_handle<> handle)
+{
+	SHARD* pShard;
+	SHARD* pTarget;
+
+	if (shard >= this->Shards.size()) {
+		this->Post(handle);
+		return;
+	}
+	pTarget = this->Shards[shard];
+	pShard = this->GetShard();
+
+	if (pShard == pTarget) {
+		pTarget->Local.push_back(handle);
+	}
+	else if ((pShard != NULL) && (PushSpscRing(&pTarget->pInbound[pShard->Index], handle.address())))
+	{
+#ifdef _WIN32
+		WakeShard(&pTarget->bSleeping, pTarget->hWake);
+#else
+		WakeShard(&pTarget->bSleeping, (void*)(intptr_t)pTarget->WakeEvent);
+#endif
+	}
+	else {
+		// Not from a shard, or the ring is full
+		this->QueueRemote(pTarget, handle, std::chrono::steady_clock::time_point());
+	}
+}
+
+void WebSocketExecutor::PostDelayed(std::coroutine_handle<> handle, unsigned int dwMilliseconds)
+{
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMilliseconds);
+	SHARD* pShard;
+
+	if (!this->Shards.empty())
+	{
+		pShard = this->GetShard();
+		if (pShard != NULL) {
+			pShard->Timers.push_back(TIMER{ deadline, handle });
+			std::push_heap(pShard->Timers.begin(), pShard->Timers.end(), [](const TIMER& left, const TIMER& right) { return LaterDeadline(left.Deadline, right.Deadline); });
+		}
+		else {
+			this->QueueRemote(this->Shards[this->AssignShard()], handle, deadline);
+		}
+		return;
+	}
+
+	// Every thread may be waiting for a later deadline
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		this->Timers.push_back(TIMER{ deadline, handle });
+		std::push_heap(this->Timers.begin(), this->Timers.end(), [](const TIMER& left, const TIMER& right) { return LaterDeadline(left.Deadline, right.Deadline); });
+	}
+	this->Ready.notify_all();
+}
+
+size_t WebSocketExecutor::GetThreadCount()
+{
+	return this->Threads.size();
+}
+
+unsigned int WebSocketExecutor::GetShardCount()
+{
+	return (unsigned int)this->Shards.size();
+}
+
+unsigned int WebSocketExecutor::GetCurrentShard()
+{
+	SHARD* pShard = this->GetShard();
+
+	return (pShard != NULL) ? pShard->Index : IIS_WEB_SOCKET_NO_SHARD;
+}
+
+unsigned int WebSocketExecutor::AssignShard()
+{
+	if (this->Shards.empty()) {
+		return IIS_WEB_SOCKET_NO_SHARD;
+	}
+
+	return this->NextShard.fetch_add(1, std::memory_order_relaxed) % (unsigned int)this->Shards.size();
+}
+
+void* WebSocketExecutor::AllocateBuffer()
+{
+	SHARD* pShard = this->GetShard();
+
+	return (pShard != NULL) ? AllocatePoolBuffer(&pShard->Pool) : NULL;
+}
+
+bool WebSocketExecutor::FreeBuffer(void* pBuffer)
+{
+	SHARD* pShard = this->GetShard();
+
+	if ((pShard == NULL) || (!IsPoolBuffer(&pShard->Pool, pBuffer))) {
+		return false;
+	}
+	FreePoolBuffer(&pShard->Pool, pBuffer);
+
+	return true;
+}
+
+unsigned long WebSocketExecutor::GetBufferSize()
+{
+	SHARD* pShard = this->GetShard();
+
+	// The pools round the size up, every shard's pool has the same size
+	return ((pShard != NULL) && (pShard->Pool.pMemory != NULL)) ? pShard->Pool.BufferSize : this->ShardOptions.BufferSize;
+}
+
+bool WebSocketExecutor::RegisterConnection(void* pConnection)
+{
+	SHARD* pShard = this->GetShard();
+
+	if (pShard == NULL) {
+		return false;
+	}
+	try {
+		pShard->Connections.insert(pConnection);
+	}
+	catch (const std::bad_alloc&) {
+		return false;
+	}
+	pShard->ConnectionCount.store(pShard->Connections.size(), std::memory_order_relaxed);
+
+	return true;
+}
+
+bool WebSocketExecutor::UnregisterConnection(void* pConnection)
+{
+	SHARD* pShard = this->GetShard();
+
+	if ((pShard == NULL) || (pShard->Connections.erase(pConnection) == 0)) {
+		return false;
+	}
+	pShard->ConnectionCount.store(pShard->Connections.size(), std::memory_order_relaxed);
+
+	return true;
+}
+
+size_t WebSocketExecutor::GetConnectionCount()
+{
+	size_t count = 0;
+
+	for (SHARD* pShard : this->Shards) {
+		count += pShard->ConnectionCount.load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+void WebSocketExecutor::ForEachShardConnection(void (*pfnConnection)(void* pContext, void* pConnection), void* pContext)
+{
+	SHARD* pShard = this->GetShard();
+
+	if (pShard != NULL)
+	{
+		for (void* pConnection : pShard->Connections) {
+			pfnConnection(pContext, pConnection);
+		}
+	}
+}
+
+#ifdef __linux__
+
+bool WebSocketExecutor::Watch(WEB_SOCKET_SHARD_WATCH* pWatch, int fd, unsigned int events, PFN_IIS_WEB_SOCKET_SHARD_READY pfnReady, void* pContext)
+{
+	SHARD* pShard = this->GetShard();
+	struct epoll_event event;
+
+	if (pShard == NULL) {
+		return false;
+	}
+
+	pWatch->fd = fd;
+	pWatch->pfnReady = pfnReady;
+	pWatch->pContext = pContext;
+	event.events = events | EPOLLET;
+	event.data.ptr = pWatch;
+
+	return (epoll_ctl(pShard->Epoll, EPOLL_CTL_ADD, fd, &event) == 0);
+}
+
+bool WebSocketExecutor::Unwatch(WEB_SOCKET_SHARD_WATCH* pWatch)
+{
+	SHARD* pShard = this->GetShard();
+
+	if (pShard == NULL) {
+		return false;
+	}
+
+	return (epoll_ctl(pShard->Epoll, EPOLL_CTL_DEL, pWatch->fd, NULL) == 0);
+}
+
+#endif
+
+void WebSocketExecutor::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		this->bStopping.store(true);
+		this->Queue.clear();
+		this->Timers.clear();
+	}
+	this->Ready.notify_all();
+
+	// Shards are woken whether they wait or not
+	for (SHARD* pShard : this->Shards)
+	{
+#ifdef _WIN32
+		if (pShard->hWake != NULL) {
+			SetEvent(pShard->hWake);
+		}
+#else
+		if (pShard->WakeEvent >= 0) {
+			eventfd_write(pShard->WakeEvent, 1);
+		}
+#endif
+	}
+
+	for (std::thread& thread : this->Threads) {
+		thread.join();
+	}
+	this->Threads.clear();
+
+	for (SHARD* pShard : this->Shards)
+	{
+		if (pShard->pInbound != NULL)
+		{
+			for (size_t i = 0; i < this->Shards.size(); i++) {
+				DestroySpscRing(&pShard->pInbound[i]);
+			}
+			delete[] pShard->pInbound;
+		}
+		DestroyBufferPool(&pShard->Pool);
+#ifdef _WIN32
+		if (pShard->hWake != NULL) {
+			CloseHandle(pShard->hWake);
+		}
+#else
+		if (pShard->WakeEvent >= 0) {
+			close(pShard->WakeEvent);
+		}
+		if (pShard->Epoll >= 0) {
+			close(pShard->Epoll);
+		}
+#endif
+		delete pShard;
+	}
+	this->Shards.clear();
+}
+
+WebSocketTask::~WebSocketTask()
+{
+	if (this->Handle) {
+		this->Handle.destroy();
+	}
+}
+
+void WebSocketTask::Start(WebSocketExecutor* pExecutor)
+{
+	std::coroutine_handle<promise_type> handle = this->Handle;
+
+	// The coroutine frees itself when it returns
+	this->Handle = nullptr;
+	if (pExecutor != NULL) {
+		pExecutor->Post(handle);
+	}
+	else {
+		handle.resume();
+	}
+}
+
+bool WebSocketAsyncConnection::Initialize(WebSocketExecutor* pExecutor, PFN_IIS_WEB_SOCKET_ASYNC_READ pfnRead, PFN_IIS_WEB_SOCKET_ASYNC_WRITE pfnWrite,
+	void* pTransportContext, unsigned long dwReadBufferLength)
+{
+	this->pExecutor = pExecutor;
+	this->Shard = IIS_WEB_SOCKET_NO_SHARD;
+	this->bPooledInput = false;
+	this->bRegistered = false;
+	this->pfnRead = pfnRead;
+	this->pfnWrite = pfnWrite;
+	this->pTransportContext = pTransportContext;
+	InitializeMemoryAccount(&this->MemoryAccount, this);
+
+	memset(&this->Stream, 0, sizeof(this->Stream));
+	memset(&this->Frame, 0, sizeof(this->Frame));
+	this->Stream.bQueuing = true;
+	this->Stream.pFrameBuffer = this->FrameBuffer;
+
+	// The buffer must hold the largest frame header
+	if (dwReadBufferLength == 0) {
+		dwReadBufferLength = IIS_WEB_SOCKET_ASYNC_READ_BUFFER_LENGTH;
+	}
+	if (dwReadBufferLength < IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + sizeof(this->ControlBuffer)) {
+		dwReadBufferLength = IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + sizeof(this->ControlBuffer);
+	}
+
+	// A connection set up on a shard stays on it, one set up elsewhere is given a shard
+	if ((pExecutor != NULL) && (pExecutor->GetShardCount() != 0))
+	{
+		this->Shard = pExecutor->GetCurrentShard();
+		if (this->Shard == IIS_WEB_SOCKET_NO_SHARD) {
+			this->Shard = pExecutor->AssignShard();
+		}
+		else
+		{
+			this->bRegistered = pExecutor->RegisterConnection(this);
+			if (dwReadBufferLength <= pExecutor->GetBufferSize())
+			{
+				this->pInput = (unsigned char*)pExecutor->AllocateBuffer();
+				if (this->pInput != NULL) {
+					this->bPooledInput = true;
+					dwReadBufferLength = pExecutor->GetBufferSize();
+				}
+			}
+		}
+	}
+	if (!this->bPooledInput)
+	{
+		this->pInput = NULL;
+		if (ChargeMemory(&this->MemoryAccount, dwReadBufferLength))
+		{
+			this->pInput = (unsigned char*)malloc(dwReadBufferLength);
+			if (this->pInput == NULL) {
+				ReleaseMemory(&this->MemoryAccount, dwReadBufferLength);
+			}
+		}
+	}
+	this->dwInputLength = dwReadBufferLength;
+	this->dwInputStart = 0;
+	this->dwInputEnd = 0;
+
+	this->pMessage = NULL;
+	this->qwMessageSize = 0;
+	this->qwMessageLength = 0;
+	this->MessageType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+	this->bFragmented = false;
+	this->bMessageReturned = false;
+
+	this->bReceiving.store(false);
+	this->bSending.store(false);
+	this->pReceiver = NULL;
+	this->pSender = NULL;
+	this->bByteCredits = false;
+	this->bMessageCredits = false;
+	this->ByteCredits.store(0);
+	this->MessageCredits.store(0);
+	this->bCreditWait.store(false);
+
+	this->MaxPayloadLength = 0xFFFFFFFFFFFFFFFFULL;
+	this->MaxMessageLength = 0;
+	this->TransportError = 0;
+
+	return (this->pInput != NULL);
+}
+
+unsigned long WebSocketAsyncConnection::ReadInput(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	WebSocketAsyncConnection* pConnection = (WebSocketAsyncConnection*)pContext;
+	unsigned long dwAvailable;
+
+	// ParseInput only calls the protocol core once enough bytes are buffered, it never has to wait here
+	dwAvailable = pConnection->dwInputEnd - pConnection->dwInputStart;
+	if (dwLength > dwAvailable) {
+		dwLength = dwAvailable;
+	}
+	memcpy(pBuffer, pConnection->pInput + pConnection->dwInputStart, dwLength);
+	pConnection->dwInputStart += dwLength;
+	*pdwBytesRead = dwLength;
+
+	return 0;
+}
+
+bool WebSocketAsyncConnection::ParseInput(IIS_WEB_SOCKET_ASYNC_RESULT* pResult)
+{
+	WEB_SOCKET_FRAME frame;
+	IIS_WEB_SOCKET_BUFFER_TYPE controlType;
+	IIS_WEB_SOCKET_RECEIVE_RESULT result;
+	WEB_SOCKET_ASYNC_MESSAGE* pMessage;
+	unsigned long long qwRemaining;
+	unsigned long long qwSize;
+	unsigned long dwAvailable;
+	unsigned long dwLength;
+	unsigned long dwReceived;
+	bool bControl;
+	char* pNewMessage;
+
+	pMessage = this->pReceiver->pMessage;
+
+	for (;;)
+	{
+		dwAvailable = this->dwInputEnd - this->dwInputStart;
+
+		if (this->Stream.bQueuing)
+		{
+			// Wait for the whole header before the protocol core parses it again, an invalid header is rejected at once
+			if (!ParseWebSocketFrame(this->pInput + this->dwInputStart, dwAvailable, &frame, true)) {
+				return false;
+			}
+
+			// Continuations must follow a fragment, and a new message must not start before the last one ends
+			bControl = ((frame.Opcode & 0x08) != 0);
+			if ((frame.Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) ||
+				((frame.Opcode == 0x00) && (!this->bFragmented)) || (((frame.Opcode == 0x01) || (frame.Opcode == 0x02)) && (this->bFragmented))) {
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_ASYNC_RESULT;
+				return true;
+			}
+			if (frame.PayloadLength > this->MaxPayloadLength) {
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_PAYLOAD_TOO_LARGE_ASYNC_RESULT;
+				return true;
+			}
+
+			// Control frames are returned whole, the parser made sure they fit in ControlBuffer
+			// A data frame is handed over as its payload arrives
+			if (bControl)
+			{
+				if (dwAvailable - frame.FrameSize < frame.PayloadLength) {
+					return false;
+				}
+			}
+			else if ((frame.PayloadLength != 0) && (dwAvailable == frame.FrameSize)) {
+				return false;
+			}
+			qwRemaining = frame.PayloadLength;
+		}
+		else
+		{
+			// The rest of a data frame's payload
+			if (dwAvailable == 0) {
+				return false;
+			}
+			bControl = false;
+			qwRemaining = this->Stream.qwPayloadRemaining;
+		}
+
+		if (bControl)
+		{
+			result = ReceiveWebSocketData(&this->Stream, &this->Frame, this->MaxPayloadLength, ReadInput, this,
+				this->ControlBuffer, sizeof(this->ControlBuffer), &dwReceived, &controlType, NULL);
+			if (result != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_ASYNC_RESULT;
+				return true;
+			}
+
+			// A data message being reassembled is kept
+			pMessage->BufferType = controlType;
+			pMessage->pData = this->ControlBuffer;
+			pMessage->qwLength = dwReceived;
+			*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT;
+			return true;
+		}
+
+		// Make room for the rest of the frame
+		if ((this->MaxMessageLength != 0) && (this->qwMessageLength + qwRemaining > this->MaxMessageLength)) {
+			*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_MESSAGE_TOO_LARGE_ASYNC_RESULT;
+			return true;
+		}
+		if (this->qwMessageLength + qwRemaining > this->qwMessageSize)
+		{
+			qwSize = (this->qwMessageSize < 0x100) ? 0x100 : this->qwMessageSize;
+			while (qwSize < this->qwMessageLength + qwRemaining) {
+				qwSize *= 2;
+			}
+			if (!ChargeMemory(&this->MemoryAccount, qwSize - this->qwMessageSize)) {
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_ASYNC_RESULT;
+				return true;
+			}
+			pNewMessage = (char*)realloc(this->pMessage, (size_t)qwSize);
+			if (pNewMessage == NULL) {
+				ReleaseMemory(&this->MemoryAccount, qwSize - this->qwMessageSize);
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_ASYNC_RESULT;
+				return true;
+			}
+			this->pMessage = pNewMessage;
+			this->qwMessageSize = qwSize;
+		}
+
+		// The protocol core parses the header again, and unmasks what's buffered of the payload
+		dwLength = (qwRemaining < 0x7FFFFFFF) ? (unsigned long)qwRemaining : 0x7FFFFFFF;
+		result = ReceiveWebSocketData(&this->Stream, &this->Frame, this->MaxPayloadLength, ReadInput, this,
+			this->pMessage + this->qwMessageLength, dwLength, &dwReceived, &this->MessageType, NULL);
+		if (result != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_ASYNC_RESULT;
+			return true;
+		}
+		this->qwMessageLength += dwReceived;
+
+		// The frame is done, and the message with it when it's the final fragment
+		if (this->Stream.bQueuing)
+		{
+			this->bFragmented = !this->Frame.FIN;
+			if (this->Frame.FIN)
+			{
+				pMessage->BufferType = this->MessageType;
+				pMessage->pData = this->pMessage;
+				pMessage->qwLength = this->qwMessageLength;
+				this->bMessageReturned = true;
+				if ((this->bByteCredits) || (this->bMessageCredits)) {
+					this->ByteCredits.fetch_sub((long long)this->qwMessageLength);
+					this->MessageCredits.fetch_sub(1);
+				}
+				*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT;
+				return true;
+			}
+		}
+	}
+}
+
+// The buffer type of a whole message or control frame
+static IIS_WEB_SOCKET_BUFFER_TYPE MessageBufferType(int opcode)
+{
+	switch (opcode)
+	{
+	case 0x01:
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
+	case 0x08:
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE;
+	case 0x09:
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE;
+	case 0x0A:
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
+	default:
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+	}
+}
+
+bool WebSocketAsyncConnection::ParseBatch(IIS_WEB_SOCKET_ASYNC_RESULT* pResult)
+{
+	WEB_SOCKET_FRAME frame;
+	WEB_SOCKET_ASYNC_MESSAGE* pMessages;
+	unsigned char* pPayload;
+	unsigned long dwAvailable;
+	unsigned long dwCount;
+	bool bControl;
+
+	pMessages = this->pReceiver->pMessage;
+	dwCount = 0;
+
+	// Credits were checked before the first message, the batch stops once they run out
+	while ((dwCount < this->pReceiver->dwMaxCount) && ((dwCount == 0) || (this->HasReceiveCredits())))
+	{
+		dwAvailable = this->dwInputEnd - this->dwInputStart;
+
+		// A whole unfragmented message or control frame is unmasked where it was read, the payload isn't copied
+		if ((this->Stream.bQueuing) && (ParseWebSocketFrame(this->pInput + this->dwInputStart, dwAvailable, &frame, true)) &&
+			(frame.Violation == IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) && (frame.FIN) &&
+			(frame.PayloadLength <= this->MaxPayloadLength) && (dwAvailable - frame.FrameSize >= frame.PayloadLength))
+		{
+			bControl = ((frame.Opcode & 0x08) != 0);
+			if ((bControl) || (((frame.Opcode == 0x01) || (frame.Opcode == 0x02)) && (!this->bFragmented) &&
+				((this->MaxMessageLength == 0) || (frame.PayloadLength <= this->MaxMessageLength))))
+			{
+				pPayload = this->pInput + this->dwInputStart + frame.FrameSize;
+				UnmaskWebSocketPayload(pPayload, frame.PayloadLength, frame.MaskingKey, 0);
+				pMessages[dwCount].BufferType = MessageBufferType(frame.Opcode);
+				pMessages[dwCount].pData = (char*)pPayload;
+				pMessages[dwCount].qwLength = frame.PayloadLength;
+				this->dwInputStart += frame.FrameSize + (unsigned long)frame.PayloadLength;
+				if ((!bControl) && ((this->bByteCredits) || (this->bMessageCredits))) {
+					this->ByteCredits.fetch_sub((long long)frame.PayloadLength);
+					this->MessageCredits.fetch_sub(1);
+				}
+				dwCount++;
+				continue;
+			}
+		}
+
+		// Anything else is left to ParseInput, after the messages so far are returned, errors included
+		if (dwCount != 0) {
+			break;
+		}
+		if (!this->ParseInput(pResult)) {
+			return false;
+		}
+		if (*pResult != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			return true;
+		}
+		dwCount = 1;
+	}
+
+	*this->pReceiver->pdwCount = dwCount;
+	*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT;
+	return true;
+}
+
+bool WebSocketAsyncConnection::ContinueReceive(IIS_WEB_SOCKET_ASYNC_RESULT* pResult)
+{
+	unsigned long dwBytesRead;
+	unsigned long errorCode;
+	bool bPending;
+
+	for (;;)
+	{
+		if ((this->pReceiver->pdwCount != NULL) ? this->ParseBatch(pResult) : this->ParseInput(pResult)) {
+			return true;
+		}
+
+		// Move what's left of the input to the front of the buffer, it's never more than a partial frame header or control frame
+		if (this->dwInputStart != 0)
+		{
+			memmove(this->pInput, this->pInput + this->dwInputStart, this->dwInputEnd - this->dwInputStart);
+			this->dwInputEnd -= this->dwInputStart;
+			this->dwInputStart = 0;
+		}
+
+		// Read more
+		dwBytesRead = 0;
+		bPending = false;
+		errorCode = this->pfnRead(this->pTransportContext, this->pInput + this->dwInputEnd, this->dwInputLength - this->dwInputEnd, &dwBytesRead, &bPending);
+		if (errorCode != 0) {
+			this->TransportError = errorCode;
+			*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT;
+			return true;
+		}
+		if (bPending) {
+			return false;
+		}
+		if (dwBytesRead == 0) {
+			*pResult = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_CLOSED_ASYNC_RESULT;
+			return true;
+		}
+		this->dwInputEnd += dwBytesRead;
+	}
+}
+
+void WebSocketAsyncConnection::Resume(std::coroutine_handle<> handle)
+{
+	if (this->pExecutor != NULL) {
+		this->pExecutor->PostToShard(this->Shard, handle);
+	}
+	else {
+		handle.resume();
+	}
+}
+
+bool WebSocketAsyncConnection::ReceiveAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	WebSocketAsyncConnection* pConnection = this->pConnection;
+
+	if (this->pdwCount != NULL) {
+		*this->pdwCount = 0;
+	}
+	if ((this->pdwCount != NULL) && (this->dwMaxCount == 0)) {
+		return false;
+	}
+	if (pConnection->bReceiving.exchange(true)) {
+		this->Result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_BUSY_ASYNC_RESULT;
+		return false;
+	}
+
+	// The buffer of the last data message is reused
+	if (pConnection->bMessageReturned) {
+		pConnection->qwMessageLength = 0;
+		pConnection->bMessageReturned = false;
+	}
+
+	this->Handle = handle;
+	pConnection->pReceiver = this;
+	if (!pConnection->CheckReceiveCredits()) {
+		// GrantReceiveCredits continues the receive
+		return true;
+	}
+	if (!pConnection->ContinueReceive(&this->Result)) {
+		// CompleteRead resumes the coroutine
+		return true;
+	}
+
+	// Everything needed was buffered, or read right away
+	pConnection->bReceiving.store(false);
+	return false;
+}
+
+void WebSocketAsyncConnection::CompleteRead(unsigned long dwBytesRead, unsigned long errorCode)
+{
+	ReceiveAwaiter* pReceiver = this->pReceiver;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+
+	if (errorCode != 0) {
+		this->TransportError = errorCode;
+		result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT;
+	}
+	else if (dwBytesRead == 0) {
+		result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_CLOSED_ASYNC_RESULT;
+	}
+	else
+	{
+		this->dwInputEnd += dwBytesRead;
+		if (!this->ContinueReceive(&result)) {
+			// Another read is pending
+			return;
+		}
+	}
+
+	pReceiver->Result = result;
+	this->bReceiving.store(false);
+	this->Resume(pReceiver->Handle);
+}
+
+bool WebSocketAsyncConnection::HasReceiveCredits()
+{
+	return ((!this->bByteCredits) || (this->ByteCredits.load() > 0)) && ((!this->bMessageCredits) || (this->MessageCredits.load() > 0));
+}
+
+bool WebSocketAsyncConnection::CheckReceiveCredits()
+{
+	if (this->HasReceiveCredits()) {
+		return true;
+	}
+
+	// A grant between the check and the flag didn't see the flag, whoever clears it continues the receive
+	this->bCreditWait.store(true);
+	return (this->HasReceiveCredits()) && (this->bCreditWait.exchange(false));
+}
+
+void WebSocketAsyncConnection::EnableReceiveCredits(unsigned long long qwBytes, unsigned long long qwMessages)
+{
+	this->bByteCredits = (qwBytes != 0);
+	this->bMessageCredits = (qwMessages != 0);
+	this->ByteCredits.store((long long)qwBytes);
+	this->MessageCredits.store((long long)qwMessages);
+}
+
+void WebSocketAsyncConnection::GrantReceiveCredits(unsigned long long qwBytes, unsigned long long qwMessages)
+{
+	ReceiveAwaiter* pReceiver;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+
+	this->ByteCredits.fetch_add((long long)qwBytes);
+	this->MessageCredits.fetch_add((long long)qwMessages);
+	if ((!this->HasReceiveCredits()) || (!this->bCreditWait.exchange(false))) {
+		return;
+	}
+
+	// The receive waiting for credits starts reading again
+	pReceiver = this->pReceiver;
+	if (!this->ContinueReceive(&result)) {
+		// CompleteRead resumes the coroutine
+		return;
+	}
+	pReceiver->Result = result;
+	this->bReceiving.store(false);
+	this->Resume(pReceiver->Handle);
+}
+
+void WebSocketAsyncConnection::GetReceiveCredits(long long* pBytes, long long* pMessages)
+{
+	*pBytes = this->ByteCredits.load();
+	*pMessages = this->MessageCredits.load();
+}
+
+void WebSocketAsyncConnection::SetMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget)
+{
+	SetMemoryAccountBudget(&this->MemoryAccount, pBudget);
+}
+
+void WebSocketAsyncConnection::GetMemoryStats(IIS_WEB_SOCKET_MEMORY_STATS* pStats)
+{
+	IISWebSocketServer::GetMemoryStats(&this->MemoryAccount, pStats);
+}
+
+bool WebSocketAsyncConnection::SendAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	WebSocketAsyncConnection* pConnection = this->pConnection;
+	unsigned long errorCode;
+	bool bPending;
+
+	if (pConnection->bSending.exchange(true)) {
+		this->Result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_BUSY_ASYNC_RESULT;
+		return false;
+	}
+
+	this->Handle = handle;
+	pConnection->pSender = this;
+	bPending = false;
+	errorCode = pConnection->pfnWrite(pConnection->pTransportContext, this->BufferType, this->pData, this->qwLength, &bPending);
+	if ((errorCode == 0) && (bPending)) {
+		// CompleteWrite resumes the coroutine
+		return true;
+	}
+
+	if (errorCode != 0) {
+		pConnection->TransportError = errorCode;
+		this->Result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT;
+	}
+	pConnection->bSending.store(false);
+	return false;
+}
+
+void WebSocketAsyncConnection::CompleteWrite(unsigned long errorCode)
+{
+	SendAwaiter* pSender = this->pSender;
+
+	if (errorCode != 0) {
+		this->TransportError = errorCode;
+		pSender->Result = IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT;
+	}
+	this->bSending.store(false);
+	this->Resume(pSender->Handle);
+}
+
+void WebSocketAsyncConnection::Free()
+{
+	if (this->bRegistered) {
+		this->pExecutor->UnregisterConnection(this);
+		this->bRegistered = false;
+	}
+	if (this->pInput)
+	{
+		// A pooled buffer freed off its shard is released with the pool by Stop
+		if (this->bPooledInput) {
+			this->pExecutor->FreeBuffer(this->pInput);
+		}
+		else {
+			free(this->pInput);
+			ReleaseMemory(&this->MemoryAccount, this->dwInputLength);
+		}
+		this->pInput = NULL;
+		this->bPooledInput = false;
+	}
+	if (this->pMessage) {
+		free(this->pMessage);
+		ReleaseMemory(&this->MemoryAccount, this->qwMessageSize);
+		this->pMessage = NULL;
+	}
+	this->qwMessageSize = 0;
+	this->qwMessageLength = 0;
+}
+
+#endif // __cpp_impl_coroutine
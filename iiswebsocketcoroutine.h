@@ -0,0 +1,386 @@
+
+//
+// iiswebsocketcoroutine.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Coroutine connections, co_await ReceiveMessage and Send suspend while the transport reads or writes
+//     and resume on a small executor once it completes, so handlers are written as straight-line code without a thread per connection.
+//     The executor can also run a thread per core, each owning the connections, timers and buffers of its shard.
+//     Frames are parsed by the protocol core. The transport types build with any C++ standard, the coroutines need C++20.
+//
+
+#ifndef IIS_WEB_SOCKET_COROUTINE_H
+#define IIS_WEB_SOCKET_COROUTINE_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Starts a read from the transport, returns 0 on success or an error code
+	// Set *pbPending when the read completes later, the transport then calls WebSocketAsyncConnection::CompleteRead from any thread
+	// A read that completes with 0 bytes ends the connection
+	typedef unsigned long (*PFN_IIS_WEB_SOCKET_ASYNC_READ)(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending);
+
+	// Starts writing a message or control frame, the transport does the framing, returns 0 on success or an error code
+	// Set *pbPending when the write completes later, pData stays valid until the transport calls WebSocketAsyncConnection::CompleteWrite
+	typedef unsigned long (*PFN_IIS_WEB_SOCKET_ASYNC_WRITE)(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending);
+
+	// The result of co_await ReceiveMessage and Send
+	typedef enum class _IIS_WEB_SOCKET_ASYNC_RESULT
+	{
+		IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT = 0,
+		// The transport returned an error, TransportError holds it
+		IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT = 1,
+		// A read completed with 0 bytes, the client is gone
+		IIS_WEB_SOCKET_CLOSED_ASYNC_RESULT = 2,
+		// The frame's PayloadLength exceeded MaxPayloadLength
+		IIS_WEB_SOCKET_PAYLOAD_TOO_LARGE_ASYNC_RESULT = 3,
+		// The message exceeded MaxMessageLength, close the connection with status code 1009
+		IIS_WEB_SOCKET_MESSAGE_TOO_LARGE_ASYNC_RESULT = 4,
+		// The client sent a frame out of order or with an unknown opcode, close the connection with status code 1002
+		IIS_WEB_SOCKET_PROTOCOL_ERROR_ASYNC_RESULT = 5,
+		// Another coroutine is already receiving, or sending, on the connection
+		IIS_WEB_SOCKET_BUSY_ASYNC_RESULT = 6,
+		IIS_WEB_SOCKET_OUT_OF_MEMORY_ASYNC_RESULT = 7
+	} IIS_WEB_SOCKET_ASYNC_RESULT;
+
+	// A complete message returned by WebSocketAsyncConnection::ReceiveMessage and ReceiveBatch
+	struct WEB_SOCKET_ASYNC_MESSAGE
+	{
+		// A complete data message or a control frame, never a fragment
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		// The message payload, valid until the next ReceiveMessage or ReceiveBatch
+		char* pData;
+		unsigned long long qwLength;
+	};
+
+	// The default size of the buffer a connection reads into
+#define IIS_WEB_SOCKET_ASYNC_READ_BUFFER_LENGTH 0x1000
+
+	// The default number of coroutines the ring between two shards holds
+#define IIS_WEB_SOCKET_SHARD_RING_CAPACITY 0x400
+
+	// Returned by WebSocketExecutor::GetCurrentShard when the calling thread isn't a shard of the executor
+#define IIS_WEB_SOCKET_NO_SHARD 0xFFFFFFFF
+
+	// Options of WebSocketExecutor::StartShards
+	struct IIS_WEB_SOCKET_SHARD_OPTIONS
+	{
+		// Pin shard i to the i'th processor the process may run on
+		bool bPinThreads;
+		// The buffers of each shard's pool, allocated by the shard's thread so they're on its NUMA node (0 = no pool)
+		unsigned long BufferSize;
+		unsigned long BufferCount;
+		// Back the pools with huge pages
+		bool bHugePages;
+		// The coroutines the ring between two shards holds (0 = IIS_WEB_SOCKET_SHARD_RING_CAPACITY)
+		unsigned long RingCapacity;
+	};
+
+#ifdef __linux__
+	// Called on a shard's thread when a watched file descriptor is ready, events are EPOLLIN, EPOLLOUT, EPOLLHUP and EPOLLERR
+	typedef void (*PFN_IIS_WEB_SOCKET_SHARD_READY)(void* pContext, unsigned int events);
+
+	// A file descriptor watched by a shard, it must stay valid until it's unwatched
+	struct WEB_SOCKET_SHARD_WATCH
+	{
+		int fd;
+		PFN_IIS_WEB_SOCKET_SHARD_READY pfnReady;
+		void* pContext;
+	};
+#endif
+}
+
+// The coroutines need C++20
+#if defined(__cpp_impl_coroutine)
+
+#include <chrono>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Resumes coroutines on a few threads that share one queue, or on a thread per core that each own their coroutines
+	class WebSocketExecutor
+	{
+	private:
+		// A shard of the sharded mode, defined in iiswebsocketcoroutine.cpp
+		struct SHARD;
+		// A coroutine to resume at a deadline
+		struct TIMER
+		{
+			std::chrono::steady_clock::time_point Deadline;
+			std::coroutine_handle<> Handle;
+		};
+		std::mutex Lock;
+		std::condition_variable Ready;
+		std::deque<std::coroutine_handle<>> Queue;
+		// Delayed coroutines of the shared mode, a heap ordered by deadline
+		std::vector<TIMER> Timers;
+		std::vector<std::thread> Threads;
+		std::atomic<bool> bStopping;
+		// The shards of the sharded mode, empty in the shared mode
+		std::vector<SHARD*> Shards;
+		std::atomic<unsigned int> NextShard;
+		IIS_WEB_SOCKET_SHARD_OPTIONS ShardOptions;
+		// Resume queued coroutines until Stop
+		void Run();
+		// Resume the coroutines of a shard until Stop
+		void RunShard(SHARD* pShard);
+		// Queue a coroutine on a shard from another thread, the deadline is 0 to resume it right away
+		void QueueRemote(SHARD* pShard, std::coroutine_handle<> handle, std::chrono::steady_clock::time_point deadline);
+		// Get the shard of the calling thread, NULL when it isn't a shard of this executor
+		SHARD* GetShard();
+	public:
+		// Continues the awaiting coroutine on an executor thread
+		struct ScheduleAwaiter
+		{
+			WebSocketExecutor* pExecutor;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { pExecutor->Post(handle); }
+			void await_resume() const noexcept {}
+		};
+		// Continues the awaiting coroutine on a shard
+		struct SwitchAwaiter
+		{
+			WebSocketExecutor* pExecutor;
+			unsigned int Shard;
+			bool await_ready() { return pExecutor->GetCurrentShard() == Shard; }
+			void await_suspend(std::coroutine_handle<> handle) { pExecutor->PostToShard(Shard, handle); }
+			void await_resume() const noexcept {}
+		};
+		// Continues the awaiting coroutine after a delay
+		struct DelayAwaiter
+		{
+			WebSocketExecutor* pExecutor;
+			unsigned int dwMilliseconds;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { pExecutor->PostDelayed(handle, dwMilliseconds); }
+			void await_resume() const noexcept {}
+		};
+		WebSocketExecutor() : bStopping(false), NextShard(0), ShardOptions() {}
+		WebSocketExecutor(const WebSocketExecutor&) = delete;
+		WebSocketExecutor& operator=(const WebSocketExecutor&) = delete;
+		// Start the threads, 0 starts one per processor
+		bool Start(unsigned int threadCount);
+		// Start a thread per shard, 0 starts one per processor the process may run on, pOptions may be NULL
+		// A coroutine stays on the shard it was posted to, shards pass coroutines to each other through rings without locks
+		bool StartShards(unsigned int shardCount, const IIS_WEB_SOCKET_SHARD_OPTIONS* pOptions);
+		// Queue a coroutine to be resumed by an executor thread, a shard queues it on itself and other threads spread them over the shards
+		void Post(std::coroutine_handle<> handle);
+		// Queue a coroutine to be resumed by a shard
+		void PostToShard(unsigned int shard, std::coroutine_handle<> handle);
+		// Queue a coroutine to be resumed after a delay, on the same shard when called from one
+		void PostDelayed(std::coroutine_handle<> handle, unsigned int dwMilliseconds);
+		// co_await Schedule() to continue on an executor thread
+		ScheduleAwaiter Schedule() { return ScheduleAwaiter{ this }; }
+		// co_await SwitchToShard(shard) to continue on a shard
+		SwitchAwaiter SwitchToShard(unsigned int shard) { return SwitchAwaiter{ this, shard }; }
+		// co_await Delay(milliseconds) to continue after a delay
+		DelayAwaiter Delay(unsigned int dwMilliseconds) { return DelayAwaiter{ this, dwMilliseconds }; }
+		// Get the number of executor threads
+		size_t GetThreadCount();
+		// Get the number of shards, 0 in the shared mode
+		unsigned int GetShardCount();
+		// Get the shard of the calling thread, IIS_WEB_SOCKET_NO_SHARD when it isn't a shard of this executor
+		unsigned int GetCurrentShard();
+		// Pick the shard of a new connection, round robin
+		unsigned int AssignShard();
+		// Take a buffer from the pool of the calling thread's shard, NULL when it isn't a shard or the pool is empty
+		void* AllocateBuffer();
+		// Give a buffer back to the pool of the calling thread's shard, returns false if it isn't from that pool
+		bool FreeBuffer(void* pBuffer);
+		// Get the size of the buffers of the pools
+		unsigned long GetBufferSize();
+		// Add a connection to the registry of the calling thread's shard, returns false if it isn't a shard
+		bool RegisterConnection(void* pConnection);
+		// Remove a connection from the registry of the calling thread's shard
+		bool UnregisterConnection(void* pConnection);
+		// Get the number of registered connections of every shard
+		size_t GetConnectionCount();
+		// Call pfnConnection with each connection registered on the calling thread's shard
+		void ForEachShardConnection(void (*pfnConnection)(void* pContext, void* pConnection), void* pContext);
+#ifdef __linux__
+		// Watch a file descriptor from the calling thread's shard, pfnReady is called on the shard without locks
+		// The descriptor is edge triggered, events are EPOLLIN, EPOLLOUT or both
+		bool Watch(WEB_SOCKET_SHARD_WATCH* pWatch, int fd, unsigned int events, PFN_IIS_WEB_SOCKET_SHARD_READY pfnReady, void* pContext);
+		// Stop watching a file descriptor, from the shard that watches it
+		bool Unwatch(WEB_SOCKET_SHARD_WATCH* pWatch);
+#endif
+		// Stop and join the threads, queued coroutines aren't resumed
+		// Free the connections of the shards before, their buffers are in the pools
+		void Stop();
+	};
+
+	// The return type of a connection handler coroutine, the handler runs once started and frees itself when it returns
+	class WebSocketTask
+	{
+	public:
+		struct promise_type
+		{
+			WebSocketTask get_return_object() { return WebSocketTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			// Handlers report errors with result codes, like the rest of the server
+			void unhandled_exception() noexcept { std::terminate(); }
+		};
+		explicit WebSocketTask(std::coroutine_handle<promise_type> handle) : Handle(handle) {}
+		WebSocketTask(WebSocketTask&& other) noexcept : Handle(other.Handle) { other.Handle = nullptr; }
+		WebSocketTask(const WebSocketTask&) = delete;
+		WebSocketTask& operator=(const WebSocketTask&) = delete;
+		// A task that was never started is destroyed with the WebSocketTask
+		~WebSocketTask();
+		// Run the handler on an executor thread
+		void Start(WebSocketExecutor* pExecutor);
+	private:
+		std::coroutine_handle<promise_type> Handle;
+	};
+
+	// A WebSocket connection for coroutines, one ReceiveMessage and one Send may be awaited at a time
+	class WebSocketAsyncConnection
+	{
+	public:
+		// The awaiter of ReceiveMessage and ReceiveBatch
+		struct ReceiveAwaiter
+		{
+			WebSocketAsyncConnection* pConnection;
+			WEB_SOCKET_ASYNC_MESSAGE* pMessage;
+			// The messages a batch has room for, and where it returns how many it received, NULL for ReceiveMessage
+			unsigned long dwMaxCount;
+			unsigned long* pdwCount;
+			IIS_WEB_SOCKET_ASYNC_RESULT Result;
+			std::coroutine_handle<> Handle;
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> handle);
+			IIS_WEB_SOCKET_ASYNC_RESULT await_resume() const noexcept { return Result; }
+		};
+		// The awaiter of Send
+		struct SendAwaiter
+		{
+			WebSocketAsyncConnection* pConnection;
+			IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+			const void* pData;
+			unsigned long long qwLength;
+			IIS_WEB_SOCKET_ASYNC_RESULT Result;
+			std::coroutine_handle<> Handle;
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> handle);
+			IIS_WEB_SOCKET_ASYNC_RESULT await_resume() const noexcept { return Result; }
+		};
+	private:
+		WebSocketExecutor* pExecutor;
+		// The shard the connection's coroutines are resumed on, in the sharded mode
+		unsigned int Shard;
+		// Set when the read buffer is from the shard's pool, and when the connection is in the shard's registry
+		bool bPooledInput;
+		bool bRegistered;
+		PFN_IIS_WEB_SOCKET_ASYNC_READ pfnRead;
+		PFN_IIS_WEB_SOCKET_ASYNC_WRITE pfnWrite;
+		void* pTransportContext;
+		// The frame being received, parsed by the protocol core
+		WEB_SOCKET_STREAM Stream;
+		WEB_SOCKET_FRAME Frame;
+		char FrameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+		// Bytes read from the transport and not parsed yet
+		unsigned char* pInput;
+		unsigned long dwInputLength;
+		unsigned long dwInputStart;
+		unsigned long dwInputEnd;
+		// The data message being reassembled, and the buffer type the protocol core tracks its fragments with
+		char* pMessage;
+		unsigned long long qwMessageSize;
+		unsigned long long qwMessageLength;
+		IIS_WEB_SOCKET_BUFFER_TYPE MessageType;
+		bool bFragmented;
+		// Set when the last message returned was a data message, its buffer is reused by the next one
+		bool bMessageReturned;
+		char ControlBuffer[125];
+		// The awaiters of the pending ReceiveMessage and Send
+		std::atomic<bool> bReceiving;
+		std::atomic<bool> bSending;
+		ReceiveAwaiter* pReceiver;
+		SendAwaiter* pSender;
+		// Receive credits, data messages are charged when they're returned and nothing is read once a budget is spent
+		bool bByteCredits;
+		bool bMessageCredits;
+		std::atomic<long long> ByteCredits;
+		std::atomic<long long> MessageCredits;
+		// Set while a ReceiveMessage waits for GrantReceiveCredits
+		std::atomic<bool> bCreditWait;
+		// The read buffer and message buffer are charged to it, a pooled read buffer is charged to the pool
+		WEB_SOCKET_MEMORY_ACCOUNT MemoryAccount;
+		// Reads buffered input for the protocol core, pContext is the WebSocketAsyncConnection
+		static unsigned long ReadInput(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead);
+		// Parse buffered input, returns true when a message is complete or receiving failed, false when more input is needed
+		bool ParseInput(IIS_WEB_SOCKET_ASYNC_RESULT* pResult);
+		// Parse every complete message buffered into the batch, returns false when none is complete and more input is needed
+		bool ParseBatch(IIS_WEB_SOCKET_ASYNC_RESULT* pResult);
+		// Parse and read until a message is complete, returns false once a read is pending
+		// Nothing of the connection is touched after a read is pending, it may complete on another thread right away
+		bool ContinueReceive(IIS_WEB_SOCKET_ASYNC_RESULT* pResult);
+		// Resume a coroutine on the executor
+		void Resume(std::coroutine_handle<> handle);
+		// Check the budgets of the receive credits, false when one is spent
+		bool HasReceiveCredits();
+		// Returns false when the receive has to wait for credits, GrantReceiveCredits continues it then
+		bool CheckReceiveCredits();
+	public:
+		// The maximum a payload can be in a frame
+		unsigned long long MaxPayloadLength;
+		// The maximum length of a reassembled message (0 = no limit)
+		unsigned long long MaxMessageLength;
+		// The error code of the transport when a result is IIS_WEB_SOCKET_TRANSPORT_FAILED_ASYNC_RESULT
+		unsigned long TransportError;
+		// Set up the connection, pExecutor resumes its coroutines, NULL resumes them on the transport's thread
+		// dwReadBufferLength is the size of the buffer the transport reads into (0 = IIS_WEB_SOCKET_ASYNC_READ_BUFFER_LENGTH)
+		// On a shard the connection stays on it, takes its buffer from the shard's pool and is registered with the shard
+		bool Initialize(WebSocketExecutor* pExecutor, PFN_IIS_WEB_SOCKET_ASYNC_READ pfnRead, PFN_IIS_WEB_SOCKET_ASYNC_WRITE pfnWrite,
+			void* pTransportContext, unsigned long dwReadBufferLength);
+		// co_await the next complete message, fragments are reassembled and control frames are returned as they arrive
+		ReceiveAwaiter ReceiveMessage(WEB_SOCKET_ASYNC_MESSAGE* pMessage) { return ReceiveAwaiter{ this, pMessage, 1, NULL, IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT, nullptr }; }
+		// co_await every complete message a read brought in, up to dwMaxCount, *pdwCount is set to how many were returned
+		// Whole messages are unmasked where they were read and returned without a copy, one that has to be reassembled is only ever the first of a batch
+		ReceiveAwaiter ReceiveBatch(WEB_SOCKET_ASYNC_MESSAGE* pMessages, unsigned long dwMaxCount, unsigned long* pdwCount) { return ReceiveAwaiter{ this, pMessages, dwMaxCount, pdwCount, IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT, nullptr }; }
+		// co_await sending a message or control frame, pData must stay valid until it completes
+		SendAwaiter Send(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength) { return SendAwaiter{ this, bufferType, pData, qwLength, IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT, nullptr }; }
+		// Called by the transport when a pending read completes, errorCode is 0 on success
+		void CompleteRead(unsigned long dwBytesRead, unsigned long errorCode);
+		// Called by the transport when a pending write completes, errorCode is 0 on success
+		void CompleteWrite(unsigned long errorCode);
+		// Stop reading once the application holds qwBytes or qwMessages of data messages it hasn't granted back, 0 doesn't limit that one
+		// Call before the first ReceiveMessage, the transport's flow control then holds the client back instead of memory
+		void EnableReceiveCredits(unsigned long long qwBytes, unsigned long long qwMessages);
+		// Give credits back once the application is done with messages, from any thread
+		// A ReceiveMessage waiting for them continues on the calling thread, like it does in CompleteRead
+		void GrantReceiveCredits(unsigned long long qwBytes, unsigned long long qwMessages);
+		// Get the bytes and messages that can still be received, negative when the last message went over
+		void GetReceiveCredits(long long* pBytes, long long* pMessages);
+		// Set the memory budgets of the connection, NULL removes them, a message that would go over the hard budget fails with out of memory
+		void SetMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget);
+		// Get the memory the connection holds
+		void GetMemoryStats(IIS_WEB_SOCKET_MEMORY_STATS* pStats);
+		// Get the shard the connection's coroutines are resumed on
+		unsigned int GetShard() { return Shard; }
+		// Free the buffers, nothing may be pending, on the connection's shard in the sharded mode
+		void Free();
+	};
+}
+
+#endif // __cpp_impl_coroutine
+
+#endif // !IIS_WEB_SOCKET_COROUTINE_H
@@ -0,0 +1,313 @@
+
+//
+// iiswebsocketdrain.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Graceful shutdown of every connection of a process.
+//
+
+#include "iiswebsocketdrain.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace IISWebSocketServer;
+
+// The text in front of the reconnect hint in a close reason
+#define IIS_WEB_SOCKET_DRAIN_HINT_PREFIX "; reconnect-after="
+
+// Connections are allocated on 16 byte boundaries, the low bits of the address would leave most shards empty
+static uint64_t HashConnection(void* pConnection)
+{
+	return ((uint64_t)(uintptr_t)pConnection >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+WebSocketDrain::CONNECTION_SHARD* WebSocketDrain::GetShard(void* pConnection)
+{
+	return &this->pShards[(size_t)(HashConnection(pConnection) >> 32) % this->ShardCount];
+}
+
+bool WebSocketDrain::Initialize(unsigned int shardCount)
+{
+	if (shardCount == 0) {
+		shardCount = IIS_WEB_SOCKET_DEFAULT_DRAIN_SHARDS;
+	}
+
+	this->pShards.reset(new (std::nothrow) CONNECTION_SHARD[shardCount]);
+	if (this->pShards == NULL) {
+		return false;
+	}
+	this->ShardCount = shardCount;
+	this->bDraining.store(false);
+	this->ConnectionCount.store(0);
+
+	return true;
+}
+
+bool WebSocketDrain::Add(void* pConnection)
+{
+	CONNECTION_SHARD* pShard = this->GetShard(pConnection);
+
+	// Checked under the shard lock, so a connection is either refused or seen by the drain
+	std::lock_guard<std::mutex> lock(pShard->Lock);
+	if (this->bDraining.load()) {
+		return false;
+	}
+	try {
+		if (pShard->Connections.insert(pConnection).second) {
+			this->ConnectionCount.fetch_add(1);
+		}
+	}
+	catch (const std::bad_alloc&) {
+		return false;
+	}
+
+	return true;
+}
+
+void WebSocketDrain::Remove(void* pConnection)
+{
+	CONNECTION_SHARD* pShard = this->GetShard(pConnection);
+	bool bEmpty = false;
+
+	{
+		std::lock_guard<std::mutex> lock(pShard->Lock);
+		if (pShard->Connections.erase(pConnection) != 0) {
+			bEmpty = (this->ConnectionCount.fetch_sub(1) == 1);
+		}
+	}
+
+	// Wake a drain waiting for the last connection
+	if ((bEmpty) && (this->bDraining.load()))
+	{
+		std::lock_guard<std::mutex> lock(this->EmptyLock);
+		this->Empty.notify_all();
+	}
+}
+
+bool WebSocketDrain::IsDraining()
+{
+	return this->bDraining.load(std::memory_order_relaxed);
+}
+
+unsigned long long WebSocketDrain::GetConnectionCount()
+{
+	return this->ConnectionCount.load(std::memory_order_relaxed);
+}
+
+// Encode a close frame with status 1001, the reason and a reconnect hint, hint is ignored when bHint is false
+static WEB_SOCKET_SHARED_FRAME* CreateDrainFrame(const char* pReason, bool bHint, unsigned int hint)
+{
+	unsigned char payload[125];
+	char suffix[40];
+	size_t suffixLength = 0;
+	size_t reasonLength;
+
+	if (bHint) {
+		suffixLength = (size_t)snprintf(suffix, sizeof(suffix), IIS_WEB_SOCKET_DRAIN_HINT_PREFIX "%u", hint);
+	}
+
+	// The reason is cut to fit the control frame, never in the middle of a UTF-8 sequence
+	reasonLength = strlen(pReason);
+	if (reasonLength > sizeof(payload) - 2 - suffixLength)
+	{
+		reasonLength = sizeof(payload) - 2 - suffixLength;
+		while ((reasonLength != 0) && (((unsigned char)pReason[reasonLength] & 0xC0) == 0x80)) {
+			reasonLength--;
+		}
+	}
+
+	payload[0] = (unsigned char)(1001 >> 8);
+	payload[1] = (unsigned char)(1001 & 0xFF);
+	memcpy(payload + 2, pReason, reasonLength);
+	memcpy(payload + 2 + reasonLength, suffix, suffixLength);
+
+	return CreateSharedFrame(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, payload, 2 + reasonLength + suffixLength);
+}
+
+// Hand a connection its close frame, a connection always gets the same hint, and abort it if the frame can't be sent
+static void CloseConnection(void* pConnection, WEB_SOCKET_SHARED_FRAME** pFrames, unsigned int frameCount, PFN_IIS_WEB_SOCKET_DRAIN_CLOSE pfnClose,
+	PFN_IIS_WEB_SOCKET_DRAIN_ABORT pfnAbort, void* pContext, IIS_WEB_SOCKET_DRAIN_STATS* pStats)
+{
+	WEB_SOCKET_SHARED_FRAME* pFrame = pFrames[(size_t)(HashConnection(pConnection) >> 16) % frameCount];
+
+	if ((pFrame != NULL) && (pfnClose(pConnection, pFrame, pContext))) {
+		pStats->ClosesSent++;
+		return;
+	}
+
+	pStats->CloseFailures++;
+	pStats->Aborted++;
+	pfnAbort(pConnection, pContext);
+}
+
+// Microseconds between two times
+static unsigned long long ElapsedMicroseconds(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+void WebSocketDrain::Drain(const IIS_WEB_SOCKET_DRAIN_OPTIONS* pOptions, PFN_IIS_WEB_SOCKET_DRAIN_CLOSE pfnClose,
+	PFN_IIS_WEB_SOCKET_DRAIN_ABORT pfnAbort, void* pContext, IIS_WEB_SOCKET_DRAIN_STATS* pStats)
+{
+	WEB_SOCKET_SHARED_FRAME* pFrames[IIS_WEB_SOCKET_DRAIN_HINTS];
+	IIS_WEB_SOCKET_DRAIN_STATS stats;
+	std::vector<void*> connections;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point sent;
+	unsigned int frameCount;
+	unsigned int reconnectMin;
+	unsigned int reconnectMax;
+	unsigned long long qwBudget;
+	size_t next;
+	bool bSnapshot;
+
+	memset(&stats, 0, sizeof(stats));
+	start = std::chrono::steady_clock::now();
+
+	// Turn new connections away, then every connection that got in is in a shard
+	this->bDraining.store(true);
+	stats.Connections = this->ConnectionCount.load();
+
+	// One close frame per reconnect hint, spread evenly over the range so the clients don't all come back at once
+	reconnectMin = pOptions->ReconnectMin;
+	reconnectMax = (pOptions->ReconnectMax > reconnectMin) ? pOptions->ReconnectMax : reconnectMin;
+	frameCount = ((reconnectMin == 0) && (reconnectMax == 0)) ? 1 : ((reconnectMin == reconnectMax) ? 1 : IIS_WEB_SOCKET_DRAIN_HINTS);
+	for (unsigned int i = 0; i < frameCount; i++)
+	{
+		pFrames[i] = CreateDrainFrame((pOptions->pReason != NULL) ? pOptions->pReason : "Server restarting", (reconnectMax != 0),
+			reconnectMin + (unsigned int)((unsigned long long)(reconnectMax - reconnectMin) * i / ((frameCount > 1) ? (frameCount - 1) : 1)));
+	}
+
+	// Send the close frames a batch at a time, a batch never holds a shard lock across the pause
+	qwBudget = (pOptions->BatchSize != 0) ? pOptions->BatchSize : (unsigned long long)-1;
+	for (size_t shard = 0; shard < this->ShardCount; shard++)
+	{
+		CONNECTION_SHARD* pShard = &this->pShards[shard];
+
+		// Copy the shard, a connection removed meanwhile is skipped below
+		{
+			std::lock_guard<std::mutex> lock(pShard->Lock);
+			try {
+				connections.assign(pShard->Connections.begin(), pShard->Connections.end());
+				bSnapshot = true;
+			}
+			catch (const std::bad_alloc&) {
+				bSnapshot = false;
+			}
+
+			// Out of memory, the whole shard is sent under its lock
+			if (!bSnapshot)
+			{
+				for (void* pConnection : pShard->Connections) {
+					CloseConnection(pConnection, pFrames, frameCount, pfnClose, pfnAbort, pContext, &stats);
+				}
+				connections.clear();
+			}
+		}
+
+		for (next = 0; next < connections.size();)
+		{
+			if (qwBudget == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(pOptions->BatchInterval));
+				qwBudget = pOptions->BatchSize;
+			}
+
+			std::lock_guard<std::mutex> lock(pShard->Lock);
+			for (; (next < connections.size()) && (qwBudget != 0); next++)
+			{
+				if (pShard->Connections.find(connections[next]) == pShard->Connections.end()) {
+					continue;
+				}
+				CloseConnection(connections[next], pFrames, frameCount, pfnClose, pfnAbort, pContext, &stats);
+				qwBudget--;
+			}
+		}
+		connections.clear();
+	}
+	connections.shrink_to_fit();
+	sent = std::chrono::steady_clock::now();
+	stats.SendTime = ElapsedMicroseconds(start, sent);
+
+	// Wait for the clients to answer and the connections to end
+	{
+		std::unique_lock<std::mutex> lock(this->EmptyLock);
+		this->Empty.wait_until(lock, sent + std::chrono::milliseconds(pOptions->Timeout), [this] {
+			return this->ConnectionCount.load() == 0;
+		});
+	}
+	stats.WaitTime = ElapsedMicroseconds(sent, std::chrono::steady_clock::now());
+
+	// Abort the rest, they stay in the set until they're removed
+	for (size_t shard = 0; shard < this->ShardCount; shard++)
+	{
+		CONNECTION_SHARD* pShard = &this->pShards[shard];
+
+		std::lock_guard<std::mutex> lock(pShard->Lock);
+		for (void* pConnection : pShard->Connections) {
+			stats.Aborted++;
+			pfnAbort(pConnection, pContext);
+		}
+	}
+	stats.Closed = (stats.Connections > stats.Aborted) ? (stats.Connections - stats.Aborted) : 0;
+
+	// The connections that queued a frame hold references of their own
+	for (unsigned int i = 0; i < frameCount; i++)
+	{
+		if (pFrames[i] != NULL) {
+			ReleaseSharedFrame(pFrames[i]);
+		}
+	}
+
+	if (pStats != NULL) {
+		*pStats = stats;
+	}
+}
+
+void WebSocketDrain::Free()
+{
+	this->pShards.reset();
+	this->ShardCount = 0;
+	this->ConnectionCount.store(0);
+}
+
+bool IISWebSocketServer::ParseDrainReconnectHint(const char* pReason, size_t length, unsigned int* pMilliseconds)
+{
+	const size_t prefixLength = sizeof(IIS_WEB_SOCKET_DRAIN_HINT_PREFIX) - 1;
+	unsigned long long qwValue;
+	size_t i;
+
+	// The hint is at the end of the reason
+	for (size_t start = 0; start + prefixLength < length; start++)
+	{
+		if (memcmp(pReason + start, IIS_WEB_SOCKET_DRAIN_HINT_PREFIX, prefixLength) != 0) {
+			continue;
+		}
+
+		qwValue = 0;
+		for (i = start + prefixLength; (i < length) && (pReason[i] >= '0') && (pReason[i] <= '9'); i++)
+		{
+			qwValue = qwValue * 10 + (unsigned long long)(pReason[i] - '0');
+			if (qwValue > 0xFFFFFFFF) {
+				return false;
+			}
+		}
+		if ((i != length) || (i == start + prefixLength)) {
+			return false;
+		}
+
+		*pMilliseconds = (unsigned int)qwValue;
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,118 @@
+
+//
+// iiswebsocketdrain.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Graceful shutdown of every connection of a process, for when the application pool recycles.
+//     New connections are turned away, the open ones are sent a close frame encoded once in batches, and the ones that
+//     don't answer by a deadline are aborted. Like the protocol core, this only uses standard types and builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_DRAIN_H
+#define IIS_WEB_SOCKET_DRAIN_H
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Hands the close frame to a connection, returns false if it can't be sent and the connection should be aborted
+	// Called while the connection can't be removed, it must not block or call WebSocketDrain::Remove
+	// WebSocketServer::QueueDrainClose is the intended callback
+	typedef bool (*PFN_IIS_WEB_SOCKET_DRAIN_CLOSE)(void* pConnection, WEB_SOCKET_SHARED_FRAME* pFrame, void* pContext);
+
+	// Ends a connection that didn't answer the close frame in time, same rules as PFN_IIS_WEB_SOCKET_DRAIN_CLOSE
+	// WebSocketServer::AbortDrain is the intended callback
+	typedef void (*PFN_IIS_WEB_SOCKET_DRAIN_ABORT)(void* pConnection, void* pContext);
+
+	// The number of shards the connection set uses when Initialize is given 0
+#define IIS_WEB_SOCKET_DEFAULT_DRAIN_SHARDS 64
+
+	// The number of close frames encoded with different reconnect hints, connections are spread over them
+#define IIS_WEB_SOCKET_DRAIN_HINTS 16
+
+	// How a drain sends its close frames and how long it waits for the replies
+	struct IIS_WEB_SOCKET_DRAIN_OPTIONS
+	{
+		// The close reason, the reconnect hint is appended to it (NULL = "Server restarting")
+		const char* pReason;
+		// Close frames sent before pausing (0 = all at once), and the pause in milliseconds
+		unsigned int BatchSize;
+		unsigned int BatchInterval;
+		// The range of the reconnect hint in milliseconds, clients wait a random time in it before reconnecting (0, 0 = no hint)
+		unsigned int ReconnectMin;
+		unsigned int ReconnectMax;
+		// Milliseconds to wait for the connections to end once every close frame was sent
+		unsigned int Timeout;
+	};
+
+	// What a drain did
+	struct IIS_WEB_SOCKET_DRAIN_STATS
+	{
+		// The connections when the drain started
+		unsigned long long Connections;
+		// Close frames handed to connections, and connections that couldn't take one
+		unsigned long long ClosesSent;
+		unsigned long long CloseFailures;
+		// Connections that ended before the deadline, and ones aborted
+		unsigned long long Closed;
+		unsigned long long Aborted;
+		// Microseconds spent sending the close frames, and waiting for the connections to end
+		unsigned long long SendTime;
+		unsigned long long WaitTime;
+	};
+
+	// Tracks the connections of a process and drains them, a connection is any pointer the application chooses
+	class WebSocketDrain
+	{
+	private:
+		// A part of the connection set, a connection always lives in the same shard
+		struct CONNECTION_SHARD
+		{
+			std::mutex Lock;
+			std::unordered_set<void*> Connections;
+		};
+		std::unique_ptr<CONNECTION_SHARD[]> pShards;
+		size_t ShardCount;
+		std::atomic<bool> bDraining;
+		std::atomic<unsigned long long> ConnectionCount;
+		// Signalled when the last connection is removed during a drain
+		std::mutex EmptyLock;
+		std::condition_variable Empty;
+		// Get the shard of a connection
+		CONNECTION_SHARD* GetShard(void* pConnection);
+	public:
+		// Create the shards, 0 uses IIS_WEB_SOCKET_DEFAULT_DRAIN_SHARDS, returns false if out of memory
+		bool Initialize(unsigned int shardCount);
+		// Add a connection, returns false when draining or out of memory, the connection should be closed then
+		bool Add(void* pConnection);
+		// Remove a connection when it ends, nothing is called for it once this returns
+		void Remove(void* pConnection);
+		// Check if a drain has started, turn new connections away before the handshake when it has
+		bool IsDraining();
+		// Get the number of connections
+		unsigned long long GetConnectionCount();
+		// Stop adding connections, send every connection a close frame with status 1001 and wait for them to end
+		// Connections still open at the deadline are aborted, pStats is optional
+		void Drain(const IIS_WEB_SOCKET_DRAIN_OPTIONS* pOptions, PFN_IIS_WEB_SOCKET_DRAIN_CLOSE pfnClose,
+			PFN_IIS_WEB_SOCKET_DRAIN_ABORT pfnAbort, void* pContext, IIS_WEB_SOCKET_DRAIN_STATS* pStats);
+		// Free resources
+		void Free();
+	};
+
+	// Get the reconnect hint of a close reason sent by a drain, returns false if it doesn't have one
+	bool ParseDrainReconnectHint(const char* pReason, size_t length, unsigned int* pMilliseconds);
+}
+
+#endif // !IIS_WEB_SOCKET_DRAIN_H
@@ -0,0 +1,1739 @@
+
+//
+// iiswebsocketframe.cpp
+// 
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+// 
+// Description:
+//     The platform-neutral WebSocket protocol core, shared by the IIS WebSocket server and the benchmarks.
+//
+
+#include "iiswebsocketframe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <chrono>
+#include <random>
+
+// SSE2 is part of every x64 target
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define IIS_WEB_SOCKET_SSE2
+#include <emmintrin.h>
+#endif
+
+// _BitScanReverse64 for the latency histograms
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace IISWebSocketServer;
+
+// What the first byte of a header says about a frame, the low bits are a violation and the high bit marks a control frame
+struct FRAME_BYTE_TABLE
+{
+	unsigned char Entries[256];
+
+	constexpr FRAME_BYTE_TABLE() : Entries()
+	{
+		for (unsigned int frameByte = 0; frameByte < 256; frameByte++)
+		{
+			unsigned int opcode = frameByte & 0x0F;
+			bool bControl = ((opcode & 0x08) != 0);
+			IIS_WEB_SOCKET_FRAME_VIOLATION violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION;
+
+			if ((frameByte & 0x70) != 0) {
+				violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_RESERVED_BITS_FRAME_VIOLATION;
+			}
+			else if (((opcode > 0x02) && (opcode < 0x08)) || (opcode > 0x0A)) {
+				violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_UNKNOWN_OPCODE_FRAME_VIOLATION;
+			}
+			else if ((bControl) && ((frameByte & 0x80) == 0)) {
+				violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_FRAGMENTED_CONTROL_FRAME_VIOLATION;
+			}
+			this->Entries[frameByte] = (unsigned char)((bControl ? 0x80 : 0x00) | (unsigned int)violation);
+		}
+	}
+};
+
+static constexpr FRAME_BYTE_TABLE FrameByteTable;
+
+// The violation of the second byte, indexed by a control frame's payload being over 125 bytes and the mask bit being wrong
+static const unsigned char SecondByteViolations[4] =
+{
+	(unsigned char)IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION,
+	(unsigned char)IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_MASK_FRAME_VIOLATION,
+	(unsigned char)IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_CONTROL_TOO_LONG_FRAME_VIOLATION,
+	(unsigned char)IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_CONTROL_TOO_LONG_FRAME_VIOLATION
+};
+
+bool IISWebSocketServer::ParseWebSocketFrame(unsigned char* pBuffer, unsigned long dwLength, WEB_SOCKET_FRAME* pOutFrame, bool bMasked)
+{
+	unsigned int firstByte;
+	unsigned int secondByte;
+	unsigned int entry;
+	unsigned int violation;
+	unsigned int frameSize;
+	unsigned long long payloadLength;
+
+	// Minimal size is 2 bytes for a WebSocket frame
+	pOutFrame->Violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION;
+	if (dwLength < 2) {
+		pOutFrame->FrameSize = 2;
+		return false;
+	}
+
+	// The header bytes are read once, writing the frame can't make the compiler read them again
+	firstByte = pBuffer[0];
+	secondByte = pBuffer[1];
+	payloadLength = secondByte & 0x7F;
+
+	// Everything but the length encoding is known from the first 2 bytes, two table lookups check it without a branch per rule
+	entry = FrameByteTable.Entries[firstByte];
+	violation = entry & 0x0F;
+	if (violation == 0) {
+		violation = SecondByteViolations[(((entry >> 7) & (payloadLength > 125 ? 1u : 0u)) << 1) | ((secondByte >> 7) ^ (bMasked ? 1u : 0u))];
+	}
+
+	// Get the Opcode, FIN, Mask boolean and the size of the header
+	pOutFrame->Opcode = firstByte & 0x0F;
+	pOutFrame->FIN = (firstByte & 0x80) != 0;
+	pOutFrame->bMask = (secondByte & 0x80) != 0;
+	frameSize = 2 + ((secondByte & 0x80) >> 5);
+	if (payloadLength == 126) {
+		frameSize += 2;
+	}
+	else if (payloadLength == 127) {
+		frameSize += 8;
+	}
+	pOutFrame->FrameSize = frameSize;
+
+	// An invalid header is rejected without waiting for the rest of it
+	if (violation != 0) {
+		pOutFrame->Violation = (IIS_WEB_SOCKET_FRAME_VIOLATION)violation;
+		return true;
+	}
+
+	// Return false if the buffer doesn't contain all of the frame
+	if (dwLength < frameSize) {
+		return false;
+	}
+
+	// Get the actual Payload length, the shortest encoding must be used
+	if (payloadLength == 126)
+	{
+		// Payload length is stored in the next 2 bytes
+		payloadLength = ((unsigned long long)pBuffer[2] << 8) + pBuffer[3];
+		if (payloadLength < 126) {
+			pOutFrame->Violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NON_MINIMAL_LENGTH_FRAME_VIOLATION;
+		}
+	}
+	else if (payloadLength == 127)
+	{
+		// Payload length is stored in the next 8 bytes
+		payloadLength =
+			((unsigned long long)pBuffer[2] << 56) +
+			((unsigned long long)pBuffer[3] << 48) +
+			((unsigned long long)pBuffer[4] << 40) +
+			((unsigned long long)pBuffer[5] << 32) +
+			((unsigned long long)pBuffer[6] << 24) +
+			((unsigned long long)pBuffer[7] << 16) +
+			((unsigned long long)pBuffer[8] << 8) +
+			(unsigned long long)pBuffer[9];
+		if ((payloadLength < 0x10000) || ((payloadLength >> 63) != 0)) {
+			pOutFrame->Violation = IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NON_MINIMAL_LENGTH_FRAME_VIOLATION;
+		}
+	}
+
+	// Set the Payload length
+	pOutFrame->PayloadLength = payloadLength;
+
+	// Read the Masking key, the last 4 bytes of the header
+	if (secondByte & 0x80) {
+		memcpy(pOutFrame->MaskingKey, pBuffer + frameSize - 4, 4);
+	}
+
+	// We have parsed the full frame
+	return true;
+}
+
+const char* IISWebSocketServer::GetWebSocketFrameViolationReason(IIS_WEB_SOCKET_FRAME_VIOLATION violation)
+{
+	switch (violation)
+	{
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION:
+		return "No violation";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_RESERVED_BITS_FRAME_VIOLATION:
+		return "Reserved bits set";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_UNKNOWN_OPCODE_FRAME_VIOLATION:
+		return "Unknown opcode";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_FRAGMENTED_CONTROL_FRAME_VIOLATION:
+		return "Fragmented control frame";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_CONTROL_TOO_LONG_FRAME_VIOLATION:
+		return "Control frame over 125 bytes";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_MASK_FRAME_VIOLATION:
+		return "Wrong mask bit";
+	case IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NON_MINIMAL_LENGTH_FRAME_VIOLATION:
+		return "Non-minimal payload length";
+	default:
+		return "Invalid frame";
+	}
+}
+
+unsigned int IISWebSocketServer::EncodeWebSocketFrameHeader(unsigned char pHeader[10], unsigned char frameByte, unsigned long long qwPayloadLength)
+{
+	// Set FIN and Opcode
+	pHeader[0] = frameByte;
+
+	// Payload length fits in the 2nd byte
+	if (qwPayloadLength <= 125)
+	{
+		pHeader[1] = (unsigned char)qwPayloadLength;
+		return 2;
+	}
+
+	// Payload length is stored in the next 2 bytes
+	if (qwPayloadLength <= 65535)
+	{
+		pHeader[1] = 126;
+		pHeader[2] = (qwPayloadLength >> 8) & 0xFF;
+		pHeader[3] = qwPayloadLength & 0xFF;
+		return 4;
+	}
+
+	// Payload length is stored in the next 8 bytes
+	pHeader[1] = 127;
+	pHeader[2] = (qwPayloadLength >> 56) & 0xFF;
+	pHeader[3] = (qwPayloadLength >> 48) & 0xFF;
+	pHeader[4] = (qwPayloadLength >> 40) & 0xFF;
+	pHeader[5] = (qwPayloadLength >> 32) & 0xFF;
+	pHeader[6] = (qwPayloadLength >> 24) & 0xFF;
+	pHeader[7] = (qwPayloadLength >> 16) & 0xFF;
+	pHeader[8] = (qwPayloadLength >> 8) & 0xFF;
+	pHeader[9] = qwPayloadLength & 0xFF;
+	return 10;
+}
+
+unsigned int IISWebSocketServer::EncodeMaskedWebSocketFrameHeader(unsigned char pHeader[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH], unsigned char frameByte, unsigned long long qwPayloadLength, const char MaskingKey[4])
+{
+	unsigned int headerLength;
+
+	// Encode the header, then set the Mask bit and append the Masking key
+	headerLength = EncodeWebSocketFrameHeader(pHeader, frameByte, qwPayloadLength);
+	pHeader[1] |= 0x80;
+	memcpy(&pHeader[headerLength], MaskingKey, 4);
+
+	return headerLength + 4;
+}
+
+IIS_WEB_SOCKET_BUFFER_TYPE IISWebSocketServer::GetFragmentBufferType(IIS_WEB_SOCKET_BUFFER_TYPE bufferType)
+{
+	if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) {
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+	}
+	if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) {
+		return IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+	}
+	return bufferType;
+}
+
+bool IISWebSocketServer::EncodeWebSocketFrameOpcode(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, bool* pbFragment, unsigned char* pFrameByte)
+{
+	// Set FIN and Opcode in the frame
+	switch (bufferType)
+	{
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
+		if (*pbFragment) {
+			*pFrameByte = 0x80; // End of multi frame message
+		}
+		else {
+			*pFrameByte = 0x81; // A single frame message
+		}
+		*pbFragment = false;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE:
+		if (*pbFragment) {
+			*pFrameByte = 0x00; // Continuation frame
+		}
+		else {
+			*pFrameByte = 0x01; // Start of multi frame message
+			*pbFragment = true;
+		}
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE:
+		if (*pbFragment) {
+			*pFrameByte = 0x80; // End of multi frame data
+		}
+		else {
+			*pFrameByte = 0x82; // A single frame of data
+		}
+		*pbFragment = false;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE:
+		if (*pbFragment) {
+			*pFrameByte = 0x00; // Continuation frame
+		}
+		else {
+			*pFrameByte = 0x02; // Start of multi frame data
+			*pbFragment = true;
+		}
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE:
+		*pFrameByte = 0x88;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE:
+		*pFrameByte = 0x89;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE:
+		*pFrameByte = 0x8A;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+bool IISWebSocketServer::PlanWebSocketFragment(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwRemaining, unsigned long long qwMaxFrameLength,
+	bool* pbFragment, unsigned char* pFrameByte, unsigned long long* pqwFrameLength)
+{
+	// Get the length of this frame
+	if ((qwMaxFrameLength == 0) || (qwRemaining <= qwMaxFrameLength)) {
+		*pqwFrameLength = qwRemaining;
+	}
+	else {
+		*pqwFrameLength = qwMaxFrameLength;
+	}
+
+	// Set FIN and Opcode in the frame, the last frame uses the callers buffer type
+	if (*pqwFrameLength == qwRemaining) {
+		return EncodeWebSocketFrameOpcode(bufferType, pbFragment, pFrameByte);
+	}
+	return EncodeWebSocketFrameOpcode(GetFragmentBufferType(bufferType), pbFragment, pFrameByte);
+}
+
+IIS_WEB_SOCKET_SEND_STREAM_RESULT IISWebSocketServer::BeginWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	unsigned long long qwMessageLength, bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame)
+{
+	pFrame->bHeader = false;
+	pFrame->FrameByte = 0;
+	pFrame->qwPayloadLength = 0;
+
+	// Only one streamed message can be sent at a time, and not in the middle of a fragmented message
+	if ((pStream->bActive) || (*pbFragment)) {
+		return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT;
+	}
+	if ((bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) &&
+		(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)) {
+		return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_TYPE_SEND_STREAM_RESULT;
+	}
+
+	pStream->bActive = true;
+	pStream->MessageType = bufferType;
+	if (qwMessageLength != IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH)
+	{
+		// The length is known, a single frame with the full 64-bit length and none of the payload
+		pStream->bDeclaredLength = true;
+		pStream->qwPayloadRemaining = qwMessageLength;
+		pFrame->bHeader = true;
+		EncodeWebSocketFrameOpcode(bufferType, pbFragment, &pFrame->FrameByte);
+		pFrame->qwPayloadLength = qwMessageLength;
+	}
+	else
+	{
+		// The length is unknown, each chunk is sent as a fragment
+		pStream->bDeclaredLength = false;
+		pStream->qwPayloadRemaining = 0;
+	}
+
+	return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT;
+}
+
+IIS_WEB_SOCKET_SEND_STREAM_RESULT IISWebSocketServer::WriteWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, unsigned long long qwLength,
+	bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame)
+{
+	pFrame->bHeader = false;
+	pFrame->FrameByte = 0;
+	pFrame->qwPayloadLength = 0;
+
+	if (!pStream->bActive) {
+		return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT;
+	}
+
+	// Nothing to send
+	if (qwLength == 0) {
+		return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT;
+	}
+
+	if (pStream->bDeclaredLength)
+	{
+		// We can't send more than the length declared in the frame header
+		if (qwLength > pStream->qwPayloadRemaining) {
+			return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT;
+		}
+		pStream->qwPayloadRemaining -= qwLength;
+	}
+	else
+	{
+		// The chunk is the next fragment of the message
+		pFrame->bHeader = true;
+		EncodeWebSocketFrameOpcode(GetFragmentBufferType(pStream->MessageType), pbFragment, &pFrame->FrameByte);
+		pFrame->qwPayloadLength = qwLength;
+	}
+
+	return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT;
+}
+
+IIS_WEB_SOCKET_SEND_STREAM_RESULT IISWebSocketServer::EndWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame)
+{
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT result;
+
+	pFrame->bHeader = false;
+	pFrame->FrameByte = 0;
+	pFrame->qwPayloadLength = 0;
+
+	if (!pStream->bActive) {
+		return IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT;
+	}
+
+	result = IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT;
+	if (pStream->bDeclaredLength)
+	{
+		// The frame can't be finished short of its length
+		if (pStream->qwPayloadRemaining != 0) {
+			result = IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT;
+		}
+	}
+	else
+	{
+		// The final empty fragment, or a single empty frame if no chunk was sent
+		pFrame->bHeader = true;
+		EncodeWebSocketFrameOpcode(pStream->MessageType, pbFragment, &pFrame->FrameByte);
+	}
+
+	AbortWebSocketSendStream(pStream, pbFragment);
+
+	return result;
+}
+
+void IISWebSocketServer::AbortWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, bool* pbFragment)
+{
+	// A message of unknown length that isn't finished leaves no fragment open for the next one
+	if ((pStream->bActive) && (!pStream->bDeclaredLength)) {
+		*pbFragment = false;
+	}
+	pStream->bActive = false;
+	pStream->bDeclaredLength = false;
+	pStream->qwPayloadRemaining = 0;
+}
+
+unsigned long long IISWebSocketServer::UnmaskWebSocketPayload(void* pBuffer, unsigned long long qwLength, const char MaskingKey[4], unsigned long long mkI)
+{
+	unsigned char* pBytes = (unsigned char*)pBuffer;
+	unsigned char mask[16];
+	unsigned long long i;
+	uint64_t mask64;
+	uint64_t value;
+
+	// Rotate the masking key so mask[0] lines up with the first byte, then repeat it
+	for (int k = 0; k < 4; k++) {
+		mask[k] = (unsigned char)MaskingKey[(mkI + k) % 4];
+	}
+	memcpy(mask + 4, mask, 4);
+	memcpy(mask + 8, mask, 8);
+
+	i = 0;
+
+#ifdef IIS_WEB_SOCKET_SSE2
+	// 64 bytes at a time, then 16
+	__m128i mask128 = _mm_loadu_si128((const __m128i*)mask);
+	for (; i + 64 <= qwLength; i += 64)
+	{
+		__m128i v0 = _mm_loadu_si128((const __m128i*)(pBytes + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i*)(pBytes + i + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i*)(pBytes + i + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i*)(pBytes + i + 48));
+		_mm_storeu_si128((__m128i*)(pBytes + i), _mm_xor_si128(v0, mask128));
+		_mm_storeu_si128((__m128i*)(pBytes + i + 16), _mm_xor_si128(v1, mask128));
+		_mm_storeu_si128((__m128i*)(pBytes + i + 32), _mm_xor_si128(v2, mask128));
+		_mm_storeu_si128((__m128i*)(pBytes + i + 48), _mm_xor_si128(v3, mask128));
+	}
+	for (; i + 16 <= qwLength; i += 16) {
+		_mm_storeu_si128((__m128i*)(pBytes + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(pBytes + i)), mask128));
+	}
+#endif
+
+	// 8 bytes at a time, memcpy keeps unaligned access portable and compiles to a single load and store
+	memcpy(&mask64, mask, 8);
+	for (; i + 8 <= qwLength; i += 8)
+	{
+		memcpy(&value, pBytes + i, 8);
+		value ^= mask64;
+		memcpy(pBytes + i, &value, 8);
+	}
+
+	// The remaining bytes, every step above is a multiple of 4 so the mask is still lined up
+	for (; i < qwLength; i++) {
+		pBytes[i] ^= mask[i % 4];
+	}
+
+	return mkI + qwLength;
+}
+
+IIS_WEB_SOCKET_RECEIVE_RESULT IISWebSocketServer::ReceiveWebSocketData(WEB_SOCKET_STREAM* pStream, WEB_SOCKET_FRAME* pFrame, unsigned long long qwMaxPayloadLength,
+	PFN_IIS_WEB_SOCKET_READ pfnRead, void* pReadContext, void* pBuffer, unsigned long dwBufferLength,
+	unsigned long* pdwBytesReceived, IIS_WEB_SOCKET_BUFFER_TYPE* pBufferType, WEB_SOCKET_RECEIVE_TIMING* pTiming)
+{
+	unsigned long dwBytesReceived;
+	unsigned long dwMaxReceive;
+	unsigned long long qwTimestamp;
+	bool bTiming;
+
+	// Set defaults
+	*pdwBytesReceived = 0;
+	dwBytesReceived = 0;
+	qwTimestamp = 0;
+	bTiming = (pTiming != NULL) && (pTiming->pfnTimestamp != NULL);
+	if (pTiming != NULL) {
+		pTiming->qwReadWait = 0;
+		pTiming->qwParse = 0;
+		pTiming->qwUnmask = 0;
+		pTiming->bNewFrame = false;
+	}
+
+	// Are we queuing a new frame?
+	if (pStream->bQueuing)
+	{
+		// Reset dwReceivedSize
+		pStream->dwReceivedSize = 0;
+
+		// Parsing is the time spent in this loop outside of the read function
+		if (bTiming) {
+			pTiming->qwParse = pTiming->pfnTimestamp();
+		}
+
+		// Parse the frame, a client's frames must be masked and a server's must not
+		while (!ParseWebSocketFrame((unsigned char*)pStream->pFrameBuffer, pStream->dwReceivedSize, pFrame, !pStream->bClient))
+		{
+			// Reset parameters
+			dwBytesReceived = 0;
+
+			// Receive data
+			if (bTiming) {
+				qwTimestamp = pTiming->pfnTimestamp();
+			}
+			if (pfnRead(pReadContext, pStream->pFrameBuffer + pStream->dwReceivedSize, pFrame->FrameSize - pStream->dwReceivedSize, &dwBytesReceived) != 0) {
+				return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_READ_FAILED_RECEIVE_RESULT;
+			}
+			if (bTiming) {
+				pTiming->qwReadWait += pTiming->pfnTimestamp() - qwTimestamp;
+			}
+
+			// Add bytes received to our total
+			pStream->dwReceivedSize += dwBytesReceived;
+		}
+
+		if (bTiming) {
+			pTiming->qwParse = pTiming->pfnTimestamp() - pTiming->qwParse - pTiming->qwReadWait;
+		}
+
+		// Reject the frame before any of its payload is read, the stream can't be trusted past it
+		if (pFrame->Violation != IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION) {
+			return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_PROTOCOL_ERROR_RECEIVE_RESULT;
+		}
+
+		// Check if the payload will exceed the maximum length set by the server
+		if (pFrame->PayloadLength > qwMaxPayloadLength) {
+			return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_PAYLOAD_TOO_LARGE_RECEIVE_RESULT;
+		}
+
+		// Reset parameters
+		dwBytesReceived = 0;
+
+		// Setup our stream parameters
+		pStream->qwPayloadRemaining = pFrame->PayloadLength;
+
+		// Reset masking key index
+		pStream->mkI = 0;
+
+		// Set queuing to false until payload is received and transferred
+		pStream->bQueuing = false;
+
+		if (pTiming != NULL) {
+			pTiming->bNewFrame = true;
+		}
+	}
+
+receiveLoop: // Only used for "Connection close", "Ping" and "Pong" frames
+
+	// Determine the max amount to receive (so we dont receive any of the next frame, or past the end of the buffer)
+	dwMaxReceive = dwBufferLength - *pdwBytesReceived;
+	if (pStream->qwPayloadRemaining < dwMaxReceive) {
+		dwMaxReceive = (unsigned long)pStream->qwPayloadRemaining;
+	}
+
+	// Receive payload
+	if (bTiming) {
+		qwTimestamp = pTiming->pfnTimestamp();
+	}
+	if (pfnRead(pReadContext, (char*)pBuffer + *pdwBytesReceived, dwMaxReceive, &dwBytesReceived) != 0) {
+		return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_READ_FAILED_RECEIVE_RESULT;
+	}
+	if (bTiming) {
+		pTiming->qwReadWait += pTiming->pfnTimestamp() - qwTimestamp;
+	}
+
+	// Check if we should have received payload data
+	if ((dwBytesReceived == 0) && (pStream->qwPayloadRemaining != 0)) {
+		goto receiveLoop;
+	}
+
+	// Adjust payload remaining
+	pStream->qwPayloadRemaining -= dwBytesReceived;
+
+	// Set bytes received for the transfer
+	*pdwBytesReceived += dwBytesReceived;
+
+	// Are we done with this payload?
+	if (pStream->qwPayloadRemaining != 0)
+	{
+		// This is a fragment because we haven't finished receiving the payload
+		if (pFrame->Opcode == 0x01) {
+			*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+		}
+		else if (pFrame->Opcode == 0x02) {
+			*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+		}
+		else if ((pFrame->Opcode == 0x08) || (pFrame->Opcode == 0x09) || (pFrame->Opcode == 0x0A)) {
+			// "Connection close", "Ping" and "Pong" must be received in a single buffer
+			if (*pdwBytesReceived != dwBufferLength) {
+				goto receiveLoop;
+			}
+			else {
+				return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_BUFFER_TOO_SMALL_RECEIVE_RESULT;
+			}
+		}
+
+		// Could be a "Continuation frame", we assume `*pBufferType` has already been set
+	}
+	else
+	{
+		// This could be a fragment, or the end of the message
+		if (pFrame->FIN)
+		{
+			// This is the final fragment in a message
+			if (pFrame->Opcode == 0x00) {
+				// "Continuation frame"
+				if (*pBufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE) {
+					*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
+				}
+				else if (*pBufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE) {
+					*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+				}
+			}
+			else if (pFrame->Opcode == 0x01) {
+				// "Text frame"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x02) {
+				// "Binary frame"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x08) {
+				// "Connection close"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x09) {
+				// "Ping"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x0A) {
+				// "Pong"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
+			}
+		}
+		else
+		{
+			// This is a fragment of a message
+			if (pFrame->Opcode == 0x00) {
+				// "Continuation frame"
+				// ... Do nothing!
+			}
+			else if (pFrame->Opcode == 0x01) {
+				// "Text frame"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x02) {
+				// "Binary frame"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x08) {
+				// "Connection close"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x09) {
+				// "Ping"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE;
+			}
+			else if (pFrame->Opcode == 0x0A) {
+				// "Pong"
+				*pBufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE;
+			}
+		}
+
+		// We need to get a new frame on the next call
+		pStream->bQueuing = true;
+	}
+
+	// Unmask the payload data if necessary
+	if (pFrame->bMask)
+	{
+		if (bTiming) {
+			qwTimestamp = pTiming->pfnTimestamp();
+		}
+		pStream->mkI = UnmaskWebSocketPayload(pBuffer, *pdwBytesReceived, pFrame->MaskingKey, pStream->mkI);
+		if (bTiming) {
+			pTiming->qwUnmask = pTiming->pfnTimestamp() - qwTimestamp;
+		}
+	}
+
+	return IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT;
+}
+
+// Per-thread xorshift128+ generator, seeded the first time a thread uses it
+struct WEB_SOCKET_RANDOM
+{
+	uint64_t State[2];
+	bool bSeeded;
+};
+
+static thread_local WEB_SOCKET_RANDOM WebSocketRandomState;
+
+// SplitMix64, spreads a seed across the generator state
+static uint64_t SplitMix64(uint64_t* pSeed)
+{
+	uint64_t z = (*pSeed += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Get the next 64 random bits for this thread, not for cryptographic use
+static uint64_t WebSocketRandom()
+{
+	WEB_SOCKET_RANDOM* pRandom = &WebSocketRandomState;
+	uint64_t s1;
+	uint64_t s0;
+
+	if (!pRandom->bSeeded)
+	{
+		// Mix the OS entropy source with the thread's state address and the time
+		std::random_device device;
+		uint64_t seed = ((uint64_t)device() << 32) ^ (uint64_t)device();
+		seed ^= (uint64_t)(uintptr_t)pRandom;
+		seed ^= (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+		pRandom->State[0] = SplitMix64(&seed);
+		pRandom->State[1] = SplitMix64(&seed);
+		pRandom->bSeeded = true;
+	}
+
+	s1 = pRandom->State[0];
+	s0 = pRandom->State[1];
+	pRandom->State[0] = s0;
+	s1 ^= s1 << 23;
+	pRandom->State[1] = s1 ^ s0 ^ (s1 >> 18) ^ (s0 >> 5);
+	return pRandom->State[1] + s0;
+}
+
+void IISWebSocketServer::WebSocketGenerateMaskingKey(char MaskingKey[4])
+{
+	// The high bits of xorshift128+ are the strongest
+	uint32_t key = (uint32_t)(WebSocketRandom() >> 32);
+	memcpy(MaskingKey, &key, 4);
+}
+
+// Base64 encode, pOut must have room for 4 characters for every 3 bytes plus the NULL character
+static void WebSocketBase64Encode(const unsigned char* pData, size_t length, char* pOut)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+	uint32_t value;
+
+	for (i = 0; i + 3 <= length; i += 3)
+	{
+		value = ((uint32_t)pData[i] << 16) | ((uint32_t)pData[i + 1] << 8) | pData[i + 2];
+		*pOut++ = alphabet[(value >> 18) & 0x3F];
+		*pOut++ = alphabet[(value >> 12) & 0x3F];
+		*pOut++ = alphabet[(value >> 6) & 0x3F];
+		*pOut++ = alphabet[value & 0x3F];
+	}
+
+	if (length - i == 1)
+	{
+		value = (uint32_t)pData[i] << 16;
+		*pOut++ = alphabet[(value >> 18) & 0x3F];
+		*pOut++ = alphabet[(value >> 12) & 0x3F];
+		*pOut++ = '=';
+		*pOut++ = '=';
+	}
+	else if (length - i == 2)
+	{
+		value = ((uint32_t)pData[i] << 16) | ((uint32_t)pData[i + 1] << 8);
+		*pOut++ = alphabet[(value >> 18) & 0x3F];
+		*pOut++ = alphabet[(value >> 12) & 0x3F];
+		*pOut++ = alphabet[(value >> 6) & 0x3F];
+		*pOut++ = '=';
+	}
+
+	*pOut = 0;
+}
+
+void IISWebSocketServer::WebSocketGenerateHandshakeKey(char pKey[IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH + 1])
+{
+	uint64_t nonce[2];
+
+	// The key is a random 16 byte nonce, base64 encoded
+	nonce[0] = WebSocketRandom();
+	nonce[1] = WebSocketRandom();
+	WebSocketBase64Encode((const unsigned char*)nonce, 16, pKey);
+}
+
+// SHA-1 of a message, only used for the handshake so it favors size over speed
+static void WebSocketSha1(const unsigned char* pData, size_t length, unsigned char pDigest[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	unsigned char block[64];
+	uint32_t w[80];
+	uint64_t bitLength = (uint64_t)length * 8;
+	size_t offset = 0;
+	size_t blockLength;
+	bool bLengthWritten = false;
+	bool bPadded = false;
+
+	while (!bLengthWritten)
+	{
+		// Fill the next block, padding with 0x80, zeros and the bit length at the end of the message
+		blockLength = 0;
+		if (offset < length) {
+			blockLength = (length - offset < 64) ? (length - offset) : 64;
+			memcpy(block, pData + offset, blockLength);
+			offset += blockLength;
+		}
+		if (blockLength < 64)
+		{
+			if (!bPadded) {
+				block[blockLength++] = 0x80;
+				bPadded = true;
+			}
+			memset(block + blockLength, 0, 64 - blockLength);
+			if (blockLength <= 56) {
+				for (int i = 0; i < 8; i++) {
+					block[63 - i] = (unsigned char)(bitLength >> (i * 8));
+				}
+				bLengthWritten = true;
+			}
+		}
+
+		for (int i = 0; i < 16; i++) {
+			w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+		}
+		for (int i = 16; i < 80; i++) {
+			uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = (x << 1) | (x >> 31);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = (b << 30) | (b >> 2);
+			b = a;
+			a = temp;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	for (int i = 0; i < 5; i++)
+	{
+		pDigest[i * 4] = (unsigned char)(h[i] >> 24);
+		pDigest[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+		pDigest[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+		pDigest[i * 4 + 3] = (unsigned char)h[i];
+	}
+}
+
+void IISWebSocketServer::WebSocketComputeHandshakeAccept(const char* pKey, size_t keyLength, char pAccept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1])
+{
+	// The GUID every server appends to the key (RFC 6455 section 4.2.2)
+	static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	unsigned char message[0x100];
+	unsigned char digest[20];
+
+	// Keys are 24 characters, anything that doesn't fit can't be valid and gets an accept value that won't match
+	if (keyLength > sizeof(message) - (sizeof(guid) - 1)) {
+		keyLength = sizeof(message) - (sizeof(guid) - 1);
+	}
+
+	memcpy(message, pKey, keyLength);
+	memcpy(message + keyLength, guid, sizeof(guid) - 1);
+	WebSocketSha1(message, keyLength + sizeof(guid) - 1, digest);
+	WebSocketBase64Encode(digest, 20, pAccept);
+}
+
+// Lower case an ASCII character
+static inline char WebSocketToLower(char c)
+{
+	if ((c >= 'A') && (c <= 'Z')) {
+		return c + ('a' - 'A');
+	}
+	return c;
+}
+
+bool IISWebSocketServer::WebSocketHeaderValueEquals(const char* pValue, size_t valueLength, const char* pExpected)
+{
+	size_t i;
+
+	for (i = 0; i < valueLength; i++)
+	{
+		// pExpected is shorter than the value
+		if (pExpected[i] == 0) {
+			return false;
+		}
+		if (WebSocketToLower(pValue[i]) != WebSocketToLower(pExpected[i])) {
+			return false;
+		}
+	}
+
+	// pExpected must not be longer than the value
+	return pExpected[i] == 0;
+}
+
+bool IISWebSocketServer::WebSocketConnectionHasUpgrade(const char* pValue, size_t valueLength)
+{
+	return WebSocketHeaderHasToken(pValue, valueLength, "Upgrade");
+}
+
+bool IISWebSocketServer::WebSocketHeaderHasToken(const char* pValue, size_t valueLength, const char* pToken)
+{
+	size_t start;
+	size_t end;
+	size_t i;
+
+	i = 0;
+	while (i < valueLength)
+	{
+		// Skip spaces before the item
+		while ((i < valueLength) && ((pValue[i] == ' ') || (pValue[i] == '\t'))) {
+			i++;
+		}
+
+		// Find the end of the item
+		start = i;
+		while ((i < valueLength) && (pValue[i] != ',')) {
+			i++;
+		}
+
+		// Trim spaces after the item
+		end = i;
+		while ((end > start) && ((pValue[end - 1] == ' ') || (pValue[end - 1] == '\t'))) {
+			end--;
+		}
+
+		// Check for the token
+		if (WebSocketHeaderValueEquals(&pValue[start], end - start, pToken)) {
+			return true;
+		}
+
+		// Skip the comma
+		i++;
+	}
+
+	return false;
+}
+
+// Set up a single token bucket, a burst of 0 allows one second of the rate
+static void InitializeTokenBucket(WEB_SOCKET_TOKEN_BUCKET* pBucket, unsigned long long qwRate, unsigned long long qwBurst, unsigned long long qwTicksPerSecond)
+{
+	pBucket->qwFullTime = 0;
+	if (qwRate == 0) {
+		pBucket->TokenTime = 0;
+		pBucket->qwBurstTime = 0;
+		return;
+	}
+
+	if (qwBurst == 0) {
+		qwBurst = qwRate;
+	}
+	pBucket->TokenTime = (double)qwTicksPerSecond / (double)qwRate;
+	pBucket->qwBurstTime = (unsigned long long)((double)qwBurst * pBucket->TokenTime);
+}
+
+// Take tokens from a bucket, returns how long until the bucket is back within its burst
+static inline unsigned long long ChargeTokenBucket(WEB_SOCKET_TOKEN_BUCKET* pBucket, unsigned long long qwNow, unsigned long long qwTokens)
+{
+	unsigned long long qwFullTime;
+
+	if ((pBucket->TokenTime == 0) || (qwTokens == 0)) {
+		return 0;
+	}
+
+	// A bucket that filled up while the client was quiet doesn't keep counting
+	qwFullTime = (pBucket->qwFullTime > qwNow) ? pBucket->qwFullTime : qwNow;
+	qwFullTime += (unsigned long long)((double)qwTokens * pBucket->TokenTime);
+	pBucket->qwFullTime = qwFullTime;
+
+	if (qwFullTime - qwNow <= pBucket->qwBurstTime) {
+		return 0;
+	}
+	return qwFullTime - qwNow - pBucket->qwBurstTime;
+}
+
+void IISWebSocketServer::InitializeRateLimiter(WEB_SOCKET_RATE_LIMITER* pLimiter, const IIS_WEB_SOCKET_RATE_LIMITS* pLimits, unsigned long long qwTicksPerSecond)
+{
+	memset(pLimiter, 0, sizeof(WEB_SOCKET_RATE_LIMITER));
+	if (pLimits == NULL) {
+		return;
+	}
+
+	pLimiter->qwOverLimitGrace = qwTicksPerSecond / 10;
+
+	InitializeTokenBucket(&pLimiter->Frames, pLimits->FramesPerSecond, pLimits->FrameBurst, qwTicksPerSecond);
+	InitializeTokenBucket(&pLimiter->Bytes, pLimits->BytesPerSecond, pLimits->ByteBurst, qwTicksPerSecond);
+	InitializeTokenBucket(&pLimiter->Messages, pLimits->MessagesPerSecond, pLimits->MessageBurst, qwTicksPerSecond);
+}
+
+unsigned long long IISWebSocketServer::ChargeRateLimiter(WEB_SOCKET_RATE_LIMITER* pLimiter, unsigned long long qwNow,
+	unsigned long long qwFrames, unsigned long long qwBytes, unsigned long long qwMessages)
+{
+	unsigned long long qwPause;
+	unsigned long long qwBucketPause;
+
+	// The pause is for the bucket furthest over its burst
+	qwPause = ChargeTokenBucket(&pLimiter->Frames, qwNow, qwFrames);
+	qwBucketPause = ChargeTokenBucket(&pLimiter->Bytes, qwNow, qwBytes);
+	if (qwBucketPause > qwPause) {
+		qwPause = qwBucketPause;
+	}
+	qwBucketPause = ChargeTokenBucket(&pLimiter->Messages, qwNow, qwMessages);
+	if (qwBucketPause > qwPause) {
+		qwPause = qwBucketPause;
+	}
+
+	// Track how long the client has been over its limits, a client that stays within its limits starts over
+	if (qwPause != 0)
+	{
+		if (pLimiter->qwOverLimitSince == 0) {
+			pLimiter->qwOverLimitSince = qwNow;
+		}
+		pLimiter->qwLastOverLimit = qwNow;
+	}
+	else if ((pLimiter->qwOverLimitSince != 0) && (qwNow - pLimiter->qwLastOverLimit > pLimiter->qwOverLimitGrace)) {
+		pLimiter->qwOverLimitSince = 0;
+	}
+
+	return qwPause;
+}
+
+IIS_WEB_SOCKET_FLUSH_ACTION IISWebSocketServer::GetWebSocketFlushAction(IIS_WEB_SOCKET_FLUSH_POLICY policy, bool bUrgent,
+	unsigned long dwCoalescedLength, unsigned long dwFlushThreshold, bool bTimerSet)
+{
+	// Flush now if the policy or caller says so
+	if ((bUrgent) || (policy == IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_IMMEDIATE_FLUSH_POLICY)) {
+		return IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_FLUSH_NOW_FLUSH_ACTION;
+	}
+
+	// Flush now if enough has been coalesced
+	if ((policy == IIS_WEB_SOCKET_FLUSH_POLICY::IIS_WEB_SOCKET_SIZE_THRESHOLD_FLUSH_POLICY) && (dwCoalescedLength >= dwFlushThreshold)) {
+		return IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_FLUSH_NOW_FLUSH_ACTION;
+	}
+
+	// Everything was too large to coalesce and has been written, or the timer is already set
+	if ((dwCoalescedLength == 0) || (bTimerSet)) {
+		return IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_WAIT_FLUSH_ACTION;
+	}
+
+	return IIS_WEB_SOCKET_FLUSH_ACTION::IIS_WEB_SOCKET_SET_TIMER_FLUSH_ACTION;
+}
+
+// Get the bucket of a latency in nanoseconds
+static inline unsigned int LatencyBucketIndex(unsigned long long qwNanoseconds)
+{
+	unsigned long msb;
+
+	if (qwNanoseconds < IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT) {
+		return (unsigned int)qwNanoseconds;
+	}
+
+#ifdef _MSC_VER
+	_BitScanReverse64(&msb, qwNanoseconds);
+#else
+	msb = 63 - __builtin_clzll(qwNanoseconds);
+#endif
+	if (msb > IIS_WEB_SOCKET_LATENCY_MAX_BIT) {
+		return IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT - 1;
+	}
+
+	// The highest bit picks the power of 2, the next IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS bits pick the linear bucket
+	return (unsigned int)(((msb - IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS + 1) << IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS) +
+		((qwNanoseconds >> (msb - IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS)) - IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT));
+}
+
+// Get the highest latency in nanoseconds that falls in a bucket
+static unsigned long long LatencyBucketHighestValue(unsigned int index)
+{
+	unsigned int group;
+	unsigned long long top;
+
+	if (index < IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT) {
+		return index;
+	}
+
+	group = index >> IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS;
+	top = IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT + (index & (IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT - 1));
+	return ((top + 1) << (group - 1)) - 1;
+}
+
+void IISWebSocketServer::ClearWebSocketLatencyHistogram(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram)
+{
+	pHistogram->Sum.store(0, std::memory_order_relaxed);
+	pHistogram->Min.store(0xFFFFFFFFFFFFFFFFULL, std::memory_order_relaxed);
+	pHistogram->Max.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT; i++) {
+		pHistogram->Counts[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void IISWebSocketServer::MergeWebSocketLatencyHistogram(WEB_SOCKET_LATENCY_HISTOGRAM* pDestination, WEB_SOCKET_LATENCY_HISTOGRAM* pSource)
+{
+	pDestination->Sum.store(pDestination->Sum.load(std::memory_order_relaxed) + pSource->Sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	if (pSource->Min.load(std::memory_order_relaxed) < pDestination->Min.load(std::memory_order_relaxed)) {
+		pDestination->Min.store(pSource->Min.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	if (pSource->Max.load(std::memory_order_relaxed) > pDestination->Max.load(std::memory_order_relaxed)) {
+		pDestination->Max.store(pSource->Max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	for (int i = 0; i < IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT; i++) {
+		pDestination->Counts[i].store(pDestination->Counts[i].load(std::memory_order_relaxed) + pSource->Counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+void IISWebSocketServer::RecordWebSocketLatency(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram, unsigned long long qwNanoseconds)
+{
+	std::atomic<unsigned long long>* pCount;
+
+	// Only this thread writes the histogram, so a relaxed load and store is enough
+	pCount = &pHistogram->Counts[LatencyBucketIndex(qwNanoseconds)];
+	pCount->store(pCount->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	pHistogram->Sum.store(pHistogram->Sum.load(std::memory_order_relaxed) + qwNanoseconds, std::memory_order_relaxed);
+	if (qwNanoseconds < pHistogram->Min.load(std::memory_order_relaxed)) {
+		pHistogram->Min.store(qwNanoseconds, std::memory_order_relaxed);
+	}
+	if (qwNanoseconds > pHistogram->Max.load(std::memory_order_relaxed)) {
+		pHistogram->Max.store(qwNanoseconds, std::memory_order_relaxed);
+	}
+}
+
+unsigned long long IISWebSocketServer::GetWebSocketLatencyPercentile(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram, unsigned long long qwCount, double fraction)
+{
+	unsigned long long qwTarget;
+	unsigned long long qwSeen;
+	unsigned long long qwValue;
+
+	qwTarget = (unsigned long long)((double)qwCount * fraction + 0.5);
+	if (qwTarget == 0) {
+		qwTarget = 1;
+	}
+
+	qwSeen = 0;
+	for (unsigned int i = 0; i < IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT; i++)
+	{
+		qwSeen += pHistogram->Counts[i].load(std::memory_order_relaxed);
+		if (qwSeen >= qwTarget)
+		{
+			// The bucket's highest value, but never more than the largest latency recorded
+			qwValue = LatencyBucketHighestValue(i);
+			if (qwValue > pHistogram->Max.load(std::memory_order_relaxed)) {
+				qwValue = pHistogram->Max.load(std::memory_order_relaxed);
+			}
+			return qwValue;
+		}
+	}
+
+	return pHistogram->Max.load(std::memory_order_relaxed);
+}
+
+void IISWebSocketServer::WriteTraceRecord(WEB_SOCKET_TRACE_RING* pRing, unsigned long long ConnectionId, unsigned long long Timestamp, unsigned int ThreadId,
+	unsigned char Direction, unsigned char Opcode, bool FIN, unsigned long long PayloadLength, unsigned int FrameSize,
+	const void* pPayload, unsigned long long qwPayloadBytes)
+{
+	IIS_WEB_SOCKET_TRACE_RECORD* pRecord;
+	unsigned long long head;
+
+	// Only this thread writes Head, so a relaxed load is enough
+	head = pRing->Head.load(std::memory_order_relaxed);
+	if (head - pRing->Tail.load(std::memory_order_acquire) >= IIS_WEB_SOCKET_TRACE_RING_SIZE) {
+		pRing->Dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	pRecord = &pRing->Records[head & (IIS_WEB_SOCKET_TRACE_RING_SIZE - 1)];
+	pRecord->ConnectionId = ConnectionId;
+	pRecord->Timestamp = Timestamp;
+	pRecord->PayloadLength = PayloadLength;
+	pRecord->ThreadId = ThreadId;
+	pRecord->FrameSize = (unsigned short)FrameSize;
+	pRecord->Direction = Direction;
+	pRecord->Opcode = Opcode;
+	pRecord->FIN = FIN;
+	if (qwPayloadBytes > IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES) {
+		qwPayloadBytes = IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES;
+	}
+	pRecord->CapturedBytes = (unsigned char)qwPayloadBytes;
+	memcpy(pRecord->Payload, pPayload, (size_t)qwPayloadBytes);
+
+	// Publish the record to the thread that drains the ring
+	pRing->Head.store(head + 1, std::memory_order_release);
+}
+
+bool IISWebSocketServer::BeginWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, unsigned long long qwNow, unsigned long long qwTimeout)
+{
+	switch (pHandshake->State)
+	{
+	case IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_OPEN_CLOSE_STATE:
+		pHandshake->State = IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE;
+		pHandshake->qwDeadline = qwNow + qwTimeout;
+		return true;
+	case IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_RECEIVED_CLOSE_STATE:
+		// Answering the client, the handshake is done once this is sent
+		pHandshake->State = IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// A status code a client may send, 1005, 1006 and 1015 are reserved for reporting and never sent (RFC 6455 7.4)
+static bool IsValidCloseStatus(unsigned int status)
+{
+	if ((status >= 1000) && (status <= 1003)) {
+		return true;
+	}
+	if ((status >= 1007) && (status <= 1014)) {
+		return true;
+	}
+	return (status >= 3000) && (status <= 4999);
+}
+
+bool IISWebSocketServer::ReceiveWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, const void* pPayload, unsigned long long qwLength,
+	unsigned char pReply[2], unsigned long* pdwReplyLength)
+{
+	const unsigned char* pStatus = (const unsigned char*)pPayload;
+
+	switch (pHandshake->State)
+	{
+	case IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_OPEN_CLOSE_STATE:
+		pHandshake->State = IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_RECEIVED_CLOSE_STATE;
+		break;
+	case IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE:
+		// The client answered in time
+		pHandshake->State = IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE;
+		return false;
+	default:
+		return false;
+	}
+
+	// Echo the status code, a close without one is answered without one
+	// A 1 byte payload or a status code that's reserved or unassigned is a protocol error
+	if ((qwLength >= 2) && (IsValidCloseStatus(((unsigned int)pStatus[0] << 8) | pStatus[1]))) {
+		pReply[0] = pStatus[0];
+		pReply[1] = pStatus[1];
+		*pdwReplyLength = 2;
+	}
+	else if (qwLength != 0) {
+		pReply[0] = (unsigned char)(1002 >> 8);
+		pReply[1] = (unsigned char)(1002 & 0xFF);
+		*pdwReplyLength = 2;
+	}
+	else {
+		*pdwReplyLength = 0;
+	}
+
+	return true;
+}
+
+bool IISWebSocketServer::ExpireWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, unsigned long long qwNow)
+{
+	if ((pHandshake->State != IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE) || (qwNow < pHandshake->qwDeadline)) {
+		return false;
+	}
+
+	pHandshake->State = IIS_WEB_SOCKET_CLOSE_STATE::IIS_WEB_SOCKET_CLOSED_CLOSE_STATE;
+	pHandshake->bTimedOut = true;
+
+	return true;
+}
+
+// End a stall of an outbound queue, adding its length to the stall time
+static void EndOutboundStall(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, unsigned long long qwNow)
+{
+	if (pQueue->bStalled) {
+		pQueue->Stats.StallTime += (qwNow > pQueue->qwStallStart) ? (qwNow - pQueue->qwStallStart) : 0;
+		pQueue->bStalled = false;
+	}
+}
+
+// Every allocation of every connection is charged here too, aligned so its counter has a cache line to itself
+alignas(IIS_WEB_SOCKET_CACHE_LINE) static WEB_SOCKET_MEMORY_ACCOUNT GlobalMemory;
+
+// Told when the pressure of an account changes
+static std::atomic<PFN_IIS_WEB_SOCKET_MEMORY_PRESSURE> MemoryPressureCallback;
+static std::atomic<void*> MemoryPressureContext;
+
+void IISWebSocketServer::InitializeMemoryAccount(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, void* pConnection)
+{
+	pAccount->Bytes.store(0, std::memory_order_relaxed);
+	pAccount->SoftLimit.store(0, std::memory_order_relaxed);
+	pAccount->HardLimit.store(0, std::memory_order_relaxed);
+	pAccount->Refused.store(0, std::memory_order_relaxed);
+	pAccount->Pressure.store((int)IIS_WEB_SOCKET_MEMORY_PRESSURE::IIS_WEB_SOCKET_NORMAL_MEMORY_PRESSURE, std::memory_order_relaxed);
+	pAccount->pConnection = pConnection;
+}
+
+void IISWebSocketServer::SetMemoryAccountBudget(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget)
+{
+	pAccount->SoftLimit.store((pBudget != NULL) ? pBudget->SoftLimit : 0, std::memory_order_relaxed);
+	pAccount->HardLimit.store((pBudget != NULL) ? pBudget->HardLimit : 0, std::memory_order_relaxed);
+}
+
+void IISWebSocketServer::SetGlobalMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget)
+{
+	SetMemoryAccountBudget(&GlobalMemory, pBudget);
+}
+
+void IISWebSocketServer::SetMemoryPressureCallback(PFN_IIS_WEB_SOCKET_MEMORY_PRESSURE pfnPressure, void* pContext)
+{
+	MemoryPressureContext.store(pContext, std::memory_order_relaxed);
+	MemoryPressureCallback.store(pfnPressure, std::memory_order_release);
+}
+
+// Tell the callback about a new pressure, only the thread that changes it calls it
+static void ReportMemoryPressure(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, IIS_WEB_SOCKET_MEMORY_PRESSURE pressure, unsigned long long qwBytes)
+{
+	PFN_IIS_WEB_SOCKET_MEMORY_PRESSURE pfnPressure;
+
+	if (pAccount->Pressure.exchange((int)pressure, std::memory_order_relaxed) == (int)pressure) {
+		return;
+	}
+	pfnPressure = MemoryPressureCallback.load(std::memory_order_acquire);
+	if (pfnPressure != NULL) {
+		pfnPressure(MemoryPressureContext.load(std::memory_order_relaxed), pAccount->pConnection, pressure, qwBytes);
+	}
+}
+
+// Give back a charge, the pressure is normal again below the soft budget, or below half the hard budget without one
+static void ReleaseAccount(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes)
+{
+	unsigned long long qwBytesLeft;
+	unsigned long long qwSoftLimit;
+
+	qwBytesLeft = pAccount->Bytes.fetch_sub(qwBytes, std::memory_order_relaxed) - qwBytes;
+	if (pAccount->Pressure.load(std::memory_order_relaxed) == (int)IIS_WEB_SOCKET_MEMORY_PRESSURE::IIS_WEB_SOCKET_NORMAL_MEMORY_PRESSURE) {
+		return;
+	}
+	qwSoftLimit = pAccount->SoftLimit.load(std::memory_order_relaxed);
+	if (qwSoftLimit == 0) {
+		qwSoftLimit = pAccount->HardLimit.load(std::memory_order_relaxed) / 2;
+	}
+	if (qwBytesLeft < qwSoftLimit) {
+		ReportMemoryPressure(pAccount, IIS_WEB_SOCKET_MEMORY_PRESSURE::IIS_WEB_SOCKET_NORMAL_MEMORY_PRESSURE, qwBytesLeft);
+	}
+}
+
+// Charge an account, a single relaxed add unless a budget is crossed
+static bool ChargeAccount(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes)
+{
+	unsigned long long qwBefore;
+	unsigned long long qwHardLimit;
+	unsigned long long qwSoftLimit;
+
+	qwBefore = pAccount->Bytes.fetch_add(qwBytes, std::memory_order_relaxed);
+
+	// Taken back right away, another thread may see the account over its budget for a moment and be refused too
+	qwHardLimit = pAccount->HardLimit.load(std::memory_order_relaxed);
+	if ((qwHardLimit != 0) && (qwBefore + qwBytes > qwHardLimit))
+	{
+		pAccount->Bytes.fetch_sub(qwBytes, std::memory_order_relaxed);
+		pAccount->Refused.fetch_add(1, std::memory_order_relaxed);
+		ReportMemoryPressure(pAccount, IIS_WEB_SOCKET_MEMORY_PRESSURE::IIS_WEB_SOCKET_HARD_MEMORY_PRESSURE, qwBefore);
+		return false;
+	}
+
+	// Only the charge that crosses the soft budget reports it
+	qwSoftLimit = pAccount->SoftLimit.load(std::memory_order_relaxed);
+	if ((qwSoftLimit != 0) && (qwBefore < qwSoftLimit) && (qwBefore + qwBytes >= qwSoftLimit)) {
+		ReportMemoryPressure(pAccount, IIS_WEB_SOCKET_MEMORY_PRESSURE::IIS_WEB_SOCKET_SOFT_MEMORY_PRESSURE, qwBefore + qwBytes);
+	}
+
+	return true;
+}
+
+bool IISWebSocketServer::ChargeMemory(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes)
+{
+	if ((pAccount != NULL) && (!ChargeAccount(pAccount, qwBytes))) {
+		return false;
+	}
+	if (!ChargeAccount(&GlobalMemory, qwBytes))
+	{
+		if (pAccount != NULL) {
+			ReleaseAccount(pAccount, qwBytes);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+void IISWebSocketServer::ReleaseMemory(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes)
+{
+	if (pAccount != NULL) {
+		ReleaseAccount(pAccount, qwBytes);
+	}
+	ReleaseAccount(&GlobalMemory, qwBytes);
+}
+
+void IISWebSocketServer::GetMemoryStats(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, IIS_WEB_SOCKET_MEMORY_STATS* pStats)
+{
+	if (pAccount == NULL) {
+		pAccount = &GlobalMemory;
+	}
+	pStats->Bytes = pAccount->Bytes.load(std::memory_order_relaxed);
+	pStats->SoftLimit = pAccount->SoftLimit.load(std::memory_order_relaxed);
+	pStats->HardLimit = pAccount->HardLimit.load(std::memory_order_relaxed);
+	pStats->RefusedAllocations = pAccount->Refused.load(std::memory_order_relaxed);
+	pStats->Pressure = (IIS_WEB_SOCKET_MEMORY_PRESSURE)pAccount->Pressure.load(std::memory_order_relaxed);
+}
+
+WEB_SOCKET_SHARED_FRAME* IISWebSocketServer::CreateSharedFrame(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength)
+{
+	WEB_SOCKET_SHARED_FRAME* pFrame;
+	unsigned char frameByte;
+
+	// FIN and the opcode, control frames can't be fragmented so their payload must fit a single frame
+	switch (bufferType)
+	{
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
+		frameByte = 0x81;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE:
+		frameByte = 0x82;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE:
+		frameByte = 0x88;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE:
+		frameByte = 0x89;
+		break;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE:
+		frameByte = 0x8A;
+		break;
+	default:
+		return NULL;
+	}
+	if (((frameByte & 0x08) != 0) && (qwLength > 125)) {
+		return NULL;
+	}
+
+	// The header is encoded into the room for the largest unmasked header
+	if (qwLength > (unsigned long long)(size_t)-1 - sizeof(WEB_SOCKET_SHARED_FRAME) - 10) {
+		return NULL;
+	}
+	// Shared frames aren't owned by a connection, only the global account is charged
+	if (!ChargeMemory(NULL, sizeof(WEB_SOCKET_SHARED_FRAME) + 10 + qwLength)) {
+		return NULL;
+	}
+	pFrame = (WEB_SOCKET_SHARED_FRAME*)malloc(sizeof(WEB_SOCKET_SHARED_FRAME) + 10 + (size_t)qwLength);
+	if (pFrame == NULL) {
+		ReleaseMemory(NULL, sizeof(WEB_SOCKET_SHARED_FRAME) + 10 + qwLength);
+		return NULL;
+	}
+
+	new (&pFrame->References) std::atomic<unsigned long>(1);
+	pFrame->BufferType = bufferType;
+	pFrame->pFrame = (unsigned char*)(pFrame + 1);
+	pFrame->HeaderLength = EncodeWebSocketFrameHeader(pFrame->pFrame, frameByte, qwLength);
+	pFrame->qwPayloadLength = qwLength;
+	if (qwLength != 0) {
+		memcpy(pFrame->pFrame + pFrame->HeaderLength, pData, (size_t)qwLength);
+	}
+
+	return pFrame;
+}
+
+void IISWebSocketServer::AddSharedFrameReference(WEB_SOCKET_SHARED_FRAME* pFrame)
+{
+	pFrame->References.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IISWebSocketServer::ReleaseSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame)
+{
+	if (pFrame->References.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		ReleaseMemory(NULL, sizeof(WEB_SOCKET_SHARED_FRAME) + 10 + pFrame->qwPayloadLength);
+		free(pFrame);
+	}
+}
+
+void IISWebSocketServer::FreeOutboundMessage(WEB_SOCKET_QUEUED_MESSAGE* pMessage)
+{
+	if (pMessage->pSharedFrame != NULL) {
+		ReleaseSharedFrame(pMessage->pSharedFrame);
+	}
+	ReleaseMemory(pMessage->pAccount, pMessage->AllocationSize);
+	free(pMessage);
+}
+
+bool IISWebSocketServer::IsControlBufferType(IIS_WEB_SOCKET_BUFFER_TYPE bufferType)
+{
+	return (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) ||
+		(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) ||
+		(bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE);
+}
+
+// Add a copied payload or a shared frame to an outbound queue, applying the policy at the limit
+static IIS_WEB_SOCKET_QUEUE_RESULT PushOutbound(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pData, unsigned long long qwLength, WEB_SOCKET_SHARED_FRAME* pSharedFrame, const char* pKey, unsigned long long qwNow)
+{
+	IIS_WEB_SOCKET_QUEUE_RESULT result;
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+	WEB_SOCKET_QUEUED_MESSAGE* pQueued;
+	WEB_SOCKET_QUEUED_MESSAGE* pPrevious;
+	size_t keyLength;
+	size_t allocationSize;
+	unsigned long long copyLength;
+
+	if (pQueue->bDisconnected) {
+		return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT;
+	}
+
+	// The client isn't keeping up, apply the policy
+	// Control frames are never dropped, the closing handshake and keepalives depend on them, at most 125 bytes each go over the limit
+	if ((pQueue->qwLimit != 0) && (pQueue->Stats.QueuedBytes + qwLength > pQueue->qwLimit) && (!IsControlBufferType(bufferType)))
+	{
+		if (!pQueue->bStalled) {
+			pQueue->bStalled = true;
+			pQueue->qwStallStart = qwNow;
+		}
+
+		if (pQueue->Policy == IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY) {
+			pQueue->Stats.DroppedMessages += pQueue->Stats.QueuedMessages + 1;
+			ClearOutboundQueue(pQueue);
+			EndOutboundStall(pQueue, qwNow);
+			pQueue->bDisconnected = true;
+			return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT;
+		}
+
+		if (pQueue->Policy == IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_NEWEST_OUTBOUND_POLICY) {
+			pQueue->Stats.DroppedMessages++;
+			return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DROPPED_QUEUE_RESULT;
+		}
+	}
+
+	// The key and a copied payload are in the same allocation as the message
+	keyLength = (pKey != NULL) ? strlen(pKey) + 1 : 0;
+	copyLength = (pSharedFrame == NULL) ? qwLength : 0;
+	if (copyLength > (unsigned long long)(size_t)-1 - sizeof(WEB_SOCKET_QUEUED_MESSAGE) - keyLength) {
+		return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_QUEUE_RESULT;
+	}
+	allocationSize = sizeof(WEB_SOCKET_QUEUED_MESSAGE) + keyLength + (size_t)copyLength;
+	if (!ChargeMemory(pQueue->pAccount, allocationSize)) {
+		return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_QUEUE_RESULT;
+	}
+	pMessage = (WEB_SOCKET_QUEUED_MESSAGE*)malloc(allocationSize);
+	if (pMessage == NULL) {
+		ReleaseMemory(pQueue->pAccount, allocationSize);
+		return IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_OUT_OF_MEMORY_QUEUE_RESULT;
+	}
+
+	pMessage->pNext = NULL;
+	pMessage->pAccount = pQueue->pAccount;
+	pMessage->AllocationSize = allocationSize;
+	pMessage->BufferType = bufferType;
+	pMessage->pKey = NULL;
+	pMessage->qwLength = qwLength;
+	pMessage->pSharedFrame = pSharedFrame;
+	if (pKey != NULL) {
+		pMessage->pKey = (char*)(pMessage + 1);
+		memcpy(pMessage->pKey, pKey, keyLength);
+	}
+	if (pSharedFrame != NULL) {
+		AddSharedFrameReference(pSharedFrame);
+		pMessage->pData = (char*)pSharedFrame->pFrame + pSharedFrame->HeaderLength;
+	}
+	else {
+		pMessage->pData = (char*)(pMessage + 1) + keyLength;
+		if (qwLength != 0) {
+			memcpy(pMessage->pData, pData, (size_t)qwLength);
+		}
+	}
+
+	// Replace a queued message with the same key, the new value takes its place in the queue
+	pQueued = NULL;
+	if ((pQueue->Policy == IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_CONFLATE_OUTBOUND_POLICY) && (pKey != NULL))
+	{
+		pPrevious = NULL;
+		for (pQueued = pQueue->pHead; pQueued != NULL; pQueued = pQueued->pNext)
+		{
+			if ((pQueued->pKey != NULL) && (strcmp(pQueued->pKey, pKey) == 0)) {
+				break;
+			}
+			pPrevious = pQueued;
+		}
+
+		if (pQueued != NULL)
+		{
+			pMessage->pNext = pQueued->pNext;
+			if (pPrevious != NULL) {
+				pPrevious->pNext = pMessage;
+			}
+			else {
+				pQueue->pHead = pMessage;
+			}
+			if (pQueue->pTail == pQueued) {
+				pQueue->pTail = pMessage;
+			}
+			pQueue->Stats.QueuedBytes -= pQueued->qwLength;
+			pQueue->Stats.QueuedBytes += qwLength;
+			pQueue->Stats.ConflatedMessages++;
+			FreeOutboundMessage(pQueued);
+		}
+	}
+
+	// Otherwise add the message to the end of the queue
+	if (pQueued == NULL)
+	{
+		if (pQueue->pTail != NULL) {
+			pQueue->pTail->pNext = pMessage;
+		}
+		else {
+			pQueue->pHead = pMessage;
+		}
+		pQueue->pTail = pMessage;
+		pQueue->Stats.QueuedBytes += qwLength;
+		pQueue->Stats.QueuedMessages++;
+	}
+
+	// Drop the oldest data messages until the queue is within its limit, a message larger than the limit drops itself last
+	// Control frames stay and don't push out data, the queue can be over its limit by the control frames it holds
+	result = IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_QUEUED_QUEUE_RESULT;
+	while ((pQueue->qwLimit != 0) && (pQueue->Stats.QueuedBytes > pQueue->qwLimit) && (!IsControlBufferType(bufferType)))
+	{
+		pPrevious = NULL;
+		for (pQueued = pQueue->pHead; pQueued != NULL; pQueued = pQueued->pNext)
+		{
+			if (!IsControlBufferType(pQueued->BufferType)) {
+				break;
+			}
+			pPrevious = pQueued;
+		}
+		if (pQueued == NULL) {
+			break;
+		}
+
+		if (pPrevious != NULL) {
+			pPrevious->pNext = pQueued->pNext;
+		}
+		else {
+			pQueue->pHead = pQueued->pNext;
+		}
+		if (pQueue->pTail == pQueued) {
+			pQueue->pTail = pPrevious;
+		}
+		pQueue->Stats.QueuedBytes -= pQueued->qwLength;
+		pQueue->Stats.QueuedMessages--;
+		pQueue->Stats.DroppedMessages++;
+		if (pQueued == pMessage) {
+			result = IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DROPPED_QUEUE_RESULT;
+		}
+		FreeOutboundMessage(pQueued);
+	}
+
+	return result;
+}
+
+IIS_WEB_SOCKET_QUEUE_RESULT IISWebSocketServer::PushOutboundMessage(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pData, unsigned long long qwLength, const char* pKey, unsigned long long qwNow)
+{
+	return PushOutbound(pQueue, bufferType, pData, qwLength, NULL, pKey, qwNow);
+}
+
+IIS_WEB_SOCKET_QUEUE_RESULT IISWebSocketServer::PushOutboundFrame(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, WEB_SOCKET_SHARED_FRAME* pFrame,
+	const char* pKey, unsigned long long qwNow)
+{
+	return PushOutbound(pQueue, pFrame->BufferType, NULL, pFrame->qwPayloadLength, pFrame, pKey, qwNow);
+}
+
+WEB_SOCKET_QUEUED_MESSAGE* IISWebSocketServer::PopOutboundMessage(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, unsigned long long qwNow)
+{
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+
+	pMessage = pQueue->pHead;
+	if (pMessage == NULL) {
+		EndOutboundStall(pQueue, qwNow);
+		return NULL;
+	}
+
+	pQueue->pHead = pMessage->pNext;
+	if (pQueue->pHead == NULL) {
+		pQueue->pTail = NULL;
+	}
+	pQueue->Stats.QueuedBytes -= pMessage->qwLength;
+	pQueue->Stats.QueuedMessages--;
+	pQueue->Stats.SentMessages++;
+
+	// The client has caught up once the queue drains to half its limit
+	if ((pQueue->bStalled) && (pQueue->Stats.QueuedBytes <= pQueue->qwLimit / 2)) {
+		EndOutboundStall(pQueue, qwNow);
+	}
+
+	return pMessage;
+}
+
+void IISWebSocketServer::ClearOutboundQueue(WEB_SOCKET_OUTBOUND_QUEUE* pQueue)
+{
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+
+	while (pQueue->pHead != NULL)
+	{
+		pMessage = pQueue->pHead;
+		pQueue->pHead = pMessage->pNext;
+		FreeOutboundMessage(pMessage);
+	}
+
+	pQueue->pTail = NULL;
+	pQueue->Stats.QueuedBytes = 0;
+	pQueue->Stats.QueuedMessages = 0;
+}
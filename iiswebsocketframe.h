@@ -0,0 +1,593 @@
+//
+// iiswebsocketframe.h
+// 
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+// 
+// Description:
+//     The platform-neutral WebSocket protocol core, frame parsing, encoding, unmasking and handshake header checks.
+//     This header only uses standard types so the protocol core builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_FRAME_H
+#define IIS_WEB_SOCKET_FRAME_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "iiswebsockettrace.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Why ParseWebSocketFrame rejected a frame header, any of them is answered with close status 1002
+	typedef enum class _IIS_WEB_SOCKET_FRAME_VIOLATION
+	{
+		IIS_WEB_SOCKET_NO_FRAME_VIOLATION = 0,
+		// RSV1, RSV2 or RSV3 is set, no extension is negotiated
+		IIS_WEB_SOCKET_RESERVED_BITS_FRAME_VIOLATION = 1,
+		// The opcode is reserved
+		IIS_WEB_SOCKET_UNKNOWN_OPCODE_FRAME_VIOLATION = 2,
+		// A close, ping or pong frame without FIN
+		IIS_WEB_SOCKET_FRAGMENTED_CONTROL_FRAME_VIOLATION = 3,
+		// A close, ping or pong frame with a payload over 125 bytes
+		IIS_WEB_SOCKET_CONTROL_TOO_LONG_FRAME_VIOLATION = 4,
+		// A client frame without a mask, or a server frame with one
+		IIS_WEB_SOCKET_MASK_FRAME_VIOLATION = 5,
+		// The payload length is encoded in more bytes than needed, or uses the most significant bit
+		IIS_WEB_SOCKET_NON_MINIMAL_LENGTH_FRAME_VIOLATION = 6
+	} IIS_WEB_SOCKET_FRAME_VIOLATION;
+
+	// Parsed WebSocket frame
+	struct WEB_SOCKET_FRAME
+	{
+		// 0x00 = Continuation frame
+		// 0x01 = Text frame
+		// 0x02 = Binary frame
+		// 0x08 = Connection close
+		// 0x09 = Ping
+		// 0x0A = Pong
+		int Opcode;
+		bool FIN;
+		unsigned long long PayloadLength;
+		bool bMask;
+		char MaskingKey[4];
+		unsigned int FrameSize;
+		// Why the header was rejected, the other members can't be trusted unless this is IIS_WEB_SOCKET_NO_FRAME_VIOLATION
+		IIS_WEB_SOCKET_FRAME_VIOLATION Violation;
+	};
+
+	// WebSocket buffer type
+	typedef enum class _IIS_WEB_SOCKET_BUFFER_TYPE {
+		IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE = 0,
+		IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE = 1,
+		IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE = 2,
+		IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE = 3,
+		IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE = 4,
+		IIS_WEB_SOCKET_PING_BUFFER_TYPE = 5,
+		IIS_WEB_SOCKET_PONG_BUFFER_TYPE = 6
+	} IIS_WEB_SOCKET_BUFFER_TYPE;
+
+	// Returns true if the buffer type is a control frame (close, ping or pong)
+	bool IsControlBufferType(IIS_WEB_SOCKET_BUFFER_TYPE bufferType);
+
+	// WebSocket receiving stream
+	struct WEB_SOCKET_STREAM
+	{
+		// Set to true when we are queuing a new frame
+		int bQueuing;
+		// The frame buffer, must hold at least IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH bytes
+		char* pFrameBuffer;
+		// The total bytes received in the frame buffer
+		unsigned long dwReceivedSize;
+		// Remaining payload to receive
+		unsigned long long qwPayloadRemaining;
+		// Index of the current payload byte to unmask
+		unsigned long long mkI;
+		// Set when the stream reads the unmasked frames of a server, the client side of the protocol
+		bool bClient;
+	};
+
+	// The largest a frame header can be, 2 bytes + 8 bytes of payload length + 4 bytes of masking key
+#define IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH 14
+
+	// Parse and validate a frame header, returns false if the buffer doesn't hold the full header yet
+	// pOutFrame->FrameSize is set to the number of header bytes needed either way
+	// Returns true as soon as the header is known to be invalid, with pOutFrame->Violation set, without waiting for the rest
+	// bMasked is the mask bit frames must have, true for frames sent by a client
+	bool ParseWebSocketFrame(unsigned char* pBuffer, unsigned long dwLength, WEB_SOCKET_FRAME* pOutFrame, bool bMasked);
+
+	// Get a short description of a violation, short enough for the reason of a close frame
+	const char* GetWebSocketFrameViolationReason(IIS_WEB_SOCKET_FRAME_VIOLATION violation);
+
+	// Encode an unmasked frame header, returns the number of header bytes written to pHeader
+	unsigned int EncodeWebSocketFrameHeader(unsigned char pHeader[10], unsigned char frameByte, unsigned long long qwPayloadLength);
+
+	// Encode a masked frame header as sent by a client, returns the number of header bytes written to pHeader
+	unsigned int EncodeMaskedWebSocketFrameHeader(unsigned char pHeader[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH], unsigned char frameByte, unsigned long long qwPayloadLength, const char MaskingKey[4]);
+
+	// Get the fragment buffer type of a message buffer type, other buffer types are returned as they are
+	IIS_WEB_SOCKET_BUFFER_TYPE GetFragmentBufferType(IIS_WEB_SOCKET_BUFFER_TYPE bufferType);
+
+	// Get the first frame byte (FIN and Opcode) of a frame of a buffer type, returns false if it isn't one
+	// *pbFragment is true while a message sent as fragments is in progress, a fragment type starts or continues it and a message type ends it
+	bool EncodeWebSocketFrameOpcode(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, bool* pbFragment, unsigned char* pFrameByte);
+
+	// Plan the next frame of a data message split into frames of at most qwMaxFrameLength payload bytes, 0 is no limit
+	// qwRemaining is what's left to send, the frame that sends all of it uses bufferType and the others its fragment type
+	// *pbFragment is the fragment state of the connection, returns false if bufferType isn't a frame
+	bool PlanWebSocketFragment(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, unsigned long long qwRemaining, unsigned long long qwMaxFrameLength,
+		bool* pbFragment, unsigned char* pFrameByte, unsigned long long* pqwFrameLength);
+
+	// Pass as the message length to BeginWebSocketSendStream when the length isn't known up front
+#define IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH 0xFFFFFFFFFFFFFFFFULL
+
+	// WebSocket sending stream, a message sent in chunks as a single frame of declared length, or as a fragment per chunk
+	struct WEB_SOCKET_SEND_STREAM
+	{
+		// Set to true while a streamed message is being sent
+		bool bActive;
+		// Set to true if the message length was declared when the stream began
+		bool bDeclaredLength;
+		// The message buffer type, UTF-8 or binary
+		IIS_WEB_SOCKET_BUFFER_TYPE MessageType;
+		// Remaining payload to send for a declared length
+		unsigned long long qwPayloadRemaining;
+	};
+
+	// What to write for a call of a sending stream, the header is written first if bHeader is set, then the caller's chunk
+	struct WEB_SOCKET_SEND_FRAME
+	{
+		// Not set when the chunk continues the payload of the frame of declared length, or there's nothing to write
+		bool bHeader;
+		unsigned char FrameByte;
+		unsigned long long qwPayloadLength;
+	};
+
+	// The result of the sending stream functions
+	typedef enum class _IIS_WEB_SOCKET_SEND_STREAM_RESULT
+	{
+		IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT = 0,
+		// Began while a message is in progress, or written or ended without one
+		IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT = 1,
+		// Not a UTF-8 or binary message buffer type
+		IIS_WEB_SOCKET_INVALID_TYPE_SEND_STREAM_RESULT = 2,
+		// A chunk goes past the declared length, or the message ends short of it
+		IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT = 3
+	} IIS_WEB_SOCKET_SEND_STREAM_RESULT;
+
+	// Begin a streamed message, a declared length is sent at once as the header of a single frame
+	// *pbFragment is the fragment state of the connection, a message can't begin while fragments of another are in progress
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT BeginWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+		unsigned long long qwMessageLength, bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame);
+
+	// Get what to write for the next qwLength bytes of a streamed message, nothing is written for an empty chunk
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT WriteWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, unsigned long long qwLength,
+		bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame);
+
+	// End a streamed message, the final empty fragment of an unknown length, nothing for a declared one
+	// The stream is over even if it fails, the client has seen a truncated frame if a declared length wasn't reached
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT EndWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, bool* pbFragment, WEB_SOCKET_SEND_FRAME* pFrame);
+
+	// End a streamed message without writing anything
+	void AbortWebSocketSendStream(WEB_SOCKET_SEND_STREAM* pStream, bool* pbFragment);
+
+	// Unmask (or mask) payload bytes in place, mkI is the index of the first byte in the payload
+	// Returns the index of the byte after the last one unmasked
+	unsigned long long UnmaskWebSocketPayload(void* pBuffer, unsigned long long qwLength, const char MaskingKey[4], unsigned long long mkI);
+
+	// Generate a masking key for a client frame from a per-thread random generator
+	void WebSocketGenerateMaskingKey(char MaskingKey[4]);
+
+	// The length of a Sec-WebSocket-Key or Sec-WebSocket-Accept value, not including the NULL character
+#define IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH 24
+#define IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH 28
+
+	// Generate a random NULL terminated Sec-WebSocket-Key for a client handshake
+	void WebSocketGenerateHandshakeKey(char pKey[IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH + 1]);
+
+	// Compute the NULL terminated Sec-WebSocket-Accept value a server returns for a Sec-WebSocket-Key
+	void WebSocketComputeHandshakeAccept(const char* pKey, size_t keyLength, char pAccept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1]);
+
+	// Reads bytes from the transport for ReceiveWebSocketData, returns 0 on success or an error code
+	// *pdwBytesRead may be 0, the read is repeated until payload arrives
+	typedef unsigned long (*PFN_IIS_WEB_SOCKET_READ)(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead);
+
+	// The result of ReceiveWebSocketData
+	typedef enum class _IIS_WEB_SOCKET_RECEIVE_RESULT
+	{
+		IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT = 0,
+		// The read function returned an error
+		IIS_WEB_SOCKET_READ_FAILED_RECEIVE_RESULT = 1,
+		// The frame's PayloadLength exceeded the maximum payload length
+		IIS_WEB_SOCKET_PAYLOAD_TOO_LARGE_RECEIVE_RESULT = 2,
+		// A close, ping or pong frame doesn't fit in the buffer
+		IIS_WEB_SOCKET_BUFFER_TOO_SMALL_RECEIVE_RESULT = 3,
+		// The frame header violates the protocol, see pFrame->Violation, nothing of the payload was read
+		IIS_WEB_SOCKET_PROTOCOL_ERROR_RECEIVE_RESULT = 4
+	} IIS_WEB_SOCKET_RECEIVE_RESULT;
+
+	// Optional phase timing of ReceiveWebSocketData
+	struct WEB_SOCKET_RECEIVE_TIMING
+	{
+		// Reads a timestamp, set to NULL to skip timing
+		unsigned long long (*pfnTimestamp)();
+		// Timestamp ticks spent in the read function, parsing the frame header and unmasking
+		unsigned long long qwReadWait;
+		unsigned long long qwParse;
+		unsigned long long qwUnmask;
+		// Set to true when a new frame header was parsed, even without timing
+		bool bNewFrame;
+	};
+
+	// Receive the next part of a frame's payload, the transport independent part of WebSocketServer::Receive
+	// pTiming is optional
+	IIS_WEB_SOCKET_RECEIVE_RESULT ReceiveWebSocketData(WEB_SOCKET_STREAM* pStream, WEB_SOCKET_FRAME* pFrame, unsigned long long qwMaxPayloadLength,
+		PFN_IIS_WEB_SOCKET_READ pfnRead, void* pReadContext, void* pBuffer, unsigned long dwBufferLength,
+		unsigned long* pdwBytesReceived, IIS_WEB_SOCKET_BUFFER_TYPE* pBufferType, WEB_SOCKET_RECEIVE_TIMING* pTiming);
+
+	// Compare a header value with a string, ignoring case
+	bool WebSocketHeaderValueEquals(const char* pValue, size_t valueLength, const char* pExpected);
+
+	// Check a 'Connection' header value contains the 'Upgrade' token
+	// Some clients send a comma separated list, for example Firefox sends "keep-alive, Upgrade"
+	bool WebSocketConnectionHasUpgrade(const char* pValue, size_t valueLength);
+
+	// Check a comma separated header value, like 'Sec-WebSocket-Protocol', contains a token, ignoring case
+	bool WebSocketHeaderHasToken(const char* pValue, size_t valueLength, const char* pToken);
+
+	// Inbound rate limits, a rate of 0 is no limit
+	struct IIS_WEB_SOCKET_RATE_LIMITS
+	{
+		// The sustained rates a client may send at
+		unsigned long long FramesPerSecond;
+		unsigned long long BytesPerSecond;
+		unsigned long long MessagesPerSecond;
+		// How far a client may get ahead of each rate, 0 allows one second of the rate
+		unsigned long long FrameBurst;
+		unsigned long long ByteBurst;
+		unsigned long long MessageBurst;
+	};
+
+	// A token bucket, kept as the time the bucket will be full again so a charge is a couple of additions
+	struct WEB_SOCKET_TOKEN_BUCKET
+	{
+		// Ticks to earn back one token, 0 when there's no limit
+		double TokenTime;
+		// Ticks of tokens the bucket holds when it's full
+		unsigned long long qwBurstTime;
+		// When the bucket will be full again
+		unsigned long long qwFullTime;
+	};
+
+	// The state of a set of rate limits
+	struct WEB_SOCKET_RATE_LIMITER
+	{
+		WEB_SOCKET_TOKEN_BUCKET Frames;
+		WEB_SOCKET_TOKEN_BUCKET Bytes;
+		WEB_SOCKET_TOKEN_BUCKET Messages;
+		// When the limiter started asking for pauses, 0 while the client is within its limits
+		unsigned long long qwOverLimitSince;
+		// When the limiter last asked for a pause
+		unsigned long long qwLastOverLimit;
+		// How long a client must stay within its limits before qwOverLimitSince starts over, a tenth of a second
+		// Without it a thread that isn't scheduled for a moment would let a flooding client start over
+		unsigned long long qwOverLimitGrace;
+	};
+
+	// Set up a rate limiter, qwTicksPerSecond is the frequency of the timestamps passed to ChargeRateLimiter
+	// Pass NULL for pLimits to remove all limits
+	void InitializeRateLimiter(WEB_SOCKET_RATE_LIMITER* pLimiter, const IIS_WEB_SOCKET_RATE_LIMITS* pLimits, unsigned long long qwTicksPerSecond);
+
+	// Charge what was received to a rate limiter, returns the number of ticks reading should pause for
+	unsigned long long ChargeRateLimiter(WEB_SOCKET_RATE_LIMITER* pLimiter, unsigned long long qwNow,
+		unsigned long long qwFrames, unsigned long long qwBytes, unsigned long long qwMessages);
+
+	// WebSocket flush policy, decides when frames written by Send are flushed to the network
+	typedef enum class _IIS_WEB_SOCKET_FLUSH_POLICY
+	{
+		// Flush after every Send
+		IIS_WEB_SOCKET_IMMEDIATE_FLUSH_POLICY = 0,
+		// Coalesce frames until FlushThreshold bytes are pending, or FlushDelay has passed
+		IIS_WEB_SOCKET_SIZE_THRESHOLD_FLUSH_POLICY = 1,
+		// Coalesce frames until FlushDelay has passed since the oldest pending frame
+		IIS_WEB_SOCKET_MAX_DELAY_FLUSH_POLICY = 2
+	} IIS_WEB_SOCKET_FLUSH_POLICY;
+
+	// What to do with the coalesced frames after a frame is written
+	typedef enum class _IIS_WEB_SOCKET_FLUSH_ACTION
+	{
+		// Nothing is pending, or the flush timer is already counting down from the oldest pending frame
+		IIS_WEB_SOCKET_WAIT_FLUSH_ACTION = 0,
+		IIS_WEB_SOCKET_FLUSH_NOW_FLUSH_ACTION = 1,
+		// Start the flush timer for FlushDelay
+		IIS_WEB_SOCKET_SET_TIMER_FLUSH_ACTION = 2
+	} IIS_WEB_SOCKET_FLUSH_ACTION;
+
+	// Decide what a flush policy does after a frame is written, dwCoalescedLength is what's pending including the frame
+	// bUrgent flushes whatever the policy
+	IIS_WEB_SOCKET_FLUSH_ACTION GetWebSocketFlushAction(IIS_WEB_SOCKET_FLUSH_POLICY policy, bool bUrgent,
+		unsigned long dwCoalescedLength, unsigned long dwFlushThreshold, bool bTimerSet);
+
+	// The size of a cache line, counters written by different threads are kept on separate lines
+#define IIS_WEB_SOCKET_CACHE_LINE 64
+
+	// The number of records in each thread's trace ring buffer, must be a power of 2
+#define IIS_WEB_SOCKET_TRACE_RING_SIZE 0x400
+
+	// A single thread's trace ring buffer, Head is written by the owning thread and Tail by the thread that drains it
+	struct alignas(IIS_WEB_SOCKET_CACHE_LINE) WEB_SOCKET_TRACE_RING
+	{
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) std::atomic<unsigned long long> Head;
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) std::atomic<unsigned long long> Tail;
+		std::atomic<unsigned long long> Dropped;
+		std::atomic<bool> bOrphaned;
+		WEB_SOCKET_TRACE_RING* pNext;
+		IIS_WEB_SOCKET_TRACE_RECORD Records[IIS_WEB_SOCKET_TRACE_RING_SIZE];
+	};
+
+	// Add a frame record to a ring buffer, only called by the thread that owns it
+	// The record is dropped and counted if the ring is full, the first IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES of the payload are kept
+	void WriteTraceRecord(WEB_SOCKET_TRACE_RING* pRing, unsigned long long ConnectionId, unsigned long long Timestamp, unsigned int ThreadId,
+		unsigned char Direction, unsigned char Opcode, bool FIN, unsigned long long PayloadLength, unsigned int FrameSize,
+		const void* pPayload, unsigned long long qwPayloadBytes);
+
+	// Each power of 2 of a latency histogram is split into 2^IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS linear buckets, about 3% precision
+#define IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS 5
+#define IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT (1 << IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS)
+
+	// Latencies are clamped to 2^(IIS_WEB_SOCKET_LATENCY_MAX_BIT + 1) - 1 nanoseconds, about 36 minutes
+#define IIS_WEB_SOCKET_LATENCY_MAX_BIT 40
+
+	// The number of buckets in a latency histogram
+#define IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT ((IIS_WEB_SOCKET_LATENCY_MAX_BIT - IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_BITS + 2) * IIS_WEB_SOCKET_LATENCY_SUB_BUCKET_COUNT)
+
+	// A log-linear latency histogram, only the owning thread writes to it, others may read it
+	struct WEB_SOCKET_LATENCY_HISTOGRAM
+	{
+		std::atomic<unsigned long long> Sum;
+		std::atomic<unsigned long long> Min;
+		std::atomic<unsigned long long> Max;
+		std::atomic<unsigned long long> Counts[IIS_WEB_SOCKET_LATENCY_BUCKET_COUNT];
+	};
+
+	// Empty a histogram
+	void ClearWebSocketLatencyHistogram(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram);
+
+	// Add the counts of one histogram to another, the caller makes sure nothing writes pDestination meanwhile
+	void MergeWebSocketLatencyHistogram(WEB_SOCKET_LATENCY_HISTOGRAM* pDestination, WEB_SOCKET_LATENCY_HISTOGRAM* pSource);
+
+	// Add a latency in nanoseconds to a histogram, only called by the thread that owns it
+	void RecordWebSocketLatency(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram, unsigned long long qwNanoseconds);
+
+	// Get the smallest latency in nanoseconds that at least the given fraction of the qwCount latencies is at or below
+	unsigned long long GetWebSocketLatencyPercentile(WEB_SOCKET_LATENCY_HISTOGRAM* pHistogram, unsigned long long qwCount, double fraction);
+
+	// Where a connection is in the closing handshake
+	typedef enum class _IIS_WEB_SOCKET_CLOSE_STATE
+	{
+		IIS_WEB_SOCKET_OPEN_CLOSE_STATE = 0,
+		// The server sent a close frame and waits for the client's until the deadline
+		IIS_WEB_SOCKET_CLOSE_SENT_CLOSE_STATE = 1,
+		// The client sent a close frame and the server's answer hasn't been sent yet
+		IIS_WEB_SOCKET_CLOSE_RECEIVED_CLOSE_STATE = 2,
+		// Both close frames were exchanged, or the deadline passed, the connection can be freed
+		IIS_WEB_SOCKET_CLOSED_CLOSE_STATE = 3
+	} IIS_WEB_SOCKET_CLOSE_STATE;
+
+	// The closing handshake of a connection, the caller serializes the calls
+	struct WEB_SOCKET_CLOSE_HANDSHAKE
+	{
+		IIS_WEB_SOCKET_CLOSE_STATE State;
+		// When the client must have answered the server's close frame, in the caller's time units
+		unsigned long long qwDeadline;
+		// Set when the deadline passed before the client answered
+		bool bTimedOut;
+	};
+
+	// Call before sending a close frame, returns false if one was already sent and this one must not be
+	// Starts the deadline when the server is the first to close
+	bool BeginWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, unsigned long long qwNow, unsigned long long qwTimeout);
+
+	// Call when a close frame is received, returns true if it must be answered with the close frame in pReply
+	// The answer echoes the client's status code, or is 1002 for a status code a client must not send, pReply has room for 2 bytes
+	bool ReceiveWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, const void* pPayload, unsigned long long qwLength,
+		unsigned char pReply[2], unsigned long* pdwReplyLength);
+
+	// Check the deadline of a server initiated close, returns true once it passed and the connection should be aborted
+	bool ExpireWebSocketClose(WEB_SOCKET_CLOSE_HANDSHAKE* pHandshake, unsigned long long qwNow);
+
+	// What happens when a data message would take an outbound queue over its byte limit
+	// Close, ping and pong frames are never dropped, they're queued over the limit
+	typedef enum class _IIS_WEB_SOCKET_OUTBOUND_POLICY
+	{
+		// Drop queued messages, oldest first, until the new message fits
+		IIS_WEB_SOCKET_DROP_OLDEST_OUTBOUND_POLICY = 0,
+		// Drop the new message
+		IIS_WEB_SOCKET_DROP_NEWEST_OUTBOUND_POLICY = 1,
+		// A message with a key replaces the queued message with the same key, then the oldest are dropped until it fits
+		IIS_WEB_SOCKET_CONFLATE_OUTBOUND_POLICY = 2,
+		// Drop everything and reset the connection
+		IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY = 3
+	} IIS_WEB_SOCKET_OUTBOUND_POLICY;
+
+	// Counters of an outbound queue
+	struct IIS_WEB_SOCKET_OUTBOUND_STATS
+	{
+		// Payload bytes and messages waiting to be written
+		unsigned long long QueuedBytes;
+		unsigned long long QueuedMessages;
+		// Messages taken from the queue to be written
+		unsigned long long SentMessages;
+		// Messages dropped by the policy
+		unsigned long long DroppedMessages;
+		// Messages replaced by a newer message with the same key
+		unsigned long long ConflatedMessages;
+		// Microseconds the queue has spent at its limit, the time the client wasn't keeping up
+		unsigned long long StallTime;
+	};
+
+	// How close an account is to its budgets
+	typedef enum class _IIS_WEB_SOCKET_MEMORY_PRESSURE
+	{
+		IIS_WEB_SOCKET_NORMAL_MEMORY_PRESSURE = 0,
+		// The soft budget was crossed, shed load before the hard budget is reached
+		IIS_WEB_SOCKET_SOFT_MEMORY_PRESSURE = 1,
+		// An allocation was refused by the hard budget
+		IIS_WEB_SOCKET_HARD_MEMORY_PRESSURE = 2
+	} IIS_WEB_SOCKET_MEMORY_PRESSURE;
+
+	// The budgets of an account in bytes, 0 is no budget
+	struct IIS_WEB_SOCKET_MEMORY_BUDGET
+	{
+		// Crossing it reports soft pressure
+		unsigned long long SoftLimit;
+		// Allocations that would go over it are refused
+		unsigned long long HardLimit;
+	};
+
+	// What an account holds
+	struct IIS_WEB_SOCKET_MEMORY_STATS
+	{
+		unsigned long long Bytes;
+		unsigned long long SoftLimit;
+		unsigned long long HardLimit;
+		// Allocations refused by the hard budget
+		unsigned long long RefusedAllocations;
+		// The pressure last reported
+		IIS_WEB_SOCKET_MEMORY_PRESSURE Pressure;
+	};
+
+	// Called when the pressure of an account changes, pConnection is NULL for the global account
+	// Called on the thread that allocated or freed, it must not allocate from the same connection
+	typedef void (*PFN_IIS_WEB_SOCKET_MEMORY_PRESSURE)(void* pContext, void* pConnection, IIS_WEB_SOCKET_MEMORY_PRESSURE pressure, unsigned long long qwBytes);
+
+	// The library-owned memory of a connection, charged with relaxed atomics from any thread
+	struct WEB_SOCKET_MEMORY_ACCOUNT
+	{
+		// Written by every charge, padded so the budgets every charge reads are never on its cache line
+		// The structure isn't aligned, accounts are part of structures that are allocated with malloc
+		std::atomic<unsigned long long> Bytes;
+		char BytesPadding[IIS_WEB_SOCKET_CACHE_LINE - sizeof(std::atomic<unsigned long long>)];
+		std::atomic<unsigned long long> SoftLimit;
+		std::atomic<unsigned long long> HardLimit;
+		std::atomic<unsigned long long> Refused;
+		// The pressure last reported, an IIS_WEB_SOCKET_MEMORY_PRESSURE
+		std::atomic<int> Pressure;
+		// Passed to the pressure callback
+		void* pConnection;
+	};
+
+	// Set up a connection's account without budgets, pConnection is passed to the pressure callback
+	void InitializeMemoryAccount(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, void* pConnection);
+
+	// Set the budgets of an account, NULL removes them
+	void SetMemoryAccountBudget(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget);
+
+	// Set the budgets of the global account, every allocation of every connection is charged to it too, NULL removes them
+	void SetGlobalMemoryBudget(const IIS_WEB_SOCKET_MEMORY_BUDGET* pBudget);
+
+	// Set the callback told when the pressure of any account changes, NULL removes it, set it before connections are made
+	void SetMemoryPressureCallback(PFN_IIS_WEB_SOCKET_MEMORY_PRESSURE pfnPressure, void* pContext);
+
+	// Charge an allocation to an account and the global account, before allocating, pAccount is NULL for memory no connection owns
+	// Returns false without charging anything when it would go over a hard budget
+	bool ChargeMemory(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes);
+
+	// Give back what ChargeMemory charged, once the memory is freed
+	void ReleaseMemory(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, unsigned long long qwBytes);
+
+	// Get what an account holds, NULL gets the global account
+	void GetMemoryStats(WEB_SOCKET_MEMORY_ACCOUNT* pAccount, IIS_WEB_SOCKET_MEMORY_STATS* pStats);
+
+	// A frame encoded once and queued on many connections, the header and payload follow the structure
+	// Freed when the last reference is released
+	struct WEB_SOCKET_SHARED_FRAME
+	{
+		std::atomic<unsigned long> References;
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		// The encoded frame, the header followed by the payload
+		unsigned char* pFrame;
+		unsigned int HeaderLength;
+		unsigned long long qwPayloadLength;
+	};
+
+	// Encode a message as a single unmasked frame with one reference, returns NULL if out of memory or over the global hard memory budget
+	// A close, ping or pong frame is encoded too, returns NULL if its payload is over 125 bytes
+	WEB_SOCKET_SHARED_FRAME* CreateSharedFrame(IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength);
+
+	// Add a reference to a shared frame
+	void AddSharedFrameReference(WEB_SOCKET_SHARED_FRAME* pFrame);
+
+	// Release a reference to a shared frame, the last reference frees it
+	void ReleaseSharedFrame(WEB_SOCKET_SHARED_FRAME* pFrame);
+
+	// A message waiting in an outbound queue, the key and payload follow the structure in the same allocation
+	// The payload of a shared frame isn't copied, pData points into the frame
+	struct WEB_SOCKET_QUEUED_MESSAGE
+	{
+		WEB_SOCKET_QUEUED_MESSAGE* pNext;
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		// NULL terminated conflation key, NULL if the message doesn't have one
+		char* pKey;
+		char* pData;
+		unsigned long long qwLength;
+		// The shared frame the message references, NULL if the payload was copied
+		WEB_SOCKET_SHARED_FRAME* pSharedFrame;
+		// The account the allocation is charged to, and its size
+		WEB_SOCKET_MEMORY_ACCOUNT* pAccount;
+		size_t AllocationSize;
+	};
+
+	// A bounded queue of outbound messages, the caller does the locking
+	struct WEB_SOCKET_OUTBOUND_QUEUE
+	{
+		WEB_SOCKET_QUEUED_MESSAGE* pHead;
+		WEB_SOCKET_QUEUED_MESSAGE* pTail;
+		// The most payload bytes the queue holds (0 = no limit) and what happens at the limit
+		unsigned long long qwLimit;
+		IIS_WEB_SOCKET_OUTBOUND_POLICY Policy;
+		IIS_WEB_SOCKET_OUTBOUND_STATS Stats;
+		// Set from when the queue reaches its limit until it drains to half the limit
+		bool bStalled;
+		unsigned long long qwStallStart;
+		// Set once the disconnect policy was applied, nothing more is queued
+		bool bDisconnected;
+		// The connection's account the messages are charged to, NULL charges only the global account
+		WEB_SOCKET_MEMORY_ACCOUNT* pAccount;
+	};
+
+	// The result of PushOutboundMessage
+	typedef enum class _IIS_WEB_SOCKET_QUEUE_RESULT
+	{
+		IIS_WEB_SOCKET_QUEUED_QUEUE_RESULT = 0,
+		// The new message was dropped by the policy
+		IIS_WEB_SOCKET_DROPPED_QUEUE_RESULT = 1,
+		// The disconnect policy was applied, the queue is empty
+		IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT = 2,
+		// Out of memory, or the message would go over a hard memory budget
+		IIS_WEB_SOCKET_OUT_OF_MEMORY_QUEUE_RESULT = 3
+	} IIS_WEB_SOCKET_QUEUE_RESULT;
+
+	// Copy a message into an outbound queue, applying the policy at the limit
+	// pKey is optional, qwNow is a timestamp in microseconds for the stall time
+	IIS_WEB_SOCKET_QUEUE_RESULT PushOutboundMessage(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+		const void* pData, unsigned long long qwLength, const char* pKey, unsigned long long qwNow);
+
+	// Add a reference to a shared frame to an outbound queue, applying the policy at the limit
+	IIS_WEB_SOCKET_QUEUE_RESULT PushOutboundFrame(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, WEB_SOCKET_SHARED_FRAME* pFrame,
+		const char* pKey, unsigned long long qwNow);
+
+	// Take the oldest message from an outbound queue, returns NULL if it's empty
+	// Free the message with FreeOutboundMessage once it's written
+	WEB_SOCKET_QUEUED_MESSAGE* PopOutboundMessage(WEB_SOCKET_OUTBOUND_QUEUE* pQueue, unsigned long long qwNow);
+
+	// Free a message taken from an outbound queue, releasing its shared frame
+	void FreeOutboundMessage(WEB_SOCKET_QUEUED_MESSAGE* pMessage);
+
+	// Free every message in an outbound queue
+	void ClearOutboundQueue(WEB_SOCKET_OUTBOUND_QUEUE* pQueue);
+}
+
+#endif // !IIS_WEB_SOCKET_FRAME_H
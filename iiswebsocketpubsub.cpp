@@ -0,0 +1,202 @@
+
+//
+// iiswebsocketpubsub.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Topic based publish and subscribe for WebSocket connections.
+//
+
+#include "iiswebsocketpubsub.h"
+#include <functional>
+#include <new>
+
+using namespace IISWebSocketServer;
+
+WebSocketRouter::TOPIC_SHARD* WebSocketRouter::GetTopicShard(const std::string& topic)
+{
+	return &this->pTopicShards[std::hash<std::string>()(topic) % this->ShardCount];
+}
+
+WebSocketRouter::SUBSCRIBER_SHARD* WebSocketRouter::GetSubscriberShard(void* pSubscriber)
+{
+	return &this->pSubscriberShards[std::hash<void*>()(pSubscriber) % this->ShardCount];
+}
+
+bool WebSocketRouter::Initialize(unsigned int shardCount)
+{
+	if (shardCount == 0) {
+		shardCount = IIS_WEB_SOCKET_DEFAULT_ROUTER_SHARDS;
+	}
+
+	this->pTopicShards.reset(new (std::nothrow) TOPIC_SHARD[shardCount]);
+	this->pSubscriberShards.reset(new (std::nothrow) SUBSCRIBER_SHARD[shardCount]);
+	if ((this->pTopicShards == NULL) || (this->pSubscriberShards == NULL)) {
+		this->Free();
+		return false;
+	}
+	this->ShardCount = shardCount;
+
+	return true;
+}
+
+bool WebSocketRouter::Subscribe(void* pSubscriber, const char* pTopic)
+{
+	TOPIC_SHARD* pTopicShard;
+	SUBSCRIBER_SHARD* pSubscriberShard;
+
+	// The containers throw when they can't allocate
+	try
+	{
+		std::string topic(pTopic);
+
+		// Remember the topic for UnsubscribeAll first, so a subscriber is never in a topic it can't be removed from
+		pSubscriberShard = this->GetSubscriberShard(pSubscriber);
+		{
+			std::lock_guard<std::mutex> lock(pSubscriberShard->Lock);
+			pSubscriberShard->Subscribers[pSubscriber].insert(topic);
+		}
+
+		pTopicShard = this->GetTopicShard(topic);
+		{
+			std::unique_lock<std::shared_mutex> lock(pTopicShard->Lock);
+			pTopicShard->Topics[topic].insert(pSubscriber);
+		}
+	}
+	catch (const std::bad_alloc&) {
+		return false;
+	}
+
+	return true;
+}
+
+void WebSocketRouter::Unsubscribe(void* pSubscriber, const char* pTopic)
+{
+	TOPIC_SHARD* pTopicShard;
+	SUBSCRIBER_SHARD* pSubscriberShard;
+	std::string topic(pTopic);
+
+	// Remove the subscriber from the topic, an empty topic is removed
+	pTopicShard = this->GetTopicShard(topic);
+	{
+		std::unique_lock<std::shared_mutex> lock(pTopicShard->Lock);
+		auto it = pTopicShard->Topics.find(topic);
+		if (it != pTopicShard->Topics.end()) {
+			it->second.erase(pSubscriber);
+			if (it->second.empty()) {
+				pTopicShard->Topics.erase(it);
+			}
+		}
+	}
+
+	pSubscriberShard = this->GetSubscriberShard(pSubscriber);
+	{
+		std::lock_guard<std::mutex> lock(pSubscriberShard->Lock);
+		auto it = pSubscriberShard->Subscribers.find(pSubscriber);
+		if (it != pSubscriberShard->Subscribers.end()) {
+			it->second.erase(topic);
+			if (it->second.empty()) {
+				pSubscriberShard->Subscribers.erase(it);
+			}
+		}
+	}
+}
+
+void WebSocketRouter::UnsubscribeAll(void* pSubscriber)
+{
+	TOPIC_SHARD* pTopicShard;
+	SUBSCRIBER_SHARD* pSubscriberShard;
+	std::unordered_set<std::string> topics;
+
+	// Take the subscriber's topics
+	pSubscriberShard = this->GetSubscriberShard(pSubscriber);
+	{
+		std::lock_guard<std::mutex> lock(pSubscriberShard->Lock);
+		auto it = pSubscriberShard->Subscribers.find(pSubscriber);
+		if (it == pSubscriberShard->Subscribers.end()) {
+			return;
+		}
+		topics.swap(it->second);
+		pSubscriberShard->Subscribers.erase(it);
+	}
+
+	// Remove it from each topic, a publish in progress finishes before the topic's lock is taken
+	for (const std::string& topic : topics)
+	{
+		pTopicShard = this->GetTopicShard(topic);
+		std::unique_lock<std::shared_mutex> lock(pTopicShard->Lock);
+		auto it = pTopicShard->Topics.find(topic);
+		if (it != pTopicShard->Topics.end()) {
+			it->second.erase(pSubscriber);
+			if (it->second.empty()) {
+				pTopicShard->Topics.erase(it);
+			}
+		}
+	}
+}
+
+bool WebSocketRouter::Publish(const char* pTopic, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength,
+	PFN_IIS_WEB_SOCKET_DELIVER pfnDeliver, void* pContext, size_t* pSubscriberCount)
+{
+	TOPIC_SHARD* pTopicShard;
+	WEB_SOCKET_SHARED_FRAME* pFrame = NULL;
+	bool bSuccess = true;
+
+	*pSubscriberCount = 0;
+
+	try
+	{
+		std::string topic(pTopic);
+
+		pTopicShard = this->GetTopicShard(topic);
+		std::shared_lock<std::shared_mutex> lock(pTopicShard->Lock);
+
+		auto it = pTopicShard->Topics.find(topic);
+		if (it == pTopicShard->Topics.end()) {
+			return true;
+		}
+
+		// Encode the frame once, each subscriber that queues it takes a reference
+		pFrame = CreateSharedFrame(bufferType, pData, qwLength);
+		if (pFrame == NULL) {
+			return false;
+		}
+
+		for (void* pSubscriber : it->second) {
+			pfnDeliver(pSubscriber, pFrame, pTopic, pContext);
+		}
+		*pSubscriberCount = it->second.size();
+	}
+	catch (const std::bad_alloc&) {
+		bSuccess = false;
+	}
+
+	// Release the reference of the publisher
+	if (pFrame != NULL) {
+		ReleaseSharedFrame(pFrame);
+	}
+
+	return bSuccess;
+}
+
+size_t WebSocketRouter::GetSubscriberCount(const char* pTopic)
+{
+	TOPIC_SHARD* pTopicShard;
+	std::string topic(pTopic);
+
+	pTopicShard = this->GetTopicShard(topic);
+	std::shared_lock<std::shared_mutex> lock(pTopicShard->Lock);
+	auto it = pTopicShard->Topics.find(topic);
+
+	return (it != pTopicShard->Topics.end()) ? it->second.size() : 0;
+}
+
+void WebSocketRouter::Free()
+{
+	this->pTopicShards.reset();
+	this->pSubscriberShards.reset();
+	this->ShardCount = 0;
+}
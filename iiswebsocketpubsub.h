@@ -0,0 +1,80 @@
+
+//
+// iiswebsocketpubsub.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Topic based publish and subscribe for WebSocket connections.
+//     The topic index is split into shards so subscribing and publishing on different topics don't contend.
+//     Like the protocol core, this only uses standard types and builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_PUBSUB_H
+#define IIS_WEB_SOCKET_PUBSUB_H
+
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Hands a published frame to a subscriber, called while the topic is locked for reading
+	// It must not block or subscribe, WebSocketServer::QueueSharedFrame is the intended callback
+	typedef void (*PFN_IIS_WEB_SOCKET_DELIVER)(void* pSubscriber, WEB_SOCKET_SHARED_FRAME* pFrame, const char* pTopic, void* pContext);
+
+	// The number of shards the router uses when Initialize is given 0
+#define IIS_WEB_SOCKET_DEFAULT_ROUTER_SHARDS 64
+
+	// Routes published messages to the subscribers of a topic, a subscriber is any pointer the application chooses
+	class WebSocketRouter
+	{
+	private:
+		// A part of the topic index, a topic always lives in the same shard
+		struct TOPIC_SHARD
+		{
+			std::shared_mutex Lock;
+			std::unordered_map<std::string, std::unordered_set<void*>> Topics;
+		};
+		// A part of the subscriber index, the topics of each subscriber for UnsubscribeAll
+		struct SUBSCRIBER_SHARD
+		{
+			std::mutex Lock;
+			std::unordered_map<void*, std::unordered_set<std::string>> Subscribers;
+		};
+		std::unique_ptr<TOPIC_SHARD[]> pTopicShards;
+		std::unique_ptr<SUBSCRIBER_SHARD[]> pSubscriberShards;
+		size_t ShardCount;
+		// Get the shard of a topic or subscriber
+		TOPIC_SHARD* GetTopicShard(const std::string& topic);
+		SUBSCRIBER_SHARD* GetSubscriberShard(void* pSubscriber);
+	public:
+		// Create the shards, 0 uses IIS_WEB_SOCKET_DEFAULT_ROUTER_SHARDS, returns false if out of memory
+		bool Initialize(unsigned int shardCount);
+		// Subscribe to a topic, returns false if out of memory
+		bool Subscribe(void* pSubscriber, const char* pTopic);
+		// Unsubscribe from a topic
+		void Unsubscribe(void* pSubscriber, const char* pTopic);
+		// Unsubscribe from every topic, nothing is delivered to the subscriber once this returns
+		void UnsubscribeAll(void* pSubscriber);
+		// Encode a message once and deliver it to every subscriber of a topic
+		// Returns false if out of memory, *pSubscriberCount is set to the number of subscribers delivered to
+		bool Publish(const char* pTopic, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength,
+			PFN_IIS_WEB_SOCKET_DELIVER pfnDeliver, void* pContext, size_t* pSubscriberCount);
+		// Get the number of subscribers of a topic
+		size_t GetSubscriberCount(const char* pTopic);
+		// Free resources
+		void Free();
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_PUBSUB_H
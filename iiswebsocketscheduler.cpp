@@ -0,0 +1,282 @@
+
+//
+// iiswebsocketscheduler.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Fair dispatch of inbound messages when many connections share a few worker threads.
+//
+
+#include "iiswebsocketscheduler.h"
+#include <limits.h>
+#include <string.h>
+
+using namespace IISWebSocketServer;
+
+bool WebSocketScheduler::Initialize(const IIS_WEB_SOCKET_SCHEDULER_OPTIONS* pOptions, PFN_IIS_WEB_SOCKET_SCHEDULER_DISPATCH pfnDispatch, void* pContext)
+{
+	unsigned int classCount;
+
+	if ((pOptions == NULL) || (pfnDispatch == NULL)) {
+		return false;
+	}
+	classCount = (pOptions->ClassCount != 0) ? pOptions->ClassCount : 1;
+	if ((classCount > IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES) || (pOptions->Quantum > (unsigned long long)LLONG_MAX)) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES; i++)
+	{
+		this->Classes[i].pHead = NULL;
+		this->Classes[i].pTail = NULL;
+		this->Classes[i].Weight = ((i < classCount) && (pOptions->Weights[i] != 0)) ? pOptions->Weights[i] : 1;
+	}
+	this->ClassCount = classCount;
+	this->CurrentClass = 0;
+	this->ClassTurns = 0;
+	this->QuantumType = pOptions->QuantumType;
+	this->Quantum = (long long)pOptions->Quantum;
+	this->pfnDispatch = pfnDispatch;
+	this->pContext = pContext;
+	this->bStopping = false;
+	memset(&this->Stats, 0, sizeof(this->Stats));
+
+	return true;
+}
+
+void WebSocketScheduler::Enqueue(WEB_SOCKET_SCHEDULER_ENTRY* pEntry)
+{
+	SCHEDULER_CLASS* pClass = &this->Classes[pEntry->Class];
+
+	pEntry->pPrev = pClass->pTail;
+	pEntry->pNext = NULL;
+	if (pClass->pTail != NULL) {
+		pClass->pTail->pNext = pEntry;
+	}
+	else {
+		pClass->pHead = pEntry;
+	}
+	pClass->pTail = pEntry;
+	pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_WAITING_SCHEDULER_STATE;
+}
+
+void WebSocketScheduler::Unlink(WEB_SOCKET_SCHEDULER_ENTRY* pEntry)
+{
+	SCHEDULER_CLASS* pClass = &this->Classes[pEntry->Class];
+
+	if (pEntry->pPrev != NULL) {
+		pEntry->pPrev->pNext = pEntry->pNext;
+	}
+	else {
+		pClass->pHead = pEntry->pNext;
+	}
+	if (pEntry->pNext != NULL) {
+		pEntry->pNext->pPrev = pEntry->pPrev;
+	}
+	else {
+		pClass->pTail = pEntry->pPrev;
+	}
+	pEntry->pPrev = NULL;
+	pEntry->pNext = NULL;
+}
+
+WEB_SOCKET_SCHEDULER_ENTRY* WebSocketScheduler::Next()
+{
+	WEB_SOCKET_SCHEDULER_ENTRY* pEntry;
+	SCHEDULER_CLASS* pClass;
+
+	// Each class gets its weight in turns, then the next class with connections waiting is served
+	// Coming back to the class it started at, every class was looked at once
+	for (unsigned int i = 0; i <= this->ClassCount; i++)
+	{
+		pClass = &this->Classes[this->CurrentClass];
+		if ((pClass->pHead != NULL) && (this->ClassTurns < pClass->Weight))
+		{
+			this->ClassTurns++;
+			pEntry = pClass->pHead;
+			this->Unlink(pEntry);
+			return pEntry;
+		}
+		this->CurrentClass = (this->CurrentClass + 1) % this->ClassCount;
+		this->ClassTurns = 0;
+	}
+
+	return NULL;
+}
+
+bool WebSocketScheduler::Register(WEB_SOCKET_SCHEDULER_ENTRY* pEntry, void* pConnection, unsigned int classIndex)
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+
+	if (classIndex >= this->ClassCount) {
+		return false;
+	}
+
+	pEntry->pConnection = pConnection;
+	pEntry->Class = classIndex;
+	pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_IDLE_SCHEDULER_STATE;
+	pEntry->bReadyAgain = false;
+	pEntry->bRemoved = false;
+	pEntry->Deficit = 0;
+	pEntry->pPrev = NULL;
+	pEntry->pNext = NULL;
+
+	return true;
+}
+
+void WebSocketScheduler::SetReady(WEB_SOCKET_SCHEDULER_ENTRY* pEntry)
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+
+	if (pEntry->bRemoved) {
+		return;
+	}
+
+	if (pEntry->State == IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_IDLE_SCHEDULER_STATE)
+	{
+		this->Enqueue(pEntry);
+		this->Available.notify_one();
+	}
+	else if (pEntry->State == IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_RUNNING_SCHEDULER_STATE)
+	{
+		// The turn may have seen the connection empty already, it goes back in line when it ends
+		pEntry->bReadyAgain = true;
+	}
+}
+
+void WebSocketScheduler::Remove(WEB_SOCKET_SCHEDULER_ENTRY* pEntry)
+{
+	std::unique_lock<std::mutex> lock(this->Lock);
+
+	if (pEntry->State == IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_WAITING_SCHEDULER_STATE) {
+		this->Unlink(pEntry);
+	}
+	else if (pEntry->State == IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_RUNNING_SCHEDULER_STATE)
+	{
+		pEntry->bRemoved = true;
+		this->TurnEnded.wait(lock, [pEntry] {
+			return pEntry->State != IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_RUNNING_SCHEDULER_STATE;
+		});
+	}
+
+	pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_UNREGISTERED_SCHEDULER_STATE;
+	pEntry->bRemoved = false;
+}
+
+bool WebSocketScheduler::RunTurn(bool bWait)
+{
+	WEB_SOCKET_SCHEDULER_ENTRY* pEntry;
+	unsigned long long qwBytes;
+	unsigned long long qwMessages = 0;
+	unsigned long long qwTotalBytes = 0;
+	long long deficit;
+	bool bPreempted = false;
+
+	// Take the connection whose turn it is
+	{
+		std::unique_lock<std::mutex> lock(this->Lock);
+		for (;;)
+		{
+			if (this->bStopping) {
+				return false;
+			}
+			pEntry = this->Next();
+			if (pEntry != NULL) {
+				break;
+			}
+			if (!bWait) {
+				return false;
+			}
+			this->Available.wait(lock);
+		}
+		pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_RUNNING_SCHEDULER_STATE;
+		pEntry->bReadyAgain = false;
+		pEntry->Deficit += this->Quantum;
+		deficit = pEntry->Deficit;
+	}
+
+	// Dispatch without the lock, a connection is only ever in one turn so its messages stay in order
+	// The message that goes over the quantum is still dispatched, the connection pays for it next turn
+	for (;;)
+	{
+		if ((this->Quantum != 0) && (deficit <= 0))
+		{
+			bPreempted = true;
+			break;
+		}
+		qwBytes = 0;
+		if (!this->pfnDispatch(pEntry->pConnection, this->pContext, &qwBytes)) {
+			break;
+		}
+		qwMessages++;
+		qwTotalBytes += qwBytes;
+		if (this->Quantum != 0) {
+			deficit -= (this->QuantumType == IIS_WEB_SOCKET_QUANTUM_TYPE::IIS_WEB_SOCKET_BYTES_QUANTUM_TYPE) ? (long long)qwBytes : 1;
+		}
+	}
+
+	// Back in line if the quantum ended the turn or messages arrived, otherwise the quantum left over isn't kept
+	{
+		std::lock_guard<std::mutex> lock(this->Lock);
+		this->Stats.Turns++;
+		this->Stats.Messages += qwMessages;
+		this->Stats.Bytes += qwTotalBytes;
+		if (bPreempted) {
+			this->Stats.Preemptions++;
+		}
+
+		pEntry->Deficit = (this->Quantum != 0) ? deficit : 0;
+		if ((!bPreempted) && (pEntry->Deficit > 0)) {
+			pEntry->Deficit = 0;
+		}
+		if (pEntry->bRemoved)
+		{
+			pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_IDLE_SCHEDULER_STATE;
+			this->TurnEnded.notify_all();
+		}
+		else if ((bPreempted) || (pEntry->bReadyAgain))
+		{
+			this->Enqueue(pEntry);
+			this->Available.notify_one();
+		}
+		else {
+			pEntry->State = IIS_WEB_SOCKET_SCHEDULER_STATE::IIS_WEB_SOCKET_IDLE_SCHEDULER_STATE;
+		}
+	}
+
+	return true;
+}
+
+void WebSocketScheduler::Run()
+{
+	while (this->RunTurn(true)) {
+	}
+}
+
+void WebSocketScheduler::Stop()
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+	this->bStopping = true;
+	this->Available.notify_all();
+}
+
+void WebSocketScheduler::GetStats(IIS_WEB_SOCKET_SCHEDULER_STATS* pStats)
+{
+	std::lock_guard<std::mutex> lock(this->Lock);
+	*pStats = this->Stats;
+}
+
+void WebSocketScheduler::Free()
+{
+	for (unsigned int i = 0; i < IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES; i++)
+	{
+		this->Classes[i].pHead = NULL;
+		this->Classes[i].pTail = NULL;
+	}
+	this->ClassCount = 0;
+	this->pfnDispatch = NULL;
+	this->pContext = NULL;
+}
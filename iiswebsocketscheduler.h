@@ -0,0 +1,148 @@
+
+//
+// iiswebsocketscheduler.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Fair dispatch of inbound messages when many connections share a few worker threads.
+//     A connection with messages waiting gets a turn of a quantum of messages or bytes, then goes to the back of its class,
+//     with deficit round robin so a connection that went over its quantum gets less the next turn.
+//     Priority classes are served in order, each for as many turns as its weight, so a flooding connection can't hold up the others.
+//     Like the protocol core, this only uses standard types and builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_SCHEDULER_H
+#define IIS_WEB_SOCKET_SCHEDULER_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Handles the next message of a connection and sets *pqwBytes to its length, returns false when it has none waiting
+	typedef bool (*PFN_IIS_WEB_SOCKET_SCHEDULER_DISPATCH)(void* pConnection, void* pContext, unsigned long long* pqwBytes);
+
+	// What the quantum of a turn counts
+	typedef enum class _IIS_WEB_SOCKET_QUANTUM_TYPE
+	{
+		IIS_WEB_SOCKET_MESSAGES_QUANTUM_TYPE = 0,
+		IIS_WEB_SOCKET_BYTES_QUANTUM_TYPE = 1
+	} IIS_WEB_SOCKET_QUANTUM_TYPE;
+
+	// The most priority classes a scheduler can have
+#define IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES 8
+
+	// How a scheduler hands out turns
+	struct IIS_WEB_SOCKET_SCHEDULER_OPTIONS
+	{
+		// What Quantum counts
+		IIS_WEB_SOCKET_QUANTUM_TYPE QuantumType;
+		// The messages or bytes a connection is dispatched per turn (0 = until it has none, like a thread per connection)
+		unsigned long long Quantum;
+		// The number of priority classes, class 0 is served first (0 = 1)
+		unsigned int ClassCount;
+		// The turns each class gets before the next class is served (0 = 1)
+		unsigned int Weights[IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES];
+	};
+
+	// What a scheduler did
+	struct IIS_WEB_SOCKET_SCHEDULER_STATS
+	{
+		// Turns given, and turns ended by the quantum while the connection had more messages
+		unsigned long long Turns;
+		unsigned long long Preemptions;
+		// Messages dispatched and their bytes
+		unsigned long long Messages;
+		unsigned long long Bytes;
+	};
+
+	// Where a connection is in a scheduler
+	typedef enum class _IIS_WEB_SOCKET_SCHEDULER_STATE
+	{
+		IIS_WEB_SOCKET_UNREGISTERED_SCHEDULER_STATE = 0,
+		// No messages waiting
+		IIS_WEB_SOCKET_IDLE_SCHEDULER_STATE = 1,
+		// Waiting for a turn
+		IIS_WEB_SOCKET_WAITING_SCHEDULER_STATE = 2,
+		// A worker thread is dispatching its messages
+		IIS_WEB_SOCKET_RUNNING_SCHEDULER_STATE = 3
+	} IIS_WEB_SOCKET_SCHEDULER_STATE;
+
+	// The state of a connection in a scheduler, owned by the connection, it must stay valid until it's removed
+	struct WEB_SOCKET_SCHEDULER_ENTRY
+	{
+		void* pConnection;
+		unsigned int Class;
+		IIS_WEB_SOCKET_SCHEDULER_STATE State;
+		// Set when messages arrive during a turn, and when the connection is removed during it
+		bool bReadyAgain;
+		bool bRemoved;
+		// The quantum left, negative when the last message went over it
+		long long Deficit;
+		// The connections of the class waiting for a turn
+		WEB_SOCKET_SCHEDULER_ENTRY* pPrev;
+		WEB_SOCKET_SCHEDULER_ENTRY* pNext;
+	};
+
+	// Hands out turns of message dispatch to connections, from any number of worker threads
+	class WebSocketScheduler
+	{
+	private:
+		// The connections of a class waiting for a turn, oldest first
+		struct SCHEDULER_CLASS
+		{
+			WEB_SOCKET_SCHEDULER_ENTRY* pHead;
+			WEB_SOCKET_SCHEDULER_ENTRY* pTail;
+			unsigned int Weight;
+		};
+		std::mutex Lock;
+		// Signalled when a connection is waiting for a turn, and when a turn ends
+		std::condition_variable Available;
+		std::condition_variable TurnEnded;
+		SCHEDULER_CLASS Classes[IIS_WEB_SOCKET_MAX_SCHEDULER_CLASSES];
+		unsigned int ClassCount;
+		// The class being served and the turns it had
+		unsigned int CurrentClass;
+		unsigned int ClassTurns;
+		IIS_WEB_SOCKET_QUANTUM_TYPE QuantumType;
+		long long Quantum;
+		PFN_IIS_WEB_SOCKET_SCHEDULER_DISPATCH pfnDispatch;
+		void* pContext;
+		bool bStopping;
+		IIS_WEB_SOCKET_SCHEDULER_STATS Stats;
+		// Put a connection at the back of its class
+		void Enqueue(WEB_SOCKET_SCHEDULER_ENTRY* pEntry);
+		// Take a connection out of its class
+		void Unlink(WEB_SOCKET_SCHEDULER_ENTRY* pEntry);
+		// Take the connection whose turn it is, NULL when none is waiting
+		WEB_SOCKET_SCHEDULER_ENTRY* Next();
+	public:
+		// Set up the classes, pfnDispatch is called with pContext to handle each message, returns false if the options are invalid
+		bool Initialize(const IIS_WEB_SOCKET_SCHEDULER_OPTIONS* pOptions, PFN_IIS_WEB_SOCKET_SCHEDULER_DISPATCH pfnDispatch, void* pContext);
+		// Add a connection in a class, the entry must not be registered already, returns false if the class doesn't exist
+		bool Register(WEB_SOCKET_SCHEDULER_ENTRY* pEntry, void* pConnection, unsigned int classIndex);
+		// Tell the scheduler the connection has messages waiting, call it after queuing them
+		void SetReady(WEB_SOCKET_SCHEDULER_ENTRY* pEntry);
+		// Remove a connection, waits for its turn to end, nothing is called for it once this returns
+		// Not from the dispatch callback of the same connection
+		void Remove(WEB_SOCKET_SCHEDULER_ENTRY* pEntry);
+		// Give the next connection its turn, returns false when none is waiting, or when stopped
+		// With bWait, waits for a connection until Stop
+		bool RunTurn(bool bWait);
+		// Give turns until Stop, for a worker thread
+		void Run();
+		// Wake the worker threads and make RunTurn return false
+		void Stop();
+		// Get what the scheduler did
+		void GetStats(IIS_WEB_SOCKET_SCHEDULER_STATS* pStats);
+		// Free resources, every connection must be removed and no worker thread may be running
+		void Free();
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_SCHEDULER_H
@@ -0,0 +1,504 @@
+
+//
+// iiswebsocketsession.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Resumable sessions with a bounded log of the messages sent to each.
+//
+
+#include "iiswebsocketsession.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <thread>
+
+using namespace IISWebSocketServer;
+
+// The session slots start after the header
+#define IIS_WEB_SOCKET_SESSION_HEADER_SIZE 0x40
+
+// Records in the log are 16 byte aligned
+#define IIS_WEB_SOCKET_SESSION_ALIGN(length) (((length) + 15) & ~15ULL)
+
+static_assert(sizeof(WEB_SOCKET_SESSION_HEADER) <= IIS_WEB_SOCKET_SESSION_HEADER_SIZE, "The session header doesn't fit");
+
+// A message in the log, the payload follows it
+struct WEB_SOCKET_SESSION_RECORD
+{
+	// 0 for padding at the end of the log
+	unsigned long long qwSequence;
+	// The length of the record and payload, the next record starts at the length aligned to 16 bytes
+	unsigned int Length;
+	unsigned int BufferType;
+};
+
+static_assert(sizeof(WEB_SOCKET_SESSION_RECORD) == 16, "A session record must be 16 bytes");
+
+// Milliseconds on the monotonic clock, which is the same in every process
+static unsigned long long SessionTimestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Parse hex digits, returns false if a character isn't a hex digit
+static bool ParseHex(const char* pText, size_t length, unsigned char* pBytes)
+{
+	unsigned char nibble;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		if ((pText[i] >= '0') && (pText[i] <= '9')) {
+			nibble = (unsigned char)(pText[i] - '0');
+		}
+		else if ((pText[i] >= 'a') && (pText[i] <= 'f')) {
+			nibble = (unsigned char)(pText[i] - 'a' + 10);
+		}
+		else if ((pText[i] >= 'A') && (pText[i] <= 'F')) {
+			nibble = (unsigned char)(pText[i] - 'A' + 10);
+		}
+		else {
+			return false;
+		}
+		if ((i & 1) == 0) {
+			pBytes[i / 2] = (unsigned char)(nibble << 4);
+		}
+		else {
+			pBytes[i / 2] |= nibble;
+		}
+	}
+
+	return true;
+}
+
+bool IISWebSocketServer::NextSessionReplayMessage(WEB_SOCKET_SESSION_REPLAY* pReplay, WEB_SOCKET_SESSION_MESSAGE* pMessage)
+{
+	WEB_SOCKET_SESSION_RECORD record;
+
+	if (pReplay->qwOffset + sizeof(record) > pReplay->qwLength) {
+		return false;
+	}
+
+	memcpy(&record, pReplay->pRecords + pReplay->qwOffset, sizeof(record));
+	pMessage->qwSequence = record.qwSequence;
+	pMessage->BufferType = (IIS_WEB_SOCKET_BUFFER_TYPE)record.BufferType;
+	pMessage->pData = pReplay->pRecords + pReplay->qwOffset + sizeof(record);
+	pMessage->qwLength = record.Length - sizeof(record);
+	pReplay->qwOffset += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length);
+
+	return true;
+}
+
+void IISWebSocketServer::FreeSessionReplay(WEB_SOCKET_SESSION_REPLAY* pReplay)
+{
+	free(pReplay->pRecords);
+	memset(pReplay, 0, sizeof(*pReplay));
+}
+
+WEB_SOCKET_SESSION_SLOT* WebSocketSessions::GetSlot(unsigned int slot)
+{
+	return (WEB_SOCKET_SESSION_SLOT*)(this->pSlots + slot * this->pHeader->qwSlotSize);
+}
+
+unsigned char* WebSocketSessions::GetLog(unsigned int slot)
+{
+	return this->pSlots + slot * this->pHeader->qwSlotSize + IIS_WEB_SOCKET_SESSION_ALIGN(sizeof(WEB_SOCKET_SESSION_SLOT));
+}
+
+void WebSocketSessions::LockSlot(WEB_SOCKET_SESSION_SLOT* pSlot)
+{
+	unsigned long processId = this->ProcessId;
+	unsigned long owner;
+
+	for (unsigned long long spin = 1; ; spin++)
+	{
+		owner = 0;
+		if (pSlot->Lock.compare_exchange_weak(owner, processId, std::memory_order_acquire)) {
+			break;
+		}
+		if ((spin % 0x10000) == 0) {
+			if ((owner != 0) && (!IsBusProcessAlive(owner)) &&
+				(pSlot->Lock.compare_exchange_strong(owner, processId, std::memory_order_acquire))) {
+				break;
+			}
+		}
+		if ((spin % 0x40) == 0) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void WebSocketSessions::UnlockSlot(WEB_SOCKET_SESSION_SLOT* pSlot)
+{
+	pSlot->Lock.store(0, std::memory_order_release);
+}
+
+void WebSocketSessions::MakeRoom(unsigned int slot, unsigned long long qwLength)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot = this->GetSlot(slot);
+	unsigned char* pLog = this->GetLog(slot);
+	unsigned long long qwCapacity = this->pHeader->qwLogCapacity;
+	WEB_SOCKET_SESSION_RECORD record;
+
+	while (pSlot->qwWritePosition + qwLength - pSlot->qwReadPosition > qwCapacity)
+	{
+		memcpy(&record, pLog + (pSlot->qwReadPosition % qwCapacity), sizeof(record));
+		pSlot->qwReadPosition += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length);
+		if (record.qwSequence != 0) {
+			pSlot->qwFirstSequence = record.qwSequence + 1;
+		}
+	}
+}
+
+void WebSocketSessions::Attach(unsigned int slot, WEB_SOCKET_SESSION* pSession)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot = this->GetSlot(slot);
+
+	pSlot->State = IIS_WEB_SOCKET_SESSION_ATTACHED;
+	pSlot->Generation++;
+	pSlot->ProcessId = this->ProcessId;
+
+	pSession->Slot = slot;
+	pSession->Generation = pSlot->Generation;
+	snprintf(pSession->Token, sizeof(pSession->Token), "%08x", slot);
+	for (int i = 0; i < 12; i++) {
+		snprintf(pSession->Token + 8 + i * 2, 3, "%02x", pSlot->Secret[i]);
+	}
+}
+
+bool WebSocketSessions::Open(const char* pName, unsigned int sessionCount, unsigned long long qwLogCapacity, unsigned long dwTimeout)
+{
+	bool bCreated;
+	unsigned long long qwSlotSize;
+
+	this->pHeader = NULL;
+	this->pSlots = NULL;
+	this->ProcessId = GetBusProcessId();
+	this->dwTimeout = (dwTimeout != 0) ? dwTimeout : IIS_WEB_SOCKET_SESSION_DEFAULT_TIMEOUT;
+
+	if (qwLogCapacity == 0) {
+		qwLogCapacity = IIS_WEB_SOCKET_SESSION_DEFAULT_LOG_CAPACITY;
+	}
+	qwLogCapacity &= ~15ULL;
+	if (qwLogCapacity < 0x1000) {
+		qwLogCapacity = 0x1000;
+	}
+	if ((sessionCount == 0) || (sessionCount >= IIS_WEB_SOCKET_NO_SESSION)) {
+		return false;
+	}
+	qwSlotSize = IIS_WEB_SOCKET_SESSION_ALIGN(sizeof(WEB_SOCKET_SESSION_SLOT)) + qwLogCapacity;
+
+	if (!OpenSharedMemory(&this->Memory, pName, (size_t)(IIS_WEB_SOCKET_SESSION_HEADER_SIZE + qwSlotSize * sessionCount), &bCreated)) {
+		return false;
+	}
+	this->pHeader = (WEB_SOCKET_SESSION_HEADER*)this->Memory.pView;
+
+	// New shared memory is zeroed, every slot starts free
+	if (bCreated)
+	{
+		this->pHeader->Version = IIS_WEB_SOCKET_SESSION_VERSION;
+		this->pHeader->SessionCount = sessionCount;
+		this->pHeader->qwLogCapacity = qwLogCapacity;
+		this->pHeader->qwSlotSize = qwSlotSize;
+		this->pHeader->Magic.store(IIS_WEB_SOCKET_SESSION_MAGIC, std::memory_order_release);
+	}
+	else
+	{
+		for (int i = 0; this->pHeader->Magic.load(std::memory_order_acquire) != IIS_WEB_SOCKET_SESSION_MAGIC; i++)
+		{
+			if (i == 1000) {
+				this->Close();
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if ((this->pHeader->Version != IIS_WEB_SOCKET_SESSION_VERSION) ||
+			(this->pHeader->qwSlotSize != IIS_WEB_SOCKET_SESSION_ALIGN(sizeof(WEB_SOCKET_SESSION_SLOT)) + this->pHeader->qwLogCapacity) ||
+			(IIS_WEB_SOCKET_SESSION_HEADER_SIZE + this->pHeader->qwSlotSize * this->pHeader->SessionCount > this->Memory.Size)) {
+			this->Close();
+			return false;
+		}
+	}
+	this->pSlots = (unsigned char*)this->Memory.pView + IIS_WEB_SOCKET_SESSION_HEADER_SIZE;
+
+	return true;
+}
+
+bool WebSocketSessions::Create(WEB_SOCKET_SESSION* pSession)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+	unsigned int sessionCount = this->pHeader->SessionCount;
+	unsigned int start = this->pHeader->NextSlot.fetch_add(1, std::memory_order_relaxed);
+	unsigned long long qwNow = SessionTimestamp();
+	unsigned long processId = this->ProcessId;
+	bool bFree;
+
+	pSession->Slot = IIS_WEB_SOCKET_NO_SESSION;
+
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		unsigned int slot = (start + i) % sessionCount;
+		pSlot = this->GetSlot(slot);
+		this->LockSlot(pSlot);
+
+		// The sessions of a process that exited are kept like any other detached session
+		if ((pSlot->State == IIS_WEB_SOCKET_SESSION_ATTACHED) && (pSlot->ProcessId != processId) && (!IsBusProcessAlive(pSlot->ProcessId))) {
+			pSlot->State = IIS_WEB_SOCKET_SESSION_DETACHED;
+			pSlot->qwDetachedAt = qwNow;
+		}
+		bFree = (pSlot->State == IIS_WEB_SOCKET_SESSION_FREE) ||
+			((pSlot->State == IIS_WEB_SOCKET_SESSION_DETACHED) && (qwNow - pSlot->qwDetachedAt >= this->dwTimeout));
+
+		if (bFree)
+		{
+			// The secret is the client's proof that it owns the session, so it comes from the OS entropy source
+			std::random_device device;
+			for (int j = 0; j < 12; j += 4) {
+				unsigned int value = device();
+				memcpy(pSlot->Secret + j, &value, 4);
+			}
+			pSlot->qwReadPosition = 0;
+			pSlot->qwWritePosition = 0;
+			pSlot->qwNextSequence = 1;
+			pSlot->qwFirstSequence = 1;
+			this->Attach(slot, pSession);
+			this->UnlockSlot(pSlot);
+
+			pSession->qwFirstSequence = 1;
+			pSession->bResumed = false;
+			return true;
+		}
+
+		this->UnlockSlot(pSlot);
+	}
+
+	return false;
+}
+
+bool WebSocketSessions::Resume(const char* pToken, size_t tokenLength, unsigned long long qwLastSequence, WEB_SOCKET_SESSION* pSession, WEB_SOCKET_SESSION_REPLAY* pReplay)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+	WEB_SOCKET_SESSION_RECORD record;
+	unsigned char slotBytes[4];
+	unsigned char secret[12];
+	unsigned char difference;
+	unsigned int slot;
+	unsigned char* pLog;
+	unsigned long long qwCapacity = this->pHeader->qwLogCapacity;
+	unsigned long long qwPosition;
+	unsigned long long qwLength;
+	bool bValid;
+
+	pSession->Slot = IIS_WEB_SOCKET_NO_SESSION;
+	memset(pReplay, 0, sizeof(*pReplay));
+
+	if ((tokenLength != IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH) || (!ParseHex(pToken, 8, slotBytes)) || (!ParseHex(pToken + 8, 24, secret))) {
+		return false;
+	}
+	slot = ((unsigned int)slotBytes[0] << 24) | ((unsigned int)slotBytes[1] << 16) | ((unsigned int)slotBytes[2] << 8) | slotBytes[3];
+	if (slot >= this->pHeader->SessionCount) {
+		return false;
+	}
+
+	pSlot = this->GetSlot(slot);
+	pLog = this->GetLog(slot);
+	this->LockSlot(pSlot);
+
+	// Compare every byte of the secret, so the time taken doesn't tell how much of it was right
+	difference = 0;
+	for (int i = 0; i < 12; i++) {
+		difference |= (unsigned char)(pSlot->Secret[i] ^ secret[i]);
+	}
+	bValid = (difference == 0) && (pSlot->State != IIS_WEB_SOCKET_SESSION_FREE) &&
+		((pSlot->State != IIS_WEB_SOCKET_SESSION_DETACHED) || (SessionTimestamp() - pSlot->qwDetachedAt < this->dwTimeout));
+	if (!bValid) {
+		this->UnlockSlot(pSlot);
+		return false;
+	}
+
+	// The message after the last one received must still be in the log, the client can't be ahead
+	if ((qwLastSequence + 1 < pSlot->qwFirstSequence) || (qwLastSequence >= pSlot->qwNextSequence)) {
+		pSlot->State = IIS_WEB_SOCKET_SESSION_FREE;
+		this->UnlockSlot(pSlot);
+		return false;
+	}
+
+	// Copy out the messages after the last one received, the padding is left behind
+	qwLength = 0;
+	for (qwPosition = pSlot->qwReadPosition; qwPosition < pSlot->qwWritePosition; qwPosition += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length))
+	{
+		memcpy(&record, pLog + (qwPosition % qwCapacity), sizeof(record));
+		if (record.qwSequence > qwLastSequence) {
+			qwLength += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length);
+		}
+	}
+	if (qwLength != 0)
+	{
+		pReplay->pRecords = (unsigned char*)malloc((size_t)qwLength);
+		if (pReplay->pRecords == NULL) {
+			this->UnlockSlot(pSlot);
+			return false;
+		}
+		for (qwPosition = pSlot->qwReadPosition; qwPosition < pSlot->qwWritePosition; qwPosition += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length))
+		{
+			memcpy(&record, pLog + (qwPosition % qwCapacity), sizeof(record));
+			if (record.qwSequence > qwLastSequence) {
+				memcpy(pReplay->pRecords + pReplay->qwLength, pLog + (qwPosition % qwCapacity), record.Length);
+				pReplay->qwLength += IIS_WEB_SOCKET_SESSION_ALIGN(record.Length);
+			}
+		}
+	}
+
+	// A connection that still has the session attached can no longer add to it
+	this->Attach(slot, pSession);
+	this->UnlockSlot(pSlot);
+
+	pSession->qwFirstSequence = qwLastSequence + 1;
+	pSession->bResumed = true;
+
+	return true;
+}
+
+unsigned long long WebSocketSessions::Append(WEB_SOCKET_SESSION* pSession, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+	WEB_SOCKET_SESSION_RECORD record;
+	unsigned char* pLog;
+	unsigned long long qwCapacity = this->pHeader->qwLogCapacity;
+	unsigned long long qwRecordLength;
+	unsigned long long qwOffset;
+	unsigned long long qwPadding;
+	unsigned long long qwSequence;
+
+	if (pSession->Slot == IIS_WEB_SOCKET_NO_SESSION) {
+		return 0;
+	}
+	pSlot = this->GetSlot(pSession->Slot);
+	pLog = this->GetLog(pSession->Slot);
+	qwRecordLength = IIS_WEB_SOCKET_SESSION_ALIGN(sizeof(record) + prefixLength + qwLength);
+
+	this->LockSlot(pSlot);
+
+	if ((pSlot->Generation != pSession->Generation) || (pSlot->State != IIS_WEB_SOCKET_SESSION_ATTACHED)) {
+		this->UnlockSlot(pSlot);
+		return 0;
+	}
+	qwSequence = pSlot->qwNextSequence++;
+
+	// A message larger than the log can't be replayed, nor can anything before it
+	if (qwRecordLength > qwCapacity)
+	{
+		pSlot->qwReadPosition = pSlot->qwWritePosition;
+		pSlot->qwFirstSequence = pSlot->qwNextSequence;
+		this->UnlockSlot(pSlot);
+		return qwSequence;
+	}
+
+	// A record doesn't wrap, the end of the log is padded when it doesn't fit
+	qwOffset = pSlot->qwWritePosition % qwCapacity;
+	qwPadding = (qwOffset + qwRecordLength > qwCapacity) ? qwCapacity - qwOffset : 0;
+	this->MakeRoom(pSession->Slot, qwPadding + qwRecordLength);
+	if (qwPadding != 0)
+	{
+		record.qwSequence = 0;
+		record.Length = (unsigned int)qwPadding;
+		record.BufferType = 0;
+		memcpy(pLog + qwOffset, &record, sizeof(record));
+		pSlot->qwWritePosition += qwPadding;
+		qwOffset = 0;
+	}
+
+	record.qwSequence = qwSequence;
+	record.Length = (unsigned int)(sizeof(record) + prefixLength + qwLength);
+	record.BufferType = (unsigned int)bufferType;
+	memcpy(pLog + qwOffset, &record, sizeof(record));
+	if (prefixLength != 0) {
+		memcpy(pLog + qwOffset + sizeof(record), pPrefix, prefixLength);
+	}
+	if (qwLength != 0) {
+		memcpy(pLog + qwOffset + sizeof(record) + prefixLength, pData, (size_t)qwLength);
+	}
+	pSlot->qwWritePosition += qwRecordLength;
+
+	this->UnlockSlot(pSlot);
+
+	return qwSequence;
+}
+
+unsigned long long WebSocketSessions::Skip(WEB_SOCKET_SESSION* pSession)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+	unsigned long long qwSequence;
+
+	if (pSession->Slot == IIS_WEB_SOCKET_NO_SESSION) {
+		return 0;
+	}
+	pSlot = this->GetSlot(pSession->Slot);
+
+	this->LockSlot(pSlot);
+	if ((pSlot->Generation != pSession->Generation) || (pSlot->State != IIS_WEB_SOCKET_SESSION_ATTACHED)) {
+		this->UnlockSlot(pSlot);
+		return 0;
+	}
+	qwSequence = pSlot->qwNextSequence++;
+	pSlot->qwReadPosition = pSlot->qwWritePosition;
+	pSlot->qwFirstSequence = pSlot->qwNextSequence;
+	this->UnlockSlot(pSlot);
+
+	return qwSequence;
+}
+
+void WebSocketSessions::Detach(WEB_SOCKET_SESSION* pSession)
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+
+	if (pSession->Slot == IIS_WEB_SOCKET_NO_SESSION) {
+		return;
+	}
+	pSlot = this->GetSlot(pSession->Slot);
+
+	this->LockSlot(pSlot);
+	if ((pSlot->Generation == pSession->Generation) && (pSlot->State == IIS_WEB_SOCKET_SESSION_ATTACHED)) {
+		pSlot->State = IIS_WEB_SOCKET_SESSION_DETACHED;
+		pSlot->qwDetachedAt = SessionTimestamp();
+	}
+	this->UnlockSlot(pSlot);
+
+	pSession->Slot = IIS_WEB_SOCKET_NO_SESSION;
+}
+
+unsigned int WebSocketSessions::GetSessionCount()
+{
+	WEB_SOCKET_SESSION_SLOT* pSlot;
+	unsigned long long qwNow = SessionTimestamp();
+	unsigned int count = 0;
+
+	// Detached sessions past the timeout are free, they're reused by Create
+	for (unsigned int i = 0; i < this->pHeader->SessionCount; i++)
+	{
+		pSlot = this->GetSlot(i);
+		this->LockSlot(pSlot);
+		if ((pSlot->State == IIS_WEB_SOCKET_SESSION_ATTACHED) ||
+			((pSlot->State == IIS_WEB_SOCKET_SESSION_DETACHED) && (qwNow - pSlot->qwDetachedAt < this->dwTimeout))) {
+			count++;
+		}
+		this->UnlockSlot(pSlot);
+	}
+
+	return count;
+}
+
+void WebSocketSessions::Close()
+{
+	if (this->pHeader != NULL) {
+		CloseSharedMemory(&this->Memory);
+	}
+	this->pHeader = NULL;
+	this->pSlots = NULL;
+}
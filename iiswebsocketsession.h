@@ -0,0 +1,172 @@
+
+//
+// iiswebsocketsession.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Resumable sessions, a client that reconnects gets the messages it missed instead of starting over.
+//     The messages sent to each session are numbered and kept in a bounded log in shared memory, so a session
+//     outlives its connection and can be resumed by any worker process, including the one that replaces a recycled worker.
+//     Like the bus, this builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_SESSION_H
+#define IIS_WEB_SOCKET_SESSION_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketbus.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+#define IIS_WEB_SOCKET_SESSION_MAGIC 0x53534553
+#define IIS_WEB_SOCKET_SESSION_VERSION 1
+
+	// The request and response headers of a resumable session
+	// The client sends the token and the sequence of the last message it received, the server answers
+	// with the token of the session and the sequence of the first message it sends on the connection
+#define IIS_WEB_SOCKET_SESSION_HEADER "Sec-WebSocket-Session"
+#define IIS_WEB_SOCKET_SESSION_SEQUENCE_HEADER "Sec-WebSocket-Session-Sequence"
+
+	// A token is the slot in 8 hex digits followed by a 12 byte secret in 24 hex digits
+#define IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH 32
+
+	// The log capacity and detached session lifetime used when Open is given 0
+#define IIS_WEB_SOCKET_SESSION_DEFAULT_LOG_CAPACITY 0x10000
+#define IIS_WEB_SOCKET_SESSION_DEFAULT_TIMEOUT 60000
+
+	// The slot of a WEB_SOCKET_SESSION without a session
+#define IIS_WEB_SOCKET_NO_SESSION 0xFFFFFFFF
+
+	// The state of a session slot
+#define IIS_WEB_SOCKET_SESSION_FREE 0
+#define IIS_WEB_SOCKET_SESSION_ATTACHED 1
+#define IIS_WEB_SOCKET_SESSION_DETACHED 2
+
+	// A session in shared memory, its log follows it
+	struct WEB_SOCKET_SESSION_SLOT
+	{
+		// The id of the process using the slot, 0 when no one is
+		std::atomic<unsigned long> Lock;
+		unsigned int State;
+		// Incremented when a connection attaches, the connection it replaced can no longer add to the log
+		unsigned int Generation;
+		// The process of the attached connection
+		unsigned long ProcessId;
+		unsigned char Secret[12];
+		// When the connection detached, in milliseconds of the monotonic clock
+		unsigned long long qwDetachedAt;
+		// The sequence of the oldest message in the log, qwNextSequence when the log is empty
+		unsigned long long qwFirstSequence;
+		// The sequence the next message gets, the first message is 1
+		unsigned long long qwNextSequence;
+		// The total number of bytes ever removed from and written to the log
+		unsigned long long qwReadPosition;
+		unsigned long long qwWritePosition;
+	};
+
+	// The start of the shared memory, the session slots follow it
+	struct WEB_SOCKET_SESSION_HEADER
+	{
+		// Set last by the process that created the sessions
+		std::atomic<unsigned int> Magic;
+		unsigned int Version;
+		unsigned int SessionCount;
+		// Where Create starts looking for a free slot
+		std::atomic<unsigned int> NextSlot;
+		// Bytes in each log, and in each slot with its log
+		unsigned long long qwLogCapacity;
+		unsigned long long qwSlotSize;
+	};
+
+	// The session of a connection
+	struct WEB_SOCKET_SESSION
+	{
+		// IIS_WEB_SOCKET_NO_SESSION when the connection has no session
+		unsigned int Slot;
+		unsigned int Generation;
+		// NULL terminated, sent to the client in the IIS_WEB_SOCKET_SESSION_HEADER header
+		char Token[IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH + 1];
+		// The sequence of the first message sent on this connection, replayed messages included
+		unsigned long long qwFirstSequence;
+		// Set when an existing session was resumed
+		bool bResumed;
+	};
+
+	// A message read from a replay
+	struct WEB_SOCKET_SESSION_MESSAGE
+	{
+		unsigned long long qwSequence;
+		IIS_WEB_SOCKET_BUFFER_TYPE BufferType;
+		const void* pData;
+		unsigned long long qwLength;
+	};
+
+	// The messages a resumed session missed, copied out of the log
+	struct WEB_SOCKET_SESSION_REPLAY
+	{
+		unsigned char* pRecords;
+		unsigned long long qwLength;
+		unsigned long long qwOffset;
+	};
+
+	// Get the next message of a replay, returns false after the last one
+	bool NextSessionReplayMessage(WEB_SOCKET_SESSION_REPLAY* pReplay, WEB_SOCKET_SESSION_MESSAGE* pMessage);
+
+	// Free the messages of a replay
+	void FreeSessionReplay(WEB_SOCKET_SESSION_REPLAY* pReplay);
+
+	// Resumable sessions shared by the worker processes
+	class WebSocketSessions
+	{
+	private:
+		WEB_SOCKET_SHARED_MEMORY Memory;
+		WEB_SOCKET_SESSION_HEADER* pHeader;
+		unsigned char* pSlots;
+		// Milliseconds a detached session is kept
+		unsigned long dwTimeout;
+		// The id of this process, taken by Open
+		unsigned long ProcessId;
+		// Get a slot and its log
+		WEB_SOCKET_SESSION_SLOT* GetSlot(unsigned int slot);
+		unsigned char* GetLog(unsigned int slot);
+		// Lock a slot, the lock of a process that died while holding it is taken over
+		void LockSlot(WEB_SOCKET_SESSION_SLOT* pSlot);
+		void UnlockSlot(WEB_SOCKET_SESSION_SLOT* pSlot);
+		// Remove the oldest messages until qwLength more bytes fit in the log
+		void MakeRoom(unsigned int slot, unsigned long long qwLength);
+		// Attach a connection to a locked slot
+		void Attach(unsigned int slot, WEB_SOCKET_SESSION* pSession);
+	public:
+		// Create or open the sessions, sessionCount and qwLogCapacity are used when they're created
+		// qwLogCapacity is the bytes of messages kept for each session (0 = 64 KB), dwTimeout is how long
+		// a session is kept after its connection ends in milliseconds (0 = 60 seconds)
+		bool Open(const char* pName, unsigned int sessionCount, unsigned long long qwLogCapacity, unsigned long dwTimeout);
+		// Start a new session, returns false if every session is in use
+		bool Create(WEB_SOCKET_SESSION* pSession);
+		// Resume a session from the message after qwLastSequence, pReplay receives the messages the client missed
+		// Returns false if the token isn't valid or the messages after qwLastSequence are no longer in the log
+		bool Resume(const char* pToken, size_t tokenLength, unsigned long long qwLastSequence, WEB_SOCKET_SESSION* pSession, WEB_SOCKET_SESSION_REPLAY* pReplay);
+		// Add a sent message to the log, the payload is the prefix followed by pData
+		// Returns the sequence of the message, 0 if the connection was replaced by one that resumed the session
+		// A message larger than the log takes a sequence but empties the log, the session can't be resumed from before it
+		unsigned long long Append(WEB_SOCKET_SESSION* pSession, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+			const void* pPrefix, unsigned int prefixLength, const void* pData, unsigned long long qwLength);
+		// Count a message that wasn't added to the log, the log is emptied
+		unsigned long long Skip(WEB_SOCKET_SESSION* pSession);
+		// End the connection of a session, the session is kept for the timeout given to Open
+		void Detach(WEB_SOCKET_SESSION* pSession);
+		// Get the number of attached and detached sessions
+		unsigned int GetSessionCount();
+		// Unmap the sessions
+		void Close();
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_SESSION_H
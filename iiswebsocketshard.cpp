@@ -0,0 +1,322 @@
+
+//
+// iiswebsocketshard.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Thread pinning, NUMA-local buffer pools and single producer single consumer rings.
+//
+
+#include "iiswebsocketshard.h"
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace IISWebSocketServer;
+
+//
+// Processors
+//
+
+#ifdef _WIN32
+
+unsigned int IISWebSocketServer::GetShardProcessorCount()
+{
+	DWORD_PTR processMask;
+	DWORD_PTR systemMask;
+	unsigned int count = 0;
+
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		return 1;
+	}
+	for (; processMask != 0; processMask &= processMask - 1) {
+		count++;
+	}
+
+	return (count != 0) ? count : 1;
+}
+
+bool IISWebSocketServer::PinShardThread(unsigned int index)
+{
+	DWORD_PTR processMask;
+	DWORD_PTR systemMask;
+	DWORD_PTR mask;
+
+	// The index'th bit of the process's processor group
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		return false;
+	}
+	for (mask = processMask; (mask != 0) && (index != 0); index--) {
+		mask &= mask - 1;
+	}
+	if (mask == 0) {
+		return false;
+	}
+
+	return SetThreadAffinityMask(GetCurrentThread(), mask & (~mask + 1)) != 0;
+}
+
+#else
+
+unsigned int IISWebSocketServer::GetShardProcessorCount()
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		return (unsigned int)CPU_COUNT(&set);
+	}
+#endif
+
+	unsigned int count = std::thread::hardware_concurrency();
+	return (count != 0) ? count : 1;
+}
+
+bool IISWebSocketServer::PinShardThread(unsigned int index)
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	cpu_set_t set;
+
+	// The index'th processor the process may run on, a container may not start at processor 0
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return false;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+		if (index-- == 0)
+		{
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+		}
+	}
+#else
+	(void)index;
+#endif
+
+	return false;
+}
+
+#endif
+
+//
+// Buffer pools
+//
+
+bool IISWebSocketServer::CreateBufferPool(WEB_SOCKET_BUFFER_POOL* pPool, unsigned long bufferSize, unsigned long bufferCount, bool bHugePages)
+{
+	unsigned char* pBuffer;
+
+	memset(pPool, 0, sizeof(WEB_SOCKET_BUFFER_POOL));
+
+	// Buffers hold the free list link, and are cache line aligned so two threads never share a line
+	bufferSize = (bufferSize + IIS_WEB_SOCKET_CACHE_LINE - 1) & ~(unsigned long)(IIS_WEB_SOCKET_CACHE_LINE - 1);
+	if ((bufferSize == 0) || (bufferCount == 0)) {
+		return false;
+	}
+	pPool->Size = (size_t)bufferSize * bufferCount;
+
+#ifdef _WIN32
+	PROCESSOR_NUMBER processor;
+	USHORT node = 0;
+	SIZE_T largePage;
+
+	// Allocate on the node of the processor the thread runs on, with large pages if the account may lock memory
+	GetCurrentProcessorNumberEx(&processor);
+	GetNumaProcessorNodeEx(&processor, &node);
+	largePage = GetLargePageMinimum();
+	if ((bHugePages) && (largePage != 0))
+	{
+		pPool->pMemory = VirtualAllocExNuma(GetCurrentProcess(), NULL, (pPool->Size + largePage - 1) & ~(largePage - 1),
+			MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+		pPool->bHugePages = (pPool->pMemory != NULL);
+	}
+	if (pPool->pMemory == NULL) {
+		pPool->pMemory = VirtualAllocExNuma(GetCurrentProcess(), NULL, pPool->Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+	}
+	if (pPool->pMemory == NULL) {
+		return false;
+	}
+#else
+	void* pMemory = MAP_FAILED;
+
+	// Reserved huge pages first, then transparent huge pages, the first touch below places the pages on this thread's node
+#ifdef MAP_HUGETLB
+	if (bHugePages)
+	{
+		pMemory = mmap(NULL, (pPool->Size + 0x1FFFFF) & ~(size_t)0x1FFFFF, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		pPool->bHugePages = (pMemory != MAP_FAILED);
+		if (pPool->bHugePages) {
+			pPool->Size = (pPool->Size + 0x1FFFFF) & ~(size_t)0x1FFFFF;
+		}
+	}
+#endif
+	if (pMemory == MAP_FAILED)
+	{
+		pMemory = mmap(NULL, pPool->Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pMemory == MAP_FAILED) {
+			return false;
+		}
+#ifdef MADV_HUGEPAGE
+		if (bHugePages) {
+			madvise(pMemory, pPool->Size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	pPool->pMemory = pMemory;
+#endif
+
+	// The whole pool is charged to the global account, whether its buffers are in use or not
+	if (!ChargeMemory(NULL, pPool->Size))
+	{
+#ifdef _WIN32
+		VirtualFree(pPool->pMemory, 0, MEM_RELEASE);
+#else
+		munmap(pPool->pMemory, pPool->Size);
+#endif
+		memset(pPool, 0, sizeof(WEB_SOCKET_BUFFER_POOL));
+		return false;
+	}
+
+	// Link every buffer into the free list, which touches each one from this thread
+	pPool->BufferSize = bufferSize;
+	pPool->BufferCount = bufferCount;
+	pPool->FreeCount = bufferCount;
+	pPool->pFree = NULL;
+	for (unsigned long i = bufferCount; i != 0; i--)
+	{
+		pBuffer = (unsigned char*)pPool->pMemory + (size_t)(i - 1) * bufferSize;
+		*(void**)pBuffer = pPool->pFree;
+		pPool->pFree = pBuffer;
+	}
+
+	return true;
+}
+
+void* IISWebSocketServer::AllocatePoolBuffer(WEB_SOCKET_BUFFER_POOL* pPool)
+{
+	void* pBuffer = pPool->pFree;
+
+	if (pBuffer != NULL) {
+		pPool->pFree = *(void**)pBuffer;
+		pPool->FreeCount--;
+	}
+
+	return pBuffer;
+}
+
+void IISWebSocketServer::FreePoolBuffer(WEB_SOCKET_BUFFER_POOL* pPool, void* pBuffer)
+{
+	*(void**)pBuffer = pPool->pFree;
+	pPool->pFree = pBuffer;
+	pPool->FreeCount++;
+}
+
+bool IISWebSocketServer::IsPoolBuffer(const WEB_SOCKET_BUFFER_POOL* pPool, const void* pBuffer)
+{
+	return (pPool->pMemory != NULL) && ((const unsigned char*)pBuffer >= (const unsigned char*)pPool->pMemory) &&
+		((const unsigned char*)pBuffer < (const unsigned char*)pPool->pMemory + (size_t)pPool->BufferSize * pPool->BufferCount);
+}
+
+void IISWebSocketServer::DestroyBufferPool(WEB_SOCKET_BUFFER_POOL* pPool)
+{
+	if (pPool->pMemory != NULL)
+	{
+#ifdef _WIN32
+		VirtualFree(pPool->pMemory, 0, MEM_RELEASE);
+#else
+		munmap(pPool->pMemory, pPool->Size);
+#endif
+		ReleaseMemory(NULL, pPool->Size);
+	}
+	memset(pPool, 0, sizeof(WEB_SOCKET_BUFFER_POOL));
+}
+
+//
+// Rings
+//
+
+bool IISWebSocketServer::CreateSpscRing(WEB_SOCKET_SPSC_RING* pRing, unsigned long capacity)
+{
+	unsigned long long qwCapacity = 2;
+
+	while (qwCapacity < capacity) {
+		qwCapacity *= 2;
+	}
+
+	pRing->pEntries = (void**)malloc((size_t)qwCapacity * sizeof(void*));
+	pRing->qwMask = qwCapacity - 1;
+	pRing->qwHead.store(0);
+	pRing->qwTail.store(0);
+	pRing->qwCachedHead = 0;
+	pRing->qwCachedTail = 0;
+
+	return (pRing->pEntries != NULL);
+}
+
+bool IISWebSocketServer::PushSpscRing(WEB_SOCKET_SPSC_RING* pRing, void* pEntry)
+{
+	unsigned long long qwTail = pRing->qwTail.load(std::memory_order_relaxed);
+
+	// Only read the consumer's end when the ring looks full
+	if (qwTail - pRing->qwCachedHead > pRing->qwMask)
+	{
+		pRing->qwCachedHead = pRing->qwHead.load(std::memory_order_acquire);
+		if (qwTail - pRing->qwCachedHead > pRing->qwMask) {
+			return false;
+		}
+	}
+
+	pRing->pEntries[qwTail & pRing->qwMask] = pEntry;
+	pRing->qwTail.store(qwTail + 1, std::memory_order_release);
+
+	return true;
+}
+
+bool IISWebSocketServer::PopSpscRing(WEB_SOCKET_SPSC_RING* pRing, void** ppEntry)
+{
+	unsigned long long qwHead = pRing->qwHead.load(std::memory_order_relaxed);
+
+	// Only read the producer's end when the ring looks empty
+	if (qwHead == pRing->qwCachedTail)
+	{
+		pRing->qwCachedTail = pRing->qwTail.load(std::memory_order_acquire);
+		if (qwHead == pRing->qwCachedTail) {
+			return false;
+		}
+	}
+
+	*ppEntry = pRing->pEntries[qwHead & pRing->qwMask];
+	pRing->qwHead.store(qwHead + 1, std::memory_order_release);
+
+	return true;
+}
+
+bool IISWebSocketServer::IsSpscRingEmpty(WEB_SOCKET_SPSC_RING* pRing)
+{
+	return pRing->qwHead.load(std::memory_order_acquire) == pRing->qwTail.load(std::memory_order_acquire);
+}
+
+void IISWebSocketServer::DestroySpscRing(WEB_SOCKET_SPSC_RING* pRing)
+{
+	if (pRing->pEntries != NULL) {
+		free(pRing->pEntries);
+		pRing->pEntries = NULL;
+	}
+}
@@ -0,0 +1,94 @@
+
+//
+// iiswebsocketshard.h
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     The building blocks of a thread per core, pinning a thread to a processor, a pool of buffers allocated on the
+//     NUMA node of the thread that owns it, and a single producer single consumer ring between two threads.
+//     The sharded mode of WebSocketExecutor is built from them. Like the bus, this builds on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_SHARD_H
+#define IIS_WEB_SOCKET_SHARD_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "iiswebsocketframe.h"
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// Get the number of processors the process may run on
+	unsigned int GetShardProcessorCount();
+
+	// Pin the calling thread to the index'th processor the process may run on, returns false if it can't be pinned
+	bool PinShardThread(unsigned int index);
+
+	// A pool of equally sized buffers, only the thread that created it may allocate and free
+	struct WEB_SOCKET_BUFFER_POOL
+	{
+		// The memory of every buffer, and its size
+		void* pMemory;
+		size_t Size;
+		// Set when the memory is backed by huge pages
+		bool bHugePages;
+		// The buffers that aren't in use, linked through their first bytes
+		void* pFree;
+		unsigned long BufferSize;
+		unsigned long BufferCount;
+		unsigned long FreeCount;
+	};
+
+	// Create a pool from the calling thread, the memory is touched by it so it's local to the thread's NUMA node
+	// bHugePages backs the pool with huge pages when the system has them reserved, and asks for transparent huge pages otherwise
+	bool CreateBufferPool(WEB_SOCKET_BUFFER_POOL* pPool, unsigned long bufferSize, unsigned long bufferCount, bool bHugePages);
+
+	// Take a buffer from a pool, returns NULL when every buffer is in use
+	void* AllocatePoolBuffer(WEB_SOCKET_BUFFER_POOL* pPool);
+
+	// Give a buffer back to the pool it came from
+	void FreePoolBuffer(WEB_SOCKET_BUFFER_POOL* pPool, void* pBuffer);
+
+	// Check if a buffer came from a pool
+	bool IsPoolBuffer(const WEB_SOCKET_BUFFER_POOL* pPool, const void* pBuffer);
+
+	// Free the memory of a pool
+	void DestroyBufferPool(WEB_SOCKET_BUFFER_POOL* pPool);
+
+	// A ring of pointers written by one thread and read by another, without locks
+	struct WEB_SOCKET_SPSC_RING
+	{
+		// The next entry to read, written by the consumer
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) std::atomic<unsigned long long> qwHead;
+		// The next entry to write, written by the producer
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) std::atomic<unsigned long long> qwTail;
+		// The producer's and consumer's copies of the other end, so they only read it when the ring looks full or empty
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) unsigned long long qwCachedHead;
+		alignas(IIS_WEB_SOCKET_CACHE_LINE) unsigned long long qwCachedTail;
+		void** pEntries;
+		// The capacity minus 1, the capacity is a power of 2
+		unsigned long long qwMask;
+	};
+
+	// Allocate the entries of a ring, the capacity is rounded up to a power of 2
+	bool CreateSpscRing(WEB_SOCKET_SPSC_RING* pRing, unsigned long capacity);
+
+	// Add an entry, only from the producer, returns false if the ring is full
+	bool PushSpscRing(WEB_SOCKET_SPSC_RING* pRing, void* pEntry);
+
+	// Take the oldest entry, only from the consumer, returns false if the ring is empty
+	bool PopSpscRing(WEB_SOCKET_SPSC_RING* pRing, void** ppEntry);
+
+	// Check if a ring is empty, from either side
+	bool IsSpscRingEmpty(WEB_SOCKET_SPSC_RING* pRing);
+
+	// Free the entries of a ring
+	void DestroySpscRing(WEB_SOCKET_SPSC_RING* pRing);
+}
+
+#endif // !IIS_WEB_SOCKET_SHARD_H
@@ -0,0 +1,77 @@
+//
+// iiswebsockettrace.h
+// 
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+// 
+// Description:
+//     The binary trace file format written by the IIS WebSocket server frame tracer.
+//     This header only uses standard types so offline tools can read trace files on any platform.
+//
+
+#ifndef IIS_WEB_SOCKET_TRACE_H
+#define IIS_WEB_SOCKET_TRACE_H
+
+// WebSocket server namespace
+namespace IISWebSocketServer
+{
+	// "IWST" at the start of every trace file
+	#define IIS_WEB_SOCKET_TRACE_MAGIC 0x54535749
+
+	// Trace file format version
+	#define IIS_WEB_SOCKET_TRACE_VERSION 1
+
+	// The number of payload bytes captured for each frame
+	#define IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES 24
+
+	// Trace record direction
+	#define IIS_WEB_SOCKET_TRACE_INBOUND 0
+	#define IIS_WEB_SOCKET_TRACE_OUTBOUND 1
+
+	// Trace file header, followed by RecordCapacity records
+	struct IIS_WEB_SOCKET_TRACE_FILE_HEADER
+	{
+		// IIS_WEB_SOCKET_TRACE_MAGIC
+		unsigned int Magic;
+		// IIS_WEB_SOCKET_TRACE_VERSION
+		unsigned int Version;
+		// Timestamp ticks per second
+		unsigned long long TimestampFrequency;
+		// The number of records the file can hold, the file wraps around when it's full
+		unsigned long long RecordCapacity;
+		// The total number of records written, record i is at index (i % RecordCapacity)
+		unsigned long long RecordCount;
+		// Records lost because a thread's ring buffer was full
+		unsigned long long DroppedRecords;
+		unsigned long long Reserved[3];
+	};
+
+	// A single traced frame, 64 bytes
+	struct IIS_WEB_SOCKET_TRACE_RECORD
+	{
+		// WebSocketServer::ConnectionId of the connection
+		unsigned long long ConnectionId;
+		// Timestamp in IIS_WEB_SOCKET_TRACE_FILE_HEADER::TimestampFrequency ticks
+		unsigned long long Timestamp;
+		// The payload length of the frame
+		unsigned long long PayloadLength;
+		// The thread that sent or received the frame
+		unsigned int ThreadId;
+		// The size of the frame header in bytes
+		unsigned short FrameSize;
+		// IIS_WEB_SOCKET_TRACE_INBOUND or IIS_WEB_SOCKET_TRACE_OUTBOUND
+		unsigned char Direction;
+		// The frame Opcode
+		unsigned char Opcode;
+		// The frame FIN bit
+		unsigned char FIN;
+		// The number of bytes in Payload
+		unsigned char CapturedBytes;
+		unsigned char Reserved[6];
+		// The first bytes of the (unmasked) payload
+		unsigned char Payload[IIS_WEB_SOCKET_TRACE_PAYLOAD_BYTES];
+	};
+}
+
+#endif // !IIS_WEB_SOCKET_TRACE_H
@@ -0,0 +1,1061 @@
+
+//
+// loadgen.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Loopback load generator for the WebSocket protocol core.
+//     Opens N client connections to an echo server over loopback and reports throughput and latency percentiles.
+//     The echo server runs in the same process unless --connect is given, so everything runs on one box.
+//
+//     With --flood, extra connections send tiny frames as fast as they can to show how the rate limits
+//     given with --rate-limit and --global-rate-limit keep the other connections served.
+//     With --slow-consumers, extra connections send messages but stop reading the echoes. --outbound-limit
+//     puts the echoes through the same bounded outbound queue as WebSocketServer::QueueMessage.
+//
+//     Usage: loadgen [--connections <count>] [--duration <seconds>] [--sizes <size:weight,...>]
+//                    [--rate <messages per second per connection>] [--connect <ipv4 address:port>] [--json <output file>]
+//                    [--flood <count>] [--rate-limit <frames:bytes:messages per second>]
+//                    [--global-rate-limit <frames:bytes:messages per second>] [--rate-limit-close <milliseconds>]
+//                    [--slow-consumers <count>] [--outbound-limit <bytes>]
+//                    [--outbound-policy <drop-oldest|drop-newest|conflate|disconnect>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The largest message the echo server accepts
+#define LOADGEN_MAX_MESSAGE_LENGTH 0x1000000
+
+// A message size and how often it's picked relative to the other sizes
+struct LOADGEN_SIZE
+{
+	unsigned long long qwLength;
+	unsigned int Weight;
+};
+
+// Load generator settings
+struct LOADGEN_OPTIONS
+{
+	unsigned int Connections;
+	double Duration;
+	double Rate;
+	std::vector<LOADGEN_SIZE> Sizes;
+	sockaddr_in Address;
+	const char* pJsonPath;
+	// Connections that flood the server with tiny frames
+	unsigned int FloodConnections;
+	// Rate limits the echo server applies to each connection and to all of them together
+	bool bRateLimited;
+	IIS_WEB_SOCKET_RATE_LIMITS RateLimits;
+	bool bGlobalRateLimited;
+	IIS_WEB_SOCKET_RATE_LIMITS GlobalRateLimits;
+	// Milliseconds a connection may stay over its rate limits before the echo server closes it (0 = never)
+	unsigned long RateLimitCloseDelay;
+	// Connections that stop reading the echoes
+	unsigned int SlowConsumers;
+	// The echo server queues echoes up to this many bytes per connection (0 = echo directly)
+	unsigned long long OutboundLimit;
+	IIS_WEB_SOCKET_OUTBOUND_POLICY OutboundPolicy;
+};
+
+// The results of a single client connection
+struct LOADGEN_CLIENT
+{
+	std::thread Thread;
+	std::vector<unsigned long long> Latencies;
+	unsigned long long qwBytes;
+	bool bFailed;
+};
+
+// The results of a flooding connection
+struct LOADGEN_FLOODER
+{
+	std::thread Thread;
+	unsigned long long qwFrames;
+	// Set by the drain thread when the server closes with a policy violation
+	std::atomic<bool> bPolicyClosed;
+	bool bFailed;
+};
+
+// An echo connection's outbound queue and the thread that writes it
+struct LOADGEN_OUTBOUND
+{
+	std::mutex Lock;
+	std::condition_variable Ready;
+	WEB_SOCKET_OUTBOUND_QUEUE Queue;
+	bool bStopping;
+};
+
+// A connection that stops reading
+struct LOADGEN_SLOW_CONSUMER
+{
+	std::thread Thread;
+	unsigned long long qwMessages;
+	bool bDisconnected;
+	bool bFailed;
+};
+
+// Stops the in-process echo server
+static std::atomic<bool> ServerStopping;
+
+// The outbound queue counters of all echo connections, added up as connections end
+static std::mutex OutboundTotalsLock;
+static IIS_WEB_SOCKET_OUTBOUND_STATS OutboundTotals;
+static unsigned long long qwPeakQueuedBytes;
+static unsigned int OutboundDisconnects;
+
+// The echo server's rate limiter shared by all connections
+static std::mutex GlobalRateLimitLock;
+static WEB_SOCKET_RATE_LIMITER GlobalRateLimiter;
+
+// Rate limiter timestamps are in nanoseconds
+static unsigned long long RateLimitTimestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+//
+// Socket helpers
+//
+
+// Write all bytes to a socket
+static bool SendAll(int socket, const void* pBuffer, size_t length)
+{
+	const char* pBytes = (const char*)pBuffer;
+	ssize_t sent;
+
+	while (length != 0)
+	{
+		sent = send(socket, pBytes, length, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		pBytes += sent;
+		length -= (size_t)sent;
+	}
+
+	return true;
+}
+
+// Read exactly length bytes from a socket
+static bool ReceiveAll(int socket, void* pBuffer, size_t length)
+{
+	char* pBytes = (char*)pBuffer;
+	ssize_t received;
+
+	while (length != 0)
+	{
+		received = recv(socket, pBytes, length, 0);
+		if (received <= 0) {
+			if ((received < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		pBytes += received;
+		length -= (size_t)received;
+	}
+
+	return true;
+}
+
+// Read an HTTP request or response up to the blank line that ends the headers
+static bool ReceiveHttpHeaders(int socket, std::string* pHeaders)
+{
+	char c;
+
+	pHeaders->clear();
+	while ((pHeaders->size() < 4) || (pHeaders->compare(pHeaders->size() - 4, 4, "\r\n\r\n") != 0))
+	{
+		// One byte at a time so none of the first frame is consumed, this only runs once per connection
+		if (!ReceiveAll(socket, &c, 1) || (pHeaders->size() > 0x2000)) {
+			return false;
+		}
+		pHeaders->push_back(c);
+	}
+
+	return true;
+}
+
+// Find a header value in HTTP headers, the header name is compared ignoring case
+static bool FindHttpHeader(const std::string& headers, const char* pName, std::string* pValue)
+{
+	size_t nameLength = strlen(pName);
+	size_t line = headers.find("\r\n");
+	size_t end;
+
+	while ((line != std::string::npos) && (line + 2 < headers.size()))
+	{
+		line += 2;
+		end = headers.find("\r\n", line);
+		if (end == std::string::npos) {
+			break;
+		}
+		if ((end - line > nameLength) && (headers[line + nameLength] == ':') && (strncasecmp(&headers[line], pName, nameLength) == 0))
+		{
+			size_t start = line + nameLength + 1;
+			while ((start < end) && (headers[start] == ' ')) {
+				start++;
+			}
+			pValue->assign(headers, start, end - start);
+			return true;
+		}
+		line = end;
+	}
+
+	return false;
+}
+
+// Read a frame header, returns false if the connection was closed or the header is invalid
+// bMasked is true when reading a client's frames
+static bool ReceiveFrameHeader(int socket, unsigned char pHeader[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH], WEB_SOCKET_FRAME* pFrame, bool bMasked)
+{
+	unsigned long dwReceived = 0;
+
+	// ParseWebSocketFrame tells us how many header bytes are still needed
+	while (!ParseWebSocketFrame(pHeader, dwReceived, pFrame, bMasked))
+	{
+		if (!ReceiveAll(socket, pHeader + dwReceived, pFrame->FrameSize - dwReceived)) {
+			return false;
+		}
+		dwReceived = pFrame->FrameSize;
+	}
+
+	return pFrame->Violation == IIS_WEB_SOCKET_FRAME_VIOLATION::IIS_WEB_SOCKET_NO_FRAME_VIOLATION;
+}
+
+//
+// Echo server
+//
+
+// After sending a close frame, read and discard until the client closes its side
+// Closing with unread data would reset the connection and could lose the close frame
+static void DiscardUntilClosed(int socket)
+{
+	char buffer[0x1000];
+	timeval timeout = { 1, 0 };
+
+	shutdown(socket, SHUT_WR);
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (recv(socket, buffer, sizeof(buffer), 0) > 0)
+	{
+	}
+}
+
+// Outbound queue timestamps are in microseconds
+static unsigned long long QueueTimestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Write the echoes queued for a connection, like the queue writer of WebSocketServer
+static void EchoWriterThread(int socket, LOADGEN_OUTBOUND* pOutbound)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+	bool bSent;
+
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(pOutbound->Lock);
+		while ((pOutbound->Queue.pHead == NULL) && (!pOutbound->bStopping)) {
+			pOutbound->Ready.wait(lock);
+		}
+		if (pOutbound->bStopping) {
+			break;
+		}
+		pMessage = PopOutboundMessage(&pOutbound->Queue, QueueTimestamp());
+		lock.unlock();
+
+		// Blocks while the client isn't reading
+		headerLength = EncodeWebSocketFrameHeader(header,
+			(pMessage->BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ? 0x81 : 0x82, pMessage->qwLength);
+		bSent = SendAll(socket, header, headerLength) && SendAll(socket, pMessage->pData, (size_t)pMessage->qwLength);
+		FreeOutboundMessage(pMessage);
+		if (!bSent) {
+			break;
+		}
+	}
+}
+
+// Stop the writer of an echo connection and add its counters to the totals
+static void EndEchoWriter(int socket, LOADGEN_OUTBOUND* pOutbound, std::thread* pWriter, bool bDisconnect)
+{
+	unsigned char close[4];
+	unsigned long long qwNow;
+
+	{
+		std::lock_guard<std::mutex> lock(pOutbound->Lock);
+		pOutbound->bStopping = true;
+	}
+	pOutbound->Ready.notify_one();
+
+	// A disconnected client isn't reading, try to send the close frame and reset the connection to wake the writer
+	if (bDisconnect) {
+		EncodeWebSocketFrameHeader(close, 0x88, 2);
+		close[2] = 1008 >> 8;
+		close[3] = 1008 & 0xFF;
+		send(socket, close, sizeof(close), MSG_NOSIGNAL | MSG_DONTWAIT);
+		shutdown(socket, SHUT_RDWR);
+	}
+	pWriter->join();
+
+	std::lock_guard<std::mutex> lock(OutboundTotalsLock);
+	qwNow = QueueTimestamp();
+	OutboundTotals.SentMessages += pOutbound->Queue.Stats.SentMessages;
+	OutboundTotals.DroppedMessages += pOutbound->Queue.Stats.DroppedMessages + pOutbound->Queue.Stats.QueuedMessages;
+	OutboundTotals.ConflatedMessages += pOutbound->Queue.Stats.ConflatedMessages;
+	OutboundTotals.StallTime += pOutbound->Queue.Stats.StallTime;
+	if ((pOutbound->Queue.bStalled) && (qwNow > pOutbound->Queue.qwStallStart)) {
+		OutboundTotals.StallTime += qwNow - pOutbound->Queue.qwStallStart;
+	}
+	OutboundDisconnects += bDisconnect ? 1 : 0;
+	ClearOutboundQueue(&pOutbound->Queue);
+}
+
+// Handle a single connection, sends every message back to the client
+// Like WebSocketServer::Receive, reading pauses while the connection is over its rate limits
+// With an outbound limit the echoes are queued, like WebSocketServer::QueueMessage
+static void EchoConnection(int socket, const LOADGEN_OPTIONS* pOptions)
+{
+	std::string request;
+	std::string key;
+	std::string connection;
+	std::string upgrade;
+	char accept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1];
+	char response[0x100];
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	WEB_SOCKET_FRAME frame;
+	std::vector<unsigned char> payload;
+	WEB_SOCKET_RATE_LIMITER rateLimiter;
+	unsigned long long qwNow;
+	unsigned long long qwPause;
+	unsigned long long qwMessages;
+	LOADGEN_OUTBOUND outbound;
+	std::thread writer;
+	IIS_WEB_SOCKET_QUEUE_RESULT result;
+	unsigned long long qwEchoes = 0;
+	bool bDisconnect = false;
+	char topic[0x20];
+	int flag = 1;
+
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	InitializeRateLimiter(&rateLimiter, pOptions->bRateLimited ? &pOptions->RateLimits : NULL, 1000000000);
+
+	// Check the handshake request with the same header checks the IIS server uses
+	if (!ReceiveHttpHeaders(socket, &request) ||
+		!FindHttpHeader(request, "Connection", &connection) || !WebSocketConnectionHasUpgrade(connection.data(), connection.size()) ||
+		!FindHttpHeader(request, "Upgrade", &upgrade) || !WebSocketHeaderValueEquals(upgrade.data(), upgrade.size(), "websocket") ||
+		!FindHttpHeader(request, "Sec-WebSocket-Key", &key)) {
+		close(socket);
+		return;
+	}
+
+	WebSocketComputeHandshakeAccept(key.data(), key.size(), accept);
+	snprintf(response, sizeof(response),
+		"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+	if (!SendAll(socket, response, strlen(response))) {
+		close(socket);
+		return;
+	}
+
+	if (pOptions->OutboundLimit != 0)
+	{
+		memset(&outbound.Queue, 0, sizeof(outbound.Queue));
+		outbound.Queue.qwLimit = pOptions->OutboundLimit;
+		outbound.Queue.Policy = pOptions->OutboundPolicy;
+		outbound.bStopping = false;
+		writer = std::thread(EchoWriterThread, socket, &outbound);
+	}
+
+	while (ReceiveFrameHeader(socket, header, &frame, true))
+	{
+		if (frame.PayloadLength > LOADGEN_MAX_MESSAGE_LENGTH) {
+			break;
+		}
+
+		payload.resize((size_t)frame.PayloadLength);
+		if (!ReceiveAll(socket, payload.data(), payload.size())) {
+			break;
+		}
+		UnmaskWebSocketPayload(payload.data(), payload.size(), frame.MaskingKey, 0);
+
+		// Charge the frame to the rate limits, the last frame of a message and control frames complete a message
+		if ((pOptions->bRateLimited) || (pOptions->bGlobalRateLimited))
+		{
+			qwNow = RateLimitTimestamp();
+			qwMessages = ((frame.FIN) || (frame.Opcode >= 0x08)) ? 1 : 0;
+			qwPause = ChargeRateLimiter(&rateLimiter, qwNow, 1, frame.FrameSize + frame.PayloadLength, qwMessages);
+
+			// Close a connection that stays over its own limits with a policy violation
+			if ((rateLimiter.qwOverLimitSince != 0) && (pOptions->RateLimitCloseDelay != 0) &&
+				(qwNow - rateLimiter.qwOverLimitSince > (unsigned long long)pOptions->RateLimitCloseDelay * 1000000))
+			{
+				headerLength = EncodeWebSocketFrameHeader(header, 0x88, 2);
+				header[headerLength++] = 1008 >> 8;
+				header[headerLength++] = 1008 & 0xFF;
+				SendAll(socket, header, headerLength);
+				DiscardUntilClosed(socket);
+				break;
+			}
+
+			if (pOptions->bGlobalRateLimited) {
+				std::lock_guard<std::mutex> lock(GlobalRateLimitLock);
+				qwPause = std::max(qwPause, ChargeRateLimiter(&GlobalRateLimiter, qwNow, 1, frame.FrameSize + frame.PayloadLength, qwMessages));
+			}
+
+			// Stop reading, the client is held back by TCP flow control
+			if (qwPause != 0) {
+				std::this_thread::sleep_for(std::chrono::nanoseconds(qwPause));
+			}
+		}
+
+		// Queue the echo, this thread doesn't wait for a client that isn't reading
+		// The echoes cycle through 16 topics so the conflate policy has something to replace
+		if ((pOptions->OutboundLimit != 0) && ((frame.Opcode == 0x01) || (frame.Opcode == 0x02)))
+		{
+			snprintf(topic, sizeof(topic), "topic-%llu", qwEchoes++ % 16);
+			std::unique_lock<std::mutex> lock(outbound.Lock);
+			result = PushOutboundMessage(&outbound.Queue,
+				(frame.Opcode == 0x01) ? IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE : IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE,
+				payload.data(), payload.size(), topic, QueueTimestamp());
+			{
+				std::lock_guard<std::mutex> totalsLock(OutboundTotalsLock);
+				qwPeakQueuedBytes = std::max(qwPeakQueuedBytes, outbound.Queue.Stats.QueuedBytes);
+			}
+			lock.unlock();
+			outbound.Ready.notify_one();
+
+			if (result == IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT) {
+				bDisconnect = true;
+				break;
+			}
+			continue;
+		}
+
+		// Nothing else is written while the writer runs, a close ends the connection
+		if (writer.joinable()) {
+			EndEchoWriter(socket, &outbound, &writer, false);
+		}
+
+		// Echo the frame unmasked, a close frame is echoed and ends the connection
+		headerLength = EncodeWebSocketFrameHeader(header, (unsigned char)((frame.FIN ? 0x80 : 0x00) | frame.Opcode), frame.PayloadLength);
+		if (!SendAll(socket, header, headerLength) || !SendAll(socket, payload.data(), payload.size())) {
+			break;
+		}
+		if (frame.Opcode == 0x08) {
+			break;
+		}
+	}
+
+	if (writer.joinable()) {
+		EndEchoWriter(socket, &outbound, &writer, bDisconnect);
+	}
+
+	close(socket);
+}
+
+// Accept connections until the server is stopped
+static void EchoServer(int listenSocket, const LOADGEN_OPTIONS* pOptions)
+{
+	std::vector<std::thread> connections;
+	int socket;
+
+	while (!ServerStopping.load())
+	{
+		socket = accept(listenSocket, NULL, NULL);
+		if (socket < 0) {
+			continue;
+		}
+		connections.push_back(std::thread(EchoConnection, socket, pOptions));
+	}
+
+	for (size_t i = 0; i < connections.size(); i++) {
+		connections[i].join();
+	}
+}
+
+//
+// Client
+//
+
+// Connect and perform the client side of the handshake
+static int ClientConnect(const sockaddr_in* pAddress)
+{
+	char key[IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH + 1];
+	char accept[IIS_WEB_SOCKET_HANDSHAKE_ACCEPT_LENGTH + 1];
+	char request[0x200];
+	std::string response;
+	std::string value;
+	int flag = 1;
+	int socket;
+
+	socket = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (socket < 0) {
+		return -1;
+	}
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	if (connect(socket, (const sockaddr*)pAddress, sizeof(sockaddr_in)) != 0) {
+		close(socket);
+		return -1;
+	}
+
+	WebSocketGenerateHandshakeKey(key);
+	snprintf(request, sizeof(request),
+		"GET / HTTP/1.1\r\nHost: %s:%u\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n",
+		inet_ntoa(pAddress->sin_addr), ntohs(pAddress->sin_port), key);
+
+	// The server must answer with the accept value for our key
+	WebSocketComputeHandshakeAccept(key, IIS_WEB_SOCKET_HANDSHAKE_KEY_LENGTH, accept);
+	if (!SendAll(socket, request, strlen(request)) || !ReceiveHttpHeaders(socket, &response) ||
+		(response.compare(0, 12, "HTTP/1.1 101") != 0) ||
+		!FindHttpHeader(response, "Sec-WebSocket-Accept", &value) || (value != accept)) {
+		close(socket);
+		return -1;
+	}
+
+	return socket;
+}
+
+// Send one masked binary message with the first qwLength bytes of payload and wait for the echo
+// The message buffer has room for the largest frame header in front of the payload
+static bool ClientRoundTrip(int socket, const std::vector<unsigned char>& payload, std::vector<unsigned char>& message, unsigned long long qwLength, std::vector<unsigned char>& reply)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	char maskingKey[4];
+	WEB_SOCKET_FRAME frame;
+
+	// Mask a copy of the payload with a new key, then write the header and payload
+	WebSocketGenerateMaskingKey(maskingKey);
+	headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwLength, maskingKey);
+	memcpy(message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH, payload.data(), (size_t)qwLength);
+	UnmaskWebSocketPayload(message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH, qwLength, maskingKey, 0);
+	memcpy(message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH - headerLength, header, headerLength);
+	if (!SendAll(socket, message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH - headerLength, headerLength + (size_t)qwLength)) {
+		return false;
+	}
+
+	if (!ReceiveFrameHeader(socket, header, &frame, false) || (frame.PayloadLength != qwLength)) {
+		return false;
+	}
+	return ReceiveAll(socket, reply.data(), (size_t)qwLength);
+}
+
+// A client connection, sends messages until the duration has passed
+static void ClientThread(const LOADGEN_OPTIONS* pOptions, LOADGEN_CLIENT* pClient, Clock::time_point start)
+{
+	std::vector<unsigned char> payload;
+	std::vector<unsigned char> message;
+	std::vector<unsigned char> reply;
+	unsigned long long qwMaxLength = 0;
+	unsigned long long qwLength;
+	unsigned int totalWeight = 0;
+	unsigned int pick;
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	char maskingKey[4];
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(pOptions->Duration));
+	Clock::time_point next = start;
+	Clock::duration interval = Clock::duration::zero();
+	std::minstd_rand random((unsigned int)(uintptr_t)pClient);
+	int socket;
+
+	socket = ClientConnect(&pOptions->Address);
+	if (socket < 0) {
+		pClient->bFailed = true;
+		return;
+	}
+
+	for (size_t i = 0; i < pOptions->Sizes.size(); i++) {
+		qwMaxLength = std::max(qwMaxLength, pOptions->Sizes[i].qwLength);
+		totalWeight += pOptions->Sizes[i].Weight;
+	}
+	message.resize(IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + (size_t)qwMaxLength);
+	payload.assign((size_t)qwMaxLength, 0x5A);
+	reply.resize((size_t)qwMaxLength);
+
+	if (pOptions->Rate > 0) {
+		interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / pOptions->Rate));
+	}
+
+	while (Clock::now() < end)
+	{
+		// Pick a size from the mix
+		pick = (unsigned int)(random() % totalWeight);
+		qwLength = pOptions->Sizes[0].qwLength;
+		for (size_t i = 0; i < pOptions->Sizes.size(); i++) {
+			if (pick < pOptions->Sizes[i].Weight) {
+				qwLength = pOptions->Sizes[i].qwLength;
+				break;
+			}
+			pick -= pOptions->Sizes[i].Weight;
+		}
+
+		// With a rate, latency is measured from when the message was due so a slow reply isn't hidden
+		if (pOptions->Rate > 0) {
+			std::this_thread::sleep_until(next);
+		}
+		else {
+			next = Clock::now();
+		}
+
+		if (!ClientRoundTrip(socket, payload, message, qwLength, reply)) {
+			pClient->bFailed = true;
+			break;
+		}
+
+		pClient->Latencies.push_back((unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - next).count());
+		pClient->qwBytes += qwLength;
+		next += interval;
+	}
+
+	// Close the connection, the server echoes the close frame
+	WebSocketGenerateMaskingKey(maskingKey);
+	SendAll(socket, header, EncodeMaskedWebSocketFrameHeader(header, 0x88, 0, maskingKey));
+	close(socket);
+}
+
+// Read and discard the echoes of a flooding connection, notes a policy violation close from the server
+static void FloodDrainThread(int socket, LOADGEN_FLOODER* pFlooder)
+{
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	std::vector<unsigned char> payload;
+	WEB_SOCKET_FRAME frame;
+
+	while (ReceiveFrameHeader(socket, header, &frame, false))
+	{
+		payload.resize((size_t)frame.PayloadLength);
+		if (!ReceiveAll(socket, payload.data(), payload.size())) {
+			break;
+		}
+		if (frame.Opcode == 0x08) {
+			pFlooder->bPolicyClosed = (payload.size() >= 2) && (((payload[0] << 8) | payload[1]) == 1008);
+			break;
+		}
+	}
+}
+
+// A flooding connection, sends tiny frames in large batches without waiting for the echoes
+static void FloodThread(const LOADGEN_OPTIONS* pOptions, LOADGEN_FLOODER* pFlooder, Clock::time_point start)
+{
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(pOptions->Duration));
+	std::vector<unsigned char> batch;
+	std::thread drain;
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	char maskingKey[4];
+	linger abort = { 1, 0 };
+	int sendBufferSize = 0x10000;
+	int socket;
+
+	socket = ClientConnect(&pOptions->Address);
+	if (socket < 0) {
+		pFlooder->bFailed = true;
+		return;
+	}
+	drain = std::thread(FloodDrainThread, socket, pFlooder);
+
+	// A small send buffer, so once the server stops reading the flooder waits instead of filling megabytes of loopback buffers
+	setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, sizeof(sendBufferSize));
+
+	// 256 frames with a 2 byte payload
+	for (int i = 0; i < 256; i++)
+	{
+		WebSocketGenerateMaskingKey(maskingKey);
+		headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, 2, maskingKey);
+		batch.insert(batch.end(), header, header + headerLength);
+		batch.push_back((unsigned char)(0x46 ^ maskingKey[0]));
+		batch.push_back((unsigned char)(0x46 ^ maskingKey[1]));
+	}
+
+	while ((Clock::now() < end) && (!pFlooder->bPolicyClosed.load()))
+	{
+		if (!SendAll(socket, batch.data(), batch.size())) {
+			break;
+		}
+		pFlooder->qwFrames += 256;
+	}
+
+	// Reset the connection so the server doesn't work through the frames still queued
+	setsockopt(socket, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+	shutdown(socket, SHUT_RD);
+	drain.join();
+	close(socket);
+}
+
+// A connection that never reads, sends messages from the size mix at the client rate (1000/s without one)
+static void SlowConsumerThread(const LOADGEN_OPTIONS* pOptions, LOADGEN_SLOW_CONSUMER* pConsumer, Clock::time_point start)
+{
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(pOptions->Duration));
+	Clock::time_point next = start;
+	Clock::duration interval;
+	std::vector<unsigned char> message;
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	unsigned long long qwLength;
+	char maskingKey[4];
+	linger abort = { 1, 0 };
+	int receiveBufferSize = 0x1000;
+	int socket;
+
+	socket = ClientConnect(&pOptions->Address);
+	if (socket < 0) {
+		pConsumer->bFailed = true;
+		return;
+	}
+
+	// A small receive buffer, so the echoes back up on the server soon after they stop being read
+	setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+	interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / ((pOptions->Rate > 0) ? pOptions->Rate : 1000.0)));
+
+	while (Clock::now() < end)
+	{
+		qwLength = pOptions->Sizes[pConsumer->qwMessages % pOptions->Sizes.size()].qwLength;
+		message.assign(IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + (size_t)qwLength, 0x5A);
+		WebSocketGenerateMaskingKey(maskingKey);
+		UnmaskWebSocketPayload(message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH, qwLength, maskingKey, 0);
+		headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwLength, maskingKey);
+		memcpy(message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH - headerLength, header, headerLength);
+
+		std::this_thread::sleep_until(next);
+		if (!SendAll(socket, message.data() + IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH - headerLength, headerLength + (size_t)qwLength)) {
+			// The server gave up on the connection
+			pConsumer->bDisconnected = true;
+			break;
+		}
+		pConsumer->qwMessages++;
+		next += interval;
+	}
+
+	// Reset the connection, the echoes were never going to be read
+	setsockopt(socket, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+	close(socket);
+}
+
+//
+// Main
+//
+
+// Parse rate limits like "1000:0:500", frames, bytes and messages per second where 0 is no limit
+static bool ParseRateLimits(const char* pText, IIS_WEB_SOCKET_RATE_LIMITS* pLimits)
+{
+	memset(pLimits, 0, sizeof(IIS_WEB_SOCKET_RATE_LIMITS));
+	return sscanf(pText, "%llu:%llu:%llu", &pLimits->FramesPerSecond, &pLimits->BytesPerSecond, &pLimits->MessagesPerSecond) == 3;
+}
+
+// Parse an outbound queue policy name
+static bool ParseOutboundPolicy(const char* pText, IIS_WEB_SOCKET_OUTBOUND_POLICY* pPolicy)
+{
+	if (strcmp(pText, "drop-oldest") == 0) {
+		*pPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_OLDEST_OUTBOUND_POLICY;
+	}
+	else if (strcmp(pText, "drop-newest") == 0) {
+		*pPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_NEWEST_OUTBOUND_POLICY;
+	}
+	else if (strcmp(pText, "conflate") == 0) {
+		*pPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_CONFLATE_OUTBOUND_POLICY;
+	}
+	else if (strcmp(pText, "disconnect") == 0) {
+		*pPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+// Parse a size mix like "64:70,1024:25,65536:5", the weight is optional
+static bool ParseSizes(const char* pText, std::vector<LOADGEN_SIZE>* pSizes)
+{
+	char* pEnd;
+	LOADGEN_SIZE size;
+
+	pSizes->clear();
+	while (*pText != 0)
+	{
+		size.qwLength = strtoull(pText, &pEnd, 10);
+		size.Weight = 1;
+		if ((pEnd == pText) || (size.qwLength > LOADGEN_MAX_MESSAGE_LENGTH)) {
+			return false;
+		}
+		pText = pEnd;
+		if (*pText == ':') {
+			size.Weight = (unsigned int)strtoul(pText + 1, &pEnd, 10);
+			if ((pEnd == pText + 1) || (size.Weight == 0)) {
+				return false;
+			}
+			pText = pEnd;
+		}
+		pSizes->push_back(size);
+		if (*pText == ',') {
+			pText++;
+		}
+		else if (*pText != 0) {
+			return false;
+		}
+	}
+
+	return !pSizes->empty();
+}
+
+// Get a percentile from sorted latencies
+static unsigned long long Percentile(const std::vector<unsigned long long>& latencies, double fraction)
+{
+	size_t index;
+
+	if (latencies.empty()) {
+		return 0;
+	}
+	index = (size_t)(fraction * (double)(latencies.size() - 1) + 0.5);
+	return latencies[index];
+}
+
+int main(int argc, char* argv[])
+{
+	LOADGEN_OPTIONS options;
+	std::vector<LOADGEN_CLIENT> clients;
+	std::vector<unsigned long long> latencies;
+	std::thread server;
+	int listenSocket = -1;
+	socklen_t addressLength;
+	unsigned long long qwBytes = 0;
+	unsigned int failed = 0;
+	unsigned long long qwFloodFrames = 0;
+	unsigned int policyClosed = 0;
+	unsigned long long qwSlowMessages = 0;
+	unsigned int slowDisconnected = 0;
+	double elapsed;
+	FILE* pFile;
+
+	options.Connections = 16;
+	options.Duration = 5;
+	options.Rate = 0;
+	options.pJsonPath = NULL;
+	options.FloodConnections = 0;
+	options.bRateLimited = false;
+	options.bGlobalRateLimited = false;
+	options.RateLimitCloseDelay = 10000;
+	options.SlowConsumers = 0;
+	options.OutboundLimit = 0;
+	options.OutboundPolicy = IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY;
+	ParseSizes("64:70,1024:25,65536:5", &options.Sizes);
+	memset(&options.Address, 0, sizeof(options.Address));
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			options.Connections = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--duration") == 0) && (i + 1 < argc)) {
+			options.Duration = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)) {
+			options.Rate = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--sizes") == 0) && (i + 1 < argc) && ParseSizes(argv[i + 1], &options.Sizes)) {
+			i++;
+		}
+		else if ((strcmp(argv[i], "--connect") == 0) && (i + 1 < argc) && (strchr(argv[i + 1], ':') != NULL)) {
+			std::string address(argv[++i]);
+			options.Address.sin_family = AF_INET;
+			options.Address.sin_port = htons((unsigned short)atoi(address.substr(address.rfind(':') + 1).c_str()));
+			if (inet_pton(AF_INET, address.substr(0, address.rfind(':')).c_str(), &options.Address.sin_addr) != 1) {
+				fprintf(stderr, "invalid address %s\n", address.c_str());
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			options.pJsonPath = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--flood") == 0) && (i + 1 < argc)) {
+			options.FloodConnections = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--rate-limit") == 0) && (i + 1 < argc) && ParseRateLimits(argv[i + 1], &options.RateLimits)) {
+			options.bRateLimited = true;
+			i++;
+		}
+		else if ((strcmp(argv[i], "--global-rate-limit") == 0) && (i + 1 < argc) && ParseRateLimits(argv[i + 1], &options.GlobalRateLimits)) {
+			options.bGlobalRateLimited = true;
+			i++;
+		}
+		else if ((strcmp(argv[i], "--rate-limit-close") == 0) && (i + 1 < argc)) {
+			options.RateLimitCloseDelay = strtoul(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--slow-consumers") == 0) && (i + 1 < argc)) {
+			options.SlowConsumers = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--outbound-limit") == 0) && (i + 1 < argc)) {
+			options.OutboundLimit = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--outbound-policy") == 0) && (i + 1 < argc) && ParseOutboundPolicy(argv[i + 1], &options.OutboundPolicy)) {
+			i++;
+		}
+		else {
+			fprintf(stderr, "usage: loadgen [--connections <count>] [--duration <seconds>] [--sizes <size:weight,...>]\n"
+				"               [--rate <messages per second per connection>] [--connect <ipv4 address:port>] [--json <output file>]\n"
+				"               [--flood <count>] [--rate-limit <frames:bytes:messages per second>]\n"
+				"               [--global-rate-limit <frames:bytes:messages per second>] [--rate-limit-close <milliseconds>]\n"
+				"               [--slow-consumers <count>] [--outbound-limit <bytes>]\n"
+				"               [--outbound-policy <drop-oldest|drop-newest|conflate|disconnect>]\n");
+			return 1;
+		}
+	}
+
+	if (options.Connections == 0) {
+		fprintf(stderr, "--connections must be at least 1\n");
+		return 1;
+	}
+
+	// Start the echo server on an ephemeral loopback port
+	if (options.Address.sin_family == 0)
+	{
+		options.Address.sin_family = AF_INET;
+		options.Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		options.Address.sin_port = 0;
+
+		listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+		addressLength = sizeof(options.Address);
+		if ((listenSocket < 0) ||
+			(bind(listenSocket, (const sockaddr*)&options.Address, sizeof(options.Address)) != 0) ||
+			(listen(listenSocket, SOMAXCONN) != 0) ||
+			(getsockname(listenSocket, (sockaddr*)&options.Address, &addressLength) != 0)) {
+			fprintf(stderr, "failed to start the echo server, errno %d\n", errno);
+			return 1;
+		}
+		InitializeRateLimiter(&GlobalRateLimiter, options.bGlobalRateLimited ? &options.GlobalRateLimits : NULL, 1000000000);
+		server = std::thread(EchoServer, listenSocket, &options);
+	}
+
+	// Run the clients and the flooding connections
+	clients.resize(options.Connections);
+	std::vector<LOADGEN_FLOODER> flooders(options.FloodConnections);
+	std::vector<LOADGEN_SLOW_CONSUMER> consumers(options.SlowConsumers);
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < consumers.size(); i++) {
+		consumers[i].qwMessages = 0;
+		consumers[i].bDisconnected = false;
+		consumers[i].bFailed = false;
+		consumers[i].Thread = std::thread(SlowConsumerThread, &options, &consumers[i], start);
+	}
+	for (size_t i = 0; i < flooders.size(); i++) {
+		flooders[i].qwFrames = 0;
+		flooders[i].bPolicyClosed = false;
+		flooders[i].bFailed = false;
+		flooders[i].Thread = std::thread(FloodThread, &options, &flooders[i], start);
+	}
+	for (size_t i = 0; i < clients.size(); i++) {
+		clients[i].qwBytes = 0;
+		clients[i].bFailed = false;
+		clients[i].Thread = std::thread(ClientThread, &options, &clients[i], start);
+	}
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		clients[i].Thread.join();
+		latencies.insert(latencies.end(), clients[i].Latencies.begin(), clients[i].Latencies.end());
+		qwBytes += clients[i].qwBytes;
+		failed += clients[i].bFailed ? 1 : 0;
+	}
+	elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	for (size_t i = 0; i < flooders.size(); i++)
+	{
+		flooders[i].Thread.join();
+		qwFloodFrames += flooders[i].qwFrames;
+		policyClosed += flooders[i].bPolicyClosed ? 1 : 0;
+		failed += flooders[i].bFailed ? 1 : 0;
+	}
+	for (size_t i = 0; i < consumers.size(); i++)
+	{
+		consumers[i].Thread.join();
+		qwSlowMessages += consumers[i].qwMessages;
+		slowDisconnected += consumers[i].bDisconnected ? 1 : 0;
+		failed += consumers[i].bFailed ? 1 : 0;
+	}
+
+	// Stop the echo server, shutdown wakes the accept call
+	if (listenSocket >= 0)
+	{
+		ServerStopping.store(true);
+		shutdown(listenSocket, SHUT_RDWR);
+		close(listenSocket);
+		server.join();
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	printf("connections      %u (%u failed)\n", options.Connections, failed);
+	printf("messages         %zu\n", latencies.size());
+	printf("throughput       %.0f messages/s, %.2f MB/s\n", (double)latencies.size() / elapsed, (double)qwBytes / elapsed / 1000000.0);
+	printf("latency p50      %.1f us\n", (double)Percentile(latencies, 0.5) / 1000.0);
+	printf("latency p99      %.1f us\n", (double)Percentile(latencies, 0.99) / 1000.0);
+	printf("latency p999     %.1f us\n", (double)Percentile(latencies, 0.999) / 1000.0);
+	printf("latency max      %.1f us\n", latencies.empty() ? 0.0 : (double)latencies.back() / 1000.0);
+	if (options.FloodConnections != 0) {
+		printf("flooding         %u connections, %.0f frames/s sent, %u closed for policy violation\n",
+			options.FloodConnections, (double)qwFloodFrames / elapsed, policyClosed);
+	}
+	if (options.SlowConsumers != 0) {
+		printf("slow consumers   %u connections, %llu messages sent, %u disconnected by the server\n",
+			options.SlowConsumers, qwSlowMessages, slowDisconnected);
+	}
+	if (options.OutboundLimit != 0) {
+		printf("outbound queues  %llu dropped, %llu conflated, %.1f ms stalled, %u disconnected, %llu peak bytes\n",
+			OutboundTotals.DroppedMessages, OutboundTotals.ConflatedMessages, (double)OutboundTotals.StallTime / 1000.0,
+			OutboundDisconnects, qwPeakQueuedBytes);
+	}
+
+	if (options.pJsonPath != NULL)
+	{
+		pFile = fopen(options.pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", options.pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"connections\": %u,\n  \"failed_connections\": %u,\n  \"messages\": %zu,\n  \"seconds\": %.3f,\n"
+			"  \"messages_per_second\": %.0f,\n  \"bytes_per_second\": %.0f,\n"
+			"  \"latency_ns\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu },\n"
+			"  \"flood_connections\": %u,\n  \"flood_frames_per_second\": %.0f,\n  \"policy_closed_connections\": %u,\n"
+			"  \"slow_consumers\": %u,\n  \"outbound\": { \"dropped\": %llu, \"conflated\": %llu, \"stall_us\": %llu, \"disconnected\": %u, \"peak_bytes\": %llu }\n}\n",
+			options.Connections, failed, latencies.size(), elapsed,
+			(double)latencies.size() / elapsed, (double)qwBytes / elapsed,
+			Percentile(latencies, 0.5), Percentile(latencies, 0.99), Percentile(latencies, 0.999),
+			latencies.empty() ? 0ULL : latencies.back(),
+			options.FloodConnections, (double)qwFloodFrames / elapsed, policyClosed,
+			options.SlowConsumers, OutboundTotals.DroppedMessages, OutboundTotals.ConflatedMessages, OutboundTotals.StallTime,
+			OutboundDisconnects, qwPeakQueuedBytes);
+		fclose(pFile);
+	}
+
+	return (failed != 0) ? 1 : 0;
+}
@@ -0,0 +1,311 @@
+//
+// pongtest.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Measures how long a pong waits while a 100 MB message is sent over a slow response. The message is sent the way
+//     WebSocketServer::Send sends it, under the message lock with each frame planned by PlanWebSocketFragment and written
+//     under the frame lock, and a second thread sends a pong every few milliseconds the way SendControl does, taking only
+//     the frame lock.
+//     It runs once with MaxFramePayloadLength at 64 KB and once without fragmentation, as Send was before.
+//     The written bytes are read back with the client side of the protocol core to check every pong went out between
+//     fragments and the message arrived whole. WebSocketServer needs IIS, the response below stands in for IHttpResponse.
+//
+//     Usage: pongtest [--megabytes <count>] [--rate <MB per second>] [--fragment <bytes>] [--interval <ms between pongs>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The most a response writes at a time, like one call of WriteEntityChunks
+#define SLOW_RESPONSE_WRITE_LENGTH 0x10000
+
+// A response that takes as long to write as a slow link, and keeps what was written
+struct SLOW_RESPONSE
+{
+	double BytesPerSecond;
+	std::vector<unsigned char> Written;
+};
+
+// The locks and settings of a connection, as in WebSocketServer
+struct SLOW_CONNECTION
+{
+	SLOW_RESPONSE Response;
+	std::mutex MessageLock;
+	std::recursive_mutex FrameLock;
+	unsigned long long MaxFramePayloadLength;
+	bool IsFragment;
+};
+
+// Write bytes to the response, taking the time the link needs for them
+static void WriteResponse(SLOW_RESPONSE* pResponse, const unsigned char* pData, unsigned long long qwLength)
+{
+	unsigned long long qwWrite;
+
+	while (qwLength != 0)
+	{
+		qwWrite = std::min<unsigned long long>(qwLength, SLOW_RESPONSE_WRITE_LENGTH);
+		pResponse->Written.insert(pResponse->Written.end(), pData, pData + qwWrite);
+		std::this_thread::sleep_for(std::chrono::duration<double>((double)qwWrite / pResponse->BytesPerSecond));
+		pData += qwWrite;
+		qwLength -= qwWrite;
+	}
+}
+
+// Write one frame, the caller holds the frame lock
+static void WriteFrame(SLOW_CONNECTION* pConnection, unsigned char frameByte, const unsigned char* pPayload, unsigned long long qwLength)
+{
+	unsigned char header[10];
+	unsigned int headerLength;
+
+	headerLength = EncodeWebSocketFrameHeader(header, frameByte, qwLength);
+	WriteResponse(&pConnection->Response, header, headerLength);
+	WriteResponse(&pConnection->Response, pPayload, qwLength);
+}
+
+// A binary message, split into frames of at most MaxFramePayloadLength like Send
+static void SendMessage(SLOW_CONNECTION* pConnection, const unsigned char* pPayload, unsigned long long qwLength)
+{
+	unsigned long long qwFrameLength;
+	unsigned char frameByte;
+
+	std::lock_guard<std::mutex> messageLock(pConnection->MessageLock);
+
+	do
+	{
+		// Each frame is written under the frame lock so pending control frames can go between them
+		std::lock_guard<std::recursive_mutex> frameLock(pConnection->FrameLock);
+
+		PlanWebSocketFragment(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, qwLength,
+			pConnection->MaxFramePayloadLength, &pConnection->IsFragment, &frameByte, &qwFrameLength);
+		WriteFrame(pConnection, frameByte, pPayload, qwFrameLength);
+
+		pPayload += qwFrameLength;
+		qwLength -= qwFrameLength;
+
+	} while (qwLength != 0);
+}
+
+// A pong only takes the frame lock, like SendControl
+static void SendPong(SLOW_CONNECTION* pConnection, unsigned int sequence)
+{
+	unsigned char frameByte;
+
+	std::lock_guard<std::recursive_mutex> frameLock(pConnection->FrameLock);
+
+	EncodeWebSocketFrameOpcode(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE, &pConnection->IsFragment, &frameByte);
+	WriteFrame(pConnection, frameByte, (const unsigned char*)&sequence, sizeof(sequence));
+}
+
+// Reads the written bytes back for ReceiveWebSocketData
+struct WRITTEN_READER
+{
+	const std::vector<unsigned char>* pWritten;
+	size_t offset;
+};
+
+static unsigned long WrittenRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	WRITTEN_READER* pReader = (WRITTEN_READER*)pContext;
+	size_t length;
+
+	length = std::min<size_t>(dwLength, pReader->pWritten->size() - pReader->offset);
+	if ((length == 0) && (dwLength != 0)) {
+		return 1;
+	}
+	memcpy(pBuffer, pReader->pWritten->data() + pReader->offset, length);
+	pReader->offset += length;
+	*pdwBytesRead = (unsigned long)length;
+
+	return 0;
+}
+
+// Check the message arrived whole with every pong in order, returns the pongs that went out before the message ended
+static bool CheckWritten(const std::vector<unsigned char>& written, const std::vector<unsigned char>& message,
+	unsigned int pongs, unsigned int* pPongsInside)
+{
+	std::vector<unsigned char> buffer(0x10000);
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	WRITTEN_READER reader;
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	unsigned long long qwReceived;
+	unsigned long dwReceived;
+	unsigned int sequence;
+	unsigned int pongsSeen;
+	bool bMessageDone;
+
+	reader.pWritten = &written;
+	reader.offset = 0;
+	memset(&stream, 0, sizeof(stream));
+	memset(&frame, 0, sizeof(frame));
+	stream.bQueuing = true;
+	stream.pFrameBuffer = frameBuffer;
+	stream.bClient = true;
+	bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+
+	qwReceived = 0;
+	pongsSeen = 0;
+	*pPongsInside = 0;
+	bMessageDone = false;
+	while (reader.offset < written.size())
+	{
+		if (ReceiveWebSocketData(&stream, &frame, 0xFFFFFFFFFFFFFFFFULL, WrittenRead, &reader, buffer.data(), (unsigned long)buffer.size(),
+			&dwReceived, &bufferType, NULL) != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			fprintf(stderr, "the written frames don't parse at byte %zu\n", reader.offset);
+			return false;
+		}
+
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE)
+		{
+			memcpy(&sequence, buffer.data(), sizeof(sequence));
+			if ((dwReceived != sizeof(sequence)) || (sequence != pongsSeen)) {
+				fprintf(stderr, "pong %u arrived out of order\n", pongsSeen);
+				return false;
+			}
+			pongsSeen++;
+			if (!bMessageDone)
+			{
+				(*pPongsInside)++;
+				// A continuation takes its type from the last call, which was the pong
+				bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+			}
+			continue;
+		}
+
+		if ((bMessageDone) || (qwReceived + dwReceived > message.size()) ||
+			(memcmp(buffer.data(), message.data() + qwReceived, dwReceived) != 0)) {
+			fprintf(stderr, "the message is wrong at byte %llu\n", qwReceived);
+			return false;
+		}
+		qwReceived += dwReceived;
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) {
+			bMessageDone = true;
+		}
+	}
+
+	return (bMessageDone) && (qwReceived == message.size()) && (pongsSeen == pongs);
+}
+
+// Send the message while pongs are sent from another thread, returns false if the written bytes are wrong
+static bool RunSend(const std::vector<unsigned char>& message, double bytesPerSecond, unsigned long long qwFragment,
+	unsigned int interval, std::vector<double>* pLatencies, unsigned int* pPongsInside)
+{
+	SLOW_CONNECTION connection;
+	std::atomic<bool> bSending;
+	std::thread pongs;
+
+	connection.Response.BytesPerSecond = bytesPerSecond;
+	connection.Response.Written.reserve(message.size() + 0x100000);
+	connection.MaxFramePayloadLength = qwFragment;
+	connection.IsFragment = false;
+	pLatencies->clear();
+
+	// The pong thread measures from the call until its frame is written
+	bSending.store(true);
+	pongs = std::thread([&]()
+		{
+			unsigned int sequence = 0;
+			while (bSending.load())
+			{
+				Clock::time_point start = Clock::now();
+				SendPong(&connection, sequence++);
+				pLatencies->push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+				std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+			}
+		});
+
+	// Let the first pong go out before the message starts
+	std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+	SendMessage(&connection, message.data(), message.size());
+	bSending.store(false);
+	pongs.join();
+
+	return CheckWritten(connection.Response.Written, message, (unsigned int)pLatencies->size(), pPongsInside);
+}
+
+static double GetPercentile(std::vector<double> values, double percentile)
+{
+	if (values.empty()) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[(size_t)((double)(values.size() - 1) * percentile)];
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long long qwMegabytes = 100;
+	double rate = 200;
+	unsigned long long qwFragment = 0x10000;
+	unsigned int interval = 5;
+	std::vector<unsigned char> message;
+	std::vector<double> fragmentedLatencies;
+	std::vector<double> wholeLatencies;
+	unsigned int fragmentedInside;
+	unsigned int wholeInside;
+	double fragmentTime;
+	bool bCorrect;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--megabytes") == 0) && (i + 1 < argc)) {
+			qwMegabytes = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)) {
+			rate = atof(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--fragment") == 0) && (i + 1 < argc)) {
+			qwFragment = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--interval") == 0) && (i + 1 < argc)) {
+			interval = (unsigned int)atoi(argv[++i]);
+		}
+		else {
+			fprintf(stderr, "usage: pongtest [--megabytes <count>] [--rate <MB per second>] [--fragment <bytes>] [--interval <ms between pongs>]\n");
+			return 1;
+		}
+	}
+	if ((qwMegabytes == 0) || (rate <= 0) || (qwFragment == 0) || (interval == 0)) {
+		fprintf(stderr, "--megabytes, --rate, --fragment and --interval must be more than 0\n");
+		return 1;
+	}
+
+	message.resize((size_t)(qwMegabytes << 20));
+	for (size_t i = 0; i < message.size(); i++) {
+		message[i] = (unsigned char)(i * 31 + (i >> 16));
+	}
+
+	bCorrect = RunSend(message, rate * 1000000, qwFragment, interval, &fragmentedLatencies, &fragmentedInside);
+	bCorrect = RunSend(message, rate * 1000000, 0, interval, &wholeLatencies, &wholeInside) && bCorrect;
+
+	// A pong waits for at most the fragment being written, allow for the scheduler
+	fragmentTime = (double)qwFragment / (rate * 1000000) * 1000;
+	if ((fragmentedInside == 0) || (GetPercentile(fragmentedLatencies, 0.99) > fragmentTime * 4 + 20)) {
+		bCorrect = false;
+	}
+
+	printf("%-10s %4u pongs, %4u before the message ended, p50 %8.2f ms, p99 %8.2f ms, max %8.2f ms\n", "fragmented", (unsigned int)fragmentedLatencies.size(),
+		fragmentedInside, GetPercentile(fragmentedLatencies, 0.5), GetPercentile(fragmentedLatencies, 0.99), GetPercentile(fragmentedLatencies, 1));
+	printf("%-10s %4u pongs, %4u before the message ended, p50 %8.2f ms, p99 %8.2f ms, max %8.2f ms\n", "whole", (unsigned int)wholeLatencies.size(),
+		wholeInside, GetPercentile(wholeLatencies, 0.5), GetPercentile(wholeLatencies, 0.99), GetPercentile(wholeLatencies, 1));
+	printf("correct %s\n", bCorrect ? "yes" : "no");
+
+	return bCorrect ? 0 : 1;
+}
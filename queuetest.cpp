@@ -0,0 +1,360 @@
+//
+// queuetest.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Runs each outbound policy against a writer that's stuck in a write the client isn't reading. Messages are queued
+//     the way WebSocketServer::QueueMessage queues them, with PushOutboundMessage under the queue lock, and a writer thread
+//     takes them with PopOutboundMessage the way WriteQueue does. Checks which messages each policy drops, that a close
+//     frame queued on a full queue is never dropped, and that the disconnect policy frees the writer by resetting the
+//     response instead of queueing behind it. WebSocketServer needs IIS, the response below stands in for IHttpResponse.
+//
+//     Usage: queuetest
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// Each data message is 1 KB and carries its number, the queue holds 8 of them
+#define QUEUE_MESSAGE_LENGTH 0x400
+#define QUEUE_LIMIT (8 * QUEUE_MESSAGE_LENGTH)
+
+// Stands for the close frame in the list of written messages
+#define QUEUE_CLOSE_WRITTEN -1
+
+// A response whose writes block until the client reads, or the connection is reset
+struct STALLED_RESPONSE
+{
+	std::mutex Lock;
+	std::condition_variable Changed;
+	bool bStalled;
+	bool bReset;
+	// The numbers of the data messages written, in order
+	std::vector<int> Written;
+};
+
+// A connection with an outbound queue and its writer
+struct QUEUE_CONNECTION
+{
+	std::mutex QueueLock;
+	std::condition_variable QueueChanged;
+	WEB_SOCKET_OUTBOUND_QUEUE Queue;
+	bool bDone;
+	// Set once the disconnect policy reset the response
+	bool bReset;
+	// The error of the write that failed, 0 if none did
+	unsigned long WriteError;
+	Clock::time_point WriterExit;
+	STALLED_RESPONSE Response;
+	std::thread Writer;
+};
+
+static unsigned long long QueueTimestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Write a message, blocks while the response is stalled, fails once it's reset
+static unsigned long WriteResponse(STALLED_RESPONSE* pResponse, WEB_SOCKET_QUEUED_MESSAGE* pMessage)
+{
+	std::unique_lock<std::mutex> lock(pResponse->Lock);
+	int number;
+
+	pResponse->Changed.wait(lock, [pResponse] { return (!pResponse->bStalled) || (pResponse->bReset); });
+	if (pResponse->bReset) {
+		return 1;
+	}
+
+	if (pMessage->BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+		pResponse->Written.push_back(QUEUE_CLOSE_WRITTEN);
+	}
+	else {
+		memcpy(&number, pMessage->pData, sizeof(number));
+		pResponse->Written.push_back(number);
+	}
+
+	return 0;
+}
+
+// Take messages off the queue and write them, like WebSocketServer::WriteQueue
+static void WriteQueue(QUEUE_CONNECTION* pConnection)
+{
+	WEB_SOCKET_QUEUED_MESSAGE* pMessage;
+	unsigned long errorCode;
+
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(pConnection->QueueLock);
+		pConnection->QueueChanged.wait(lock, [pConnection] { return (pConnection->Queue.pHead != NULL) || (pConnection->bDone); });
+		pMessage = PopOutboundMessage(&pConnection->Queue, QueueTimestamp());
+		if (pMessage == NULL) {
+			pConnection->WriterExit = Clock::now();
+			return;
+		}
+		pConnection->QueueChanged.notify_all();
+		lock.unlock();
+
+		errorCode = WriteResponse(&pConnection->Response, pMessage);
+		FreeOutboundMessage(pMessage);
+
+		// The connection is broken, drop what's left
+		if (errorCode != 0)
+		{
+			lock.lock();
+			pConnection->WriteError = errorCode;
+			pConnection->Queue.Stats.DroppedMessages += pConnection->Queue.Stats.QueuedMessages;
+			ClearOutboundQueue(&pConnection->Queue);
+			pConnection->WriterExit = Clock::now();
+			return;
+		}
+	}
+}
+
+// Queue a message like WebSocketServer::PushQueue, the disconnect policy resets the response outside the queue lock
+static IIS_WEB_SOCKET_QUEUE_RESULT QueueMessage(QUEUE_CONNECTION* pConnection, IIS_WEB_SOCKET_BUFFER_TYPE bufferType,
+	const void* pData, unsigned long long qwLength, const char* pKey)
+{
+	IIS_WEB_SOCKET_QUEUE_RESULT result;
+	bool bReset;
+
+	{
+		std::lock_guard<std::mutex> lock(pConnection->QueueLock);
+		result = PushOutboundMessage(&pConnection->Queue, bufferType, pData, qwLength, pKey, QueueTimestamp());
+		bReset = (result == IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT) && (!pConnection->bReset);
+		if (bReset) {
+			pConnection->bReset = true;
+		}
+		pConnection->QueueChanged.notify_all();
+	}
+
+	if (bReset)
+	{
+		std::lock_guard<std::mutex> lock(pConnection->Response.Lock);
+		pConnection->Response.bReset = true;
+		pConnection->Response.Changed.notify_all();
+	}
+
+	return result;
+}
+
+// Queue data message number, with a key for the conflate policy
+static IIS_WEB_SOCKET_QUEUE_RESULT QueueData(QUEUE_CONNECTION* pConnection, int number, const char* pKey)
+{
+	unsigned char message[QUEUE_MESSAGE_LENGTH];
+
+	memset(message, 0, sizeof(message));
+	memcpy(message, &number, sizeof(number));
+
+	return QueueMessage(pConnection, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, message, sizeof(message), pKey);
+}
+
+// Queue the close frame of a graceful close, 1001 going away
+static IIS_WEB_SOCKET_QUEUE_RESULT QueueClose(QUEUE_CONNECTION* pConnection)
+{
+	const unsigned char close[2] = { 0x03, 0xE9 };
+
+	return QueueMessage(pConnection, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE, close, sizeof(close), NULL);
+}
+
+// Start the writer and wait until it's stuck writing message 0
+static void StartStalled(QUEUE_CONNECTION* pConnection, IIS_WEB_SOCKET_OUTBOUND_POLICY policy)
+{
+	memset(&pConnection->Queue, 0, sizeof(pConnection->Queue));
+	pConnection->Queue.qwLimit = QUEUE_LIMIT;
+	pConnection->Queue.Policy = policy;
+	pConnection->bDone = false;
+	pConnection->bReset = false;
+	pConnection->WriteError = 0;
+	pConnection->Response.bStalled = true;
+	pConnection->Response.bReset = false;
+	pConnection->Response.Written.clear();
+	pConnection->Writer = std::thread(WriteQueue, pConnection);
+
+	QueueData(pConnection, 0, NULL);
+	std::unique_lock<std::mutex> lock(pConnection->QueueLock);
+	pConnection->QueueChanged.wait(lock, [pConnection] { return pConnection->Queue.Stats.SentMessages == 1; });
+}
+
+// Let the client read again, wait for the writer to drain the queue and stop
+static void Finish(QUEUE_CONNECTION* pConnection)
+{
+	{
+		std::lock_guard<std::mutex> lock(pConnection->Response.Lock);
+		pConnection->Response.bStalled = false;
+		pConnection->Response.Changed.notify_all();
+	}
+	{
+		std::lock_guard<std::mutex> lock(pConnection->QueueLock);
+		pConnection->bDone = true;
+		pConnection->QueueChanged.notify_all();
+	}
+	pConnection->Writer.join();
+	ClearOutboundQueue(&pConnection->Queue);
+}
+
+// Compare what was written with what the policy should have kept
+static bool CheckWritten(const char* pName, QUEUE_CONNECTION* pConnection, const std::vector<int>& expected)
+{
+	std::vector<int>& written = pConnection->Response.Written;
+
+	printf("%-11s written", pName);
+	for (size_t i = 0; i < written.size(); i++) {
+		if (written[i] == QUEUE_CLOSE_WRITTEN) {
+			printf(" close");
+		}
+		else {
+			printf(" %d", written[i]);
+		}
+	}
+	printf(", dropped %llu, conflated %llu\n", pConnection->Queue.Stats.DroppedMessages, pConnection->Queue.Stats.ConflatedMessages);
+
+	if (written != expected) {
+		fprintf(stderr, "%s: the written messages aren't the ones the policy keeps\n", pName);
+		return false;
+	}
+
+	return true;
+}
+
+// Messages 1 to 8 fill the queue behind the stuck message 0, 9 to 19 are dropped, the close frame is still queued
+static bool TestDropNewest(QUEUE_CONNECTION* pConnection)
+{
+	std::vector<int> expected;
+	bool bCorrect = true;
+
+	StartStalled(pConnection, IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_NEWEST_OUTBOUND_POLICY);
+	for (int i = 1; i < 20; i++)
+	{
+		if ((QueueData(pConnection, i, NULL) == IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DROPPED_QUEUE_RESULT) != (i > 8)) {
+			fprintf(stderr, "drop-newest: message %d wasn't %s\n", i, (i > 8) ? "dropped" : "queued");
+			bCorrect = false;
+		}
+	}
+	if (QueueClose(pConnection) != IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_QUEUED_QUEUE_RESULT) {
+		fprintf(stderr, "drop-newest: the close frame wasn't queued on a full queue\n");
+		bCorrect = false;
+	}
+	Finish(pConnection);
+
+	for (int i = 0; i <= 8; i++) {
+		expected.push_back(i);
+	}
+	expected.push_back(QUEUE_CLOSE_WRITTEN);
+
+	return CheckWritten("drop-newest", pConnection, expected) && bCorrect;
+}
+
+// The queue keeps the newest messages, the close frame stays when newer messages push out the ones before it
+static bool TestDropOldest(QUEUE_CONNECTION* pConnection)
+{
+	std::vector<int> expected;
+	bool bCorrect = true;
+
+	StartStalled(pConnection, IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DROP_OLDEST_OUTBOUND_POLICY);
+	for (int i = 1; i < 20; i++) {
+		QueueData(pConnection, i, NULL);
+	}
+	if (QueueClose(pConnection) != IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_QUEUED_QUEUE_RESULT) {
+		fprintf(stderr, "drop-oldest: the close frame wasn't queued on a full queue\n");
+		bCorrect = false;
+	}
+	for (int i = 20; i < 24; i++) {
+		QueueData(pConnection, i, NULL);
+	}
+	Finish(pConnection);
+
+	expected = { 0, 17, 18, 19, QUEUE_CLOSE_WRITTEN, 20, 21, 22, 23 };
+
+	return CheckWritten("drop-oldest", pConnection, expected) && bCorrect;
+}
+
+// Four keys, each message replaces the last one with its key in place, nothing has to be dropped
+static bool TestConflate(QUEUE_CONNECTION* pConnection)
+{
+	std::vector<int> expected;
+	char key[8];
+	bool bCorrect = true;
+
+	StartStalled(pConnection, IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_CONFLATE_OUTBOUND_POLICY);
+	for (int i = 1; i < 20; i++) {
+		snprintf(key, sizeof(key), "k%d", i % 4);
+		QueueData(pConnection, i, key);
+	}
+	if (QueueClose(pConnection) != IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_QUEUED_QUEUE_RESULT) {
+		fprintf(stderr, "conflate: the close frame wasn't queued\n");
+		bCorrect = false;
+	}
+	Finish(pConnection);
+
+	expected = { 0, 17, 18, 19, 16, QUEUE_CLOSE_WRITTEN };
+
+	return CheckWritten("conflate", pConnection, expected) && bCorrect;
+}
+
+// Message 9 goes over the limit, the queue is dropped and the response reset, which ends the stuck write at once
+static bool TestDisconnect(QUEUE_CONNECTION* pConnection)
+{
+	std::vector<int> expected;
+	Clock::time_point reset;
+	double milliseconds;
+	bool bCorrect = true;
+
+	StartStalled(pConnection, IIS_WEB_SOCKET_OUTBOUND_POLICY::IIS_WEB_SOCKET_DISCONNECT_OUTBOUND_POLICY);
+	for (int i = 1; i <= 8; i++) {
+		QueueData(pConnection, i, NULL);
+	}
+	reset = Clock::now();
+	if (QueueData(pConnection, 9, NULL) != IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT) {
+		fprintf(stderr, "disconnect: the message over the limit didn't disconnect\n");
+		bCorrect = false;
+	}
+	if (QueueClose(pConnection) != IIS_WEB_SOCKET_QUEUE_RESULT::IIS_WEB_SOCKET_DISCONNECT_QUEUE_RESULT) {
+		fprintf(stderr, "disconnect: a message was queued after the disconnect\n");
+		bCorrect = false;
+	}
+
+	// The writer gets out of its write without the client reading anything
+	pConnection->Writer.join();
+	milliseconds = std::chrono::duration<double, std::milli>(pConnection->WriterExit - reset).count();
+	printf("disconnect  the stuck writer returned %.2f ms after the reset with error %lu\n", milliseconds, pConnection->WriteError);
+	if ((pConnection->WriteError == 0) || (milliseconds > 1000.0)) {
+		fprintf(stderr, "disconnect: the reset didn't free the writer\n");
+		bCorrect = false;
+	}
+	ClearOutboundQueue(&pConnection->Queue);
+
+	return CheckWritten("disconnect", pConnection, expected) && bCorrect;
+}
+
+int main(int argc, char** argv)
+{
+	QUEUE_CONNECTION connection;
+	bool bCorrect;
+
+	(void)argv;
+	if (argc > 1) {
+		fprintf(stderr, "usage: queuetest\n");
+		return 1;
+	}
+
+	bCorrect = TestDropNewest(&connection);
+	bCorrect = TestDropOldest(&connection) && bCorrect;
+	bCorrect = TestConflate(&connection) && bCorrect;
+	bCorrect = TestDisconnect(&connection) && bCorrect;
+
+	return bCorrect ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+
+//
+// replay.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Replays a capture file written by WebSocketServer::StartCapture through the protocol core's receive path.
+//     A fake request returns the captured chunks exactly as ReadEntityBody returned them, as fast as possible.
+//
+//     Usage: replay <capture file> [--buffer <bytes>] [--iterations <count>] [--json <output file>]
+//
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketcapture.h"
+using namespace IISWebSocketServer;
+
+// Returned by the fake request at the end of the capture, the value of ERROR_HANDLE_EOF
+#define REPLAY_END_OF_CAPTURE 38
+
+// A chunk returned by ReadEntityBody
+struct REPLAY_CHUNK
+{
+	size_t Offset;
+	unsigned long dwLength;
+};
+
+// The fake request, hands out the captured chunks in order
+struct REPLAY_REQUEST
+{
+	std::vector<unsigned char> Data;
+	std::vector<REPLAY_CHUNK> Chunks;
+	size_t Chunk;
+	unsigned long dwChunkOffset;
+};
+
+// Stands in for ReadEntityBody, a read never returns more than the captured chunk
+// If the receive buffer is smaller than the chunk, the rest of it is returned by the next read
+static unsigned long ReplayRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	REPLAY_REQUEST* pRequest = (REPLAY_REQUEST*)pContext;
+	REPLAY_CHUNK* pChunk;
+	unsigned long dwRemaining;
+
+	*pdwBytesRead = 0;
+	if (pRequest->Chunk >= pRequest->Chunks.size()) {
+		return REPLAY_END_OF_CAPTURE;
+	}
+
+	pChunk = &pRequest->Chunks[pRequest->Chunk];
+	dwRemaining = pChunk->dwLength - pRequest->dwChunkOffset;
+	if (dwLength > dwRemaining) {
+		dwLength = dwRemaining;
+	}
+
+	memcpy(pBuffer, &pRequest->Data[pChunk->Offset + pRequest->dwChunkOffset], dwLength);
+	*pdwBytesRead = dwLength;
+
+	pRequest->dwChunkOffset += dwLength;
+	if (pRequest->dwChunkOffset == pChunk->dwLength) {
+		pRequest->Chunk++;
+		pRequest->dwChunkOffset = 0;
+	}
+
+	return 0;
+}
+
+// Nanosecond timestamps for the phase timing
+static unsigned long long ReplayTimestamp()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Load a capture file
+static bool LoadCapture(const char* pPath, IIS_WEB_SOCKET_CAPTURE_FILE_HEADER* pHeader, REPLAY_REQUEST* pRequest)
+{
+	FILE* pFile;
+	unsigned char length[4];
+	REPLAY_CHUNK chunk;
+	bool bSuccess = false;
+
+	pFile = fopen(pPath, "rb");
+	if (pFile == NULL) {
+		fprintf(stderr, "failed to open %s\n", pPath);
+		return false;
+	}
+
+	if ((fread(pHeader, sizeof(IIS_WEB_SOCKET_CAPTURE_FILE_HEADER), 1, pFile) != 1) ||
+		(pHeader->Magic != IIS_WEB_SOCKET_CAPTURE_MAGIC) || (pHeader->Version != IIS_WEB_SOCKET_CAPTURE_VERSION)) {
+		fprintf(stderr, "%s is not a capture file\n", pPath);
+		goto exit;
+	}
+
+	// Read every record, the chunk lengths are little-endian
+	while (fread(length, 4, 1, pFile) == 1)
+	{
+		chunk.Offset = pRequest->Data.size();
+		chunk.dwLength = (unsigned long)length[0] | ((unsigned long)length[1] << 8) | ((unsigned long)length[2] << 16) | ((unsigned long)length[3] << 24);
+		pRequest->Data.resize(chunk.Offset + chunk.dwLength);
+		if ((chunk.dwLength != 0) && (fread(&pRequest->Data[chunk.Offset], chunk.dwLength, 1, pFile) != 1)) {
+			fprintf(stderr, "%s is truncated\n", pPath);
+			goto exit;
+		}
+		pRequest->Chunks.push_back(chunk);
+	}
+
+	bSuccess = true;
+
+exit:
+
+	fclose(pFile);
+	return bSuccess;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* pCapturePath = NULL;
+	const char* pJsonPath = NULL;
+	unsigned long dwBufferLength = 0x1000;
+	unsigned long long qwIterations = 10;
+	IIS_WEB_SOCKET_CAPTURE_FILE_HEADER header;
+	REPLAY_REQUEST request;
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	WEB_SOCKET_RECEIVE_TIMING timing;
+	IIS_WEB_SOCKET_RECEIVE_RESULT result;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	std::vector<char> buffer;
+	char frameBuffer[0x100];
+	unsigned long dwBytesReceived;
+	unsigned long long qwFrames = 0;
+	unsigned long long qwMessages = 0;
+	unsigned long long qwBytes = 0;
+	unsigned long long qwReadTime = 0;
+	unsigned long long qwParseTime = 0;
+	unsigned long long qwUnmaskTime = 0;
+	unsigned long long qwStart;
+	double elapsed;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--buffer") == 0) && (i + 1 < argc)) {
+			dwBufferLength = strtoul(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--iterations") == 0) && (i + 1 < argc)) {
+			qwIterations = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else if ((pCapturePath == NULL) && (argv[i][0] != '-')) {
+			pCapturePath = argv[i];
+		}
+		else {
+			pCapturePath = NULL;
+			break;
+		}
+	}
+
+	if ((pCapturePath == NULL) || (dwBufferLength == 0) || (qwIterations == 0)) {
+		fprintf(stderr, "usage: replay <capture file> [--buffer <bytes>] [--iterations <count>] [--json <output file>]\n");
+		return 1;
+	}
+
+	if (!LoadCapture(pCapturePath, &header, &request)) {
+		return 1;
+	}
+	buffer.resize(dwBufferLength);
+
+	timing.pfnTimestamp = ReplayTimestamp;
+	qwStart = ReplayTimestamp();
+
+	for (unsigned long long iteration = 0; iteration < qwIterations; iteration++)
+	{
+		// Every iteration starts from the beginning of the capture with a new connection
+		request.Chunk = 0;
+		request.dwChunkOffset = 0;
+		memset(&stream, 0, sizeof(stream));
+		memset(&frame, 0, sizeof(frame));
+		stream.bQueuing = true;
+		stream.pFrameBuffer = frameBuffer;
+		bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+
+		for (;;)
+		{
+			result = ReceiveWebSocketData(&stream, &frame, header.MaxPayloadLength, ReplayRead, &request,
+				buffer.data(), dwBufferLength, &dwBytesReceived, &bufferType, &timing);
+			if (result == IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_READ_FAILED_RECEIVE_RESULT) {
+				// The end of the capture
+				break;
+			}
+			if (result != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+				fprintf(stderr, "receive failed with result %d after %llu frames\n", (int)result, qwFrames);
+				return 1;
+			}
+
+			qwReadTime += timing.qwReadWait;
+			qwParseTime += timing.qwParse;
+			qwUnmaskTime += timing.qwUnmask;
+			qwBytes += dwBytesReceived;
+			if (timing.bNewFrame) {
+				qwFrames++;
+			}
+			if ((stream.bQueuing) &&
+				(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE) &&
+				(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE)) {
+				qwMessages++;
+			}
+		}
+	}
+
+	elapsed = (double)(ReplayTimestamp() - qwStart) / 1000000000.0;
+
+	printf("capture          connection %llu, %zu chunks, %zu bytes\n", header.ConnectionId, request.Chunks.size(), request.Data.size());
+	printf("iterations       %llu\n", qwIterations);
+	printf("frames           %llu (%.0f frames/s)\n", qwFrames, (double)qwFrames / elapsed);
+	printf("messages         %llu (%.0f messages/s)\n", qwMessages, (double)qwMessages / elapsed);
+	printf("payload          %.2f MB/s\n", (double)qwBytes / elapsed / 1000000.0);
+	if (qwFrames != 0) {
+		printf("read             %.1f ns/frame\n", (double)qwReadTime / (double)qwFrames);
+		printf("parse            %.1f ns/frame\n", (double)qwParseTime / (double)qwFrames);
+		printf("unmask           %.1f ns/frame\n", (double)qwUnmaskTime / (double)qwFrames);
+	}
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"iterations\": %llu,\n  \"frames\": %llu,\n  \"messages\": %llu,\n  \"seconds\": %.6f,\n"
+			"  \"frames_per_second\": %.0f,\n  \"bytes_per_second\": %.0f,\n"
+			"  \"phase_ns\": { \"read\": %llu, \"parse\": %llu, \"unmask\": %llu }\n}\n",
+			qwIterations, qwFrames, qwMessages, elapsed, (double)qwFrames / elapsed, (double)qwBytes / elapsed,
+			qwReadTime, qwParseTime, qwUnmaskTime);
+		fclose(pFile);
+	}
+
+	return 0;
+}
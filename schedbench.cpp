@@ -0,0 +1,423 @@
+
+//
+// schedbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Simulates inbound messages of many connections dispatched by a few worker threads, while a noisy connection
+//     sends bursts of thousands of messages. The same load runs three times: dispatching a connection until it has
+//     nothing left like a thread per connection, with a quantum per turn, and with the admin connections in a
+//     priority class of their own. Reports the latency of the quiet and admin connections in each.
+//
+//     Usage: schedbench [--workers <count>] [--quiet <connections>] [--admin <connections>] [--interval <ms between messages>]
+//                       [--noisy <connections>] [--burst <messages>] [--burst-interval <ms>] [--work <us per message>]
+//                       [--size <bytes>] [--quantum <messages>] [--bytes] [--admin-weight <turns>] [--duration <seconds>]
+//                       [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketscheduler.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The kinds of simulated connections
+#define SIM_QUIET 0
+#define SIM_ADMIN 1
+#define SIM_NOISY 2
+
+// A message waiting to be dispatched
+struct SIM_MESSAGE
+{
+	unsigned long long Sequence;
+	Clock::time_point Queued;
+};
+
+// A simulated connection, its messages are queued by the generator and dispatched by the workers
+struct SIM_CONNECTION
+{
+	unsigned int Kind;
+	std::mutex Lock;
+	std::deque<SIM_MESSAGE> Messages;
+	unsigned long long NextSequence;
+	// Only touched by the turn that dispatches the connection
+	unsigned long long ExpectedSequence;
+	unsigned long long OutOfOrder;
+	std::vector<unsigned long long> Latencies;
+	Clock::time_point Due;
+	WEB_SOCKET_SCHEDULER_ENTRY Entry;
+};
+
+// What every run shares
+struct SIM_SETTINGS
+{
+	unsigned int Workers;
+	unsigned int Quiet;
+	unsigned int Admin;
+	unsigned int Interval;
+	unsigned int Noisy;
+	unsigned int Burst;
+	unsigned int BurstInterval;
+	unsigned int Work;
+	unsigned int Size;
+	unsigned long long Quantum;
+	bool bBytes;
+	unsigned int AdminWeight;
+	unsigned int Duration;
+};
+
+// The latency percentiles of a kind of connection in microseconds
+struct SIM_LATENCY
+{
+	double p50;
+	double p99;
+	double p999;
+	double max;
+	unsigned long long Count;
+};
+
+// The result of a run
+struct SIM_RESULT
+{
+	const char* pMode;
+	SIM_LATENCY Latency[3];
+	IIS_WEB_SOCKET_SCHEDULER_STATS Stats;
+	unsigned long long Generated;
+	unsigned long long OutOfOrder;
+};
+
+// Spin for the handler's work, a sleep would give the processor away
+static void SimulateWork(unsigned int microseconds)
+{
+	Clock::time_point end = Clock::now() + std::chrono::microseconds(microseconds);
+	while (Clock::now() < end) {
+	}
+}
+
+// The dispatch callback, handles the oldest message of a connection
+static bool DispatchMessage(void* pConnection, void* pContext, unsigned long long* pqwBytes)
+{
+	SIM_CONNECTION* pSim = (SIM_CONNECTION*)pConnection;
+	SIM_SETTINGS* pSettings = (SIM_SETTINGS*)pContext;
+	SIM_MESSAGE message;
+
+	{
+		std::lock_guard<std::mutex> lock(pSim->Lock);
+		if (pSim->Messages.empty()) {
+			return false;
+		}
+		message = pSim->Messages.front();
+		pSim->Messages.pop_front();
+	}
+
+	SimulateWork(pSettings->Work);
+	pSim->Latencies.push_back((unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - message.Queued).count());
+	if (message.Sequence != pSim->ExpectedSequence) {
+		pSim->OutOfOrder++;
+	}
+	pSim->ExpectedSequence = message.Sequence + 1;
+
+	*pqwBytes = pSettings->Size;
+	return true;
+}
+
+// Queue messages on a connection and tell the scheduler
+static void QueueMessages(WebSocketScheduler* pScheduler, SIM_CONNECTION* pSim, unsigned int count, Clock::time_point now)
+{
+	{
+		std::lock_guard<std::mutex> lock(pSim->Lock);
+		for (unsigned int i = 0; i < count; i++) {
+			pSim->Messages.push_back(SIM_MESSAGE{ pSim->NextSequence++, now });
+		}
+	}
+	pScheduler->SetReady(&pSim->Entry);
+}
+
+static SIM_LATENCY GetLatency(std::vector<SIM_CONNECTION*>& connections, unsigned int kind)
+{
+	std::vector<unsigned long long> latencies;
+	SIM_LATENCY latency;
+
+	for (SIM_CONNECTION* pSim : connections)
+	{
+		if (pSim->Kind == kind) {
+			latencies.insert(latencies.end(), pSim->Latencies.begin(), pSim->Latencies.end());
+		}
+	}
+	memset(&latency, 0, sizeof(latency));
+	if (latencies.empty()) {
+		return latency;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	latency.p50 = (double)latencies[latencies.size() / 2] / 1000.0;
+	latency.p99 = (double)latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)] / 1000.0;
+	latency.p999 = (double)latencies[std::min(latencies.size() - 1, latencies.size() * 999 / 1000)] / 1000.0;
+	latency.max = (double)latencies.back() / 1000.0;
+	latency.Count = latencies.size();
+	return latency;
+}
+
+// Run the load once with a scheduler set up by pOptions, the admin connections go in class 0 and the rest in the last class
+static bool RunSimulation(SIM_SETTINGS* pSettings, const char* pMode, const IIS_WEB_SOCKET_SCHEDULER_OPTIONS* pOptions, SIM_RESULT* pResult)
+{
+	WebSocketScheduler scheduler;
+	std::vector<SIM_CONNECTION*> connections;
+	std::vector<std::thread> workers;
+	Clock::time_point start;
+	Clock::time_point end;
+	Clock::time_point now;
+	Clock::time_point deadline;
+	unsigned int count;
+	unsigned int bulkClass;
+
+	memset(pResult, 0, sizeof(*pResult));
+	pResult->pMode = pMode;
+	if (!scheduler.Initialize(pOptions, DispatchMessage, pSettings)) {
+		fprintf(stderr, "failed to initialize the scheduler\n");
+		return false;
+	}
+	bulkClass = ((pOptions->ClassCount != 0) ? pOptions->ClassCount : 1) - 1;
+
+	// The quiet and admin connections send at a steady rate, spread over the interval so they don't all send at once
+	start = Clock::now();
+	count = pSettings->Quiet + pSettings->Admin + pSettings->Noisy;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		SIM_CONNECTION* pSim = new SIM_CONNECTION;
+		pSim->Kind = (i < pSettings->Quiet) ? SIM_QUIET : ((i < pSettings->Quiet + pSettings->Admin) ? SIM_ADMIN : SIM_NOISY);
+		pSim->NextSequence = 0;
+		pSim->ExpectedSequence = 0;
+		pSim->OutOfOrder = 0;
+		pSim->Due = start + ((pSim->Kind == SIM_NOISY) ?
+			std::chrono::microseconds((unsigned long long)pSettings->BurstInterval * 500) :
+			std::chrono::microseconds((unsigned long long)pSettings->Interval * 1000 * i / count));
+		scheduler.Register(&pSim->Entry, pSim, (pSim->Kind == SIM_ADMIN) ? 0 : bulkClass);
+		connections.push_back(pSim);
+	}
+
+	for (unsigned int i = 0; i < pSettings->Workers; i++) {
+		workers.emplace_back([&scheduler] { scheduler.Run(); });
+	}
+
+	// The generator queues what is due every 100 microseconds
+	end = start + std::chrono::seconds(pSettings->Duration);
+	for (now = Clock::now(); now < end; now = Clock::now())
+	{
+		for (SIM_CONNECTION* pSim : connections)
+		{
+			while (pSim->Due <= now)
+			{
+				if (pSim->Kind == SIM_NOISY)
+				{
+					QueueMessages(&scheduler, pSim, pSettings->Burst, now);
+					pResult->Generated += pSettings->Burst;
+					pSim->Due += std::chrono::milliseconds(pSettings->BurstInterval);
+				}
+				else
+				{
+					QueueMessages(&scheduler, pSim, 1, now);
+					pResult->Generated++;
+					pSim->Due += std::chrono::milliseconds(pSettings->Interval);
+				}
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	// Every message queued is dispatched, a connection left waiting would never be
+	deadline = Clock::now() + std::chrono::seconds(10);
+	for (;;)
+	{
+		scheduler.GetStats(&pResult->Stats);
+		if ((pResult->Stats.Messages == pResult->Generated) || (Clock::now() > deadline)) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	scheduler.Stop();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	scheduler.GetStats(&pResult->Stats);
+
+	for (unsigned int kind = SIM_QUIET; kind <= SIM_NOISY; kind++) {
+		pResult->Latency[kind] = GetLatency(connections, kind);
+	}
+	for (SIM_CONNECTION* pSim : connections)
+	{
+		pResult->OutOfOrder += pSim->OutOfOrder;
+		scheduler.Remove(&pSim->Entry);
+		delete pSim;
+	}
+	scheduler.Free();
+
+	return true;
+}
+
+static void PrintResult(const SIM_RESULT* pResult)
+{
+	const char* kinds[3] = { "quiet", "admin", "noisy" };
+
+	printf("%s\n", pResult->pMode);
+	for (unsigned int kind = SIM_QUIET; kind <= SIM_NOISY; kind++)
+	{
+		if (pResult->Latency[kind].Count == 0) {
+			continue;
+		}
+		printf("  %-6s %9llu messages, p50 %9.1f us, p99 %9.1f us, p999 %9.1f us, max %9.1f us\n", kinds[kind], pResult->Latency[kind].Count,
+			pResult->Latency[kind].p50, pResult->Latency[kind].p99, pResult->Latency[kind].p999, pResult->Latency[kind].max);
+	}
+	printf("  turns  %9llu, %llu ended by the quantum, %llu of %llu messages dispatched, %llu out of order\n",
+		pResult->Stats.Turns, pResult->Stats.Preemptions, pResult->Stats.Messages, pResult->Generated, pResult->OutOfOrder);
+}
+
+static void WriteLatency(FILE* pFile, const char* pName, const SIM_LATENCY* pLatency, const char* pSeparator)
+{
+	fprintf(pFile, "      \"%s_us\": { \"messages\": %llu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }%s\n",
+		pName, pLatency->Count, pLatency->p50, pLatency->p99, pLatency->p999, pLatency->max, pSeparator);
+}
+
+int main(int argc, char* argv[])
+{
+	SIM_SETTINGS settings;
+	IIS_WEB_SOCKET_SCHEDULER_OPTIONS options[3];
+	const char* modes[3] = { "until empty", "quantum", "quantum and admin class" };
+	SIM_RESULT results[3];
+	const char* pJsonPath = NULL;
+	bool bPassed = true;
+	FILE* pFile;
+
+	settings.Workers = 1;
+	settings.Quiet = 200;
+	settings.Admin = 8;
+	settings.Interval = 10;
+	settings.Noisy = 1;
+	settings.Burst = 10000;
+	settings.BurstInterval = 200;
+	settings.Work = 2;
+	settings.Size = 256;
+	settings.Quantum = 16;
+	settings.bBytes = false;
+	settings.AdminWeight = 4;
+	settings.Duration = 3;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--workers") == 0) && (i + 1 < argc)) {
+			settings.Workers = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--quiet") == 0) && (i + 1 < argc)) {
+			settings.Quiet = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--admin") == 0) && (i + 1 < argc)) {
+			settings.Admin = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--interval") == 0) && (i + 1 < argc)) {
+			settings.Interval = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--noisy") == 0) && (i + 1 < argc)) {
+			settings.Noisy = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--burst") == 0) && (i + 1 < argc)) {
+			settings.Burst = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--burst-interval") == 0) && (i + 1 < argc)) {
+			settings.BurstInterval = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--work") == 0) && (i + 1 < argc)) {
+			settings.Work = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			settings.Size = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--quantum") == 0) && (i + 1 < argc)) {
+			settings.Quantum = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--bytes") == 0) {
+			settings.bBytes = true;
+		}
+		else if ((strcmp(argv[i], "--admin-weight") == 0) && (i + 1 < argc)) {
+			settings.AdminWeight = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--duration") == 0) && (i + 1 < argc)) {
+			settings.Duration = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: schedbench [--workers <count>] [--quiet <connections>] [--admin <connections>] [--interval <ms between messages>]\n"
+				"                  [--noisy <connections>] [--burst <messages>] [--burst-interval <ms>] [--work <us per message>]\n"
+				"                  [--size <bytes>] [--quantum <messages>] [--bytes] [--admin-weight <turns>] [--duration <seconds>]\n"
+				"                  [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((settings.Workers == 0) || (settings.Interval == 0) || (settings.BurstInterval == 0) || (settings.Quantum == 0) || (settings.Duration == 0)) {
+		fprintf(stderr, "--workers, --interval, --burst-interval, --quantum and --duration must be at least 1\n");
+		return 1;
+	}
+
+	// With --bytes the quantum is the same number of messages counted in bytes
+	memset(options, 0, sizeof(options));
+	options[0].Quantum = 0;
+	options[1].QuantumType = settings.bBytes ? IIS_WEB_SOCKET_QUANTUM_TYPE::IIS_WEB_SOCKET_BYTES_QUANTUM_TYPE : IIS_WEB_SOCKET_QUANTUM_TYPE::IIS_WEB_SOCKET_MESSAGES_QUANTUM_TYPE;
+	options[1].Quantum = settings.bBytes ? settings.Quantum * settings.Size : settings.Quantum;
+	options[2] = options[1];
+	options[2].ClassCount = 2;
+	options[2].Weights[0] = settings.AdminWeight;
+	options[2].Weights[1] = 1;
+
+	printf("%u workers, %u quiet and %u admin connections sending every %u ms, %u noisy sending %u messages every %u ms, %u us per message\n",
+		settings.Workers, settings.Quiet, settings.Admin, settings.Interval, settings.Noisy, settings.Burst, settings.BurstInterval, settings.Work);
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		if (!RunSimulation(&settings, modes[i], &options[i], &results[i])) {
+			return 1;
+		}
+		PrintResult(&results[i]);
+		bPassed = bPassed && (results[i].Stats.Messages == results[i].Generated) && (results[i].OutOfOrder == 0);
+	}
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"workers\": %u,\n  \"quiet\": %u,\n  \"admin\": %u,\n  \"interval_ms\": %u,\n  \"noisy\": %u,\n  \"burst\": %u,\n"
+			"  \"burst_interval_ms\": %u,\n  \"work_us\": %u,\n  \"size\": %u,\n  \"quantum\": %llu,\n  \"quantum_type\": \"%s\",\n  \"admin_weight\": %u,\n  \"runs\": [\n",
+			settings.Workers, settings.Quiet, settings.Admin, settings.Interval, settings.Noisy, settings.Burst, settings.BurstInterval,
+			settings.Work, settings.Size, options[1].Quantum, settings.bBytes ? "bytes" : "messages", settings.AdminWeight);
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			fprintf(pFile, "    {\n      \"mode\": \"%s\",\n", results[i].pMode);
+			WriteLatency(pFile, "quiet", &results[i].Latency[SIM_QUIET], ",");
+			WriteLatency(pFile, "admin", &results[i].Latency[SIM_ADMIN], ",");
+			WriteLatency(pFile, "noisy", &results[i].Latency[SIM_NOISY], ",");
+			fprintf(pFile, "      \"turns\": %llu,\n      \"preemptions\": %llu,\n      \"messages\": %llu,\n      \"generated\": %llu,\n      \"out_of_order\": %llu\n    }%s\n",
+				results[i].Stats.Turns, results[i].Stats.Preemptions, results[i].Stats.Messages, results[i].Generated, results[i].OutOfOrder, (i < 2) ? "," : "");
+		}
+		fprintf(pFile, "  ]\n}\n");
+		fclose(pFile);
+	}
+
+	// Every message was dispatched once, in order
+	return bPassed ? 0 : 1;
+}
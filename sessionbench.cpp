@@ -0,0 +1,328 @@
+
+//
+// sessionbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Measures resumable sessions, the cost each Send pays to add its message to the log and the time to resume
+//     every session. Sessions are created and filled by this process, then a forked process resumes them all,
+//     like the worker process that replaces a recycled one, and checks each replay has exactly the missed messages.
+//
+//     Usage: sessionbench [--sessions <count>] [--messages <count per session>] [--size <bytes>] [--gap <messages missed>]
+//                         [--log-capacity <bytes>] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "iiswebsocketsession.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The sessions used by the benchmark, removed before and after each run
+#define SESSIONBENCH_NAME "iiswebsocket-sessionbench"
+
+// What the resuming process reports back through its pipe, followed by its resume times
+struct SESSIONBENCH_RESULT
+{
+	unsigned long long qwResumed;
+	unsigned long long qwReplayed;
+	unsigned long long qwFailed;
+	// Resumes from messages that have left the log, each should be refused
+	unsigned long long qwRefused;
+	double Seconds;
+};
+
+// Write all bytes to a pipe
+static bool WriteAll(int fd, const void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = write(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (const char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read all bytes from a pipe
+static bool ReadAll(int fd, void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = read(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Get a percentile of sorted times
+static unsigned long long Percentile(const std::vector<unsigned long long>& times, double percentile)
+{
+	if (times.empty()) {
+		return 0;
+	}
+	return times[std::min(times.size() - 1, (size_t)(percentile * (double)times.size()))];
+}
+
+// The resuming process, resumes every session from qwLastSequence and checks the replayed messages
+static int Resumer(const std::vector<WEB_SOCKET_SESSION>& sessions, unsigned long long qwLastSequence, unsigned long long qwSize, int resultFd)
+{
+	WebSocketSessions store;
+	WEB_SOCKET_SESSION session;
+	WEB_SOCKET_SESSION_REPLAY replay;
+	WEB_SOCKET_SESSION_MESSAGE message;
+	SESSIONBENCH_RESULT result;
+	std::vector<unsigned long long> times;
+	unsigned long long qwExpected;
+	unsigned long long qwIndex;
+	bool bValid;
+
+	memset(&result, 0, sizeof(result));
+	if (!store.Open(SESSIONBENCH_NAME, 1, 0, 0)) {
+		fprintf(stderr, "the resuming process failed to open the sessions\n");
+		return 1;
+	}
+
+	times.reserve(sessions.size());
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < sessions.size(); i++)
+	{
+		Clock::time_point resumeStart = Clock::now();
+		if (!store.Resume(sessions[i].Token, IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH, qwLastSequence, &session, &replay)) {
+			result.qwFailed++;
+			continue;
+		}
+
+		// The replay starts after the last message received and has every message up to the last one sent
+		bValid = true;
+		qwExpected = qwLastSequence + 1;
+		while (NextSessionReplayMessage(&replay, &message))
+		{
+			memcpy(&qwIndex, message.pData, sizeof(qwIndex));
+			if ((message.qwSequence != qwExpected) || (message.qwLength != qwSize) || (qwIndex != i)) {
+				bValid = false;
+			}
+			qwExpected++;
+			result.qwReplayed++;
+		}
+		FreeSessionReplay(&replay);
+		times.push_back((unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - resumeStart).count());
+
+		if (bValid) {
+			result.qwResumed++;
+		}
+		else {
+			result.qwFailed++;
+		}
+		store.Detach(&session);
+	}
+	result.Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// The first message was pushed out of every log long ago
+	for (size_t i = 0; i < sessions.size(); i++)
+	{
+		if (!store.Resume(sessions[i].Token, IIS_WEB_SOCKET_SESSION_TOKEN_LENGTH, 0, &session, &replay)) {
+			result.qwRefused++;
+		}
+		else {
+			FreeSessionReplay(&replay);
+			store.Detach(&session);
+		}
+	}
+
+	std::sort(times.begin(), times.end());
+	unsigned long long percentiles[3] = { Percentile(times, 0.5), Percentile(times, 0.99), times.empty() ? 0ULL : times.back() };
+	WriteAll(resultFd, &result, sizeof(result));
+	WriteAll(resultFd, percentiles, sizeof(percentiles));
+	close(resultFd);
+
+	store.Close();
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int sessionCount = 10000;
+	unsigned long long qwMessages = 400;
+	unsigned long long qwSize = 64;
+	unsigned long long qwGap = 10;
+	unsigned long long qwLogCapacity = 0x4000;
+	const char* pJsonPath = NULL;
+	WebSocketSessions store;
+	std::vector<WEB_SOCKET_SESSION> sessions;
+	std::vector<unsigned char> payload;
+	SESSIONBENCH_RESULT result;
+	unsigned long long percentiles[3];
+	unsigned long long qwIndex;
+	unsigned long long qwLastSequence;
+	unsigned long long qwLogged;
+	unsigned long long qwCopies;
+	double appendSeconds;
+	double copySeconds;
+	int resultPipe[2];
+	pid_t pid;
+	FILE* pFile;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--sessions") == 0) && (i + 1 < argc)) {
+			sessionCount = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			qwMessages = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--gap") == 0) && (i + 1 < argc)) {
+			qwGap = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--log-capacity") == 0) && (i + 1 < argc)) {
+			qwLogCapacity = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: sessionbench [--sessions <count>] [--messages <count per session>] [--size <bytes>] [--gap <messages missed>]\n"
+				"                    [--log-capacity <bytes>] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if (qwSize < sizeof(unsigned long long)) {
+		qwSize = sizeof(unsigned long long);
+	}
+	if ((sessionCount == 0) || (qwGap > qwMessages)) {
+		fprintf(stderr, "--sessions must be at least 1 and --gap at most --messages\n");
+		return 1;
+	}
+
+	// Start from new sessions
+	RemoveSharedMemory(SESSIONBENCH_NAME);
+	if (!store.Open(SESSIONBENCH_NAME, sessionCount, qwLogCapacity, 0)) {
+		fprintf(stderr, "failed to create the sessions\n");
+		return 1;
+	}
+	sessions.resize(sessionCount);
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		if (!store.Create(&sessions[i])) {
+			fprintf(stderr, "failed to create session %u\n", i);
+			return 1;
+		}
+	}
+
+	// Each message starts with the index of its session, messages go to the sessions in turn like a broadcast
+	payload.assign((size_t)qwSize, 0x5A);
+	qwLogged = 0;
+	Clock::time_point start = Clock::now();
+	for (unsigned long long m = 0; m < qwMessages; m++)
+	{
+		for (unsigned int i = 0; i < sessionCount; i++)
+		{
+			qwIndex = i;
+			memcpy(payload.data(), &qwIndex, sizeof(qwIndex));
+			if (store.Append(&sessions[i], IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, NULL, 0, payload.data(), payload.size()) != 0) {
+				qwLogged++;
+			}
+		}
+	}
+	appendSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// A plain copy of the same messages, the least a log could cost
+	std::vector<unsigned char> copies((size_t)(qwLogCapacity + qwSize));
+	qwCopies = 0;
+	start = Clock::now();
+	for (unsigned long long m = 0; m < qwMessages; m++)
+	{
+		for (unsigned int i = 0; i < sessionCount; i++)
+		{
+			memcpy(copies.data() + ((qwCopies * qwSize) % qwLogCapacity), payload.data(), payload.size());
+			qwCopies++;
+		}
+	}
+	copySeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// Every connection ends, the client of each missed the last messages
+	for (unsigned int i = 0; i < sessionCount; i++) {
+		store.Detach(&sessions[i]);
+	}
+	qwLastSequence = qwMessages - qwGap;
+
+	if (pipe(resultPipe) != 0) {
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(resultPipe[0]);
+		_exit(Resumer(sessions, qwLastSequence, qwSize, resultPipe[1]));
+	}
+	close(resultPipe[1]);
+	memset(&result, 0, sizeof(result));
+	memset(percentiles, 0, sizeof(percentiles));
+	if (!ReadAll(resultPipe[0], &result, sizeof(result)) || !ReadAll(resultPipe[0], percentiles, sizeof(percentiles))) {
+		fprintf(stderr, "the resuming process failed\n");
+	}
+	close(resultPipe[0]);
+	waitpid(pid, NULL, 0);
+
+	store.Close();
+	RemoveSharedMemory(SESSIONBENCH_NAME);
+
+	printf("sessions         %u with a %llu byte log each\n", sessionCount, qwLogCapacity);
+	printf("append           %llu messages of %llu bytes, %.1f ns per message, a plain copy takes %.1f ns\n",
+		qwLogged, qwSize, appendSeconds * 1000000000.0 / (double)(qwMessages * sessionCount),
+		copySeconds * 1000000000.0 / (double)(qwMessages * sessionCount));
+	printf("resume           %llu of %u sessions in %.2f ms by another process, %llu failed\n",
+		result.qwResumed, sessionCount, result.Seconds * 1000.0, result.qwFailed);
+	printf("replayed         %llu messages, %llu missed by each client\n", result.qwReplayed, qwGap);
+	printf("resume p50       %.1f us\n", (double)percentiles[0] / 1000.0);
+	printf("resume p99       %.1f us\n", (double)percentiles[1] / 1000.0);
+	printf("resume max       %.1f us\n", (double)percentiles[2] / 1000.0);
+	printf("refused          %llu resumes from messages no longer in the log\n", result.qwRefused);
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"sessions\": %u,\n  \"log_capacity\": %llu,\n  \"messages\": %llu,\n  \"message_bytes\": %llu,\n"
+			"  \"append_ns\": %.1f,\n  \"copy_ns\": %.1f,\n  \"resumed\": %llu,\n  \"resume_failed\": %llu,\n  \"resume_seconds\": %.6f,\n"
+			"  \"replayed\": %llu,\n  \"refused\": %llu,\n  \"resume_ns\": { \"p50\": %llu, \"p99\": %llu, \"max\": %llu }\n}\n",
+			sessionCount, qwLogCapacity, qwLogged, qwSize,
+			appendSeconds * 1000000000.0 / (double)(qwMessages * sessionCount), copySeconds * 1000000000.0 / (double)(qwMessages * sessionCount),
+			result.qwResumed, result.qwFailed, result.Seconds, result.qwReplayed, result.qwRefused,
+			percentiles[0], percentiles[1], percentiles[2]);
+		fclose(pFile);
+	}
+
+	// Every session resumed with exactly the missed messages, and none from before its log
+	return ((result.qwResumed == sessionCount) && (result.qwReplayed == sessionCount * qwGap) &&
+		((qwMessages * ((16 + qwSize + 15) & ~15ULL) <= qwLogCapacity) || (result.qwRefused == sessionCount))) ? 0 : 1;
+}
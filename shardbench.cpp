@@ -0,0 +1,612 @@
+
+//
+// shardbench.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Scaling of the sharded executor from 1 shard to one per processor. Each connection is pinned to a shard for its
+//     lifetime, the shard watches its socket and reads it into a buffer from its own pool, so nothing is locked between
+//     a socket becoming readable and the echo being written. With --relay every message also hops to the next shard and
+//     back through the rings between shards. Each shard count runs in its own forked process over socket pairs, client
+//     threads drive the echoes, one per shard.
+//
+//     Usage: shardbench [--connections <count>] [--messages <count per connection>] [--size <bytes>] [--max-shards <count>]
+//                       [--relay] [--no-pin] [--huge-pages] [--json <output file>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+#include "iiswebsocketcoroutine.h"
+#include "iiswebsocketshard.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// What each forked run reports back through its pipe
+struct SHARDBENCH_RESULT
+{
+	unsigned int Shards;
+	unsigned int Connections;
+	double Seconds;
+	unsigned long long Messages;
+	bool bFailed;
+};
+
+// A server connection, only touched by the shard it's pinned to
+struct SHARDBENCH_CONNECTION
+{
+	int Socket;
+	WEB_SOCKET_SHARD_WATCH Watch;
+	// The read waiting for the socket to be readable
+	void* pReadBuffer;
+	unsigned long dwReadLength;
+	// The rest of a write waiting for the socket to be writable
+	std::vector<unsigned char> WriteBuffer;
+	size_t WriteOffset;
+	bool bWritePending;
+	WebSocketAsyncConnection Connection;
+};
+
+// The executor of the forked run, and the handlers that have returned
+static WebSocketExecutor* pBenchExecutor;
+static std::atomic<unsigned int> HandlersDone;
+static bool bRelay;
+
+// Write all bytes to a socket or pipe
+static bool WriteAll(int fd, const void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = send(fd, pBuffer, length, MSG_NOSIGNAL);
+		if ((result < 0) && (errno == ENOTSOCK)) {
+			result = write(fd, pBuffer, length);
+		}
+		if (result <= 0) {
+			if ((result < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		pBuffer = (const char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// Read exactly length bytes from a pipe
+static bool ReadAll(int fd, void* pBuffer, size_t length)
+{
+	ssize_t result;
+
+	while (length != 0)
+	{
+		result = read(fd, pBuffer, length);
+		if (result <= 0) {
+			return false;
+		}
+		pBuffer = (char*)pBuffer + result;
+		length -= (size_t)result;
+	}
+
+	return true;
+}
+
+// The first frame byte of a server frame
+static unsigned char FrameByte(IIS_WEB_SOCKET_BUFFER_TYPE bufferType)
+{
+	switch (bufferType)
+	{
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
+		return 0x81;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE:
+		return 0x88;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE:
+		return 0x89;
+	case IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE:
+		return 0x8A;
+	default:
+		return 0x82;
+	}
+}
+
+//
+// Server
+//
+
+// Read for the WebSocketAsyncConnection, pending until the shard sees the socket readable, on the shard without locks
+static unsigned long SocketReadAsync(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead, bool* pbPending)
+{
+	SHARDBENCH_CONNECTION* pConnection = (SHARDBENCH_CONNECTION*)pContext;
+	ssize_t received;
+
+	received = recv(pConnection->Socket, pBuffer, dwLength, MSG_DONTWAIT);
+	if (received >= 0) {
+		*pdwBytesRead = (unsigned long)received;
+		return 0;
+	}
+	if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		return (unsigned long)errno;
+	}
+
+	pConnection->pReadBuffer = pBuffer;
+	pConnection->dwReadLength = dwLength;
+	*pbPending = true;
+	return 0;
+}
+
+// Write for the WebSocketAsyncConnection, the rest of a partial write is sent when the shard sees the socket writable
+static unsigned long SocketWriteAsync(void* pContext, IIS_WEB_SOCKET_BUFFER_TYPE bufferType, const void* pData, unsigned long long qwLength, bool* pbPending)
+{
+	SHARDBENCH_CONNECTION* pConnection = (SHARDBENCH_CONNECTION*)pContext;
+	unsigned char header[10];
+	struct iovec chunks[2];
+	struct msghdr message;
+	size_t total;
+	ssize_t sent;
+
+	chunks[0].iov_base = header;
+	chunks[0].iov_len = EncodeWebSocketFrameHeader(header, FrameByte(bufferType), qwLength);
+	chunks[1].iov_base = (void*)pData;
+	chunks[1].iov_len = (size_t)qwLength;
+	total = chunks[0].iov_len + chunks[1].iov_len;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = chunks;
+	message.msg_iovlen = 2;
+	sent = sendmsg(pConnection->Socket, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if ((size_t)sent == total) {
+		return 0;
+	}
+	if ((sent < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		return (unsigned long)errno;
+	}
+	if (sent < 0) {
+		sent = 0;
+	}
+
+	pConnection->WriteBuffer.assign(header, header + chunks[0].iov_len);
+	pConnection->WriteBuffer.insert(pConnection->WriteBuffer.end(), (const unsigned char*)pData, (const unsigned char*)pData + qwLength);
+	pConnection->WriteOffset = (size_t)sent;
+	pConnection->bWritePending = true;
+	*pbPending = true;
+	return 0;
+}
+
+// Complete the pending read or write of a socket that became ready, called by its shard
+static void SocketReady(void* pContext, unsigned int events)
+{
+	SHARDBENCH_CONNECTION* pConnection = (SHARDBENCH_CONNECTION*)pContext;
+	ssize_t result;
+	ssize_t sent;
+
+	if ((pConnection->pReadBuffer != NULL) && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+	{
+		result = recv(pConnection->Socket, pConnection->pReadBuffer, pConnection->dwReadLength, MSG_DONTWAIT);
+		if ((result >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			pConnection->pReadBuffer = NULL;
+			pConnection->Connection.CompleteRead((result > 0) ? (unsigned long)result : 0, (result < 0) ? (unsigned long)errno : 0);
+		}
+	}
+	if ((pConnection->bWritePending) && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+	{
+		while (pConnection->WriteOffset < pConnection->WriteBuffer.size())
+		{
+			sent = send(pConnection->Socket, pConnection->WriteBuffer.data() + pConnection->WriteOffset,
+				pConnection->WriteBuffer.size() - pConnection->WriteOffset, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (sent <= 0) {
+				break;
+			}
+			pConnection->WriteOffset += (size_t)sent;
+		}
+		if (pConnection->WriteOffset == pConnection->WriteBuffer.size()) {
+			pConnection->bWritePending = false;
+			pConnection->Connection.CompleteWrite(0);
+		}
+	}
+}
+
+// Echo every message from the shard the handler was given, optionally by way of the next shard
+static WebSocketTask EchoHandler(SHARDBENCH_CONNECTION* pConnection, unsigned long dwReadBuffer)
+{
+	WebSocketExecutor* pExecutor = pBenchExecutor;
+	WEB_SOCKET_ASYNC_MESSAGE message;
+	IIS_WEB_SOCKET_ASYNC_RESULT result;
+	unsigned int shard;
+
+	// Set up on the shard, so the connection stays on it and reads into the shard's pool
+	if ((!pConnection->Connection.Initialize(pExecutor, SocketReadAsync, SocketWriteAsync, pConnection, dwReadBuffer)) ||
+		(!pExecutor->Watch(&pConnection->Watch, pConnection->Socket, EPOLLIN | EPOLLOUT, SocketReady, pConnection))) {
+		pConnection->Connection.Free();
+		HandlersDone.fetch_add(1);
+		co_return;
+	}
+	shard = pConnection->Connection.GetShard();
+
+	for (;;)
+	{
+		result = co_await pConnection->Connection.ReceiveMessage(&message);
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			break;
+		}
+
+		if (message.BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_CLOSE_BUFFER_TYPE) {
+			co_await pConnection->Connection.Send(message.BufferType, message.pData, message.qwLength);
+			break;
+		}
+		else if (message.BufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE) {
+			result = co_await pConnection->Connection.Send(IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE, message.pData, message.qwLength);
+		}
+		else if (message.BufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PONG_BUFFER_TYPE)
+		{
+			// The message visits the next shard, the way a message for a connection of another shard is handed over
+			if (bRelay) {
+				co_await pExecutor->SwitchToShard((shard + 1) % pExecutor->GetShardCount());
+				co_await pExecutor->SwitchToShard(shard);
+			}
+			result = co_await pConnection->Connection.Send(message.BufferType, message.pData, message.qwLength);
+		}
+		if (result != IIS_WEB_SOCKET_ASYNC_RESULT::IIS_WEB_SOCKET_SUCCESS_ASYNC_RESULT) {
+			break;
+		}
+	}
+
+	pExecutor->Unwatch(&pConnection->Watch);
+	pConnection->Connection.Free();
+	HandlersDone.fetch_add(1);
+}
+
+//
+// Client
+//
+
+// Send messages rounds on a slice of the connections, and check every echo
+static void ClientThread(const int* pClients, size_t count, unsigned int messages, const std::vector<unsigned char>* pRequest,
+	const std::vector<unsigned char>* pEcho, std::atomic<bool>* pbFailed)
+{
+	std::vector<unsigned char> buffer(pEcho->size());
+	std::vector<size_t> received(count);
+	struct epoll_event events[256];
+	struct epoll_event event;
+	size_t remaining;
+	unsigned int index;
+	ssize_t result;
+	int epoll;
+	int ready;
+
+	epoll = epoll_create1(0);
+	for (size_t i = 0; i < count; i++)
+	{
+		event.events = EPOLLIN;
+		event.data.u32 = (unsigned int)i;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, pClients[i], &event);
+	}
+
+	for (unsigned int m = 0; (m < messages) && (!pbFailed->load(std::memory_order_relaxed)); m++)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			received[i] = 0;
+			if (!WriteAll(pClients[i], pRequest->data(), pRequest->size())) {
+				pbFailed->store(true);
+				break;
+			}
+		}
+
+		remaining = count;
+		while ((remaining != 0) && (!pbFailed->load(std::memory_order_relaxed)))
+		{
+			ready = epoll_wait(epoll, events, 256, 10000);
+			if (ready <= 0) {
+				fprintf(stderr, "timed out waiting for %zu echoes\n", remaining);
+				pbFailed->store(true);
+				break;
+			}
+			for (int i = 0; i < ready; i++)
+			{
+				index = events[i].data.u32;
+				result = recv(pClients[index], buffer.data(), pEcho->size() - received[index], MSG_DONTWAIT);
+				if (result <= 0) {
+					if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+						continue;
+					}
+					pbFailed->store(true);
+					break;
+				}
+				if (memcmp(buffer.data(), pEcho->data() + received[index], (size_t)result) != 0) {
+					pbFailed->store(true);
+					break;
+				}
+				received[index] += (size_t)result;
+				if (received[index] == pEcho->size()) {
+					remaining--;
+				}
+			}
+		}
+	}
+
+	close(epoll);
+}
+
+// Serve the connections on a number of shards and echo messages on all of them
+static void Run(unsigned int shards, unsigned int connections, unsigned int messages, unsigned long long qwSize,
+	bool bPin, bool bHugePages, SHARDBENCH_RESULT* pResult)
+{
+	std::vector<SHARDBENCH_CONNECTION*> servers;
+	std::vector<std::thread> threads;
+	std::vector<int> clients;
+	std::vector<unsigned char> request;
+	std::vector<unsigned char> echo;
+	IIS_WEB_SOCKET_SHARD_OPTIONS options;
+	WebSocketExecutor executor;
+	std::atomic<bool> bFailed(false);
+	unsigned char header[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	unsigned int headerLength;
+	char maskingKey[4];
+	Clock::time_point start;
+	Clock::time_point deadline;
+	size_t slice;
+	int pair[2];
+
+	memset(pResult, 0, sizeof(*pResult));
+	pResult->Shards = shards;
+	HandlersDone.store(0);
+	pBenchExecutor = &executor;
+
+	// Every client sends the same masked message and expects the same echo
+	WebSocketGenerateMaskingKey(maskingKey);
+	headerLength = EncodeMaskedWebSocketFrameHeader(header, 0x82, qwSize, maskingKey);
+	request.assign(header, header + headerLength);
+	request.resize(headerLength + (size_t)qwSize, 0x5A);
+	UnmaskWebSocketPayload(request.data() + headerLength, qwSize, maskingKey, 0);
+	headerLength = EncodeWebSocketFrameHeader(header, 0x82, qwSize);
+	echo.assign(header, header + headerLength);
+	echo.resize(headerLength + (size_t)qwSize, 0x5A);
+
+	// Each shard's pool holds a read buffer for its share of the connections
+	memset(&options, 0, sizeof(options));
+	options.bPinThreads = bPin;
+	options.bHugePages = bHugePages;
+	options.BufferSize = IIS_WEB_SOCKET_ASYNC_READ_BUFFER_LENGTH;
+	options.BufferCount = connections / shards + 1;
+	if (!executor.StartShards(shards, &options)) {
+		pResult->bFailed = true;
+		return;
+	}
+
+	for (unsigned int i = 0; i < connections; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+			fprintf(stderr, "socketpair failed after %u connections: %s\n", i, strerror(errno));
+			break;
+		}
+
+		SHARDBENCH_CONNECTION* pConnection = new SHARDBENCH_CONNECTION();
+		pConnection->Socket = pair[0];
+		pConnection->pReadBuffer = NULL;
+		pConnection->bWritePending = false;
+		servers.push_back(pConnection);
+		clients.push_back(pair[1]);
+
+		// Posted from this thread, the executor spreads the handlers over the shards
+		EchoHandler(pConnection, 0).Start(&executor);
+	}
+	pResult->Connections = (unsigned int)clients.size();
+
+	// A client thread per shard, each with its own slice of the connections
+	start = Clock::now();
+	slice = (clients.size() + shards - 1) / shards;
+	try
+	{
+		for (size_t offset = 0; offset < clients.size(); offset += slice) {
+			threads.emplace_back(ClientThread, clients.data() + offset, std::min(slice, clients.size() - offset), messages, &request, &echo, &bFailed);
+		}
+	}
+	catch (const std::system_error&) {
+		bFailed.store(true);
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	pResult->Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	pResult->Messages = (unsigned long long)messages * clients.size();
+
+	// Closing the clients ends every handler
+	for (int client : clients) {
+		close(client);
+	}
+	deadline = Clock::now() + std::chrono::seconds(10);
+	while ((HandlersDone.load() < clients.size()) && (Clock::now() < deadline)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (HandlersDone.load() < clients.size()) {
+		fprintf(stderr, "%zu handlers didn't return\n", clients.size() - HandlersDone.load());
+		bFailed.store(true);
+	}
+	if (executor.GetConnectionCount() != 0) {
+		fprintf(stderr, "%zu connections still registered\n", executor.GetConnectionCount());
+		bFailed.store(true);
+	}
+	pResult->bFailed = bFailed.load();
+
+	executor.Stop();
+	for (SHARDBENCH_CONNECTION* pConnection : servers) {
+		close(pConnection->Socket);
+		delete pConnection;
+	}
+}
+
+// Run one shard count in a forked process and read back its result
+static bool RunForked(unsigned int shards, unsigned int connections, unsigned int messages, unsigned long long qwSize,
+	bool bPin, bool bHugePages, SHARDBENCH_RESULT* pResult)
+{
+	int resultPipe[2];
+	pid_t pid;
+	bool bRead;
+
+	if (pipe(resultPipe) != 0) {
+		return false;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(resultPipe[0]);
+		Run(shards, connections, messages, qwSize, bPin, bHugePages, pResult);
+		_exit(WriteAll(resultPipe[1], pResult, sizeof(*pResult)) ? 0 : 1);
+	}
+	close(resultPipe[1]);
+	bRead = ReadAll(resultPipe[0], pResult, sizeof(*pResult));
+	close(resultPipe[0]);
+	waitpid(pid, NULL, 0);
+
+	if (!bRead) {
+		memset(pResult, 0, sizeof(*pResult));
+		pResult->Shards = shards;
+		pResult->bFailed = true;
+	}
+
+	return bRead;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int connections = 4096;
+	unsigned int messages = 100;
+	unsigned long long qwSize = 64;
+	unsigned int maxShards = 0;
+	bool bPin = true;
+	bool bHugePages = false;
+	const char* pJsonPath = NULL;
+	std::vector<SHARDBENCH_RESULT> results;
+	std::vector<unsigned int> counts;
+	SHARDBENCH_RESULT result;
+	struct rlimit limit;
+	unsigned int maxConnections;
+	double baseRate;
+	double rate;
+	bool bFailed;
+	FILE* pFile;
+
+	bRelay = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			connections = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--messages") == 0) && (i + 1 < argc)) {
+			messages = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+			qwSize = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--max-shards") == 0) && (i + 1 < argc)) {
+			maxShards = (unsigned int)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--relay") == 0) {
+			bRelay = true;
+		}
+		else if (strcmp(argv[i], "--no-pin") == 0) {
+			bPin = false;
+		}
+		else if (strcmp(argv[i], "--huge-pages") == 0) {
+			bHugePages = true;
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc)) {
+			pJsonPath = argv[++i];
+		}
+		else {
+			fprintf(stderr, "usage: shardbench [--connections <count>] [--messages <count per connection>] [--size <bytes>] [--max-shards <count>]\n"
+				"                  [--relay] [--no-pin] [--huge-pages] [--json <output file>]\n");
+			return 1;
+		}
+	}
+	if ((connections == 0) || (messages == 0) || (qwSize > 0x100000)) {
+		fprintf(stderr, "--connections and --messages must be at least 1 and --size at most 1048576\n");
+		return 1;
+	}
+
+	// Every connection is a socket pair, raise the open file limit as far as it goes
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		maxConnections = (limit.rlim_cur > 64) ? (unsigned int)((limit.rlim_cur - 64) / 2) : 1;
+		if (connections > maxConnections) {
+			printf("limited to %u connections by the open file limit of %llu, raise it with ulimit -n\n",
+				maxConnections, (unsigned long long)limit.rlim_cur);
+			connections = maxConnections;
+		}
+	}
+
+	// 1, 2, 4 ... shards and one per processor, more than one per processor only when asked for
+	if (maxShards == 0) {
+		maxShards = GetShardProcessorCount();
+	}
+	for (unsigned int shards = 1; shards < maxShards; shards *= 2) {
+		counts.push_back(shards);
+	}
+	counts.push_back(maxShards);
+
+	printf("%u connections, %u round trips of %llu bytes each%s, %u processors\n", connections, messages, qwSize,
+		bRelay ? " by way of the next shard" : "", GetShardProcessorCount());
+
+	bFailed = false;
+	baseRate = 0;
+	for (unsigned int shards : counts)
+	{
+		RunForked(shards, connections, messages, qwSize, bPin, bHugePages, &result);
+		results.push_back(result);
+		bFailed |= result.bFailed;
+
+		// Efficiency is the speedup over 1 shard divided by the shards
+		rate = (result.Seconds != 0) ? (double)result.Messages / result.Seconds : 0;
+		if (shards == 1) {
+			baseRate = rate;
+		}
+		printf("%3u shards: %u connections, %.0f messages per second, %.2f us per message, efficiency %.0f%%%s\n",
+			shards, result.Connections, rate, (rate != 0) ? 1000000.0 / rate : 0.0,
+			(baseRate != 0) ? rate / baseRate / shards * 100.0 : 0.0, result.bFailed ? " (failed)" : "");
+	}
+
+	if (pJsonPath != NULL)
+	{
+		pFile = fopen(pJsonPath, "w");
+		if (pFile == NULL) {
+			fprintf(stderr, "failed to create %s\n", pJsonPath);
+			return 1;
+		}
+		fprintf(pFile, "{\n  \"connections\": %u,\n  \"messages\": %u,\n  \"message_bytes\": %llu,\n  \"relay\": %s,\n  \"processors\": %u,\n  \"runs\": [\n",
+			connections, messages, qwSize, bRelay ? "true" : "false", GetShardProcessorCount());
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			fprintf(pFile, "    { \"shards\": %u, \"connections\": %u, \"messages\": %llu, \"seconds\": %.6f, \"failed\": %s }%s\n",
+				results[i].Shards, results[i].Connections, results[i].Messages, results[i].Seconds,
+				results[i].bFailed ? "true" : "false", (i + 1 < results.size()) ? "," : "");
+		}
+		fprintf(pFile, "  ]\n}\n");
+		fclose(pFile);
+	}
+
+	return bFailed ? 1 : 0;
+}
@@ -0,0 +1,323 @@
+//
+// streamtest.cpp
+//
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+//
+// Description:
+//     Streams an 8 GB message through a fake response that never holds more than one chunk, and reads it back with the
+//     client side of the protocol core. The message is framed by the sending stream of the protocol core, the one
+//     BeginMessage, WriteMessageChunk and EndMessage write, once as a single frame with the declared 64-bit length and once
+//     as a fragment per chunk with an unknown length. The payload is made from its offsets, so it's checked as it arrives
+//     without keeping it. The sending stream's refusals of a chunk past a declared length and of a message that ends short
+//     of it are checked too.
+//
+//     Usage: streamtest [--gigabytes <count>] [--chunk <bytes>]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "iiswebsocketframe.h"
+using namespace IISWebSocketServer;
+
+typedef std::chrono::steady_clock Clock;
+
+// The frames of a streamed message, produced one chunk at a time
+struct FAKE_SENDER
+{
+	// Set when the length is declared in a single frame
+	bool bDeclaredLength;
+	unsigned long long qwMessageLength;
+	unsigned long long qwProduced;
+	unsigned long dwChunkSize;
+	WEB_SOCKET_SEND_STREAM Stream;
+	// The fragment state of the connection
+	bool bFragment;
+	bool bBegun;
+	bool bEnded;
+	// Set if the sending stream refused a call
+	bool bFailed;
+};
+
+// The response the sender writes to, emptied by the reads of the client before the next chunk is written
+struct FAKE_RESPONSE
+{
+	std::vector<unsigned char> Buffer;
+	unsigned long dwLength;
+	unsigned long dwOffset;
+	unsigned long dwLargest;
+	unsigned long long qwFrames;
+	FAKE_SENDER* pSender;
+};
+
+// Fill a chunk with the offsets of its 8 byte words, the message is never held
+static void ProduceChunk(unsigned long long qwOffset, unsigned char* pBuffer, unsigned long dwLength)
+{
+	unsigned long long qwWord;
+
+	for (unsigned long i = 0; i < dwLength; i += 8) {
+		qwWord = (qwOffset + i) / 8;
+		memcpy(pBuffer + i, &qwWord, 8);
+	}
+}
+
+// Check a received part of the payload carries its offsets
+static bool CheckChunk(unsigned long long qwOffset, const unsigned char* pBuffer, unsigned long dwLength)
+{
+	unsigned long long qwWord;
+
+	for (unsigned long i = 0; i < dwLength; i += 8) {
+		memcpy(&qwWord, pBuffer + i, 8);
+		if (qwWord != (qwOffset + i) / 8) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Write the next frame or chunk to an empty response, one call of BeginMessage, WriteMessageChunk or EndMessage
+static void SendNext(FAKE_SENDER* pSender, FAKE_RESPONSE* pResponse)
+{
+	IIS_WEB_SOCKET_SEND_STREAM_RESULT result;
+	WEB_SOCKET_SEND_FRAME frame;
+	unsigned long dwHeaderLength;
+	unsigned long dwChunk;
+
+	dwChunk = 0;
+	if (!pSender->bBegun)
+	{
+		// BeginMessage, the frame with the full 64-bit length and none of the payload, nothing for an unknown length
+		result = BeginWebSocketSendStream(&pSender->Stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE,
+			pSender->bDeclaredLength ? pSender->qwMessageLength : IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH, &pSender->bFragment, &frame);
+		pSender->bBegun = true;
+	}
+	else if (pSender->qwProduced < pSender->qwMessageLength)
+	{
+		// WriteMessageChunk, the payload of the declared frame, or the next fragment
+		dwChunk = pSender->dwChunkSize;
+		if (pSender->qwMessageLength - pSender->qwProduced < dwChunk) {
+			dwChunk = (unsigned long)(pSender->qwMessageLength - pSender->qwProduced);
+		}
+		result = WriteWebSocketSendStream(&pSender->Stream, dwChunk, &pSender->bFragment, &frame);
+	}
+	else
+	{
+		// EndMessage, the final empty fragment of an unknown length, nothing for a declared one
+		result = EndWebSocketSendStream(&pSender->Stream, &pSender->bFragment, &frame);
+		pSender->bEnded = true;
+	}
+	if (result != IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT) {
+		pSender->bFailed = true;
+		pSender->bEnded = true;
+		dwChunk = 0;
+	}
+
+	// The header is written the way WebSocketServer::WriteFrame writes it, then the chunk
+	dwHeaderLength = 0;
+	if ((result == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT) && (frame.bHeader)) {
+		dwHeaderLength = EncodeWebSocketFrameHeader(pResponse->Buffer.data(), frame.FrameByte, frame.qwPayloadLength);
+		pResponse->qwFrames++;
+	}
+	ProduceChunk(pSender->qwProduced, pResponse->Buffer.data() + dwHeaderLength, dwChunk);
+	pSender->qwProduced += dwChunk;
+
+	pResponse->dwLength = dwHeaderLength + dwChunk;
+	pResponse->dwOffset = 0;
+	if (pResponse->dwLength > pResponse->dwLargest) {
+		pResponse->dwLargest = pResponse->dwLength;
+	}
+}
+
+// The client reads what the response holds, the sender writes more once it's empty
+static unsigned long ResponseRead(void* pContext, void* pBuffer, unsigned long dwLength, unsigned long* pdwBytesRead)
+{
+	FAKE_RESPONSE* pResponse = (FAKE_RESPONSE*)pContext;
+
+	*pdwBytesRead = 0;
+	if (dwLength == 0) {
+		return 0;
+	}
+	while (pResponse->dwOffset == pResponse->dwLength)
+	{
+		if (pResponse->pSender->bEnded) {
+			// The sender is done, the client read past the message
+			return 1;
+		}
+		SendNext(pResponse->pSender, pResponse);
+	}
+	if (dwLength > pResponse->dwLength - pResponse->dwOffset) {
+		dwLength = pResponse->dwLength - pResponse->dwOffset;
+	}
+	memcpy(pBuffer, pResponse->Buffer.data() + pResponse->dwOffset, dwLength);
+	pResponse->dwOffset += dwLength;
+	*pdwBytesRead = dwLength;
+
+	return 0;
+}
+
+// Stream one message and read it back, returns true if every byte arrived in order as one message
+static bool RunStream(bool bDeclaredLength, unsigned long long qwMessageLength, unsigned long dwChunkSize)
+{
+	std::vector<unsigned char> buffer(dwChunkSize);
+	char frameBuffer[IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH];
+	FAKE_SENDER sender;
+	FAKE_RESPONSE response;
+	WEB_SOCKET_STREAM stream;
+	WEB_SOCKET_FRAME frame;
+	IIS_WEB_SOCKET_RECEIVE_RESULT result;
+	IIS_WEB_SOCKET_BUFFER_TYPE bufferType;
+	unsigned long long qwReceived;
+	unsigned long long qwMessages;
+	unsigned long dwReceived;
+	Clock::time_point start;
+	double seconds;
+	bool bCorrect;
+
+	memset(&sender, 0, sizeof(sender));
+	sender.bDeclaredLength = bDeclaredLength;
+	sender.qwMessageLength = qwMessageLength;
+	sender.dwChunkSize = dwChunkSize;
+	response.Buffer.resize(IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + dwChunkSize);
+	response.dwLength = 0;
+	response.dwOffset = 0;
+	response.dwLargest = 0;
+	response.qwFrames = 0;
+	response.pSender = &sender;
+
+	// The client side of the protocol, the server's frames aren't masked
+	memset(&stream, 0, sizeof(stream));
+	memset(&frame, 0, sizeof(frame));
+	stream.bQueuing = true;
+	stream.pFrameBuffer = frameBuffer;
+	stream.bClient = true;
+	bufferType = IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+
+	bCorrect = true;
+	qwReceived = 0;
+	qwMessages = 0;
+	start = Clock::now();
+	while (qwMessages == 0)
+	{
+		result = ReceiveWebSocketData(&stream, &frame, 0xFFFFFFFFFFFFFFFFULL, ResponseRead, &response,
+			buffer.data(), dwChunkSize, &dwReceived, &bufferType, NULL);
+		if (result != IIS_WEB_SOCKET_RECEIVE_RESULT::IIS_WEB_SOCKET_SUCCESS_RECEIVE_RESULT) {
+			fprintf(stderr, "receive failed with result %d at %llu bytes\n", (int)result, qwReceived);
+			bCorrect = false;
+			break;
+		}
+		if ((bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE) &&
+			(bufferType != IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)) {
+			fprintf(stderr, "unexpected buffer type %d at %llu bytes\n", (int)bufferType, qwReceived);
+			bCorrect = false;
+			break;
+		}
+		if (!CheckChunk(qwReceived, buffer.data(), dwReceived)) {
+			fprintf(stderr, "wrong payload in the %lu bytes at %llu\n", dwReceived, qwReceived);
+			bCorrect = false;
+			break;
+		}
+		qwReceived += dwReceived;
+		if (bufferType == IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) {
+			qwMessages++;
+		}
+	}
+	seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// One message of the full length, and the response never held more than a chunk and its header
+	if ((qwReceived != qwMessageLength) || (response.dwLargest > IIS_WEB_SOCKET_MAX_FRAME_HEADER_LENGTH + dwChunkSize)) {
+		bCorrect = false;
+	}
+	if (((bDeclaredLength) && (response.qwFrames != 1)) || (sender.bFailed)) {
+		bCorrect = false;
+	}
+
+	printf("%-9s %llu bytes in %llu frames, %.2f s, %.2f GB/s, largest response %lu bytes, correct %s\n",
+		bDeclaredLength ? "declared" : "unknown", qwReceived, response.qwFrames, seconds,
+		(seconds > 0) ? (double)qwReceived / seconds / 1e9 : 0.0, response.dwLargest, bCorrect ? "yes" : "no");
+
+	return bCorrect;
+}
+
+// A declared length can't be written past or ended short of, and a message can't begin while another is in progress
+static bool CheckStreamRefusals()
+{
+	WEB_SOCKET_SEND_STREAM stream;
+	WEB_SOCKET_SEND_FRAME frame;
+	bool bFragment;
+	bool bCorrect;
+
+	memset(&stream, 0, sizeof(stream));
+	bFragment = false;
+	bCorrect = true;
+
+	// Past the declared length
+	BeginWebSocketSendStream(&stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, 10, &bFragment, &frame);
+	bCorrect = bCorrect && (frame.bHeader) && (frame.FrameByte == 0x81) && (frame.qwPayloadLength == 10);
+	bCorrect = bCorrect && (BeginWebSocketSendStream(&stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, 10, &bFragment, &frame) ==
+		IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT);
+	bCorrect = bCorrect && (WriteWebSocketSendStream(&stream, 6, &bFragment, &frame) == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT);
+	bCorrect = bCorrect && (!frame.bHeader);
+	bCorrect = bCorrect && (WriteWebSocketSendStream(&stream, 6, &bFragment, &frame) == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT);
+
+	// Short of it, the stream is over anyway
+	bCorrect = bCorrect && (EndWebSocketSendStream(&stream, &bFragment, &frame) == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_LENGTH_SEND_STREAM_RESULT);
+	bCorrect = bCorrect && (!stream.bActive) && (!bFragment);
+	bCorrect = bCorrect && (WriteWebSocketSendStream(&stream, 1, &bFragment, &frame) == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT);
+
+	// Not while a fragmented message is in progress, and not as a control frame
+	bFragment = true;
+	bCorrect = bCorrect && (BeginWebSocketSendStream(&stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, 10, &bFragment, &frame) ==
+		IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_STATE_SEND_STREAM_RESULT);
+	bFragment = false;
+	bCorrect = bCorrect && (BeginWebSocketSendStream(&stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_PING_BUFFER_TYPE, 10, &bFragment, &frame) ==
+		IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_INVALID_TYPE_SEND_STREAM_RESULT);
+
+	// An empty message of unknown length is a single empty frame
+	BeginWebSocketSendStream(&stream, IIS_WEB_SOCKET_BUFFER_TYPE::IIS_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, IIS_WEB_SOCKET_UNKNOWN_MESSAGE_LENGTH, &bFragment, &frame);
+	bCorrect = bCorrect && (!frame.bHeader);
+	bCorrect = bCorrect && (EndWebSocketSendStream(&stream, &bFragment, &frame) == IIS_WEB_SOCKET_SEND_STREAM_RESULT::IIS_WEB_SOCKET_SUCCESS_SEND_STREAM_RESULT);
+	bCorrect = bCorrect && (frame.bHeader) && (frame.FrameByte == 0x82) && (frame.qwPayloadLength == 0);
+
+	printf("refusals  correct %s\n", bCorrect ? "yes" : "no");
+
+	return bCorrect;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long long qwGigabytes = 8;
+	unsigned long dwChunkSize = 0x10000;
+	bool bCorrect;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "--gigabytes") == 0) && (i + 1 < argc)) {
+			qwGigabytes = strtoull(argv[++i], NULL, 10);
+		}
+		else if ((strcmp(argv[i], "--chunk") == 0) && (i + 1 < argc)) {
+			dwChunkSize = strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			fprintf(stderr, "usage: streamtest [--gigabytes <count>] [--chunk <bytes>]\n");
+			return 1;
+		}
+	}
+	if ((qwGigabytes == 0) || (dwChunkSize == 0) || ((dwChunkSize % 8) != 0)) {
+		fprintf(stderr, "--gigabytes must be at least 1 and --chunk a multiple of 8\n");
+		return 1;
+	}
+
+	bCorrect = CheckStreamRefusals();
+
+	// A declared length over 4 GB needs all 8 bytes of the extended payload length
+	bCorrect = RunStream(true, qwGigabytes << 30, dwChunkSize) && bCorrect;
+	bCorrect = RunStream(false, qwGigabytes << 30, dwChunkSize) && bCorrect;
+
+	return bCorrect ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+//
+// tracedump.cpp
+// 
+// Author:
+//     Brian Sullender
+//     SULLE WAREHOUSE LLC
+// 
+// Description:
+//     Offline decoder for trace files written by IISWebSocketServer::StartTrace.
+//     Prints the records in timestamp order, optionally for a single connection.
+//
+//     Usage: tracedump <trace file> [connection id]
+//
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "iiswebsockettrace.h"
+using namespace IISWebSocketServer;
+
+// Get a readable name for a frame Opcode
+static const char* OpcodeName(unsigned char opcode)
+{
+	switch (opcode)
+	{
+	case 0x00: return "CONTINUATION";
+	case 0x01: return "TEXT";
+	case 0x02: return "BINARY";
+	case 0x08: return "CLOSE";
+	case 0x09: return "PING";
+	case 0x0A: return "PONG";
+	default: return "UNKNOWN";
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	FILE* pFile;
+	IIS_WEB_SOCKET_TRACE_FILE_HEADER header;
+	std::vector<IIS_WEB_SOCKET_TRACE_RECORD> records;
+	unsigned long long qwFirst;
+	unsigned long long qwCount;
+	unsigned long long qwConnectionId;
+	bool bFilter;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace file> [connection id]\n", argv[0]);
+		return 1;
+	}
+
+	// Only print a single connection if an id is given
+	bFilter = (argc > 2);
+	qwConnectionId = bFilter ? strtoull(argv[2], NULL, 10) : 0;
+
+	pFile = fopen(argv[1], "rb");
+	if (pFile == NULL) {
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return 1;
+	}
+
+	// Read and check the header
+	if ((fread(&header, sizeof(header), 1, pFile) != 1) ||
+		(header.Magic != IIS_WEB_SOCKET_TRACE_MAGIC) || (header.Version != IIS_WEB_SOCKET_TRACE_VERSION) ||
+		(header.RecordCapacity == 0)) {
+		fprintf(stderr, "%s is not a WebSocket trace file\n", argv[1]);
+		fclose(pFile);
+		return 1;
+	}
+
+	// The file wraps around when it's full, only the newest RecordCapacity records are kept
+	if (header.RecordCount > header.RecordCapacity) {
+		qwCount = header.RecordCapacity;
+		qwFirst = header.RecordCount % header.RecordCapacity;
+	}
+	else {
+		qwCount = header.RecordCount;
+		qwFirst = 0;
+	}
+
+	// Read the records, oldest first
+	records.resize((size_t)qwCount);
+	if (qwCount != 0)
+	{
+		if ((fseek(pFile, (long)(sizeof(header) + (qwFirst * sizeof(IIS_WEB_SOCKET_TRACE_RECORD))), SEEK_SET) != 0) ||
+			(fread(records.data(), sizeof(IIS_WEB_SOCKET_TRACE_RECORD), (size_t)(qwCount - qwFirst), pFile) != qwCount - qwFirst) ||
+			(fseek(pFile, (long)sizeof(header), SEEK_SET) != 0) ||
+			(fread(records.data() + (qwCount - qwFirst), sizeof(IIS_WEB_SOCKET_TRACE_RECORD), (size_t)qwFirst, pFile) != qwFirst)) {
+			fprintf(stderr, "%s is truncated\n", argv[1]);
+			fclose(pFile);
+			return 1;
+		}
+	}
+	fclose(pFile);
+
+	// Records are drained per thread, put them back in time order
+	std::stable_sort(records.begin(), records.end(),
+		[](const IIS_WEB_SOCKET_TRACE_RECORD& a, const IIS_WEB_SOCKET_TRACE_RECORD& b) { return a.Timestamp < b.Timestamp; });
+
+	printf("Records: %llu (written %llu, dropped %llu)\n\n", qwCount, header.RecordCount, header.DroppedRecords);
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const IIS_WEB_SOCKET_TRACE_RECORD& record = records[i];
+
+		if ((bFilter) && (record.ConnectionId != qwConnectionId)) {
+			continue;
+		}
+
+		// Time in microseconds since the first record
+		double us = (double)(record.Timestamp - records[0].Timestamp) * 1000000.0 / (double)header.TimestampFrequency;
+
+		printf("%14.3f us  conn %-6llu tid %-6u %-3s %-12s FIN:%u Payload-Len:0x%llX Frame-Len:0x%X ",
+			us, record.ConnectionId, record.ThreadId,
+			(record.Direction == IIS_WEB_SOCKET_TRACE_INBOUND) ? "IN" : "OUT",
+			OpcodeName(record.Opcode), record.FIN, record.PayloadLength, record.FrameSize);
+
+		// The captured payload as hex
+		for (unsigned int b = 0; b < record.CapturedBytes; b++) {
+			printf("%02X", record.Payload[b]);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}